@@ -0,0 +1,111 @@
+/**
+ * This file models the threads that accept the servers' connections.
+ *
+ * Each acceptor has its own listening socket, bound to the same port with SO_REUSEPORT, and
+ * the kernel spreads the incoming connections between them. After a failover every front-end
+ * reconnects at once, so the connections are accepted by several threads in parallel and wait
+ * in a large backlog on each socket, instead of overflowing a single short one and waiting for
+ * SYN retries.
+ *
+ * Connections are accepted with accept4 and SOCK_CLOEXEC. They are left blocking, the handlers
+ * they are given to receive from them with blocking calls (the event loop makes its own
+ * connections non-blocking).
+ */
+
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <atomic>
+
+#include "constants.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Affinity.h"
+
+// Called by an acceptor with each connection it accepts
+typedef void (*connection_function)(int socket);
+
+class Acceptor
+{
+private:
+    static std::atomic<int> acceptor_count; // Acceptors configured
+    static std::atomic<int> backlog;        // Connections waiting to be accepted on each socket
+
+    static int sockets[ACCEPTOR_MAX];                  // Listening socket of each acceptor
+    static int socket_count;                           // Listening sockets opened
+    static pthread_t threads[ACCEPTOR_MAX];            // Thread of each acceptor (the first one runs on the caller)
+    static std::atomic<uint64_t> accepts[ACCEPTOR_MAX]; // Connections each acceptor accepted
+    static connection_function on_accept;              // Called with each connection accepted
+    static std::atomic<bool> running;                  // If the acceptors accept connections
+
+    // Metrics
+    static Counter *accepted; // Connections accepted
+    static Counter *failures; // Accepts that failed, without stopping the acceptor
+
+public:
+    /**
+     * @brief Configures the acceptors. Should be called before open
+     * @param acceptors Threads accepting connections, each on its own socket
+     * @param queue     Connections waiting to be accepted on each socket
+     */
+    static void configure(int acceptors, int queue);
+
+    /**
+     * @brief Opens and binds the listening sockets
+     * @param port     Port the sockets are bound to
+     * @param parallel If every acceptor gets its own socket, otherwise a single one is opened
+     *                 (the event loop accepts from one socket itself)
+     * @returns The first socket
+     */
+    static int open(int port, bool parallel);
+
+    /**
+     * @brief Sets every socket as a passive listener
+     */
+    static void listen();
+
+    /**
+     * @brief Accepts connections on every socket until stopped, one thread each, the first on
+     * the calling thread. Returns once every acceptor ended
+     * @param accepted Called with each connection accepted, from the acceptor's thread
+     */
+    static void run(connection_function accepted);
+
+    /**
+     * @brief Stops every socket from receiving connections, making the acceptors return
+     */
+    static void stop();
+
+    /**
+     * @brief Closes every socket
+     */
+    static void release();
+
+    /**
+     * @brief Listening sockets opened
+     */
+    static int count();
+
+    /**
+     * @brief Debug function, lists the sockets, the backlog and what each acceptor accepted
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Acceptor thread, hands every connection accepted on its socket to the callback
+     * @param arg Index of the acceptor, as a pointer
+     */
+    static void *acceptConnections(void *arg);
+};
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * This file models where the servers' threads run and where the groups' state is allocated
+ * on machines with several NUMA nodes.
+ *
+ * The topology is read from /sys/devices/system/node. Each thread role (see AFFINITY_* in
+ * constants.h) may be given a list of CPUs. A thread pins itself to the CPUs of one node of
+ * that list when it starts, and the threads of a role take turns between the nodes the list
+ * spans, so they stop migrating between sockets.
+ *
+ * With placement on, groups, sessions and history logs are allocated from arenas bound to the
+ * node the allocating thread runs on, which is the thread that owns the connection logging in.
+ * Without it, they come from malloc and land wherever the kernel puts them.
+ *
+ * To compare placements, every message posted to a group is counted as a local or remote
+ * access, depending on whether the posting thread runs on the group's node, and the process'
+ * cache misses and misses served from another node are read from the hardware counters, when
+ * the kernel lets the process open them.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <atomic>
+
+#include "constants.h"
+#include "Logger.h"
+#include "Metrics.h"
+
+// Header of every placed block, followed by the object
+typedef struct __placed_block
+{
+    int32_t node;                // Node the block was placed on, -1 if it came from malloc
+    int32_t size_class;          // Size class of the block
+    struct __placed_block *next; // Next free block of the same node and class
+
+} placed_block;
+
+// Blocks placed on one node
+typedef struct __node_arena
+{
+    pthread_mutex_t lock;                        // Lock for the arena
+    char *cursor;                                // Next unused byte of the current chunk
+    size_t left;                                 // Bytes left in the current chunk
+    placed_block *free_list[AFFINITY_CLASSES];   // Free blocks of each size class
+    std::atomic<uint64_t> mapped;                // Bytes mapped for the node
+
+} node_arena;
+
+class Affinity
+{
+private:
+    static int node_count;                           // NUMA nodes found
+    static cpu_set_t node_cpus[AFFINITY_NODES_MAX];  // CPUs of each node
+    static cpu_set_t role_cpus[AFFINITY_ROLES];      // CPUs each role is pinned to (empty if not pinned)
+    static std::atomic<int> next_thread[AFFINITY_ROLES]; // Threads of each role pinned so far
+    static std::atomic<bool> placing;                // If objects are placed on the allocating thread's node
+    static node_arena arenas[AFFINITY_NODES_MAX];    // Placed blocks of each node
+
+    static int cache_misses_fd; // Hardware counter of cache misses (-1 if unavailable)
+    static int node_misses_fd;  // Hardware counter of misses served from another node (-1 if unavailable)
+
+    // Metrics
+    static Counter *local_accesses;  // Messages posted by a thread on the group's node
+    static Counter *remote_accesses; // Messages posted by a thread on another node
+
+public:
+    /**
+     * @brief Reads the topology and opens the hardware counters. Should be called before any
+     * thread is started, so the counters follow every thread
+     */
+    static void start();
+
+    /**
+     * @brief Sets the CPUs a thread role is pinned to. Should be called before start
+     * @param role    Thread role (see AFFINITY_* in constants.h)
+     * @param cpulist CPUs, e.g. 0-3,8,10-11, empty to leave the role unpinned
+     * @returns False if the list is malformed or none of its CPUs is online
+     */
+    static bool configure(int role, const std::string &cpulist);
+
+    /**
+     * @brief Turns placement on the allocating thread's node on or off. Should be called before start
+     */
+    static void place(bool enabled);
+
+    /**
+     * @brief Pins the calling thread to the CPUs of its role, on the next node in turn
+     * @param role Thread role (see AFFINITY_* in constants.h)
+     */
+    static void pin(int role);
+
+    /**
+     * @brief Node the calling thread runs on
+     */
+    static int currentNode();
+
+    /**
+     * @brief Allocates an object, on the calling thread's node if placement is on
+     * @param size Size (in bytes) of the object
+     */
+    static void *allocate(size_t size);
+
+    /**
+     * @brief Frees an object given by allocate
+     */
+    static void release(void *object);
+
+    /**
+     * @brief Counts an access to state placed on a node as local or remote to the calling thread
+     * @param node Node the state was allocated on
+     */
+    static void access(int node);
+
+    /**
+     * @brief If the hardware counters could be opened
+     */
+    static bool counting();
+
+    /**
+     * @brief Cache misses of the process since start, 0 if not counting
+     */
+    static uint64_t cacheMisses();
+
+    /**
+     * @brief Cache misses of the process served from another node since start, 0 if not counting
+     */
+    static uint64_t remoteMisses();
+
+    /**
+     * @brief Debug function, lists the topology, the pinned roles, placement and the access counters
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Parses a CPU list, as found in sysfs
+     * @returns False if the list is malformed
+     */
+    static bool parseList(const std::string &cpulist, cpu_set_t *cpus);
+
+    /**
+     * @brief Opens a hardware counter following every thread of the process
+     * @returns Its descriptor, -1 if the kernel refused it
+     */
+    static int openCounter(uint32_t type, uint64_t config);
+
+    /**
+     * @brief Reads a hardware counter, 0 if it is unavailable
+     */
+    static uint64_t readCounter(int fd);
+
+    /**
+     * @brief Maps another chunk for a node's arena, bound to the node. Must be called with the arena's lock held
+     * @returns False if the chunk could not be mapped
+     */
+    static bool grow(int node);
+};
+
+#endif
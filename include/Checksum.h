@@ -0,0 +1,53 @@
+/**
+ * This file models the CRC32C (Castagnoli) checksum that frames history records.
+ *
+ * On x86-64 processors with SSE4.2 the checksum is computed by the crc32 instruction, 8 bytes
+ * at a time. Elsewhere (or on older processors) a byte-wise table is used instead, which gives
+ * the same values, so files written on one machine are verified on any other. The choice is
+ * made once, the first time a checksum is computed.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>
+#include <cstdint>
+
+class Checksum
+{
+private:
+    static uint32_t table[256]; // CRC32C of every byte value, for the software version
+
+public:
+    /**
+     * @brief Computes (or continues) the CRC32C of a buffer
+     * @param data   Bytes checksummed
+     * @param length Number of bytes
+     * @param crc    Checksum of the bytes before these, 0 to start a new one
+     * @returns Checksum of every byte so far
+     */
+    static uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
+
+    /**
+     * @brief If the checksum is computed by the processor
+     */
+    static bool hardware();
+
+private:
+    /**
+     * @brief Computes the checksum with the SSE4.2 crc32 instruction
+     */
+    static uint32_t crc32cHardware(const uint8_t *data, size_t length, uint32_t crc);
+
+    /**
+     * @brief Computes the checksum with the byte table
+     */
+    static uint32_t crc32cSoftware(const uint8_t *data, size_t length, uint32_t crc);
+
+    /**
+     * @brief Fills the byte table
+     */
+    static bool buildTable();
+};
+
+#endif
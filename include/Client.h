@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <chrono>
 #include <ctime>
@@ -12,7 +13,9 @@
 #include <iostream>
 #include <atomic>
 #include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
+#include <vector>
 
 #include "constants.h"
 #include "data_types.h"
@@ -43,6 +46,22 @@ private:
 
     static RW_Monitor socket_monitor; // Monitor that controls the sending of data through the socket
 
+    static std::atomic<int> heartbeat_interval; // Time (in milliseconds) the client may stay quiet, advertised by the server at login
+    static std::atomic<uint64_t> last_sent;     // Time (in milliseconds) something was last sent to the server
+
+    static std::atomic<uint64_t> history_cursor;  // Sequence number of the oldest history message shown, older pages end before it
+    static std::atomic<bool> history_requested;   // If the user asked for a history page that was not fully received yet
+    static std::atomic<bool> gap_filling;         // If the messages missed during a failover are being fetched
+    static std::atomic<uint64_t> newest_seen;     // Newest timestamp of the messages shown
+    static std::atomic<int> newest_seen_count;    // Messages shown with the newest timestamp, skipped when filling a gap
+
+    static int read_socket;         // Socket to the backup history and searches are read from (-1 if they go to the server)
+    static RW_Monitor read_monitor; // Monitor for the read socket, a request and its answer are never interleaved
+
+    static std::vector<uint16_t> partition_members; // Ports of the replicas of a partitioned cluster (empty if it is not)
+    static int redirect_port;                       // Port of the replica leading the group, when the login was sent there
+    static int redirects;                           // Redirects followed since the last accepted login
+
     // Public methods
 public:
     /**
@@ -121,10 +140,83 @@ private:
     static void *handleUserInput(void *arg);
 
     /**
-     * Loops sending messages to server in order to keep the connection "alive"
+     * Sends a keep-alive to the server whenever the client stays quiet for heartbeat_interval,
+     * in order to keep the connection "alive" (anything else sent counts as well)
      */
     static void *keepAlive(void *arg);
 
+    /**
+     * Enables TCP keep-alive probes on the server socket, so a server that vanished without
+     * closing the connection is noticed even when nothing is being sent
+     */
+    static void probeServer(int socket);
+
+    /**
+     * Connects to a server (or replica) and sends the login, replacing the current server socket
+     * @param port Port the server listens at, on the server's host
+     * @returns False if the server could not be reached
+     */
+    bool connectServer(int port);
+
+    /**
+     * Keeps the replicas of a partitioned cluster, and where the login must be made if it was refused
+     * @param received_packet Partition map packet
+     */
+    static void handlePartitionMap(packet *received_packet);
+
+    /**
+     * Current monotonic time in milliseconds
+     */
+    static uint64_t now();
+
+    /**
+     * Asks the server for a range of the group history, answered with history batches
+     * @param cursor    Sequence number or time the range ends before or starts at
+     * @param by        HISTORY_BY_SEQUENCE or HISTORY_BY_TIME
+     * @param direction HISTORY_OLDER or HISTORY_NEWER
+     * @param limit     Messages wanted
+     */
+    static void requestHistory(uint64_t cursor, int by, int direction, int limit);
+
+    /**
+     * Shows a message found by a search, or the end of the results
+     * @param received_packet Search result packet
+     */
+    static void showSearchResult(packet *received_packet);
+
+    /**
+     * Shows a batch of history messages, and asks for the rest of a failover gap once the batch ends it
+     * @param received_packet History batch packet
+     */
+    static void showHistoryBatch(packet *received_packet);
+
+    /**
+     * Logs into the backup the server picked for history reads, read-only
+     * @param port     Port of the backup, on the server's host
+     * @param sequence Replication sequence number the backup must have applied
+     */
+    void openReader(uint16_t port, uint64_t sequence);
+
+    /**
+     * Closes the connection to the backup, reads go back to the server
+     */
+    static void closeReader();
+
+    /**
+     * Sends a history request or a search to the backup and shows its whole answer
+     * @param type         PAK_HISTORY_REQUEST or PAK_SEARCH
+     * @param payload      Request
+     * @param payload_size Size of the request
+     * @returns False if there is no backup or it went away, the request must then go to the server
+     */
+    static bool readFromReplica(int type, char *payload, int payload_size);
+
+    /**
+     * Keeps track of the newest message shown, where a gap fill starts from
+     * @param timestamp Timestamp of a message shown
+     */
+    static void noteSeen(uint64_t timestamp);
+
     /**
     * Thread procedure that handles the socket for incomming election results
     */
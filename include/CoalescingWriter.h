@@ -0,0 +1,213 @@
+/**
+ * This file models the output coalescing layer used by the servers.
+ *
+ * Instead of one send() per frame, frames headed to the same socket are appended to that
+ * socket's output queue. A queue is written with a single writev() when it holds more than
+ * max_bytes, when an urgent frame is queued behind it, or when its oldest frame has waited
+ * for window microseconds (checked by a background flusher thread). A window of 0 disables
+ * coalescing, and every frame is written right away.
+ *
+ * When the event loop runs on io_uring, the queues the flusher writes in one pass are handed
+ * to the kernel as a single batched submission instead of one writev() each.
+ *
+ * Writes never block: whatever does not fit in the socket buffer stays at the front of the
+ * queue and is tried again a window later, so one slow peer does not hold up the writes to
+ * everyone else. The flusher takes the expired queues' bytes out and writes them without
+ * holding the queue map or the queues, frames queued meanwhile go behind them. A peer that
+ * lets COALESCE_BACKLOG_MAX bytes pile up is not reading, its socket is shut down.
+ *
+ * Since the application does its own batching, registered sockets get TCP_NODELAY, so the
+ * kernel does not delay the batches any further. Optionally, each flush can be wrapped in
+ * TCP_CORK, so that big batches leave in full-sized segments.
+ */
+
+#ifndef COALESCINGWRITER_H
+#define COALESCINGWRITER_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <map>
+
+#include "constants.h"
+#include "data_types.h"
+#include "RW_Monitor.h"
+#include "Frame.h"
+#include "EventLoop.h"
+#include "Metrics.h"
+#include "Logger.h"
+#include "Affinity.h"
+
+// Frames waiting to be written to one socket
+typedef struct __output_queue
+{
+    pthread_mutex_t lock;      // Lock for the queue contents
+    std::vector<char> pending; // Bytes waiting to be written
+    uint64_t oldest;           // Time (in microseconds) the oldest pending frame was queued
+    bool scheduled;            // If the socket is in the flusher's dirty list
+    bool flushing;             // If the flusher is writing bytes it took out of the queue
+    pthread_cond_t flushed;    // Signals the end of the flusher's write, for whoever removes the queue
+
+} output_queue;
+
+// Bytes the flusher took out of an expired queue, written without holding the queue
+typedef struct __flush_job
+{
+    int socket;              // Socket descriptor where the bytes are written
+    output_queue *queue;     // Queue the bytes were taken from
+    std::vector<char> bytes; // Bytes taken
+    ssize_t written;         // Bytes written (-1 if the socket failed)
+
+} flush_job;
+
+class CoalescingWriter
+{
+private:
+    static std::atomic<int> window;    // Time (in microseconds) a frame may wait for others
+    static std::atomic<int> max_bytes; // Pending bytes that trigger an immediate flush
+    static std::atomic<bool> cork;     // If flushes are wrapped in TCP_CORK
+
+    static std::map<int, output_queue *> queues; // Output queue of each socket
+    static RW_Monitor queues_monitor;            // Monitor for the queue map
+
+    static std::vector<int> dirty;        // Sockets with pending frames, waiting for the flusher
+    static pthread_mutex_t dirty_lock;    // Lock for the dirty list
+    static pthread_cond_t dirty_signal;   // Signals the flusher that the dirty list is not empty
+    static pthread_t flusher_thread;      // Thread that flushes queues whose window expired
+    static std::atomic<bool> running;     // If the flusher thread is running
+
+    // Metrics
+    static Counter *frames;         // Frames handed to the writer
+    static Counter *bytes;          // Bytes handed to the writer
+    static Counter *syscalls;       // Write system calls issued
+    static Counter *partial_writes; // Write system calls that did not write everything
+    static Counter *size_flushes;   // Flushes caused by max_bytes or urgent frames
+    static Counter *timer_flushes;  // Flushes caused by the window expiring
+
+public:
+    /**
+     * @brief Configures the coalescing parameters. Should be called before start
+     * @param window_us    Time (in microseconds) a frame may wait to be coalesced, 0 disables coalescing
+     * @param flush_bytes  Pending bytes that trigger an immediate flush
+     * @param use_cork     If each flush is wrapped in TCP_CORK
+     */
+    static void configure(int window_us, int flush_bytes, bool use_cork);
+
+    /**
+     * @brief Starts the flusher thread (no-op when coalescing is disabled)
+     */
+    static void start();
+
+    /**
+     * @brief Flushes every queue and stops the flusher thread
+     */
+    static void stop();
+
+    /**
+     * @brief Queues a frame to be written to the socket
+     * @param socket Socket descriptor where the frame will be written
+     * @param frame  The frame, copied into the socket's queue
+     * @param urgent If the queue must be written right away (control packets)
+     * @returns Number of bytes accepted, or -1 if the socket failed
+     */
+    static int enqueue(int socket, const Frame &frame, bool urgent = false);
+
+    /**
+     * @brief Queues a packet whose payload is scattered through several buffers
+     * @param socket      Socket descriptor where the packet will be written
+     * @param packet_type Type of the packet (see constants.h)
+     * @param parts       Buffers that, in order, compose the payload
+     * @param part_count  Number of buffers in parts
+     * @param urgent      If the queue must be written right away (control packets)
+     * @returns Number of bytes accepted, or -1 if the socket failed
+     */
+    static int enqueueParts(int socket, int packet_type, const struct iovec *parts, int part_count, bool urgent = false);
+
+    /**
+     * @brief Writes whatever is pending on the socket
+     * @param socket Socket descriptor
+     */
+    static void flush(int socket);
+
+    /**
+     * @brief Drops the socket's queue. Must be called before the socket is closed,
+     * so a future socket with the same descriptor does not inherit pending frames
+     * @param socket Socket descriptor
+     */
+    static void remove(int socket);
+
+    /**
+     * @brief Bytes waiting in the socket's queue (0 if it has none)
+     * @param socket Socket descriptor
+     */
+    static long pendingBytes(int socket);
+
+    /**
+     * @brief Debug function, lists the writer metrics to stdout
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Returns the queue of the socket, creating (and configuring the socket) if needed
+     */
+    static output_queue *getQueue(int socket);
+
+    /**
+     * @brief Appends the bytes to the socket queue and flushes it if needed
+     */
+    static int append(int socket, const struct iovec *parts, int part_count, bool urgent);
+
+    /**
+     * @brief Puts the socket in the flusher's dirty list, if it is not there yet
+     * OBS: The queue lock must be held by the caller
+     */
+    static void schedule(int socket, output_queue *queue);
+
+    /**
+     * @brief Writes the queue contents, followed by the extra buffers, as far as the socket takes them
+     * without blocking. The rest stays in the queue, scheduled for the flusher
+     * OBS: The queue lock must be held by the caller, and the flusher must not be writing the queue
+     * @returns Number of bytes written or kept, or -1 on failure
+     */
+    static int write(int socket, output_queue *queue, const struct iovec *extra, int extra_count);
+
+    /**
+     * @brief Writes the buffers until they are out or the socket buffer is full
+     * @returns Number of bytes written, or -1 on failure
+     */
+    static ssize_t writeAvailable(int socket, struct iovec *vector, int count);
+
+    /**
+     * @brief Shuts the socket down if its queue grew past COALESCE_BACKLOG_MAX
+     * OBS: The queue lock must be held by the caller
+     * @returns True if it was shut down
+     */
+    static bool backlogged(int socket, output_queue *queue);
+
+    /**
+     * @brief Writes the bytes taken from the expired queues, as a single batch when the event loop offers
+     * one, and puts what was not written back in front of each queue
+     * @param jobs    Bytes taken from each queue, whose flushing flag is set
+     * @param waiting Filled with the sockets that still have bytes pending
+     */
+    static void writeExpired(std::vector<flush_job> &jobs, std::vector<int> &waiting);
+
+    /**
+     * @brief Flusher thread procedure
+     */
+    static void *flushExpired(void *arg);
+
+    /**
+     * @brief Current monotonic time in microseconds
+     */
+    static uint64_t now();
+};
+
+#endif
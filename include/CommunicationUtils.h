@@ -2,7 +2,9 @@
 #define COMMUNICATIONUTILS_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <errno.h>
 #include <signal.h>
@@ -10,9 +12,16 @@
 
 #include "data_types.h"
 #include "constants.h"
+#include "MemoryPool.h"
+#include "Frame.h"
+#include "Metrics.h"
 
 class CommunicationUtils
 {
+private:
+    // Metrics
+    static Counter *send_syscalls;  // Send system calls issued outside the coalescing writer
+    static Counter *partial_writes; // Send system calls that did not write everything
 
 protected:
     // Protected methods
@@ -21,9 +30,9 @@ protected:
     /**
      * @brief Composes a coordniator packetfor updating session mappings
      * @param translation The old_socket to new_socket mapping
-     * @returns Pointer to the allocated structure 
+     * @returns Handle to the allocated structure 
      */
-    static coordinator *composeCoordinatorUpdate(std::map<int, int> translation);
+    static PoolHandle<coordinator> composeCoordinatorUpdate(const std::map<int, int> &translation);
 
     /**
      * @brief Composes a message to start a election
@@ -39,35 +48,44 @@ protected:
      * @param ip     Front end IP
      * @param port   Front end port
      * @param socket Socket where the connection came from
-     * @returns Pointer to allocated structure
+     * @returns Handle to the allocated structure
      */
-    static login_update *composeLoginUpdate(char *login, std::string ip, int port, int socket);
+    static PoolHandle<login_update> composeLoginUpdate(char *login, const std::string &ip, int port, int socket);
 
     /**
      * @brief Composes a message update structure, with the groupname and socket where it came from
      * @param message   The message record
      * @param groupname Name of the group where this message is headed
      * @param socket    Socket where the message came from
-     * @returns Pointer to allocated structure
+     * @returns Handle to the allocated structure
      */
-    static message_update *composeMessageUpdate(message_record *message, std::string groupname, int socket);
+    static PoolHandle<message_update> composeMessageUpdate(message_record *message, const std::string &groupname, int socket);
 
     /**
      * @brief Composes a replica update structure, for new replicas to catch up with the rest of the list
      * @param identifier Replica's unique identifier
      * @param port       Replica's listening port
-     * @returns Pointer to allocated structure
+     * @returns Handle to the allocated structure
+     */
+    static PoolHandle<replica_update> composeReplicaUpdate(int identifier, int port);
+
+    /**
+     * @brief Composes the replica list of a partitioned cluster, for a client logging in
+     * @param owner    Listening port of the replica leading the client's group
+     * @param redirect If the login is refused, and must be made again at the owner
+     * @param members  Listening port of every replica
+     * @returns Handle to the allocated structure
      */
-    static replica_update *composeReplicaUpdate(int identifier, int port);
+    static PoolHandle<partition_map> composePartitionMap(int owner, bool redirect, const std::vector<uint16_t> &members);
 
     /**
      * @brief Composes a packet with the provided data
      * @param packet_type Type of packet to be created (see constants.h)
      * @param payload Packet data
      * @param payload_size Size of the data provided in payload
-     * @returns Pointer to allocated structure
+     * @returns Handle to the allocated structure
      */
-    static packet *composePacket(int packet_type, char *payload, int payload_size);
+    static PoolHandle<packet> composePacket(int packet_type, char *payload, int payload_size);
 
     /**
      * @brief Sends a packet with given payload to the provided socket descriptor
@@ -79,15 +97,33 @@ protected:
      */
     static int sendPacket(int socket, int packet_type, char *payload, int payload_size);
 
+    /**
+     * @brief Sends an already composed frame to the provided socket descriptor, without copying it
+     * @param socket Socket descriptor where the frame will be sent
+     * @param frame  The frame being sent
+     * @returns Number of bytes sent
+     */
+    static int sendFrame(int socket, const Frame &frame);
+
+    /**
+     * @brief Sends a packet whose payload is scattered through several buffers, without joining them first
+     * @param socket      Socket descriptor where the packet will be sent
+     * @param packet_type Type of packet that should be sent (see constants.h)
+     * @param parts       Buffers that, in order, compose the payload
+     * @param part_count  Number of buffers in parts
+     * @returns Number of bytes sent
+     */
+    static int sendPacketParts(int socket, int packet_type, const struct iovec *parts, int part_count);
+
     /**
      * @brief Creates a struct of type message_record with the provided data
      * @param sender_name Username of the user who sent this message
      * @param message_content Actual chat message
      * @param message_type Type of message 
      * @param port The port where the sender is listening for reconnects (None by default, regular messages)
-     * @returns Pointer to the created message record
+     * @returns Handle to the created message record
      */
-    static message_record *composeMessage(std::string sender_name, std::string message_content, int message_type, int port = 0xFFFF);
+    static PoolHandle<message_record> composeMessage(const std::string &sender_name, const std::string &message_content, int message_type, int port = 0xFFFF);
 
     /**
      * @brief Tries to fully receive a packet from the informed socket, putting it in buffer
@@ -97,6 +133,23 @@ protected:
      * @returns Number of bytes received and put into buffer
      */
     static int receivePacket(int socket, char *buffer, int buf_size);
+
+    /**
+     * @brief Tries to fully receive a packet from the informed socket into a new frame of PACKET_MAX bytes
+     * @param   socket From whence to receive the packet
+     * @param   frame  Frame that will own the received packet
+     * @returns Number of bytes received
+     */
+    static int receiveFrame(int socket, Frame &frame);
+
+    /**
+     * @brief Checks, in place, if a received frame carries a well-formed message record:
+     * the record fits in the payload, its text is at most MESSAGE_MAX characters and NUL terminated.
+     * Trailing payload bytes after the record are dropped from the frame.
+     * @param   frame The received frame
+     * @returns True if the message record is valid, false otherwise
+     */
+    static bool validateMessage(Frame &frame);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,202 @@
+/**
+ * This file models the event loop that can replace the per-connection threads of the servers.
+ *
+ * By default (the "threads" backend) every front-end connection keeps its own blocking
+ * thread, as before. With the "epoll" or "uring" backends, a single loop thread accepts the
+ * connections and receives from every front-end socket, reassembling the packets from the
+ * byte stream and handing each complete one to the server's packet handler.
+ *
+ * The "uring" backend is only available when the servers are built with IO_URING=1. It
+ * accepts with a multishot accept, receives with multishot receives into a provided buffer
+ * ring, and offers batched sends: the coalescing writer hands all the queues it flushes in
+ * one pass to a single submission, one send per socket. A short send leaves the rest of that
+ * socket's bytes to the caller, which keeps them queued for a later pass. When
+ * io_uring is not compiled in, or the kernel refuses it, the loop falls back to epoll.
+ *
+ * Watched front-ends get a USER_TIMEOUT liveness timer in the timer wheel, which shuts quiet
+ * ones down; the loop then sees them end like any other connection.
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "constants.h"
+#include "data_types.h"
+#include "Frame.h"
+#include "IORing.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include "TimerWheel.h"
+#include "Affinity.h"
+
+class IORing;
+
+// Event loop backends
+#define LOOP_THREADS 0 // One blocking thread per connection (no event loop)
+#define LOOP_EPOLL   1 // Readiness based loop
+#define LOOP_URING   2 // Completion based loop
+
+// Buffers to be written to one socket, as part of a batch
+typedef struct __write_request
+{
+    int socket;        // Socket descriptor where the buffer will be written
+    struct iovec part; // Buffer to write
+    ssize_t written;   // Bytes written, filled by the batch (-1 if the socket failed)
+
+} write_request;
+
+// Bytes received from one connection, waiting to become complete packets
+typedef struct __loop_connection
+{
+    std::vector<char> input; // Bytes of the packet(s) being received
+    uint32_t generation;     // Distinguishes connections that reuse the same descriptor
+
+} loop_connection;
+
+class EventLoop
+{
+public:
+    typedef void (*accept_function)(int socket, struct sockaddr_in *address); // Called for each accepted connection
+    typedef bool (*packet_function)(int socket, Frame &frame);                // Called for each received packet, false closes the connection
+    typedef void (*close_function)(int socket);                               // Called when a connection ends, must close the socket
+
+private:
+    static std::atomic<int> backend;  // Backend in use (see LOOP_* above)
+    static std::atomic<bool> running; // If the loop is running
+
+    static accept_function on_accept; // Accepted connection handler
+    static packet_function on_packet; // Received packet handler
+    static close_function on_close;   // Ended connection handler
+
+    static int listen_socket;                              // Socket where connections are accepted (-1 for none)
+    static int wake_fd;                                    // Event descriptor used to wake the loop up
+    static int epoll_fd;                                   // Epoll instance (epoll backend)
+    static std::map<int, loop_connection *> connections;   // Connections watched by the loop (only touched by the loop thread)
+    static uint32_t next_generation;                       // Generation given to the next watched connection
+    static std::vector<int> incoming;                      // Sockets other threads asked the loop to watch
+    static pthread_mutex_t incoming_lock;                  // Lock for the incoming list
+
+    static IORing *ring;              // Ring used by the loop thread (io_uring backend)
+    static IORing *send_ring;         // Ring used for batched writes (io_uring backend)
+    static pthread_mutex_t send_lock; // Lock for the send ring
+
+    // Metrics
+    static std::atomic<long> wakeups;   // Times the loop returned from the kernel
+    static std::atomic<long> receives;  // Receive completions (or receive calls, on epoll)
+    static std::atomic<long> accepts;   // Accepted connections
+    static std::atomic<long> packets;   // Complete packets handed to the packet handler
+    static std::atomic<long> timeouts;  // Connections dropped for being idle
+    static std::atomic<long> batches;   // Batched write submissions
+    static std::atomic<long> batched;   // Sockets written by batched submissions
+
+public:
+    /**
+     * @brief Chooses the backend. Falls back to epoll if io_uring was requested but is not available
+     * @param name "threads", "epoll" or "uring"
+     * @returns False if the name is unknown
+     */
+    static bool configure(const std::string &name);
+
+    /**
+     * @brief Checks if an event loop backend is in use (as opposed to one thread per connection)
+     */
+    static bool enabled();
+
+    /**
+     * @brief Runs the loop in the calling thread, until stop is called
+     * @param socket  Listening socket, the loop accepts connections from it (-1 to not accept)
+     * @param accepted Called for each accepted connection
+     * @param received Called for each packet received from a watched connection
+     * @param closed   Called when a watched connection ends
+     */
+    static void run(int socket, accept_function accepted, packet_function received, close_function closed);
+
+    /**
+     * @brief Makes the loop receive from the socket. May be called from any thread
+     * @param socket Connected socket descriptor
+     */
+    static void watch(int socket);
+
+    /**
+     * @brief Stops the loop. Every watched connection is handed to the close handler
+     */
+    static void stop();
+
+    /**
+     * @brief Writes the buffers of several sockets with a single submission, one send for each
+     * socket (whatever a short send left is the caller's to keep). Only available with the io_uring backend
+     * @param requests Buffer of each socket, the written field is filled for each of them
+     * @param count    Number of requests
+     * @returns Number of system calls used, or -1 if batched writes are not available
+     */
+    static int writeBatch(write_request *requests, int count);
+
+    /**
+     * @brief Debug function, lists the loop metrics to stdout
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Starts watching a socket (loop thread only)
+     */
+    static void addConnection(int socket);
+
+    /**
+     * @brief Stops watching a socket and hands it to the close handler (loop thread only)
+     */
+    static void closeConnection(int socket);
+
+    /**
+     * @brief Starts watching the sockets other threads asked for (loop thread only)
+     */
+    static void takeIncoming();
+
+    /**
+     * @brief Appends received bytes to the connection and dispatches every complete packet
+     * @returns False if the connection must be closed
+     */
+    static bool consume(int socket, loop_connection *connection, const char *data, size_t size);
+
+    /**
+     * @brief Accepts a connection, handing it to the accept handler
+     */
+    static void acceptConnection(int socket);
+
+    /**
+     * @brief Backend loops
+     */
+    static void runEpoll();
+    static void runUring();
+
+#ifdef USE_IO_URING
+    /**
+     * @brief Queue the io_uring operations the loop keeps armed (io_uring backend only)
+     * @returns If the operation was queued, false if the submission ring stayed full
+     */
+    static bool armAccept();
+    static bool armReceive(int socket, uint32_t generation);
+    static bool armWake(uint64_t *value);
+
+    /**
+     * @brief Takes a submission entry, submitting the pending ones again while the ring stays full
+     * @param ring Ring the entry is taken from
+     * @returns The entry, or NULL if the kernel took nothing after LOOP_SQE_RETRIES submissions
+     */
+    static io_uring_sqe *takeSQE(IORing *ring);
+#endif
+};
+
+#endif
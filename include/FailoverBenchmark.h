@@ -0,0 +1,189 @@
+/**
+ * This file models the failover benchmark harness.
+ *
+ * It starts a group of replicas on loopback (replica 0 leads, as in run_replicas), logs
+ * synthetic clients into the leader and makes them post numbered messages at a fixed rate.
+ * Each client listens for the connection a new leader opens after an election, exactly like
+ * the client's election listener. At the chosen moment the leader is killed (SIGKILL), and
+ * for every client the harness measures how long it takes for the new leader to connect,
+ * for its PAK_NEW_SERVER packet to arrive and for a message posted after the crash to come
+ * back, i.e. until the client can post again.
+ *
+ * Every member of a group should receive every message posted to the group exactly once, so
+ * the harness also counts the deliveries that never arrived (messages lost) and the ones
+ * that arrived more than once (duplicates). Results are written as JSON.
+ */
+
+#ifndef FAILOVERBENCHMARK_H
+#define FAILOVERBENCHMARK_H
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+
+#include "constants.h"
+#include "data_types.h"
+#include "Frame.h"
+
+// Prefix of the messages posted by the harness
+#define FAILOVER_PREFIX "failover "
+
+// A replica started by the harness
+typedef struct __failover_replica
+{
+    int id;        // Replica identifier (0 is the first leader)
+    int port;      // Port the replica listens at
+    pid_t pid;     // Process running the replica (-1 once it was reaped)
+    int input;     // Write end of the replica's standard input, used for the stop command
+
+} failover_replica;
+
+// A synthetic client
+typedef struct __failover_client
+{
+    int group;                  // Index of the group the client joined
+    std::atomic<int> socket;    // Connection to the current leader
+    std::atomic<bool> connected; // If the connection to the current leader is up
+    int listen_socket;          // Socket where a new leader connects after an election
+    int listen_port;            // Port of the listen socket, sent with the login
+    std::vector<int> retired;   // Connections to previous leaders, closed at the end
+    std::vector<char> input;    // Bytes of the packet(s) being received
+    std::atomic<bool> answered; // If the leader sent anything since login
+
+    // Only touched by the receiver thread
+    uint64_t reconnected;       // Time the new leader connected (0 if it did not)
+    uint64_t new_server;        // Time the PAK_NEW_SERVER packet arrived (0 if it did not)
+    uint64_t recovered;         // Time the first message posted after the kill came back (0 if none did)
+    std::set<uint64_t> seen;    // Messages received, by sender and sequence number
+    long duplicates;            // Messages received more than once
+
+} failover_client;
+
+// A message posted by a client
+typedef struct __failover_post
+{
+    int sender;    // Index of the client that posted it
+    uint32_t sqn;  // Sequence number of the message for its sender
+    int group;     // Index of the group it was posted to
+
+} failover_post;
+
+class FailoverBenchmark
+{
+private:
+    int replica_count;       // Number of replicas
+    int client_count;        // Number of synthetic clients
+    int group_count;         // Number of groups the clients are spread through
+    int rate;                // Messages posted per second
+    int duration;            // Time (in seconds) messages are posted for
+    int kill_after;          // Time (in seconds) after the first post the leader is killed
+    int base_port;           // Port of replica 0, replica i listens at base_port - i
+    std::string replica_binary; // Path of the replica executable
+
+    std::vector<failover_replica> replicas; // Replicas started
+    failover_client *clients;               // Synthetic clients
+    std::vector<int> group_sizes;           // Number of clients in each group
+    std::vector<failover_post> posts;       // Messages posted, only touched by the main thread
+    std::vector<uint32_t> next_sqn;         // Next sequence number of each client
+    unsigned long run_id;                   // Tells this run's messages apart from older history
+
+    int epoll_fd;                 // Epoll instance watching every client socket
+    pthread_t receiver_thread;    // Thread draining the client sockets
+    std::atomic<bool> receiving;  // If the receiver thread should keep going
+    std::atomic<int> answered;    // Clients the leader already answered
+
+    std::atomic<uint64_t> kill_time; // Time the leader was killed (0 if it was not yet)
+    long refused;                    // Posts skipped because the client had no leader
+
+public:
+    /**
+     * @brief Class constructor
+     * @param replicas       Number of replicas
+     * @param clients        Number of synthetic clients
+     * @param groups         Number of groups the clients are spread through
+     * @param rate           Messages posted per second
+     * @param duration       Time (in seconds) messages are posted for
+     * @param kill_after     Time (in seconds) after the first post the leader is killed
+     * @param base_port      Port of replica 0, replica i listens at base_port - i
+     * @param replica_binary Path of the replica executable
+     */
+    FailoverBenchmark(int replicas, int clients, int groups, int rate, int duration, int kill_after, int base_port, const std::string &replica_binary);
+
+    /**
+     * @brief Class destructor, stops the replicas and closes every connection
+     */
+    ~FailoverBenchmark();
+
+    /**
+     * @brief Starts the replicas, logs the clients in, posts messages and kills the leader
+     */
+    void run();
+
+    /**
+     * @brief Writes the results as JSON
+     * @param output Stream where the results are written
+     */
+    void report(std::ostream &output);
+
+private:
+    /**
+     * @brief Starts a replica in its own directory (failover_replicas/replica_<id>), linked to replica 0
+     */
+    void startReplica(int id);
+
+    /**
+     * @brief Asks every replica still running to stop, killing the ones that do not
+     */
+    void stopReplicas();
+
+    /**
+     * @brief Connects a client to the leader and sends its login packet
+     * @returns True if the client is connected
+     */
+    bool login(int index);
+
+    /**
+     * @brief Posts the next message of a client
+     */
+    void post(int index);
+
+    /**
+     * @brief Receiver thread procedure
+     */
+    static void *receive(void *arg);
+
+    /**
+     * @brief Takes the connection a new leader opened to a client
+     */
+    void acceptLeader(int index);
+
+    /**
+     * @brief Appends received bytes to the client's input and handles every complete packet
+     */
+    void consume(failover_client &client, int index, const char *data, size_t size);
+
+    /**
+     * @brief Current monotonic time in microseconds
+     */
+    static uint64_t now();
+
+    /**
+     * @brief Value at the given percentile (0 to 1) of sorted samples, 0 if there are none
+     */
+    static uint64_t percentile(const std::vector<uint64_t> &sorted, double p);
+};
+
+#endif
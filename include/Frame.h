@@ -0,0 +1,140 @@
+/**
+ * This file models the frames that travel through the sockets.
+ *
+ * A Frame owns a complete packet (header + payload) in a single pool block, so it can
+ * be handed to the socket as-is, without copying the payload into a new packet first.
+ * A MessageBuffer is a Frame whose payload is a message_record, composed directly in
+ * place. Both are move-only: a chat message is built once and then passed by reference
+ * (or moved) until it reaches every socket. Every payload copied into a frame is counted, per
+ * thread, so a path can be checked to copy none.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <string>
+#include <chrono>
+
+#include "constants.h"
+#include "data_types.h"
+#include "MemoryPool.h"
+
+class Frame
+{
+protected:
+    PoolHandle<packet> data;         // Packet header followed by the payload
+    static thread_local long copies; // Payloads copied (or composed) into frames by the calling thread
+
+public:
+    /**
+     * @brief Creates an empty frame, owning no packet
+     */
+    Frame();
+
+    /**
+     * @brief Allocates a packet with room for payload_size bytes of zeroed payload
+     * @param packet_type  Type of the packet (see constants.h)
+     * @param payload_size Size of the payload
+     */
+    Frame(int packet_type, int payload_size);
+
+    /**
+     * @brief Allocates a packet and copies the provided payload into it
+     * @param packet_type  Type of the packet (see constants.h)
+     * @param payload      Packet data
+     * @param payload_size Size of the data provided in payload
+     */
+    Frame(int packet_type, const char *payload, int payload_size);
+
+    Frame(Frame &&other) = default;
+    Frame &operator=(Frame &&other) = default;
+
+    /**
+     * @brief Returns the owned packet
+     */
+    packet *get() const;
+
+    /**
+     * @brief Returns a pointer to the start of the payload
+     */
+    char *payload() const;
+
+    /**
+     * @brief Returns the total size of the packet (header + payload)
+     */
+    int size() const;
+
+    /**
+     * @brief Changes the type of the packet
+     * @param packet_type The new type (see constants.h)
+     */
+    void setType(int packet_type);
+
+    /**
+     * @brief Shrinks the packet payload, so that only the first payload_size bytes are sent
+     * @param payload_size The new payload size, must not be bigger than the current one
+     */
+    void setLength(int payload_size);
+
+    /**
+     * @brief Checks if this frame owns a packet
+     */
+    explicit operator bool() const;
+
+    /**
+     * @brief Number of payloads the calling thread copied or composed into frames so far
+     */
+    static long copiedByThread();
+};
+
+class MessageBuffer : public Frame
+{
+public:
+    /**
+     * @brief Creates an empty message buffer
+     */
+    MessageBuffer();
+
+    /**
+     * @brief Composes a message record directly in the payload of a new packet
+     * @param sender_name     Username of the user who sent this message
+     * @param message_content Actual chat message
+     * @param message_type    Type of message (see constants.h)
+     * @param packet_type     Type of the packet carrying the message (PAK_DATA by default)
+     * @param port            The port where the sender is listening for reconnects (None by default)
+     */
+    MessageBuffer(const std::string &sender_name, const std::string &message_content, int message_type, int packet_type = PAK_DATA, int port = 0xFFFF);
+
+    /**
+     * @brief Composes a message record directly in the payload of a new packet
+     * @param sender_name     Username of the user who sent this message
+     * @param message_content Actual chat message (not necessarily NUL terminated)
+     * @param content_length  Number of characters in message_content
+     * @param message_type    Type of message (see constants.h)
+     * @param packet_type     Type of the packet carrying the message (PAK_DATA by default)
+     * @param port            The port where the sender is listening for reconnects (None by default)
+     */
+    MessageBuffer(const std::string &sender_name, const char *message_content, int content_length, int message_type, int packet_type = PAK_DATA, int port = 0xFFFF);
+
+    /**
+     * @brief Takes ownership of a received frame whose payload is a message record
+     * OBS: The frame must have been checked with CommunicationUtils::validateMessage
+     * @param frame The received frame
+     */
+    explicit MessageBuffer(Frame &&frame);
+
+    MessageBuffer(MessageBuffer &&other) = default;
+    MessageBuffer &operator=(MessageBuffer &&other) = default;
+
+    /**
+     * @brief Returns the message record carried by this buffer
+     */
+    message_record *record() const;
+
+    /**
+     * @brief Returns the size of the message record (header + text)
+     */
+    int recordSize() const;
+};
+
+#endif
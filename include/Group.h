@@ -11,7 +11,10 @@
 #include "User.h"
 #include "RW_Monitor.h"
 #include "CommunicationUtils.h"
+#include "Metrics.h"
+#include "Tracer.h"
 #include "Session.h"
+#include "HistoryLog.h"
 
 // Forward declare User and Session
 class User;
@@ -26,8 +29,15 @@ public:
     std::string groupname;               // Name for this group instance
     std::map<std::string, User *> users; // Map of references to users connected to this group
     RW_Monitor users_monitor;            // Monitor for this instance's user list
-    FILE *history_file;                  // File descriptor for this group's history file
-    RW_Monitor history_file_monitor;     // Monitor for acessing the group history file
+    HistoryLog *history;                 // Segmented history log of this group
+    int node;                            // NUMA node the group was allocated on
+
+    // Metrics
+    Counter *messages_in;                // Messages posted to this group
+    Counter *messages_out;               // Messages delivered to this group's members
+    static Histogram *fanout_size;       // Members each posted message was delivered to
+    static Histogram *history_read_time; // Time (in microseconds) taken to read a group's history
+    static Histogram *search_time;       // Time (in microseconds) taken to search a group's history
 
     // These static methods are related to the list of all groups (static active_groups)
     /**
@@ -67,6 +77,28 @@ public:
      */
     static int joinByName(std::string username, std::string groupname, User **user, Group **group, Session *session);
 
+    /**
+     * Reads a range of a group's history log, by sequence number or time
+     * @param history History log of the group, held by a group or opened by a reader
+     * @param request Where the range starts or ends, and how many messages it has
+     * @param message_record_list Buffer for reading recorded messages, PACKET_MAX bytes per message
+     * @param n     Number of messages read at most
+     * @param first Set to the sequence number of the first message read
+     * @param end   Set to the sequence number the group's next message will get
+     * @return Number of recorded messages retrieved from the group's history
+     */
+    static int readHistory(HistoryLog *history, const history_request &request, char *message_record_list, int n, uint64_t *first, uint64_t *end);
+
+    /**
+     * Searches a group's history for the newest messages matching a query
+     * @param history History log of the group, held by a group or opened by a reader
+     * @param query  Words the messages must have, and from:<username> or on:<YYYY-MM-DD> filters
+     * @param message_record_list Buffer for the messages found, PACKET_MAX bytes per message
+     * @param n      Number of messages found at most
+     * @return Number of messages found
+     */
+    static int search(HistoryLog *history, const std::string &query, char *message_record_list, int n);
+
     // These non-static methods are related to an instance of group
 
     /**
@@ -76,10 +108,16 @@ public:
     Group(std::string groupname);
 
     /**
-     * Class destructor, closes any open history files left by this group
+     * Class destructor, lets go of the group's history log
      */
     ~Group();
 
+    /**
+     * Allocates groups on the node of the thread creating them, if placement is on (see Affinity)
+     */
+    static void *operator new(size_t size);
+    static void operator delete(void *group);
+
     /**
      * Add given user to group
      * @param user User to be added to this group
@@ -107,30 +145,26 @@ public:
     /**
      * "Posts" a chat message in this group
      * Saves the message and notifies all group members, including sender
-     * @param message  Message that is being posted in the group
-     * @param username Who sent this message
-     * @param message_type If this messag is sent from a user or from the server
+     * @param message Composed message that is being posted in the group, sent as-is to every member
      * @return Number of users this message was sent to, should always be at least 1 (the sender) on success
      */
-    int post(std::string message, std::string username, int message_type);
+    int post(const MessageBuffer &message);
 
     /**
-     * Creates and saves the given message to this groups history file.
-     * TODO This method should be mutex protected (No other threads should read or write to the file concurrently)
-     * @param message  Message that will be saved
-     * @param username User who sent this message
-     * @param message_type Indicates wether a message was sent by the server or a user
+     * Composes and "posts" a chat message in this group
+     * @param message  Message that is being posted in the group
+     * @param username Who sent this message
+     * @param message_type If this messag is sent from a user or from the server
+     * @return Number of users this message was sent to
      */
-    void saveMessage(std::string message, std::string username, int message_type);
+    int post(const std::string &message, const std::string &username, int message_type);
 
     /**
-     * Recovers the last N messages from the group's history file, sending them to the user
-     * @param message_record_list Buffer for reading recorded messages history
-     * @param n    Number of messages that will be recovered
-     * @param user Pointer to the user instance that will receive these messages
-     * @return Number of recorded messages retrieved from the grupo.hist file
+     * Saves the given message record to this group's history log
+     * @param message Message record that will be saved
+     * @returns If the record was written
      */
-    int recoverHistory(char *message_record_list, int n, User *user);
+    bool saveMessage(const message_record *message);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,205 @@
+/**
+ * This file models the full-text index of one history segment.
+ *
+ * Every message is split in terms: the words of its text (runs of letters and digits, lowercase,
+ * anything past the first HISTORY_TERM_MAX bytes dropped), "from:<username>" and "on:<YYYY-MM-DD>"
+ * (the UTC day it was sent). For every term the index keeps the positions, in the segment, of the
+ * messages that have it, in a posting list compressed as varint deltas (one byte per message for
+ * frequent terms). It also keeps where each message's frame starts in the segment file, so a
+ * message is read from its position with a single seek.
+ *
+ * Messages are also indexed by time, sparsely: the segment is cut in blocks of HISTORY_TIME_BLOCK
+ * messages, and each block keeps its oldest timestamp and the newest timestamp up to its end.
+ * The newest timestamps never go down, even if the clock that stamped the messages stepped back,
+ * so the block a time falls in is found by a binary search, and at most one block is read.
+ *
+ * The index of the active segment is built in memory as messages are appended. When a segment
+ * is sealed its index is written next to it (<id>.idx), with the terms sorted, and is later
+ * mapped from the file: finding a term is a binary search over the mapped dictionary, and only
+ * the pages of the posting lists a query needs are read, never the history itself.
+ */
+
+#ifndef HISTORYINDEX_H
+#define HISTORYINDEX_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "constants.h"
+#include "data_types.h"
+
+// Header of an index file, followed by the time blocks, the frame offsets, the term dictionary, the term names and the posting lists
+typedef struct
+{
+    char magic[4];        // HISTORY_INDEX_MAGIC
+    uint32_t records;     // Messages in the segment
+    uint32_t terms;       // Terms in the dictionary
+    uint32_t names_bytes; // Size (in bytes) of the term names
+    uint32_t blocks;      // Time blocks, one per HISTORY_TIME_BLOCK messages
+    uint32_t reserved;    // Keeps the time blocks aligned
+
+} index_header;
+
+// Time block of an index, HISTORY_TIME_BLOCK consecutive messages of the segment
+typedef struct
+{
+    uint64_t oldest; // Oldest timestamp in the block
+    uint64_t newest; // Newest timestamp in the block or any block before it
+
+} index_block;
+
+// Dictionary entry of an index file, sorted by name
+typedef struct
+{
+    uint32_t name;        // Offset of the name, from the start of the names
+    uint32_t name_length; // Size (in bytes) of the name
+    uint32_t postings;    // Offset of the posting list, from the start of the posting lists
+    uint32_t count;       // Messages with the term
+
+} index_term;
+
+// Posting list of a term, while it is built
+typedef struct
+{
+    std::string encoded; // Varint deltas between the positions
+    uint32_t last;       // Last position added
+    uint32_t count;      // Positions added
+
+} posting_list;
+
+class HistoryIndex
+{
+private:
+    // Built in memory (active segment, or a segment being indexed)
+    std::vector<uint32_t> offsets;                       // Frame offset of each message
+    std::vector<index_block> blocks;                     // Timestamps of each block of messages
+    std::unordered_map<std::string, posting_list> terms; // Posting list of each term
+
+    // Mapped from an index file
+    const char *mapped;                 // Start of the mapping (NULL if built in memory)
+    size_t mapped_size;                 // Size of the mapping
+    const index_header *header;         // Header of the file
+    const index_block *mapped_blocks;   // Timestamps of each block of messages
+    const uint32_t *mapped_offsets;     // Frame offset of each message
+    const index_term *dictionary;       // Sorted terms
+    const char *names;                  // Term names
+    const char *postings;               // Posting lists
+    size_t postings_bytes;              // Size (in bytes) of the posting lists
+
+public:
+    /**
+     * @brief Creates an empty index, built in memory
+     */
+    HistoryIndex();
+
+    /**
+     * @brief Unmaps the file, if the index was loaded from one
+     */
+    ~HistoryIndex();
+
+    /**
+     * @brief Maps an index file
+     * @param path Path of the file
+     * @param segment_bytes Size (in bytes) of the segment the index is for
+     * @returns The index, NULL if the file is missing, damaged or points past the end of the segment
+     */
+    static HistoryIndex *load(const std::string &path, uint64_t segment_bytes);
+
+    /**
+     * @brief Splits a message in the terms it is indexed by, without repeats
+     * @param record Message record, followed by its message
+     * @param terms  Vector the terms are added to
+     */
+    static void tokenize(const message_record *record, std::vector<std::string> &terms);
+
+    /**
+     * @brief Splits a search query in terms: words are split like messages, from: and on: are kept
+     * @param query Text the user searched for
+     * @param terms Vector the terms are added to
+     */
+    static void parseQuery(const std::string &query, std::vector<std::string> &terms);
+
+    /**
+     * @brief Adds the next message of the segment (only for indexes built in memory)
+     * @param offset    Offset of the message's frame in the segment
+     * @param timestamp Timestamp of the message
+     * @param terms     Terms of the message, from tokenize
+     */
+    void add(uint32_t offset, uint64_t timestamp, const std::vector<std::string> &terms);
+
+    /**
+     * @brief Writes an index built in memory to a file, replacing it whole
+     * @param path Path of the file
+     * @returns False if the file could not be written
+     */
+    bool write(const std::string &path);
+
+    /**
+     * @brief If the index is built in memory, rather than mapped from a file
+     */
+    bool inMemory();
+
+    /**
+     * @brief Number of messages indexed
+     */
+    uint32_t count();
+
+    /**
+     * @brief Offset of a message's frame in the segment
+     * @param position Position of the message in the segment (below count)
+     */
+    uint32_t offsetOf(uint32_t position);
+
+    /**
+     * @brief Finds the block of messages a time falls in
+     * @param timestamp Time (in seconds since the epoch)
+     * @param exact     Set if the first message of the block is the first one sent at or after the time
+     * @returns Position of the block's first message, count() if every message is older
+     */
+    uint32_t seek(uint64_t timestamp, bool *exact);
+
+    /**
+     * @brief Finds the messages that have every term
+     * @param terms     Terms searched for
+     * @param positions Vector the positions are written to, in order
+     */
+    void match(const std::vector<std::string> &terms, std::vector<uint32_t> &positions);
+
+private:
+    /**
+     * @brief Decodes the posting list of a term
+     * @returns False if the term is not in the index
+     */
+    bool lookup(const std::string &term, std::vector<uint32_t> &positions);
+
+    /**
+     * @brief Number of messages with the term (0 if it is not in the index)
+     */
+    uint32_t frequency(const std::string &term);
+
+    /**
+     * @brief Dictionary entry of a term in the mapped file, NULL if it is not there
+     */
+    const index_term *find(const std::string &term);
+
+    /**
+     * @brief Decodes varint deltas into positions
+     */
+    static void decode(const char *encoded, size_t length, uint32_t count, std::vector<uint32_t> &positions);
+
+    /**
+     * @brief Splits text in lowercase words
+     */
+    static void splitWords(const char *text, size_t length, std::vector<std::string> &terms);
+};
+
+#endif
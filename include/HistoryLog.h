@@ -0,0 +1,344 @@
+/**
+ * This file models the segmented history log of a group.
+ *
+ * A group's history lives in its own directory, HIST_PATH/<group>/, split in segment files.
+ * Messages are only ever appended to the newest (active) segment, which is sealed when it
+ * reaches HISTORY_SEGMENT_BYTES or gets older than HISTORY_SEGMENT_AGE, and a new one is
+ * started. Sealed segments never change. The manifest file lists the segments in order, with
+ * the sequence number of their first message, so every message has a sequence number (its
+ * position in the whole history) without it being stored in the records. The manifest is
+ * rewritten (to a temporary file, then renamed over the old one) when a segment is sealed,
+ * deleted or merged, never for a single message.
+ *
+ * Records are framed by their size and a CRC32C of size and record, so a damaged record is
+ * detected instead of being read as garbage. The manifest names the format of its segments, and
+ * a log whose manifest has none (written before records were framed) has its segments rewritten
+ * framed once, when it is opened. Segments are synced to disk before they are
+ * sealed, so after a crash only the active segment can end in a torn record. Opening the log
+ * reads the active segment once, front to back, counting its messages and cutting the file
+ * after the last whole record; the (possibly huge) sealed history is not read at all.
+ *
+ * A maintenance thread goes over every open log once per HISTORY_MAINTENANCE_MS. It deletes
+ * the oldest sealed segments that fall out of the retention policy (by age, segment count or
+ * bytes), and merges runs of small sealed segments into one. Merged segments are written
+ * without any lock, as sealed segments are not written to, and the monitor is only taken to
+ * swap them into the manifest, so appending is never held back by a merge.
+ *
+ * Messages are read by range: a segment is found by the sequence number of its first message,
+ * and its index gives the offset of every frame in it, so a page of history far back costs one
+ * seek rather than a scan. A time is turned into a sequence number by the newest timestamp of
+ * each segment, then by the time blocks of that segment's index, reading one block at most.
+ *
+ * Each segment has a full-text index (see HistoryIndex.h). The active segment's index is kept in
+ * memory and updated by every append. Once the segment is sealed the maintenance thread writes it
+ * next to the segment, so sealing does not hold appends back, and it is mapped from there on. A
+ * search goes from the newest segment back, matching each segment's index, until it has enough
+ * messages, then reads only those messages, each from its offset.
+ *
+ * Logs are shared by name and counted: every group with the same name uses the same log, which
+ * is closed when its last user lets it go.
+ */
+
+#ifndef HISTORYLOG_H
+#define HISTORYLOG_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "data_types.h"
+#include "RW_Monitor.h"
+#include "Metrics.h"
+#include "Logger.h"
+#include "Checksum.h"
+#include "HistoryIndex.h"
+#include "Affinity.h"
+
+// A segment of a group's history, as listed in its manifest
+typedef struct __history_segment
+{
+    uint64_t id;      // Identifier, names the segment's file
+    uint64_t first;   // Sequence number of the segment's first message
+    uint64_t count;   // Messages in the segment
+    uint64_t bytes;   // Size (in bytes) of the segment's file
+    uint64_t created; // Time (in seconds since the epoch) the segment was started
+    uint64_t newest;  // Newest timestamp of the segment's messages (0 if it has none)
+
+} history_segment;
+
+// Frame of a record in a segment file
+typedef struct __history_frame
+{
+    uint32_t length;      // Size (in bytes) of the record that follows
+    uint32_t checksum;    // CRC32C of the length and the record
+    const char _record[]; // Message record, followed by its message
+
+} history_frame;
+
+// Which sealed segments are kept, 0 leaves a limit out
+typedef struct
+{
+    uint64_t age;      // Time (in seconds) a segment is kept after its newest message
+    uint64_t segments; // Segments kept, counting the active one
+    uint64_t bytes;    // Total size (in bytes) of the segments kept
+
+} retention_policy;
+
+class HistoryLog
+{
+private:
+    static std::map<std::string, HistoryLog *> open_logs; // Every open log, by group name
+    static pthread_mutex_t logs_lock;                     // Lock for the open log list
+    static retention_policy retention;                    // Segments the maintenance thread keeps
+
+    static pthread_t maintenance_thread; // Thread enforcing retention and merging segments
+    static std::atomic<bool> running;    // If the maintenance thread is running
+
+    // Metrics
+    static Counter *segments_sealed;  // Segments sealed
+    static Counter *segments_deleted; // Segments deleted by retention
+    static Counter *segments_merged;  // Segments merged into others
+    static Counter *torn_records;     // Damaged records found at the end of a segment (cut off) or inside one
+
+    std::string name;                       // Group the log belongs to
+    std::string directory;                  // Directory of the log's files
+    int references;                         // Groups (and maintenance passes) using the log
+    std::vector<history_segment> segments;  // Segments, oldest first, the last one is active
+    std::atomic<uint64_t> next_id;          // Identifier of the next segment created
+    unsigned format;                        // Format of the segments on disk (see HISTORY_FORMAT)
+    FILE *active;                           // Active segment, open for appending
+    RW_Monitor monitor;                     // Monitor for the segment list and the active segment
+
+    std::map<uint64_t, HistoryIndex *> indexes; // Index of each segment, by segment (sealed ones mapped on first use)
+    pthread_mutex_t index_lock;                 // Lock for the index list (segments may be indexed with read rights)
+
+public:
+    /**
+     * @brief Sets which segments are kept, before the maintenance thread starts
+     */
+    static void configure(const retention_policy &policy);
+
+    /**
+     * @brief Starts the maintenance thread
+     */
+    static void start();
+
+    /**
+     * @brief Stops the maintenance thread
+     */
+    static void stop();
+
+    /**
+     * @brief Opens the group's log, creating it the first time (and moving an old single-file
+     * history into it), or shares the already open one
+     * @param groupname Name of the group
+     */
+    static HistoryLog *open(const std::string &groupname);
+
+    /**
+     * @brief Lets go of a log returned by open, closing it if nobody else uses it
+     */
+    static void close(HistoryLog *log);
+
+    /**
+     * @brief Appends a message record to the active segment, sealing it first if it is full or old.
+     * If the write fails, the segment is cut back to its last whole record and nothing is indexed
+     * @param record   Message record, followed by its message
+     * @param sequence Filled with the sequence number given to the message (if not NULL)
+     * @returns If the record was written
+     */
+    bool append(const message_record *record, uint64_t *sequence = NULL);
+
+    /**
+     * @brief Sequence numbers bounding the messages kept
+     * @param oldest Set to the sequence number of the oldest message kept
+     * @param end    Set to the sequence number the next message appended will get
+     */
+    void bounds(uint64_t *oldest, uint64_t *end);
+
+    /**
+     * @brief Reads consecutive messages, oldest first, seeking to the first one through its segment's index
+     * @param sequence Sequence number of the first message (messages deleted by retention are skipped)
+     * @param buffer   Buffer the message records are copied to, PACKET_MAX bytes per message
+     * @param n        Number of messages read at most
+     * @param first    Set to the sequence number of the first message read
+     * @returns Number of messages read
+     */
+    int readRange(uint64_t sequence, char *buffer, int n, uint64_t *first);
+
+    /**
+     * @brief Finds the first message sent at or after a time, reading one block of messages at most
+     * @param timestamp Time (in seconds since the epoch)
+     * @returns Sequence number of the message, the end of the log if every message is older
+     */
+    uint64_t sequenceAt(uint64_t timestamp);
+
+    /**
+     * @brief Finds the newest messages with every term of a query, oldest first
+     * @param query  Words the messages must have, and from:<username> or on:<YYYY-MM-DD> filters
+     * @param buffer Buffer the message records are copied to, PACKET_MAX bytes per message
+     * @param n      Number of messages found at most
+     * @returns Number of messages found
+     */
+    int search(const std::string &query, char *buffer, int n);
+
+    /**
+     * @brief Total size (in bytes) of the log's segments
+     */
+    uint64_t bytes();
+
+    /**
+     * @brief Adds the size of every open log to a metrics scrape
+     */
+    static void collect(std::ostream &output);
+
+    /**
+     * @brief Debug function, lists every open log and the maintenance counters to stdout
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Opens the log's directory, reading (or creating) its manifest
+     */
+    HistoryLog(const std::string &groupname);
+
+    /**
+     * @brief Closes the active segment
+     */
+    ~HistoryLog();
+
+    /**
+     * @brief Allocates logs on the node of the thread opening them, if placement is on (see Affinity)
+     */
+    static void *operator new(size_t size);
+    static void operator delete(void *log);
+
+    /**
+     * @brief Maintenance thread procedure, enforces retention and merges segments until stopped
+     */
+    static void *maintain(void *arg);
+
+    /**
+     * @brief Deletes the oldest sealed segments that the retention policy does not keep
+     * @returns Number of segments deleted
+     */
+    int enforceRetention();
+
+    /**
+     * @brief Writes the in-memory indexes of sealed segments to their files, then drops them from memory
+     * @returns Number of indexes written
+     */
+    int persistIndexes();
+
+    /**
+     * @brief Merges the first run of small sealed segments into one
+     * @returns Number of segments merged (0 if there was no run)
+     */
+    int compact();
+
+    /**
+     * @brief Seals the active segment and starts a new one (with write rights)
+     */
+    void roll();
+
+    /**
+     * @brief Reads the manifest into the segment list, and the format of the segments
+     * @returns False if there is no manifest
+     */
+    bool readManifest();
+
+    /**
+     * @brief Replaces the manifest with the current segment list
+     */
+    void writeManifest();
+
+    /**
+     * @brief Reads the active segment in one pass, counting and indexing its messages, and cuts it
+     * after the last whole record
+     */
+    void recoverActive();
+
+    /**
+     * @brief Reads the next record of a segment, checking its frame
+     * @param segment Segment file, at the start of a frame
+     * @param record  Buffer for the record, PACKET_MAX bytes
+     * @returns Size of the record, 0 at the end of the segment or at a damaged frame
+     */
+    static size_t readRecord(FILE *segment, char *record);
+
+    /**
+     * @brief Index of a segment, mapped from its file or, if that is missing, built from the segment
+     * and written (with read rights at least)
+     * @returns The index, NULL if the segment cannot be read
+     */
+    HistoryIndex *indexOf(const history_segment &segment);
+
+    /**
+     * @brief Builds the index of a segment file by reading it
+     * @returns The index, NULL if the file cannot be read
+     */
+    static HistoryIndex *buildIndex(const std::string &path);
+
+    /**
+     * @brief Drops the index of a segment that left the manifest (with write rights)
+     */
+    void dropIndex(uint64_t id);
+
+    /**
+     * @brief Checksum of a frame
+     * @param length Size of the record
+     * @param record Message record, followed by its message
+     */
+    static uint32_t frameChecksum(uint32_t length, const char *record);
+
+    /**
+     * @brief Rewrites every segment of an older format framed, then records the new format in the manifest
+     */
+    void convertSegments();
+
+    /**
+     * @brief Rewrites a segment of bare records (format 1) with each record framed, dropping its index
+     * @param segment Segment rewritten, its size is updated
+     * @returns False if the segment could not be rewritten
+     */
+    bool convertSegment(history_segment &segment);
+
+    /**
+     * @brief If a segment file is made of whole framed records only (an empty one is)
+     * @param path Path of the segment file
+     */
+    static bool isFramed(const std::string &path);
+
+    /**
+     * @brief Appends the messages of an old single-file history, then renames the file
+     */
+    void migrate(const std::string &filename);
+
+    /**
+     * @brief Deletes segment files that are not in the manifest (left by an interrupted merge)
+     */
+    void removeOrphans();
+
+    /**
+     * @brief Path of a segment's file
+     */
+    std::string segmentPath(uint64_t id);
+
+    /**
+     * @brief Path of a segment's index file
+     */
+    std::string indexPath(uint64_t id);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * This file models a minimal io_uring instance, used by the event loop when the servers
+ * are built with IO_URING=1 (which defines USE_IO_URING).
+ *
+ * It talks to the kernel through the raw io_uring_setup/io_uring_enter/io_uring_register
+ * system calls: the submission and completion rings are mapped once, submission entries
+ * are filled in place and handed to the kernel in batches, and completions are reaped
+ * straight from the shared ring. A ring may also own a provided buffer ring, from which
+ * the kernel picks a buffer every time a multishot receive completes.
+ *
+ * An IORing is not thread safe, each instance must be used by a single thread at a time.
+ */
+
+#ifndef IORING_H
+#define IORING_H
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <string.h>
+#include <errno.h>
+
+#include "constants.h"
+
+class IORing
+{
+private:
+    int ring_fd; // io_uring instance descriptor
+
+    // Submission ring
+    void *sq_map;          // Mapped submission ring
+    size_t sq_map_size;    // Size of the submission ring mapping
+    unsigned *sq_head;     // Head of the submission ring (moved by the kernel)
+    unsigned *sq_tail;     // Tail of the submission ring (moved by us)
+    unsigned *sq_mask;     // Mask for submission ring indexes
+    unsigned *sq_array;    // Indexes of the submission entries, in submission order
+    io_uring_sqe *sqes;    // Submission entries
+    size_t sqes_size;      // Size of the submission entries mapping
+    unsigned sq_entries;   // Number of submission entries
+    unsigned sq_pending;   // Entries filled but not handed to the kernel yet
+
+    // Completion ring
+    void *cq_map;          // Mapped completion ring (the same as sq_map on single mmap kernels)
+    size_t cq_map_size;    // Size of the completion ring mapping
+    unsigned *cq_head;     // Head of the completion ring (moved by us)
+    unsigned *cq_tail;     // Tail of the completion ring (moved by the kernel)
+    unsigned *cq_mask;     // Mask for completion ring indexes
+    io_uring_cqe *cqes;    // Completion entries
+
+    // Provided buffers
+    io_uring_buf_ring *buffer_ring; // Ring the kernel picks receive buffers from
+    char *buffers;                  // Memory backing the provided buffers
+    unsigned buffer_count;          // Number of provided buffers
+    unsigned buffer_size;           // Size (in bytes) of each provided buffer
+    unsigned short buffer_tail;     // Local copy of the buffer ring tail
+
+public:
+    /**
+     * @brief Creates an io_uring instance and maps its rings
+     * @param entries Number of submission entries
+     * @throws std::runtime_error if the kernel does not support io_uring
+     */
+    IORing(unsigned entries);
+
+    /**
+     * @brief Unmaps the rings and closes the instance
+     */
+    ~IORing();
+
+    /**
+     * @brief Returns a zeroed submission entry. If the submission ring is full,
+     * the pending entries are submitted first
+     */
+    io_uring_sqe *getSQE();
+
+    /**
+     * @brief Hands the pending submission entries to the kernel and waits for completions
+     * @param wait_for Minimum number of completions to wait for
+     * @returns Number of entries submitted, or -errno on failure
+     */
+    int submit(unsigned wait_for = 0);
+
+    /**
+     * @brief Returns the oldest completion not reaped yet, or NULL if there is none
+     */
+    io_uring_cqe *peekCQE();
+
+    /**
+     * @brief Marks the oldest completion as reaped
+     */
+    void advanceCQ();
+
+    /**
+     * @brief Registers a provided buffer ring (group 0) and fills it with buffers
+     * @param count Number of buffers, must be a power of 2
+     * @param size  Size (in bytes) of each buffer
+     * @returns True on success, false if the kernel does not support buffer rings
+     */
+    bool provideBuffers(unsigned count, unsigned size);
+
+    /**
+     * @brief Returns the memory of a provided buffer
+     * @param buffer_id Identifier of the buffer, taken from the completion flags
+     */
+    char *buffer(unsigned buffer_id);
+
+    /**
+     * @brief Gives a provided buffer back to the kernel, once its data was consumed
+     * @param buffer_id Identifier of the buffer, taken from the completion flags
+     */
+    void recycleBuffer(unsigned buffer_id);
+};
+
+#endif
+
+#endif
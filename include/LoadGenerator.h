@@ -0,0 +1,144 @@
+/**
+ * This file models the load generator used by the bench application.
+ *
+ * It opens one connection per simulated user against a server (or the leader replica, both
+ * speak the same client protocol), logs every user into one of the groups (round-robin),
+ * and then posts chat messages from the users at a fixed rate while every user keeps sending
+ * keep-alives, like the interactive client does. Each message carries the monotonic time it
+ * was sent, so every member that receives it can measure the fan-out latency. The time from
+ * connect to the server's first answer is measured for every login, giving the connection
+ * setup rate. The connections are drained by a single receiver thread through epoll, so
+ * thousands of users do not need thousands of threads. Against a partitioned cluster, logins
+ * refused by a replica that does not lead the user's group are made again at the owner, so
+ * the users spread between the replicas like interactive clients do.
+ */
+
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "data_types.h"
+#include "Frame.h"
+
+// Prefix of the messages posted by the load generator
+#define BENCH_PREFIX "bench "
+
+// A simulated user
+typedef struct __bench_user
+{
+    int socket;              // Connection to the server
+    int group;               // Index of the group the user joined
+    std::vector<char> input; // Bytes of the packet(s) being received
+    bool answered;           // If the server sent anything since login (only touched by the receiver)
+    int redirect;            // Port of the replica leading the user's group, if the login was sent there (0 otherwise)
+
+} bench_user;
+
+class LoadGenerator
+{
+private:
+    std::string server_ip; // Address of the server
+    int server_port;       // Port of the server
+    int user_count;        // Number of simulated users
+    int group_count;       // Number of groups the users are spread through
+    int rate;              // Messages posted per second
+    int duration;          // Time (in seconds) messages are posted for
+    int keep_alive;        // Time (in milliseconds) between keep-alives of each user (0 disables them)
+
+    std::vector<bench_user> users;   // Simulated users
+    std::vector<int> group_sizes;    // Number of users in each group
+    int epoll_fd;                    // Epoll instance watching every connection
+    pthread_t receiver_thread;       // Thread draining the connections
+    std::atomic<bool> receiving;     // If the receiver thread should keep going
+
+    std::atomic<int> answered;       // Users the server already answered
+    std::atomic<long> posted;        // Messages posted
+    std::atomic<long> expected;      // Deliveries expected for the posted messages
+    std::atomic<long> delivered;     // Deliveries received
+    long keep_alives;                // Keep-alives sent
+    std::vector<uint64_t> latencies; // Fan-out latency (in microseconds) of each delivery, only touched by the receiver
+    std::vector<uint64_t> setups;    // Time (in microseconds) from connect to the first answer of each login
+    uint64_t login_time;             // Time (in microseconds) spent logging every user in
+
+    std::atomic<uint64_t> post_start; // Time (in microseconds) the first message was posted
+    uint64_t post_end;                // Time (in microseconds) the last delivery was received
+
+public:
+    /**
+     * @brief Class constructor
+     * @param ip       Address of the server
+     * @param port     Port of the server
+     * @param users    Number of simulated users
+     * @param groups   Number of groups the users are spread through
+     * @param rate     Messages posted per second
+     * @param duration Time (in seconds) messages are posted for
+     * @param keep_alive Time (in milliseconds) between keep-alives of each user, 0 disables them
+     */
+    LoadGenerator(const std::string &ip, int port, int users, int groups, int rate, int duration, int keep_alive);
+
+    /**
+     * @brief Class destructor, closes every connection
+     */
+    ~LoadGenerator();
+
+    /**
+     * @brief Connects and logs every user in, then posts messages and waits for their deliveries
+     */
+    void run();
+
+    /**
+     * @brief Prints the results to stdout
+     */
+    void report();
+
+private:
+    /**
+     * @brief Connects a user and sends its login packet, following redirects to the replica leading its group
+     * @returns True if the user is connected
+     */
+    bool login(int index);
+
+    /**
+     * @brief Connects a user to a port and sends its login packet
+     * @returns True if the login was sent
+     */
+    bool connectUser(int index, int port);
+
+    /**
+     * @brief Sends a keep-alive packet from every connected user
+     */
+    void sendKeepAlives();
+
+    /**
+     * @brief Receiver thread procedure
+     */
+    static void *receive(void *arg);
+
+    /**
+     * @brief Appends received bytes to the user's input and handles every complete packet
+     */
+    void consume(bench_user &user, const char *data, size_t size);
+
+    /**
+     * @brief Current monotonic time in microseconds
+     */
+    static uint64_t now();
+
+    /**
+     * @brief Value at the given percentile (0 to 1) of sorted samples, 0 if there are none
+     */
+    static uint64_t percentile(const std::vector<uint64_t> &sorted, double p);
+};
+
+#endif
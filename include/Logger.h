@@ -0,0 +1,129 @@
+/**
+ * This file models the leveled, asynchronous logger used by the servers.
+ *
+ * Threads never write to the terminal themselves: a log call formats its line straight into a
+ * slot of a fixed-size ring (a bounded multi-producer queue, claimed with a compare-and-swap on
+ * the tail), and a background thread drains the ring and writes the lines in batches. Errors
+ * and warnings go to stderr, everything else to stdout. When the ring is full, lines are
+ * dropped (and counted) instead of holding the caller back.
+ *
+ * Every line belongs to a subsystem, and each subsystem has its own level, so e.g. elections can
+ * be traced in detail while per-packet front-end lines stay off. Levels are configured with a
+ * comma-separated list, such as "info,election=debug,frontend=warn": a bare level sets every
+ * subsystem, subsystem=level sets one. Lines above their subsystem's level cost one comparison.
+ *
+ * Before start (and after stop) lines are written right away, by the calling thread.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+#include "constants.h"
+#include "Metrics.h"
+
+// Log levels
+#define LOG_ERROR 0 // Something failed
+#define LOG_WARN  1 // Something unexpected, that was handled
+#define LOG_INFO  2 // Lifecycle events (startup, connections, elections)
+#define LOG_DEBUG 3 // Per-packet details
+
+// Log subsystems
+#define LOG_MAIN        0 // Startup, shutdown and administration
+#define LOG_FRONTEND    1 // Front-end (client) connections and packets
+#define LOG_REPLICATION 2 // Replica connections and updates
+#define LOG_ELECTION    3 // Leader elections
+#define LOG_IO          4 // Event loop and output
+#define LOG_SUBSYSTEMS  5 // Number of subsystems
+
+// A line waiting to be written
+typedef struct __log_slot
+{
+    std::atomic<uint64_t> sequence; // Ring position the slot is ready for (see Logger::log)
+    int level;                      // Level of the line
+    int subsystem;                  // Subsystem of the line
+    uint64_t time;                  // Time (in microseconds since the epoch) the line was logged
+    char text[LOG_LINE_MAX];        // The formatted line
+
+} log_slot;
+
+class Logger
+{
+private:
+    static std::atomic<int> levels[LOG_SUBSYSTEMS]; // Highest level written for each subsystem
+
+    static log_slot ring[LOG_RING_ENTRIES]; // Lines waiting to be written
+    static std::atomic<uint64_t> tail;      // Next ring position a line is written to
+    static uint64_t head;                   // Next ring position the writer thread reads (only touched by it)
+
+    static pthread_t writer_thread;    // Thread writing the lines
+    static std::atomic<bool> running;  // If the writer thread is running
+
+    static Counter *dropped; // Lines dropped because the ring was full
+
+public:
+    /**
+     * @brief Sets the levels of the subsystems
+     * @param levels Comma-separated list of level (every subsystem) or subsystem=level entries
+     * @returns False if the list has an unknown level or subsystem (nothing is changed)
+     */
+    static bool configure(const std::string &levels);
+
+    /**
+     * @brief Starts the writer thread
+     */
+    static void start();
+
+    /**
+     * @brief Writes every queued line and stops the writer thread
+     */
+    static void stop();
+
+    /**
+     * @brief If lines of the level would be written for the subsystem
+     */
+    static bool enabled(int subsystem, int level);
+
+    /**
+     * @brief Logs a line
+     * @param subsystem Subsystem the line belongs to (see Logger.h)
+     * @param level     Level of the line (see Logger.h)
+     * @param format    printf-like format of the line, followed by its arguments
+     */
+    static void log(int subsystem, int level, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+private:
+    /**
+     * @brief Writer thread procedure, drains the ring until stopped
+     */
+    static void *writeLines(void *arg);
+
+    /**
+     * @brief Writes every line in the ring, returns how many were written
+     */
+    static int drain();
+
+    /**
+     * @brief Formats a line, with its time, level and subsystem, into the buffer
+     * @returns Number of bytes written into the buffer
+     */
+    static int formatLine(char *buffer, size_t size, uint64_t time, int level, int subsystem, const char *text);
+
+    /**
+     * @brief Writes the bytes to the file descriptor, ignoring errors
+     */
+    static void output(int fd, const char *data, size_t size);
+};
+
+// Hot path, inlined
+
+inline bool Logger::enabled(int subsystem, int level)
+{
+    return level <= levels[subsystem].load(std::memory_order_relaxed);
+}
+
+#endif
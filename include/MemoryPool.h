@@ -0,0 +1,116 @@
+/**
+ * This file models the memory pool used for the variable-length protocol structures
+ * (message records, message updates, login updates, packets...).
+ *
+ * Every thread keeps its own cache of free blocks, separated in size classes
+ * (POOL_MIN_BLOCK, 2 * POOL_MIN_BLOCK, ... POOL_MAX_BLOCK bytes). Allocations are served
+ * from the calling thread's cache, so no lock is taken on the hot path. Only when the
+ * cache is empty, or the requested size is bigger than the largest class, the block
+ * "spills" to the global allocator.
+ *
+ * Blocks are handed out wrapped in a PoolHandle, which gives the block back to the
+ * pool when it goes out of scope.
+ */
+
+#ifndef MEMORYPOOL_H
+#define MEMORYPOOL_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <iostream>
+
+#include "constants.h"
+
+class MemoryPool
+{
+private:
+    static std::atomic<long> live_objects; // Number of blocks currently handed out
+    static std::atomic<long> peak_objects; // Highest number of blocks handed out at the same time
+    static std::atomic<long> allocations;  // Total number of allocations served
+    static std::atomic<long> spills;       // Allocations that had to go to the global allocator
+    static thread_local long acquired;     // Blocks handed out to the calling thread, for checks that a path allocates none
+
+public:
+    /**
+     * @brief Allocates a zeroed block with at least size bytes
+     * @param size Number of bytes needed
+     * @returns Pointer to the allocated block
+     */
+    static void *allocate(size_t size);
+
+    /**
+     * @brief Gives a block back to the calling thread's pool
+     * @param block Block previously returned by allocate (NULL is ignored)
+     */
+    static void release(void *block);
+
+    /**
+     * @brief Number of blocks handed out to the calling thread so far (from its cache or spilled)
+     */
+    static long acquiredByThread();
+
+    /**
+     * @brief Debug function, lists the pool counters to stdout
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Finds the size class that fits the requested size
+     * @param size Number of bytes needed
+     * @returns Index of the size class, or -1 if no class is big enough
+     */
+    static int sizeClass(size_t size);
+};
+
+/**
+ * Move-only owner of a block allocated from the MemoryPool.
+ * The block is released when the handle is destroyed or re-assigned.
+ */
+template <typename T>
+class PoolHandle
+{
+private:
+    T *block; // Owned block
+
+public:
+    PoolHandle() : block(NULL) {}
+
+    explicit PoolHandle(T *block) : block(block) {}
+
+    PoolHandle(PoolHandle &&other) : block(other.block) { other.block = NULL; }
+
+    PoolHandle(const PoolHandle &) = delete;
+
+    ~PoolHandle() { MemoryPool::release(block); }
+
+    PoolHandle &operator=(PoolHandle &&other)
+    {
+        if (this != &other)
+        {
+            MemoryPool::release(block);
+            block = other.block;
+            other.block = NULL;
+        }
+        return *this;
+    }
+
+    PoolHandle &operator=(const PoolHandle &) = delete;
+
+    /**
+     * @brief Allocates a new zeroed block of size bytes from the pool
+     */
+    static PoolHandle allocate(size_t size) { return PoolHandle((T *)MemoryPool::allocate(size)); }
+
+    T *get() const { return block; }
+
+    T *operator->() const { return block; }
+
+    char *data() const { return (char *)block; }
+
+    explicit operator bool() const { return block != NULL; }
+};
+
+#endif
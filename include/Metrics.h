@@ -0,0 +1,256 @@
+/**
+ * This file models the metrics registry used by the servers.
+ *
+ * Metrics are counters (values that only go up) and histograms (distributions of values,
+ * usually latencies in microseconds), registered by name. A name may carry labels in the
+ * Prometheus format, e.g. group_messages_in_total{group="friends"}, so a family of related
+ * metrics shares the part before the braces.
+ *
+ * Recording is meant to stay on in production: each metric is split in METRICS_SHARDS
+ * cache-line-aligned shards, and every thread records into its own shard with a relaxed
+ * atomic add, so threads never write to the same cache line. Shards are only summed when
+ * the metric is read. Histograms use HDR-style log-linear buckets: every power of two is
+ * split in METRICS_SUB_BUCKETS linear buckets, which keeps the relative error under
+ * 1 / METRICS_SUB_BUCKETS with a fixed, small number of buckets.
+ *
+ * Metrics are created once and never freed, so callers look them up once (usually when
+ * a static or a member is initialized) and keep the pointer. Families labelled by values
+ * clients choose (e.g. group names) keep at most METRICS_SERIES_MAX of them apart, later
+ * values share a single "other" series, so clients cannot grow the registry without bound.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "constants.h"
+
+// Number of histogram buckets: values below METRICS_SUB_BUCKETS get a bucket each, then every power of two gets METRICS_SUB_BUCKETS
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+
+class Counter
+{
+private:
+    // One shard, alone in its cache line
+    struct alignas(64) counter_shard
+    {
+        std::atomic<long> value;
+    };
+
+    counter_shard shards[METRICS_SHARDS]; // Per-thread shards
+
+public:
+    /**
+     * @brief Creates a counter at 0
+     */
+    Counter();
+
+    /**
+     * @brief Adds to the counter
+     * @param amount Value added, defaults to 1
+     */
+    void add(long amount = 1);
+
+    /**
+     * @brief Returns the current value, the sum of every shard
+     */
+    long value() const;
+};
+
+class Histogram
+{
+private:
+    // One shard, starting in its own cache line
+    struct alignas(64) histogram_shard
+    {
+        std::atomic<uint64_t> buckets[METRICS_BUCKETS]; // Number of values recorded in each bucket
+        std::atomic<uint64_t> count;                    // Number of values recorded
+        std::atomic<uint64_t> sum;                      // Sum of the values recorded
+    };
+
+    histogram_shard shards[METRICS_SHARDS]; // Per-thread shards
+
+public:
+    /**
+     * @brief Creates an empty histogram
+     */
+    Histogram();
+
+    /**
+     * @brief Records a value
+     * @param value Value recorded, values beyond 2^METRICS_MAX_EXPONENT go to the last bucket
+     */
+    void record(uint64_t value);
+
+    /**
+     * @brief Returns the number of values recorded
+     */
+    uint64_t count() const;
+
+    /**
+     * @brief Returns the sum of the values recorded
+     */
+    uint64_t sum() const;
+
+    /**
+     * @brief Returns the number of values recorded in each bucket (summed through the shards)
+     */
+    std::vector<uint64_t> snapshot() const;
+
+    /**
+     * @brief Estimates the value at a percentile from a snapshot
+     * @param buckets Snapshot of the buckets
+     * @param p       Percentile, from 0 to 1
+     * @returns Highest value of the bucket the percentile falls in, 0 if nothing was recorded
+     */
+    static uint64_t percentile(const std::vector<uint64_t> &buckets, double p);
+
+    /**
+     * @brief Bucket a value is recorded in
+     */
+    static int bucketOf(uint64_t value);
+
+    /**
+     * @brief Highest value recorded in a bucket
+     */
+    static uint64_t bucketLimit(int bucket);
+};
+
+class Metrics
+{
+private:
+    static pthread_mutex_t registry_lock; // Lock for the registry (a plain mutex, RW_Monitor itself records metrics)
+    static std::atomic<int> next_shard;   // Shard given to the next thread that records a metric
+
+public:
+    /**
+     * @brief Returns the counter with the given name, creating it the first time
+     * @param name Metric name, optionally followed by labels: name{label="value"}
+     * @param help Description of the metric family, kept from the first registration
+     */
+    static Counter *counter(const std::string &name, const std::string &help);
+
+    /**
+     * @brief Returns the counter of one value of a label, creating it the first time. Once the
+     * family has METRICS_SERIES_MAX series, new values share the series whose value is "other"
+     * @param name  Metric name, without labels
+     * @param label Label name
+     * @param value Label value as given, it is escaped here
+     * @param help  Description of the metric family, kept from the first registration
+     */
+    static Counter *counter(const std::string &name, const std::string &label, const std::string &value, const std::string &help);
+
+    /**
+     * @brief Returns the histogram with the given name, creating it the first time
+     * @param name Metric name, optionally followed by labels: name{label="value"}
+     * @param help Description of the metric family, kept from the first registration
+     */
+    static Histogram *histogram(const std::string &name, const std::string &help);
+
+    /**
+     * @brief Shard the calling thread records into
+     */
+    static int shard();
+
+    /**
+     * @brief Current monotonic time in microseconds, for timing what is recorded in histograms
+     */
+    static uint64_t now();
+
+    /**
+     * @brief Current wall-clock time in microseconds since the epoch, for times compared between processes
+     */
+    static uint64_t epochTime();
+
+    /**
+     * @brief Debug function, lists every metric to stdout
+     */
+    static void listStats();
+
+    /**
+     * @brief Writes every metric in the Prometheus text exposition format
+     * @param output Stream the metrics are written to
+     */
+    static void exposition(std::ostream &output);
+
+    /**
+     * @brief Name of the family a metric belongs to (the name without its labels)
+     */
+    static std::string family(const std::string &name);
+
+    /**
+     * @brief Labels of a metric, without the braces (empty if it has none)
+     */
+    static std::string labels(const std::string &name);
+
+    /**
+     * @brief Escapes a label value for the exposition format (backslash, double quote and newline)
+     * @param value Label value as given, e.g. a group name
+     */
+    static std::string escapeLabel(const std::string &value);
+
+private:
+    /**
+     * @brief Registered metrics, by name, and the description of each family
+     * OBS: Kept as function statics, metrics are registered while other statics are initialized
+     */
+    static std::map<std::string, Counter *> &counters();
+    static std::map<std::string, Histogram *> &histograms();
+    static std::map<std::string, std::string> &helps();
+};
+
+// Hot paths, inlined
+
+inline int Metrics::shard()
+{
+    static thread_local int own_shard = next_shard++ % METRICS_SHARDS;
+    return own_shard;
+}
+
+inline uint64_t Metrics::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t Metrics::epochTime()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void Counter::add(long amount)
+{
+    shards[Metrics::shard()].value.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline int Histogram::bucketOf(uint64_t value)
+{
+    // Small values are exact
+    if (value < METRICS_SUB_BUCKETS)
+        return value;
+
+    // Power of two the value is in, and its position inside it
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT)
+        return METRICS_BUCKETS - 1;
+
+    int sub_bucket = (value >> (exponent - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (exponent - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+inline void Histogram::record(uint64_t value)
+{
+    histogram_shard &own = shards[Metrics::shard()];
+
+    own.buckets[Histogram::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    own.count.fetch_add(1, std::memory_order_relaxed);
+    own.sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * This file models the HTTP endpoint that exposes the metrics to scrapers.
+ *
+ * The endpoint listens on its own port and thread, and answers GET /metrics with every
+ * registered metric in the Prometheus text exposition format, followed by whatever the
+ * server's collector adds (gauges describing its current state). Each request is answered
+ * and the connection closed.
+ *
+ * Scrapes only read: the registry sums its shards, and collectors must at most take read
+ * rights, never write rights, so scraping does not hold back the chat hot path.
+ */
+
+#ifndef METRICSENDPOINT_H
+#define METRICSENDPOINT_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <sstream>
+#include <string>
+
+#include "constants.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+// Adds server specific metrics to a scrape
+typedef void (*metrics_collector)(std::ostream &output);
+
+class MetricsEndpoint
+{
+private:
+    static int listen_socket;              // Socket where scrapers connect
+    static pthread_t endpoint_thread;      // Thread answering scrapes
+    static std::atomic<bool> running;      // If the endpoint thread is running
+    static metrics_collector collector;    // Adds the server's own metrics to each scrape
+
+public:
+    /**
+     * @brief Starts listening for scrapes
+     * @param port      Port the endpoint listens at
+     * @param collector Function adding the server's own metrics to each scrape (may be NULL)
+     */
+    static void start(int port, metrics_collector collector);
+
+    /**
+     * @brief Stops the endpoint thread and closes its socket
+     */
+    static void stop();
+
+    /**
+     * @brief Writes the HELP and TYPE lines of a metric family
+     * @param output Stream the scrape is written to
+     * @param family Name of the metric family
+     * @param type   Prometheus type: counter, gauge or histogram
+     * @param help   Description of the family
+     */
+    static void describe(std::ostream &output, const std::string &family, const std::string &type, const std::string &help);
+
+private:
+    /**
+     * @brief Endpoint thread procedure, answers scrapes until stopped
+     */
+    static void *serve(void *arg);
+
+    /**
+     * @brief Reads one request from the socket and answers it
+     */
+    static void answer(int socket);
+};
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * This file models the microbenchmark harness for the per-message hot functions.
+ *
+ * Every case runs a fixed number of operations per repetition and measures the time per
+ * operation, so two runs with the same parameters do the same work. The message text is
+ * generated from a fixed seed, the process can be pinned to one CPU, and warmup
+ * repetitions are discarded. Socket cases only time the call being measured: the other
+ * end of the socketpair is filled or drained outside the timed region.
+ *
+ * Results are written as JSON (minimum, median and maximum time per operation, plus every
+ * sample), so runs can be compared by a script.
+ *
+ * The broadcast case runs the server's own path: a member's client end sends a message, the
+ * server end receives it into a frame and posts it to a group of several sessions, each on its
+ * own socketpair (with coalescing off, so every member gets the posted frame written as-is).
+ * Once warm, it is run again while counting the memory pool blocks taken and the payloads
+ * copied into frames after the receive, which must both be none: the received frame is
+ * stamped in place and fanned out by reference.
+ */
+
+#ifndef MICROBENCHMARK_H
+#define MICROBENCHMARK_H
+
+#include <sys/socket.h>
+#include <sched.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "data_types.h"
+#include "CommunicationUtils.h"
+#include "RW_Monitor.h"
+#include "Frame.h"
+#include "MemoryPool.h"
+#include "CoalescingWriter.h"
+#include "Session.h"
+
+// Operations done per batch by the socket cases (must fit in the socket buffer)
+#define MICROBENCH_BATCH 256
+
+// Group the broadcast case posts to
+#define MICROBENCH_GROUP "microbench"
+
+// Results of one case
+typedef struct __bench_result
+{
+    std::string name;            // Name of the case
+    std::vector<double> samples; // Time (in nanoseconds) per operation, one for each repetition
+
+} bench_result;
+
+class MicroBenchmark : protected CommunicationUtils
+{
+private:
+    long iterations;    // Operations per repetition
+    int repeats;        // Measured repetitions of each case
+    int warmup;         // Discarded repetitions run before the measured ones
+    int cpu;            // CPU the process is pinned to (-1 for no pinning)
+    bool pinned;        // If the pinning worked
+    unsigned seed;      // Seed for the message text
+    int payload_size;   // Size (in bytes) of the message text
+    int members;        // Sessions in the group of the broadcast case
+    std::string filter; // Only cases whose name contains this are run
+
+    std::string text;                  // Message text used by every case
+    int sockets[2];                    // Socketpair used by the socket cases
+    std::vector<bench_result> results; // Results of the cases run
+    std::vector<Session *> sessions;   // Server ends of the broadcast case's members
+    std::vector<int> clients;          // Client ends of the broadcast case's members
+    long fanout_blocks;                // Pool blocks taken after the receive by the broadcast case
+    long fanout_copies;                // Payloads copied into frames after the receive by the broadcast case
+    long broadcast_blocks;             // Pool blocks taken on the warm broadcast path (-1 if not checked)
+    long broadcast_copies;             // Payloads copied on the warm broadcast path (-1 if not checked)
+
+public:
+    /**
+     * @brief Class constructor, pins the process and prepares the inputs
+     * @param iterations   Operations per repetition
+     * @param repeats      Measured repetitions of each case
+     * @param warmup       Discarded repetitions run before the measured ones
+     * @param cpu          CPU to pin the process to (-1 for no pinning)
+     * @param seed         Seed for the message text
+     * @param payload_size Size (in bytes) of the message text
+     * @param members      Sessions in the group of the broadcast case (at least 2)
+     * @param filter       Only cases whose name contains this are run (empty for all)
+     */
+    MicroBenchmark(long iterations, int repeats, int warmup, int cpu, unsigned seed, int payload_size, int members, const std::string &filter);
+
+    /**
+     * @brief Class destructor, closes the socketpair
+     */
+    ~MicroBenchmark();
+
+    /**
+     * @brief Runs every case
+     */
+    void run();
+
+    /**
+     * @brief Writes the results as JSON
+     * @param output Stream where the results are written
+     */
+    void report(std::ostream &output);
+
+    /**
+     * @brief Pool blocks taken on the warm broadcast path, -1 if the broadcast case was filtered out
+     */
+    long broadcastBlocks() const;
+
+    /**
+     * @brief Payloads copied on the warm broadcast path, -1 if the broadcast case was filtered out
+     */
+    long broadcastCopies() const;
+
+private:
+    typedef uint64_t (MicroBenchmark::*bench_case)(long count); // Runs count operations, returns the time (in nanoseconds) they took
+
+    /**
+     * @brief Runs the warmup and measured repetitions of a case
+     */
+    void measure(const std::string &name, bench_case function);
+
+    /**
+     * @brief Runs the broadcast case after a warmup while counting pool blocks and payload copies
+     */
+    void countBroadcast();
+
+    /**
+     * @brief Connects the members of the broadcast case to its group
+     */
+    void joinMembers();
+
+    /**
+     * @brief Disconnects the members of the broadcast case, which also closes their group
+     */
+    void leaveMembers();
+
+    /**
+     * @brief Cases
+     */
+    uint64_t benchComposeMessage(long count);
+    uint64_t benchComposePacket(long count);
+    uint64_t benchSendPacket(long count);
+    uint64_t benchReceivePacket(long count);
+    uint64_t benchComposeMessageUpdate(long count);
+    uint64_t benchBroadcast(long count);
+    uint64_t benchMonitorRead(long count);
+    uint64_t benchMonitorWrite(long count);
+
+    /**
+     * @brief Reads exactly size bytes from the socket, discarding them
+     */
+    static void drain(int socket, size_t size);
+
+    /**
+     * @brief Current monotonic time in nanoseconds
+     */
+    static uint64_t now();
+};
+
+#endif
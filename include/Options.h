@@ -0,0 +1,43 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <string>
+#include <map>
+
+class Options
+{
+private:
+    static std::map<std::string, std::string> values; // Parsed options, by name
+
+public:
+    /**
+     * @brief Parses the optional command line arguments, given as --name=value or --name
+     * @param argc  Argument count
+     * @param argv  Argument list
+     * @param first Index of the first optional argument (after the positional ones)
+     * @returns False if an argument is not in the --name[=value] format, true otherwise
+     */
+    static bool parse(int argc, char **argv, int first);
+
+    /**
+     * @brief Checks if the option was given
+     * @param name Name of the option, without the leading dashes
+     */
+    static bool has(const std::string &name);
+
+    /**
+     * @brief Returns the value of an integer option
+     * @param name          Name of the option, without the leading dashes
+     * @param default_value Value returned if the option was not given
+     */
+    static int getInt(const std::string &name, int default_value);
+
+    /**
+     * @brief Returns the value of a string option
+     * @param name          Name of the option, without the leading dashes
+     * @param default_value Value returned if the option was not given
+     */
+    static std::string getString(const std::string &name, const std::string &default_value);
+};
+
+#endif
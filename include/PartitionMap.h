@@ -0,0 +1,132 @@
+/**
+ * This file models the consistent hash ring that splits the groups of a partitioned cluster
+ * between the replicas.
+ *
+ * Every replica takes PARTITION_VNODES points on a 64-bit ring, hashed from its identifier,
+ * and a group belongs to the replica owning the first point at or after the hash of its name.
+ * Every replica builds the ring from the same identifiers, so replicas that agree on the
+ * members agree on the owners. The owner of a group leads it: clients of the group log into
+ * it, and it relays the group's messages to the other replicas, which back it up. When a
+ * replica joins or leaves, only the groups whose points it takes or frees change owner (about
+ * one in the number of replicas), the rest stay where they are.
+ *
+ * Members come and go as each replica sees them (e.g. a keep-alive blip drops a replica on
+ * one side only), so the ring does not follow them right away. Every replica reports a digest
+ * of its members with its keep-alives, and the ring only moves to a new member list once every
+ * other member reported the same digest and the list keeps a majority of the ring's members.
+ * Until then the groups stay with their owners, so two replicas never lead the same group. A
+ * cluster of two cannot tell a dead replica from a cut link: the survivor keeps its own groups,
+ * and the other's wait for it to come back.
+ *
+ * Partitioning is off unless configured, the cluster then has a single leader for every group.
+ */
+
+#ifndef PARTITIONMAP_H
+#define PARTITIONMAP_H
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "constants.h"
+#include "RW_Monitor.h"
+
+class PartitionMap
+{
+private:
+    static std::atomic<bool> partitioned;          // If groups are split between the replicas
+    static std::map<uint64_t, int> ring;           // Replica identifier owning each point of the ring
+    static std::map<int, int> owners;              // Listening port of each replica in the ring, by identifier
+    static std::map<int, int> members;             // Listening port of each replica this one is connected to (itself included), by identifier
+    static std::map<int, uint64_t> reported;       // Member digest each other replica last reported, by identifier
+    static int local;                              // Identifier of this replica (-1 until it is added)
+    static uint64_t epoch;                         // Times the ring moved to a new member list
+    static RW_Monitor ring_monitor;                // Monitor for the ring and the member lists
+
+public:
+    /**
+     * @brief Turns partitioning on or off. Should be called before any replica is added
+     * @param enabled If groups are split between the replicas
+     */
+    static void configure(bool enabled);
+
+    /**
+     * @brief If groups are split between the replicas
+     */
+    static bool enabled();
+
+    /**
+     * @brief Adds a replica to the members, its points join the ring once the members agree
+     * @param id    Replica's unique identifier
+     * @param port  Replica's listening port
+     * @param local If it is this replica
+     * @returns False if the replica was already a member
+     */
+    static bool add(int id, int port, bool local = false);
+
+    /**
+     * @brief Removes a replica from the members, its groups move to the next points once the members agree
+     * @param id Replica's unique identifier
+     * @returns False if the replica was not a member
+     */
+    static bool remove(int id);
+
+    /**
+     * @brief Records the member digest another replica reported
+     * @param id     Replica's unique identifier
+     * @param digest Digest of that replica's members
+     */
+    static void report(int id, uint64_t digest);
+
+    /**
+     * @brief Moves the ring to the current members if every other member reported the same
+     * digest and they keep a majority of the ring's members
+     * @returns True if the ring moved, so groups may have changed owner
+     */
+    static bool confirm();
+
+    /**
+     * @brief Digest of this replica's members, reported to the others
+     */
+    static uint64_t digest();
+
+    /**
+     * @brief Finds the replica that leads a group, as the agreed ring says
+     * @param groupname Name of the group
+     * @param port      Set to the owner's listening port
+     * @returns Identifier of the owner, -1 if the ring is empty
+     */
+    static int ownerOf(const std::string &groupname, int *port);
+
+    /**
+     * @brief Highest replica identifier in the ring, -1 if it is empty
+     */
+    static int highest();
+
+    /**
+     * @brief Listening ports of every replica in the ring
+     */
+    static std::vector<uint16_t> ports();
+
+    /**
+     * @brief Debug function, lists the replicas in the ring and the share of it each owns
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Digest of the members, the caller holds the ring monitor
+     */
+    static uint64_t memberDigest();
+
+    /**
+     * @brief Hashes bytes to a point of the ring (FNV-1a, then mixed so close names land far apart)
+     */
+    static uint64_t hash(const char *data, size_t length);
+};
+
+#endif
@@ -3,8 +3,24 @@
 
 #include <iostream>
 #include <atomic>
+#include <string>
+#include <vector>
+#include <map>
 #include <pthread.h>
 
+#include "constants.h"
+#include "Metrics.h"
+
+// Contention counters of every monitor sharing a name (only filled when built with PROFILE_LOCKS)
+typedef struct __lock_profile
+{
+    std::string name;                            // Name of the monitors
+    std::atomic<uint64_t> acquisitions[2];       // Requests granted, for reading [0] and writing [1]
+    std::atomic<uint64_t> waited[2];             // Time (in nanoseconds) requests took to be granted
+    std::atomic<uint64_t> held[2];               // Time (in nanoseconds) the monitors were held
+
+} lock_profile;
+
 class RW_Monitor
 {
     public:
@@ -12,11 +28,18 @@ class RW_Monitor
     pthread_cond_t ok_read, ok_write;           // Condition variables for reading and writing
     pthread_mutex_t lock;                       // Mutex lock for the incoming requests to wait
 
+    lock_profile *profile;                      // Contention counters for this monitor's name (NULL unless profiling)
+    uint64_t read_since, write_since;           // Time (in nanoseconds) the monitor was last taken for reading and writing
+
+    static Histogram *read_waits;  // Time (in microseconds) read requests waited for writers, only when they had to
+    static Histogram *write_waits; // Time (in microseconds) write requests waited for readers or writers, only when they had to
+
     /**
      * Class constructor
      * Initializes num_readers and num_writers with 0 
+     * @param name Name shown in the contention report, shared by every instance of the same monitor
      */
-    RW_Monitor();
+    RW_Monitor(const char *name = "unnamed");
 
     /**
      * Requests to perform a read operation on the data
@@ -44,6 +67,23 @@ class RW_Monitor
      * Signal one thread on ok_write to start writing
      */
     void releaseWrite();
+
+    /**
+     * Debug function, lists the LOCK_REPORT_TOP monitors that waited the longest
+     * Only has data when built with PROFILE_LOCKS (make PROFILE_LOCKS=1)
+     */
+    static void listContention();
+
+    private:
+    /**
+     * Returns the contention counters for the name, creating them the first time
+     */
+    static lock_profile *profileOf(const char *name);
+
+    /**
+     * Current monotonic time in nanoseconds
+     */
+    static uint64_t now();
 };
 
 #endif
\ No newline at end of file
@@ -16,10 +16,29 @@
  * 
  * When the last replica is ended, it send a "disconnect" message to every fron end, informing
  * the clients that the server as a whole is begin shut-down.
+ *
+ * Backups also serve reads. The leader numbers every message update it relays (the replication
+ * sequence), and tells each client, at login, that number and a backup to read history from,
+ * taking turns between backups. The client logs into that backup read-only; the backup only
+ * accepts once it has applied the number, so history read from it is never older than the
+ * client's login, and the client falls back to the leader if it is refused.
+ *
+ * A cluster may also be partitioned (see PartitionMap): every replica leads the groups it owns
+ * on the hash ring, and relays their messages to the others as the single leader would. A login
+ * to a group led by another replica is refused with the replicas' ports, so the client logs in
+ * again at the owner. Sessions are not mirrored, since the replicas' socket numbers would clash:
+ * when a replica fails, its clients log in again at any other replica and are sent to the new
+ * owner of their group, and when one joins, the groups it takes are sent to it the same way.
+ * The replica new ones join through takes the place of the leader, and when it fails the
+ * remaining replica with the highest identifier takes its place, without an election.
+ *
+ * Connections are not given threads of their own, their handlers run as tasks on the
+ * WorkerPool, as do the connections a new leader opens to the front-ends.
  */
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -29,13 +48,26 @@
 #include <signal.h>
 #include <fstream>
 #include <sstream>
+#include <regex>
+#include <set>
+#include <cinttypes>
 
 #ifndef REPLICA_MANAGER_H
 #define REPLICA_MANAGER_H
 
 // Message exchange and mutual exclusion
 #include "CommunicationUtils.h"
+#include "CoalescingWriter.h"
+#include "EventLoop.h"
+#include "MetricsEndpoint.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include "TimerWheel.h"
+#include "HistoryLog.h"
 #include "RW_Monitor.h"
+#include "PartitionMap.h"
+#include "WorkerPool.h"
+#include "Acceptor.h"
 
 // Domain classes
 #include "User.h"
@@ -56,11 +88,13 @@ private:
 
     // Client connection logic
     static struct sockaddr_in server_address; // Replica manager socket address
-    static struct sockaddr_in client_address; // New client socket address
-    static int main_socket;                   // Socket where the replica manager listens for connections (new clients)
+    static int main_socket;                   // First socket where the replica manager listens for connections (new clients)
 
-    static std::map<int, pthread_t> front_end_threads; // Socket descriptor and threads for handling front-end connections
-    static RW_Monitor fe_threads_monitor;              // Monitor for front end trhead list
+    static std::set<int> front_end_sockets; // Front-end connections handled by a worker
+    static RW_Monitor fe_sockets_monitor;   // Monitor for the front-end socket list
+
+    static std::set<int> worker_sockets;      // Other connections handled by a worker, still identifying themselves or reading history
+    static RW_Monitor worker_sockets_monitor; // Monitor for the other socket list
 
     static std::map<int, std::pair<std::string, int>> clients; // Map with client socket - IPs and listening ports
     static RW_Monitor clients_monitor;                         // Monitor for the client IPs / Ports map
@@ -72,10 +106,11 @@ private:
 
     struct sockaddr_in replica_address; // New replica socket address
 
-    static std::map<int, pthread_t> replica_manager_threads; // Socket descriptor and threads for handling replica manager connections
-    static RW_Monitor rm_threads_monitor;                    // Monitor for replica manager thread list
+    static std::set<int> replica_manager_sockets; // Replica manager connections handled by a worker
+    static RW_Monitor rm_sockets_monitor;         // Monitor for the replica manager socket list
 
-    static pthread_t keep_alive_thread; // Keep alive thread
+    static pthread_t keep_alive_thread;          // Keep alive thread
+    static std::atomic<bool> keep_alive_started; // If the keep alive thread was started (backups start it when they link to the leader)
 
     // Election logic
 
@@ -95,6 +130,21 @@ private:
     static std::map<int, Session *> session_list; // Map containing all the sessions currently active and their sockets
     static RW_Monitor session_monitor;            // Monitor for the session list
 
+    // Metrics
+    static Histogram *replication_lag;   // Time (in microseconds) between the leader sending a message update and this replica handling it
+    static Histogram *election_duration; // Time (in microseconds) elections started by this replica took
+    static std::atomic<uint64_t> last_election; // Time (in seconds since the epoch) the last election this replica saw ended (0 if none did)
+    static Counter *reads_served;               // Read-only logins this replica accepted
+    static Counter *reads_refused;              // Read-only logins refused because this replica had not caught up
+    static Counter *partition_redirects;        // Logins and sessions sent to the replica leading their group
+    static Counter *partition_refusals;         // Messages refused because their group is led by another replica
+
+    // Read serving
+    static std::atomic<uint64_t> replication_sequence; // Last message update sent (leader) or applied (backup), as (epoch, sequence) in one number
+    static pthread_mutex_t sequence_lock;              // Lock for moving replication_sequence forward while readers wait on it
+    static pthread_cond_t sequence_signal;             // Wakes readers up when replication_sequence moves forward (or on a stop)
+    static std::atomic<unsigned> next_reader;          // Turn of the backup the next client reads from
+
     // Other
     static std::atomic<bool> stop_issued;
 
@@ -129,7 +179,7 @@ public:
     static int setupReplicaConnection(int new_replica_port, std::string new_replica_ip, int new_replica_id);
 
     /**
-     * @brief Setus up the socket for listening to connections 
+     * @brief Setus up the sockets for listening to connections, one for each acceptor
      */
     static void setupLeaderConnection();
 
@@ -148,20 +198,105 @@ public:
      */
     static void *listenConnections(void *arg);
 
+    /**
+     * @brief Hands a connection accepted by an acceptor to a worker, to be identified
+     * @param socket Socket of the connection
+     */
+    static void dispatchConnection(int socket);
+
     /**
      * @brief Handles a newly created connection to distinguish between
      * front-end and replica connection, and calling the appropriate
-     * handler for it
+     * handler for it. Runs as a worker pool task
+     * @param arg Socket of the connection, cast to a pointer
      */
     static void *handleUnkownConnection(void *arg);
 
     /**
      * @brief Handles communication with the front ends
+     * @param arg Socket of the front-end, cast to a pointer
      */
     static void *handleFEConnection(void *arg);
 
+    /**
+     * @brief Handles a connection accepted by the event loop, identifying it in a new thread
+     */
+    static void acceptConnection(int socket, struct sockaddr_in *address);
+
+    /**
+     * @brief Handles a packet received from a front end, either by its thread or by the event loop
+     * @returns True, front ends are never disconnected because of a packet
+     */
+    static bool handleFEPacket(int socket, Frame &frame);
+
+    /**
+     * @brief Ends a front end connection, propagating the disconnection and deleting its session
+     */
+    static void closeFEConnection(int socket);
+
+    /**
+     * @brief Serves the history and search reads of a read-only login, once this replica has
+     * applied the replication sequence number the reader needs (waiting READ_WAIT_MS at most)
+     * @param socket       Socket of the reader
+     * @param login_packet Read-only login packet
+     */
+    static void handleReader(int socket, packet *login_packet);
+
+    /**
+     * @brief Moves the replication sequence number forward (never back) and wakes up the readers waiting for it
+     * @param sequence Replication sequence number of the update just applied, or of a new epoch
+     */
+    static void advanceSequence(uint64_t sequence);
+
+    /**
+     * @brief Adds or removes a connection from the list a stop shuts down, for connections that are
+     * neither front-ends nor replicas (yet)
+     * @param socket Socket of the connection
+     * @param listed If the connection is added
+     * @returns False if a stop was issued, a connection added then should end right away
+     */
+    static bool listWorkerSocket(int socket, bool listed);
+
+    /**
+     * @brief Picks the backup the next client reads history from, taking turns
+     * @returns Port of the backup, 0 if there is none
+     */
+    static uint16_t pickReader();
+
+    /**
+     * @brief Refuses a login to a group another replica leads, in a partitioned cluster, telling
+     * the client where to log in (the caller closes the socket)
+     * @param login_info The login information received from the client
+     * @param socket     Socket the login came from
+     * @returns True if the login was refused, false if it goes on at this replica
+     */
+    static bool redirectLogin(message_record *login_info, int socket);
+
+    /**
+     * @brief Adds a replica to the partition members, or removes it, and tells the other replicas
+     * right away. The ring follows once they agree on the members
+     * @param id     Identifier of the replica
+     * @param port   Listening port of the replica
+     * @param joined If the replica joined, otherwise it left
+     */
+    static void updateRing(int id, int port, bool joined);
+
+    /**
+     * @brief Records the partition members another replica reported, and moves the ring if they all agree
+     * @param socket         Socket of the replica
+     * @param received_packet Keep-alive packet, carrying the digest of the replica's members
+     */
+    static void handleRingReport(int socket, packet *received_packet);
+
+    /**
+     * @brief Moves the partition ring to the members, if they agree, and sends the sessions of the
+     * groups this replica no longer leads to their new owner
+     */
+    static void confirmRing();
+
     /**
      * @brief Handles communication with the other replica managers 
+     * @param arg Socket of the replica, cast to a pointer
      */
     static void *handleRMConnection(void *arg);
 
@@ -170,6 +305,11 @@ public:
      */
     static void *keepAlive(void *arg);
 
+    /**
+     * @brief Queues a keep-alive, carrying the digest of the partition members, to every other replica
+     */
+    static void sendKeepAlives();
+
     // REPLICATION LOGIC
 
     /**
@@ -190,6 +330,15 @@ public:
      */
     static void updateAllReplicas(void *update_payload, int payload_size, int type);
 
+    /**
+     * @brief Propagates a state update, scattered through several buffers, to all the other replicas.
+     * OBS.: This should be used only by the current leader
+     * @param parts      Buffers that, in order, compose the update
+     * @param part_count Number of buffers in parts
+     * @param type       The type of update being sent
+     */
+    static void updateAllReplicas(const struct iovec *parts, int part_count, int type);
+
     /**
      * @brief All of the fucntions below perform the correct treatment
      * when receiving an update packet from the primary replica manager 
@@ -272,6 +421,13 @@ public:
      */
     static void getState();
 
+    /**
+     * @brief Writes this replica's state as metrics (Prometheus text format) for the metrics endpoint
+     * Only takes read rights, so scrapes do not hold back the replica
+     * @param output Stream the metrics are written to
+     */
+    static void exportMetrics(std::ostream &output);
+
     // ERROR HANDLING
 
     /**
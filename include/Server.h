@@ -9,6 +9,7 @@
 #include <string.h>
 #include <chrono>
 #include <vector>
+#include <set>
 #include <atomic>
 #include <pthread.h>
 #include <cmath>
@@ -17,6 +18,14 @@
 #include "constants.h"
 #include "RW_Monitor.h"
 #include "CommunicationUtils.h"
+#include "CoalescingWriter.h"
+#include "EventLoop.h"
+#include "Logger.h"
+#include "Tracer.h"
+#include "TimerWheel.h"
+#include "HistoryLog.h"
+#include "WorkerPool.h"
+#include "Acceptor.h"
 #include "Session.h"
 
 class Server : protected CommunicationUtils
@@ -28,15 +37,16 @@ class Server : protected CommunicationUtils
     static std::map<std::string,command_function> available_commands; // All available administrator commands
 
     static std::atomic<bool> stop_issued; // Atomic thread for stopping all threads
-    static int server_socket;  // Socket the server listens at for new incoming connections
+    static int server_socket;  // First socket the server listens at for new incoming connections
 
-    struct sockaddr_in server_address;  // Server socket address
-    struct sockaddr_in client_address;  // Client socket address
     static int message_history;    // Amount of old group messages to show clients
 
     pthread_t command_handler_thread; // Thread for handling server
-    static std::map<int, pthread_t> connection_handler_threads; // Socket descriptor and threads for handling client connections
-    static RW_Monitor threads_monitor;  // Monitor for connection handler threads list
+    static std::set<int> connection_sockets; // Client connections handled by a worker
+    static RW_Monitor connections_monitor;   // Monitor for the client socket list
+
+    static std::map<int, Session *> session_list; // Session of each logged in client socket
+    static RW_Monitor session_monitor;            // Monitor for the session list
 
     // Public methods
     public:
@@ -68,7 +78,7 @@ class Server : protected CommunicationUtils
     static void listCommands();
 
     /**
-     * Sets up the server socket to begin for listening
+     * Sets up the server sockets to begin for listening, one for each acceptor
      */
     void setupConnection();
 
@@ -79,11 +89,34 @@ class Server : protected CommunicationUtils
     static void *handleCommands(void* arg);
 
     /**
-     * Handle any incoming connections, spawned by listenConnections
-     * Normally, there should be one handleConnection thread per connected client
+     * Handle any incoming connections, submitted to the worker pool by listenConnections
+     * Normally, there should be one handleConnection task running per connected client
+     * @param arg Socket of the client, cast to a pointer
      */
     static void *handleConnection(void* arg);
 
+    /**
+     * Hands a connection accepted by an acceptor to a worker, scheduling its timeout
+     * @param client_socket Socket of the client
+     */
+    static void dispatchConnection(int client_socket);
+
+    /**
+     * Handles a connection accepted by the event loop, by watching it
+     */
+    static void acceptConnection(int socket, struct sockaddr_in *address);
+
+    /**
+     * Handles a packet received from a client, either by its thread or by the event loop
+     * Returns false if the client must be disconnected (login rejected)
+     */
+    static bool handlePacket(int socket, Frame &client_message);
+
+    /**
+     * Ends a client connection, deleting its session (which closes the socket)
+     */
+    static void closeConnection(int socket);
+
     /**
      * Lists all threads currently active and what socket they are
      * assigned to
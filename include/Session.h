@@ -1,20 +1,39 @@
 #ifndef SESSION_H
 #define SESSION_H
 
+#include <atomic>
+
 #include "User.h"
 #include "Group.h"
+#include "HistoryLog.h"
 #include "CommunicationUtils.h"
+#include "CoalescingWriter.h"
+#include "Tracer.h"
 
-// Forward declare User and Group
+// Forward declare User, Group and HistoryLog
 class User;
 class Group;
+class HistoryLog;
 
 class Session : protected CommunicationUtils
 {
+public:
+    static std::atomic<bool> delivering; // If sessions write to their clients, false on backups, whose sessions mirror the leader's
+
 private:
     User *user;   // User connected to the session
-    Group *group; // Group the user is connected to
-    int socket;   // Socket through which communication happens
+    Group *group;        // Group the user is connected to
+    HistoryLog *history; // History read by the session, the group's or one opened by a read-only session
+    int socket;          // Socket through which communication happens
+    bool owns_socket;    // If the socket is this process's, a backup's mirrored session carries the leader's number
+
+    /**
+     * @brief Sends a reply through the client's queue, so it never overtakes the frames queued before it
+     * @param packet_type Type of the packet sent
+     * @param payload Bytes of the reply
+     * @param payload_size How many bytes the reply has
+     */
+    void reply(int packet_type, char *payload, size_t payload_size);
 
 public:
     /**
@@ -25,11 +44,24 @@ public:
      */
     Session(std::string username, std::string groupname, int socket);
 
+    /**
+     * @brief Read-only session, serves history and search reads of a group without joining it
+     * @param history History log of the group, opened for the session, which closes it
+     * @param socket Socket descriptor used for communication
+     */
+    Session(HistoryLog *history, int socket);
+
     /**
      * @brief Class destructor 
      */
     ~Session();
 
+    /**
+     * @brief Allocates sessions on the node of the thread logging in, if placement is on (see Affinity)
+     */
+    static void *operator new(size_t size);
+    static void operator delete(void *session);
+
     // GETTERS
 
     /**
@@ -56,30 +88,57 @@ public:
     /**
      * @brief Sets the socket where communication happens
      * @param socket The new socket 
+     * @param owned If the new socket is this process's (not when a backup follows the leader's new sockets)
      */
-    void setSocket(int socket);
+    void setSocket(int socket, bool owned);
 
     // SESSION LOGIC METHODS
 
     /**
-     * @brief Sends the last N messages saved to the client
-     * @param N how many messages to send 
+     * @brief Lets the client know its login was accepted, how often it must be heard from, and where it may read history
+     * @param replication Replication sequence number a replica serving the client's reads must have applied
+     * @param read_port   Port of a backup serving history reads, 0 to keep them on this server
+     */
+    void acceptLogin(uint64_t replication, uint16_t read_port);
+
+    /**
+     * @brief Sends the last N messages saved to the client, as a history range
+     * @param N how many messages to send (HISTORY_PAGE_MAX at most), 0 only tells the client where the history ends
      * @returns Number of messages read and sent
      */
     int sendHistory(int N);
 
     /**
-     * @brief Sends a message from the client as the user to the group
-     * @param message The message being sent
+     * @brief Sends a range of the group's history to the client, in batches that each fit a packet
+     * @param request Where the range starts or ends, and how many messages it has (HISTORY_PAGE_MAX at most)
+     * @returns Number of messages read and sent
+     */
+    int sendHistoryRange(const history_request &request);
+
+    /**
+     * @brief Searches the group's history and sends the messages found, then an empty result
+     * @param query Words the messages must have, and from:<username> or on:<YYYY-MM-DD> filters
+     * @returns Number of messages found and sent
+     */
+    int sendSearch(const std::string &query);
+
+    /**
+     * @brief Stamps, in place, the server timestamp and this session's username into a received message
+     * @param message The message received from the client
+     */
+    void stampMessage(MessageBuffer &message);
+
+    /**
+     * @brief Sends a message from the client as the user to the group, relaying the buffer as-is
+     * @param message The message being sent, already validated and stamped
      */
-    void messageGroup(message_record *message);
+    void messageGroup(const MessageBuffer &message);
 
     /**
-     * @brief Sends a message form the group to the client 
-     * @param message     The message being sent
-     * @param packet_type The type of packet being sent
+     * @brief Sends a frame form the group to the client, as-is
+     * @param frame The frame being sent
      */
-    void messageClient(message_record *message, int packet_type);
+    void messageClient(const Frame &frame);
 };
 
 #endif
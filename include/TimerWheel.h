@@ -0,0 +1,154 @@
+/**
+ * This file models the timer wheel that detects dead connections.
+ *
+ * Every connection whose liveness is watched has a timer with its timeout. Receiving from the
+ * connection only stores the current tick in its timer: no lock is taken and no list is touched.
+ * Timers live in a hierarchical wheel of TIMER_LEVELS levels of TIMER_SLOTS slots, each level
+ * TIMER_SLOTS times coarser than the one below, and are only looked at when their slot comes
+ * up. A timer whose connection was heard from since it was armed moves to its new deadline,
+ * otherwise it expires. On each tick the wheel thread handles the one slot that comes due, and
+ * every TIMER_SLOTS ticks it also cascades one slot of the level above. Tick cost therefore
+ * does not grow with the number of connections, and a busy connection's timer moves at most
+ * once per timeout.
+ *
+ * Expired connections are shut down for reading, in one batch per tick. The receiver (a
+ * blocked thread or the event loop) sees the connection end and closes it as usual. Closing
+ * code must cancel the timer before the socket is closed; cancel also tells whether the
+ * connection timed out.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+#include "constants.h"
+#include "Metrics.h"
+#include "Logger.h"
+
+// Liveness timer of one socket
+typedef struct __timer_entry
+{
+    std::atomic<uint64_t> last_active; // Tick the connection was last heard from
+    uint64_t timeout;                  // Ticks the connection may stay quiet
+    uint64_t deadline;                 // Tick the timer is due at
+    int socket;                        // Socket descriptor the timer watches
+    bool armed;                        // If the timer is in the wheel
+    bool expired;                      // If the timer expired since it was armed
+    struct __timer_entry **slot;       // Wheel slot the timer is in
+    struct __timer_entry *previous;    // Previous timer in the slot
+    struct __timer_entry *next;        // Next timer in the slot
+
+} timer_entry;
+
+class TimerWheel
+{
+private:
+    static std::atomic<timer_entry *> pages[TIMER_PAGES];  // Timers by socket descriptor, in pages allocated on first use
+    static timer_entry *slots[TIMER_LEVELS][TIMER_SLOTS];  // First timer of each slot of each level
+    static std::atomic<uint64_t> current;                  // Current tick
+    static long armed_timers;                              // Timers in the wheel
+    static pthread_mutex_t wheel_lock;                     // Lock for the wheel (never taken when receiving)
+
+    static pthread_t wheel_thread;    // Thread advancing the wheel
+    static std::atomic<bool> running; // If the wheel thread is running
+
+    // Metrics
+    static Counter *expirations; // Connections that timed out
+    static Counter *reschedules; // Timers moved to a later deadline because their connection was active
+
+public:
+    /**
+     * @brief Starts the wheel thread
+     */
+    static void start();
+
+    /**
+     * @brief Stops the wheel thread, timers stop expiring
+     */
+    static void stop();
+
+    /**
+     * @brief Arms (or re-arms) the socket's timer
+     * @param socket     Connected socket descriptor
+     * @param timeout_ms Time (in milliseconds) the connection may stay quiet
+     */
+    static void schedule(int socket, int timeout_ms);
+
+    /**
+     * @brief Marks the connection as active, called whenever something is received from it
+     * @param socket Socket descriptor
+     */
+    static void touch(int socket);
+
+    /**
+     * @brief Disarms the socket's timer. Must be called before the socket is closed, so
+     * a future socket with the same descriptor is not shut down by an old timer
+     * @param socket Socket descriptor
+     * @returns True if the connection timed out
+     */
+    static bool cancel(int socket);
+
+    /**
+     * @brief Debug function, lists the wheel metrics to stdout
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Wheel thread procedure, advances the wheel once per TIMER_TICK_MS until stopped
+     */
+    static void *advanceWheel(void *arg);
+
+    /**
+     * @brief Advances the wheel to the tick, expiring or moving the timers due at it
+     * @returns Number of connections shut down
+     */
+    static int advance(uint64_t tick);
+
+    /**
+     * @brief Puts the timer in the slot of its deadline
+     */
+    static void insert(timer_entry *entry);
+
+    /**
+     * @brief Takes the timer out of its slot
+     */
+    static void unlink(timer_entry *entry);
+
+    /**
+     * @brief Timer of the socket, NULL if it is out of range (or its page was never created)
+     * @param create If the page is created when missing (only with the wheel lock)
+     */
+    static timer_entry *entryOf(int socket, bool create);
+
+    /**
+     * @brief Current monotonic time in milliseconds
+     */
+    static uint64_t now();
+};
+
+// Hot path, inlined
+
+inline void TimerWheel::touch(int socket)
+{
+    if (socket < 0 || socket >= (TIMER_PAGES << TIMER_PAGE_BITS))
+        return;
+
+    timer_entry *page = pages[socket >> TIMER_PAGE_BITS].load(std::memory_order_acquire);
+    if (page == NULL)
+        return;
+
+    // Only write when the tick changed, so busy connections do not keep dirtying the line
+    timer_entry *entry = &page[socket & ((1 << TIMER_PAGE_BITS) - 1)];
+    uint64_t tick = current.load(std::memory_order_relaxed);
+    if (entry->last_active.load(std::memory_order_relaxed) != tick)
+        entry->last_active.store(tick, std::memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,174 @@
+/**
+ * This file models the hot-path tracer, which follows sampled messages through the server.
+ *
+ * When a front-end packet is about to be received, the receiving thread decides whether the
+ * message is traced: one message out of every rate is (0 turns tracing off). For a traced
+ * message, every tracepoint it goes through on that thread records a span (stage name, start
+ * and duration, from the monotonic clock) into the thread's own ring, so recording takes no
+ * lock and never waits for other threads. Untraced messages cost a thread-local check per
+ * tracepoint. Rings keep the latest TRACE_RING_ENTRIES spans of each thread, and the rings of
+ * threads that exit are reused by new ones.
+ *
+ * The spans can be dumped in the Chrome trace-event format (chrome://tracing, Perfetto), one
+ * row per thread, with the message each span belongs to in its arguments.
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+#include "constants.h"
+
+// A recorded span
+typedef struct __trace_event
+{
+    std::atomic<const char *> name; // Stage the span measures (NULL if the entry was never written)
+    std::atomic<uint64_t> start;    // Time (in nanoseconds, monotonic) the stage started
+    std::atomic<uint64_t> duration; // Time (in nanoseconds) the stage took
+    std::atomic<uint64_t> message;  // Traced message the span belongs to
+    std::atomic<pid_t> thread;      // Kernel identifier of the thread that recorded the span
+
+} trace_event;
+
+// Spans recorded by one thread
+typedef struct __trace_ring
+{
+    pid_t thread;                           // Kernel identifier of the thread that owns the ring
+    std::atomic<uint64_t> next;             // Position the next span is written to
+    trace_event events[TRACE_RING_ENTRIES]; // Latest spans, by position modulo TRACE_RING_ENTRIES
+
+} trace_ring;
+
+class Tracer
+{
+private:
+    static std::atomic<int> rate;              // One message out of every rate is traced (0 for none)
+    static std::atomic<uint64_t> next_message; // Identifier of the next traced message
+
+    static std::vector<trace_ring *> rings;      // Every ring ever created
+    static std::vector<trace_ring *> free_rings; // Rings of threads that exited
+    static pthread_mutex_t rings_lock;           // Lock for the ring lists (only taken when threads start and exit)
+
+    static thread_local uint64_t current_message; // Traced message this thread is handling (0 if none)
+    static thread_local int countdown;            // Messages this thread lets through before tracing one
+
+public:
+    /**
+     * @brief Sets the sampling rate
+     * @param rate One message out of every rate is traced, 0 turns tracing off
+     */
+    static void configure(int rate);
+
+    /**
+     * @brief Decides if the next message handled by this thread is traced
+     * @returns Current time if it is (to time its receive), 0 if not
+     */
+    static uint64_t begin();
+
+    /**
+     * @brief Ends the message handled by this thread, later tracepoints record nothing
+     */
+    static void end();
+
+    /**
+     * @brief If the message handled by this thread is traced
+     */
+    static bool active();
+
+    /**
+     * @brief Start time for a span
+     * @returns Current time if the message is traced, 0 if not
+     */
+    static uint64_t start();
+
+    /**
+     * @brief Records a span that started at start and ends now, if start is not 0
+     * @param name  Stage the span measures (must outlive the tracer, usually a literal)
+     * @param start Value returned by begin or start
+     */
+    static void record(const char *name, uint64_t start);
+
+    /**
+     * @brief Writes every span in the Chrome trace-event JSON format
+     * @param output Stream where the spans are written
+     * @returns Number of spans written
+     */
+    static long write(std::ostream &output);
+
+    /**
+     * @brief Admin command, dumps the spans to TRACE_FILE
+     */
+    static void dump();
+
+private:
+    /**
+     * @brief Ring of the calling thread, taken (or created) on its first span
+     */
+    static trace_ring *ownRing();
+
+    /**
+     * @brief Gives the ring of an exiting thread back, so a new thread can use it
+     */
+    static void releaseRing(trace_ring *ring);
+
+    /**
+     * @brief Current monotonic time in nanoseconds
+     */
+    static uint64_t now();
+
+    friend struct __trace_ring_owner;
+};
+
+// Records a span covering the scope it is declared in
+class TraceSpan
+{
+private:
+    const char *name; // Stage the span measures
+    uint64_t started; // Time the span started, 0 if the message is not traced
+
+public:
+    /**
+     * @brief Starts the span, if the message handled by this thread is traced
+     * @param name Stage the span measures (must outlive the tracer, usually a literal)
+     */
+    TraceSpan(const char *name) : name(name), started(Tracer::start()) {}
+
+    /**
+     * @brief Records the span
+     */
+    ~TraceSpan() { Tracer::record(name, started); }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+// Hot paths, inlined
+
+inline bool Tracer::active()
+{
+    return current_message != 0;
+}
+
+inline uint64_t Tracer::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t Tracer::start()
+{
+    return Tracer::active() ? Tracer::now() : 0;
+}
+
+inline void Tracer::end()
+{
+    current_message = 0;
+}
+
+#endif
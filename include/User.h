@@ -93,14 +93,11 @@ public:
     /**
      * Signals the user instance that a new message has arrived to the group
      * The user instance then signals the corresponding client threads to send packets
-     * @param message Text message that will be sent to the clients
-     * @param username Username of the user who posted this message
+     * @param message   Composed message that will be sent to the clients
      * @param groupname Groupname of the group where the message was posted
-     * @param packet_type Packet type
-     * @param message_type Indicates wether the message type is USER_MESSAGE or SERVER_MESSAGE
-     * @returns 
+     * @returns 1
      */
-    int signalNewMessage(std::string message, std::string username, std::string groupname, int packet_type, int message_type);
+    int signalNewMessage(const MessageBuffer &message, const std::string &groupname);
 
     /**
      * Updates the user's last seen attribute to current time
@@ -0,0 +1,157 @@
+/**
+ * This file models the pool of worker threads that runs the servers' connection handlers and
+ * replica control tasks, instead of a new thread for each of them.
+ *
+ * Every worker has its own deque of tasks. Tasks submitted by a worker go to the back of its
+ * own deque and are taken back from there, the rest are spread over the deques in turns. A
+ * worker with nothing left in its deque steals from the front of the others', so tasks queued
+ * behind a worker that is busy with a long connection do not wait for it. The tasks waiting in
+ * all deques are bounded, submissions past the bound are rejected.
+ *
+ * A connection handler keeps its worker for as long as the connection lasts, so the pool
+ * starts with a fixed number of workers and only adds one when a task arrives while every
+ * worker is busy, up to WORKER_POOL_GROWTH times the workers it started with. Past that, tasks
+ * wait for a worker to be freed, and are rejected once the waiting ones reach the bound (with
+ * the threads backend, every connection keeps a worker, so the pool must be started with
+ * enough of them for the connections expected). Workers are never torn down before the pool
+ * stops, the next connection reuses the one a closed connection freed.
+ */
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <pthread.h>
+#include <iostream>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "constants.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "Affinity.h"
+
+// Signature of the tasks, the same as a thread's start routine
+typedef void *(*worker_task)(void *);
+
+// Task waiting for a worker
+typedef struct __worker_job
+{
+    worker_task task; // Function to run
+    void *argument;   // Argument it is called with
+
+} worker_job;
+
+// Worker thread and the tasks it was handed
+typedef struct __worker_queue
+{
+    pthread_mutex_t lock;           // Lock for the deque
+    std::deque<worker_job> jobs;    // Tasks waiting, the owner takes from the back and thieves from the front
+    std::atomic<int> size;          // Tasks in the deque, read without the lock by thieves
+    std::atomic<uint64_t> executed; // Tasks the worker ran
+    std::atomic<uint64_t> stolen;   // Tasks the worker took from another worker's deque
+    pthread_t thread;               // Worker thread
+
+} worker_queue;
+
+class WorkerPool
+{
+private:
+    static std::atomic<int> initial_workers; // Workers started with the pool
+    static std::atomic<int> max_workers;     // Workers the pool grows to at most
+    static std::atomic<int> max_queued;      // Tasks waiting before new ones are rejected
+
+    static std::vector<worker_queue *> workers; // Every worker started, in start order (sized when the pool starts)
+    static std::atomic<int> worker_count;       // Workers started
+    static std::atomic<int> queued;             // Tasks waiting in every deque
+    static std::atomic<int> busy;               // Workers running a task
+    static std::atomic<unsigned> next_worker;   // Deque the next task from outside the pool goes to
+    static thread_local int current;            // Index of the calling worker, -1 outside the pool
+
+    static pthread_mutex_t idle_lock;  // Lock for the idle workers and the pool size
+    static pthread_cond_t idle_signal; // Wakes idle workers when tasks are submitted
+    static int idle_workers;           // Workers waiting for tasks, not yet woken
+    static int wakeups;                // Workers woken by submissions, not yet running
+    static std::atomic<bool> running;  // If the pool accepts tasks
+
+    // Metrics
+    static Counter *submitted; // Tasks handed to the pool
+    static Counter *steals;    // Tasks run by a worker other than the one they were handed to
+    static Counter *rejected;  // Tasks rejected because too many were waiting
+    static Counter *spawned;   // Workers started
+
+public:
+    /**
+     * @brief Configures the pool. Should be called before start
+     * @param workers    Workers started with the pool, it grows to WORKER_POOL_GROWTH times as many at most
+     * @param queue_max  Tasks waiting for a worker before new ones are rejected
+     */
+    static void configure(int workers, int queue_max);
+
+    /**
+     * @brief Starts the initial workers
+     */
+    static void start();
+
+    /**
+     * @brief Stops accepting tasks, waits for the queued and running ones to end, and joins every worker
+     */
+    static void stop();
+
+    /**
+     * @brief Hands a task to the pool, starting a new worker if every worker is busy
+     * @param task     Function to run
+     * @param argument Argument it is called with
+     * @returns False if the task was rejected, in which case the caller still owns the argument
+     */
+    static bool submit(worker_task task, void *argument);
+
+    /**
+     * @brief Workers started
+     */
+    static int threads();
+
+    /**
+     * @brief Workers running a task
+     */
+    static int active();
+
+    /**
+     * @brief Tasks waiting for a worker
+     */
+    static int pending();
+
+    /**
+     * @brief Debug function, lists the pool size, queues and what each worker ran
+     */
+    static void listStats();
+
+private:
+    /**
+     * @brief Worker thread, runs tasks until the pool stops and nothing is left
+     * @param arg Index of the worker, as a pointer
+     */
+    static void *work(void *arg);
+
+    /**
+     * @brief Takes a task from the worker's own deque, or steals one from another worker
+     * @param index Index of the worker
+     * @param job   Filled with the task taken
+     * @returns False if every deque was empty
+     */
+    static bool take(int index, worker_job *job);
+
+    /**
+     * @brief Wakes an idle worker for the waiting tasks, or starts one if no worker is free to
+     * take them. Must be called with the idle lock held
+     */
+    static void wake();
+
+    /**
+     * @brief Starts one more worker. Must be called with the idle lock held
+     * @returns False if the pool is at its largest or the thread could not be created
+     */
+    static bool spawn();
+};
+
+#endif
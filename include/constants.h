@@ -12,10 +12,108 @@
 #define REPLICA_TIMEOUT        1         // Time (in seconds) for replica to be kept alive
 #define PACKET_MAX             2048      // Maximum size (in bytes) for a packet
 #define MESSAGE_MAX            256       // Maximum size (in bytes) for a user message
-#define SLEEP_TIME             0.2       // Time (in seconds) between keep-alive packets
+#define SLEEP_TIME             0.2       // Time (in seconds) between replica keep-alive packets
+#define HEARTBEAT_INTERVAL     (USER_TIMEOUT * 1000 / 3) // Time (in milliseconds) a quiet client waits before sending a keep-alive, advertised at login
+#define PROBE_IDLE             30        // Time (in seconds) a client's connection stays idle before TCP probes the server
+#define PROBE_INTERVAL         10        // Time (in seconds) between unanswered TCP probes
+#define PROBE_COUNT            3         // Unanswered TCP probes after which the client drops the server
 #define ELECTION_TIMEOUT       1         // Time (in seconds) for a election coordinator leader answer timeout
 #define USER_RECONNECT_TIMEOUT 2.5 // Time (in seconds) the user waits between a server closing and reconnecting
 
+// Memory pool related constants
+#define POOL_MIN_BLOCK         64        // Size (in bytes) of the smallest pool size class
+#define POOL_CLASSES           7         // Number of size classes (64, 128, ..., 4096 bytes)
+#define POOL_CACHE_MAX         256       // Maximum number of free blocks each thread keeps per size class
+
+// Output coalescing related constants
+#define COALESCE_WINDOW_US     500       // Time (in microseconds) a frame may wait to be written with others (0 disables coalescing)
+#define COALESCE_MAX_BYTES     16384     // Pending bytes (per socket) that cause an immediate write
+#define COALESCE_BACKLOG_MAX   (4 << 20) // Unsent bytes (per socket) after which the peer is considered stuck and shut down
+
+// Event loop related constants
+#define LOOP_EVENTS            256       // Maximum events handled per epoll_wait
+#define LOOP_RING_ENTRIES      256       // Submission entries of each io_uring instance
+#define LOOP_SQE_RETRIES       64        // Times a full submission ring is submitted again before giving up on an entry
+#define LOOP_BUFFERS           512       // Receive buffers provided to the kernel (power of 2)
+#define LOOP_BUFFER_SIZE       4096      // Size (in bytes) of each receive buffer
+#define LOOP_TICK_MS           1000      // Time (in milliseconds) the epoll loop waits for events at most
+
+// Metrics related constants
+#define METRICS_SHARDS         16        // Shards each metric is split in (threads beyond this share shards)
+#define METRICS_SUB_BITS       3         // Bits of precision kept below the leading bit of a histogram value
+#define METRICS_SUB_BUCKETS    (1 << METRICS_SUB_BITS) // Linear buckets per power of two in histograms
+#define METRICS_MAX_EXPONENT   40        // Largest power of two histograms tell apart (about 12 days in microseconds)
+#define METRICS_BACKLOG        16        // Pending scrape connections the metrics endpoint accepts
+#define METRICS_REQUEST_MAX    8192      // Maximum size (in bytes) of a scrape request
+#define METRICS_SERIES_MAX     256       // Label values a family keeps apart (e.g. groups), the rest share "other"
+
+// Logging related constants
+#define LOG_RING_ENTRIES       4096      // Lines the logger queues before dropping (power of 2)
+#define LOG_LINE_MAX           256       // Maximum size (in bytes) of a log line, longer ones are truncated
+#define LOG_BATCH_BYTES        65536     // Bytes the logger writes at once
+#define LOG_FLUSH_US           1000      // Time (in microseconds) the logger waits when it has nothing to write
+
+// Timer wheel related constants
+#define TIMER_TICK_MS          100       // Time (in milliseconds) between timer wheel ticks
+#define TIMER_LEVELS           4         // Levels of the timer wheel (TIMER_SLOTS^TIMER_LEVELS ticks of range)
+#define TIMER_SLOT_BITS        6         // Bits of a deadline each level of the timer wheel covers
+#define TIMER_SLOTS            (1 << TIMER_SLOT_BITS) // Slots in each level of the timer wheel
+#define TIMER_PAGE_BITS        12        // Bits of a socket descriptor each page of timers covers
+#define TIMER_PAGES            256       // Pages of timers, descriptors up to TIMER_PAGES << TIMER_PAGE_BITS are watched
+
+// History related constants
+#define HISTORY_SEGMENT_BYTES  (1 << 20) // Size (in bytes) at which a history segment is sealed
+#define HISTORY_SEGMENT_AGE    3600      // Time (in seconds) after which a history segment is sealed, even if not full
+#define HISTORY_COMPACT_BYTES  (HISTORY_SEGMENT_BYTES / 4) // Sealed segments smaller than this are merged with the ones after them
+#define HISTORY_MAINTENANCE_MS 1000      // Time (in milliseconds) between retention and merge passes
+#define HISTORY_MANIFEST       "MANIFEST" // File listing the segments, in each group's history directory
+#define HISTORY_FORMAT         2         // Segment format, kept in the manifest (1: bare records, 2: CRC32C framed records)
+#define HISTORY_SCAN_BUFFER    (1 << 20) // Size (in bytes) of the reads that recover the active segment
+#define HISTORY_TERM_MAX       32        // Bytes of a word that are indexed, the rest is dropped
+#define HISTORY_INDEX_MAGIC    "HIX2"    // First bytes of every history index file (older versions are rebuilt)
+#define HISTORY_TIME_BLOCK     64        // Messages per block of the sparse timestamp index
+#define SEARCH_RESULTS_MAX     20        // Messages a search answers with at most
+#define SEARCH_COMMAND         "/search " // Client input that searches the group history instead of sending a message
+#define HISTORY_PAGE_MAX       200       // Messages one history request is answered with at most
+#define HISTORY_PAGE           20        // Messages the client asks for with each history command
+#define HISTORY_COMMAND        "/history" // Client input that fetches the messages before the oldest one shown
+
+// Read replica related constants
+#define READ_WAIT_MS           500       // Time (in milliseconds) a backup waits to catch up with a reader before refusing it
+#define READ_EPOCH_SHIFT       48        // Replication sequence numbers count a leader's updates below this bit, and its epoch above it
+
+// Partitioning related constants
+#define PARTITION_VNODES       64        // Points each replica takes on the consistent hash ring
+#define PARTITION_REDIRECT_MAX 4         // Redirects a client follows in a row before waiting USER_RECONNECT_TIMEOUT between them
+
+// Worker pool related constants
+#define WORKER_POOL_SIZE       16        // Workers started with the pool
+#define WORKER_POOL_GROWTH     4         // Times its starting workers the pool grows to at most, while every worker is busy
+#define WORKER_QUEUE_MAX       4096      // Tasks waiting for a worker before new ones are rejected
+
+// Affinity related constants
+#define AFFINITY_IO            0         // Role of the threads receiving from connections (workers and the event loop)
+#define AFFINITY_REPLICATION   1         // Role of the thread writing the coalesced output to replicas and clients
+#define AFFINITY_HISTORY       2         // Role of the thread merging and deleting history segments
+#define AFFINITY_ROLES         3         // Thread roles that can be pinned
+#define AFFINITY_NODES_MAX     64        // NUMA nodes the topology is read for
+#define AFFINITY_ARENA_BYTES   (2 << 20) // Size (in bytes) of each chunk mapped for a node's placed objects
+#define AFFINITY_MIN_BLOCK     64        // Size (in bytes) of the smallest placed block
+#define AFFINITY_CLASSES       8         // Size classes of placed blocks (AFFINITY_MIN_BLOCK << AFFINITY_CLASSES - 1 at most)
+
+// Acceptor related constants
+#define ACCEPTOR_COUNT         4         // Threads accepting connections, each on its own listening socket
+#define ACCEPTOR_MAX           64        // Acceptors that can be configured at most
+#define LISTEN_BACKLOG         4096      // Connections waiting to be accepted on each listening socket (capped by net.core.somaxconn)
+#define ACCEPT_RETRY_MS        10        // Time (in milliseconds) an acceptor waits after running out of descriptors
+
+// Lock profiling related constants
+#define LOCK_REPORT_TOP        10        // Monitors listed by the lock contention report
+
+// Tracing related constants
+#define TRACE_RING_ENTRIES     1024      // Spans each thread keeps (power of 2)
+#define TRACE_FILE             "trace.json" // File the trace admin command writes the spans to
+
 // Packet types regarding chat messages
 #define PAK_DATA              1 // Message packet
 #define PAK_COMMAND           2 // Command packet
@@ -38,10 +136,32 @@
 
 // Packet for front-end updates
 #define PAK_NEW_SERVER 13
+#define PAK_LOGIN_ACCEPT 14 // Login accepted, carries the liveness parameters
+
+// Packet types regarding history search
+#define PAK_SEARCH        15 // Search request, carries the query text
+#define PAK_SEARCH_RESULT 16 // A message found by a search, an empty one ends the results
+
+// Packet types regarding history pages
+#define PAK_HISTORY_REQUEST 17 // Request for a range of the group history, by sequence number or time
+#define PAK_HISTORY_BATCH   18 // Consecutive messages of a history range, the last batch of a request is flagged
+
+// Packet types regarding reads served by backups
+#define PAK_READ_LOGIN  19 // Read-only login, carries the group and the replication sequence number the reader needs
+#define PAK_READ_ACCEPT 20 // Answer to a read-only login, says if the replica caught up with the reader
+
+// Packet types regarding partitioned clusters
+#define PAK_PARTITION_MAP 21 // Replicas of the cluster and the one leading the client's group, refuses the login if it is another one
 
 // Message types
 #define SERVER_MESSAGE 1 // Indicates a message sent by server (login or logout message)
 #define USER_MESSAGE   2 // Indicates a message sent by a user
 #define LOGIN_MESSAGE  3 // Login message containing group the user wants to log into
 
+// History cursors
+#define HISTORY_BY_SEQUENCE 0 // The cursor is a message sequence number
+#define HISTORY_BY_TIME     1 // The cursor is a time (in seconds since the epoch)
+#define HISTORY_OLDER       0 // The range ends right before the cursor
+#define HISTORY_NEWER       1 // The range starts at the cursor
+
 #endif
@@ -35,6 +35,63 @@ typedef struct __message_record
 
 } message_record;
 
+// Liveness parameters the server advertises when it accepts a login
+typedef struct
+{
+    uint32_t heartbeat; // Time (in milliseconds) a quiet client waits before sending a keep-alive
+    uint32_t timeout;   // Time (in milliseconds) of silence after which the server drops the client
+    uint64_t replication; // Replication sequence number when the login was accepted, a backup serving reads must have applied it
+    uint16_t read_port;   // Port of a backup that serves history reads, 0 if reads stay on this server
+
+} login_accept;
+
+// Read-only login, to a replica that serves history and search reads
+typedef struct
+{
+    char groupname[23]; // Group whose history is read
+    uint64_t sequence;  // Replication sequence number the replica must have applied
+
+} read_login;
+
+// Answer to a read-only login
+typedef struct
+{
+    uint64_t applied; // Replication sequence number the replica has applied
+    uint32_t fresh;   // If the replica caught up with the login, otherwise it closes the connection
+
+} read_accept;
+
+// Replicas of a partitioned cluster, sent with the answer to a login
+typedef struct
+{
+    uint16_t owner;            // Port of the replica leading the login's group
+    uint16_t redirect;         // If the login was refused, to be made again at the owner
+    uint16_t count;            // Replicas in the cluster
+    const uint16_t _members[]; // Port of every replica, where to log in again if the owner fails
+
+} partition_map;
+
+// Request for a range of the group history
+typedef struct
+{
+    uint64_t cursor;    // Sequence number or time the range ends before (HISTORY_OLDER) or starts at (HISTORY_NEWER)
+    uint16_t by;        // HISTORY_BY_SEQUENCE or HISTORY_BY_TIME
+    uint16_t direction; // HISTORY_OLDER or HISTORY_NEWER
+    uint16_t limit;     // Messages wanted, HISTORY_PAGE_MAX at most
+
+} history_request;
+
+// Consecutive messages of a history range, as many as fit in a packet
+typedef struct
+{
+    uint64_t first;        // Sequence number of the first message in the batch
+    uint64_t end;          // Sequence number the group's next message will get
+    uint32_t count;        // Messages in the batch
+    uint32_t last;         // If this is the last batch answering the request
+    const char _records[]; // Message records, each followed by its message
+
+} history_batch;
+
 // REPLICA UPDATES
 
 // Struct for updating new replicas with the current existing ones
@@ -62,6 +119,8 @@ typedef struct
     char groupname[23];    // Group where this message is posted
     uint16_t socket;       // Socket where this message came from
     uint16_t length;       // Length of the actual message
+    uint64_t sent;         // Time (in microseconds since the epoch) the leader sent this update
+    uint64_t sequence;     // Replication sequence number of this update, one per message the leader relays, its leader's epoch in the high bits
     const char _message[]; // Actual message record
 
 } message_update;
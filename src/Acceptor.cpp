@@ -0,0 +1,205 @@
+#include "Acceptor.h"
+
+#include <algorithm>
+
+std::atomic<int> Acceptor::acceptor_count(ACCEPTOR_COUNT);
+std::atomic<int> Acceptor::backlog(LISTEN_BACKLOG);
+
+int Acceptor::sockets[ACCEPTOR_MAX];
+int Acceptor::socket_count = 0;
+pthread_t Acceptor::threads[ACCEPTOR_MAX];
+std::atomic<uint64_t> Acceptor::accepts[ACCEPTOR_MAX];
+connection_function Acceptor::on_accept = NULL;
+std::atomic<bool> Acceptor::running(false);
+
+Counter *Acceptor::accepted = Metrics::counter("acceptor_connections_total", "Connections accepted by the acceptors");
+Counter *Acceptor::failures = Metrics::counter("acceptor_errors_total", "Accepts that failed without stopping the acceptor, e.g. out of descriptors");
+
+void Acceptor::configure(int acceptors, int queue)
+{
+    acceptor_count = std::min(std::max(acceptors, 1), ACCEPTOR_MAX);
+    backlog = queue > 0 ? queue : LISTEN_BACKLOG;
+}
+
+int Acceptor::open(int port, bool parallel)
+{
+    struct sockaddr_in address; // Where the sockets listen at
+    int count = parallel ? acceptor_count.load() : 1;
+    int yes = 1;
+
+    bzero((void *)&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    // Sockets sharing a port would share it with another server bound to it as well, make sure there is none
+    if (count > 1)
+    {
+        int probe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe < 0)
+            throw std::runtime_error(std::string("Error during socket creation: ") + strerror(errno));
+
+        setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(probe, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            int error = errno;
+            ::close(probe);
+            throw std::runtime_error(std::string("Error during socket bind: ") + strerror(error));
+        }
+
+        ::close(probe);
+    }
+
+    for (socket_count = 0; socket_count < count; socket_count++)
+    {
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        std::string error;
+
+        if (listener < 0)
+            error = "Error during socket creation";
+        else if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 || (count > 1 && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1))
+            error = "Error setting socket options";
+        else if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0)
+            error = "Error during socket bind";
+
+        if (!error.empty())
+        {
+            error += std::string(": ") + strerror(errno);
+
+            // Let go of the sockets opened so far
+            if (listener >= 0)
+                ::close(listener);
+            Acceptor::release();
+
+            throw std::runtime_error(error);
+        }
+
+        sockets[socket_count] = listener;
+        accepts[socket_count] = 0;
+    }
+
+    return sockets[0];
+}
+
+void Acceptor::listen()
+{
+    for (int i = 0; i < socket_count; i++)
+        if (::listen(sockets[i], backlog) < 0)
+            throw std::runtime_error(std::string("Error setting socket as passive listener: ") + strerror(errno));
+
+    running = true;
+}
+
+void Acceptor::run(connection_function accepted)
+{
+    on_accept = accepted;
+
+    // The first acceptor runs on the calling thread
+    for (int i = 1; i < socket_count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, acceptConnections, (void *)(intptr_t)i) != 0)
+        {
+            // Nobody would accept its connections, the kernel gives them to the other sockets once it is closed
+            Logger::log(LOG_MAIN, LOG_ERROR, "Could not start acceptor %d, closing its socket", i);
+            ::close(sockets[i]);
+            sockets[i] = -1;
+        }
+    }
+
+    Acceptor::acceptConnections((void *)0);
+
+    for (int i = 1; i < socket_count; i++)
+        if (sockets[i] >= 0)
+            pthread_join(threads[i], NULL);
+}
+
+void Acceptor::stop()
+{
+    running = false;
+
+    for (int i = 0; i < socket_count; i++)
+        if (sockets[i] >= 0)
+            shutdown(sockets[i], SHUT_RDWR);
+}
+
+void Acceptor::release()
+{
+    for (int i = 0; i < socket_count; i++)
+        if (sockets[i] >= 0)
+            ::close(sockets[i]);
+
+    socket_count = 0;
+}
+
+int Acceptor::count()
+{
+    return socket_count;
+}
+
+void Acceptor::listStats()
+{
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Listening sockets: " << socket_count << " (configured " << acceptor_count << "), backlog " << backlog << " each" << std::endl;
+    std::cout << "Connections accepted: " << accepted->value() << ", failed accepts: " << failures->value() << std::endl;
+
+    for (int i = 0; i < socket_count; i++)
+        std::cout << " Acceptor " << i << ": " << accepts[i] << " connections accepted" << (sockets[i] < 0 ? " (closed)" : "") << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+void *Acceptor::acceptConnections(void *arg)
+{
+    int index = (int)(intptr_t)arg; // Index of this acceptor
+    int socket = -1;                // New connection socket
+
+    // Acceptors run with the threads receiving from the connections
+    Affinity::pin(AFFINITY_IO);
+
+    while (running)
+    {
+        if ((socket = accept4(sockets[index], NULL, NULL, SOCK_CLOEXEC)) >= 0)
+        {
+            accepts[index]++;
+            accepted->add();
+
+            on_accept(socket);
+            continue;
+        }
+
+        // The socket was shut down
+        if (!running)
+            break;
+
+        switch (errno)
+        {
+        case EINTR:
+            break;
+
+        case ECONNABORTED: // The client gave up while waiting in the backlog
+            failures->add();
+            break;
+
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            // The connection stays in the backlog until descriptors are freed
+            failures->add();
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Acceptor %d could not accept a connection: %s", index, strerror(errno));
+            usleep(ACCEPT_RETRY_MS * 1000);
+            break;
+
+        default:
+            // The socket is unusable, stop every acceptor so the server stops
+            Logger::log(LOG_FRONTEND, LOG_ERROR, "Acceptor %d stopped: %s", index, strerror(errno));
+            Acceptor::stop();
+            break;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,333 @@
+#include "Affinity.h"
+
+#include <string.h>
+
+int Affinity::node_count = 1;
+cpu_set_t Affinity::node_cpus[AFFINITY_NODES_MAX];
+cpu_set_t Affinity::role_cpus[AFFINITY_ROLES];
+std::atomic<int> Affinity::next_thread[AFFINITY_ROLES];
+std::atomic<bool> Affinity::placing(false);
+node_arena Affinity::arenas[AFFINITY_NODES_MAX];
+
+int Affinity::cache_misses_fd = -1;
+int Affinity::node_misses_fd = -1;
+
+Counter *Affinity::local_accesses = Metrics::counter("numa_group_accesses_total{locality=\"local\"}", "Messages posted to a group by a thread on the node the group was allocated on, or on another node");
+Counter *Affinity::remote_accesses = Metrics::counter("numa_group_accesses_total{locality=\"remote\"}", "Messages posted to a group by a thread on the node the group was allocated on, or on another node");
+
+void Affinity::start()
+{
+    char path[64]; // Path of each node's CPU list
+    std::string cpulist;
+
+    // Nodes are numbered from 0, without gaps on every machine we run on
+    node_count = 0;
+    for (int i = 0; i < AFFINITY_NODES_MAX; i++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+        std::ifstream file(path);
+        if (!file || !std::getline(file, cpulist) || !Affinity::parseList(cpulist, &node_cpus[i]))
+            break;
+
+        node_count++;
+    }
+
+    // Without sysfs, every CPU is on one node
+    if (node_count == 0)
+    {
+        node_count = 1;
+        sched_getaffinity(0, sizeof(cpu_set_t), &node_cpus[0]);
+    }
+
+    for (int i = 0; i < node_count; i++)
+    {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].cursor = NULL;
+        arenas[i].left = 0;
+        bzero((void *)arenas[i].free_list, sizeof(arenas[i].free_list));
+    }
+
+    cache_misses_fd = Affinity::openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    node_misses_fd = Affinity::openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    Logger::log(LOG_MAIN, LOG_DEBUG, "Found %d NUMA node(s), hardware counters %s", node_count, cache_misses_fd >= 0 ? "open" : "unavailable");
+}
+
+bool Affinity::configure(int role, const std::string &cpulist)
+{
+    cpu_set_t online;
+
+    if (role < 0 || role >= AFFINITY_ROLES)
+        return false;
+
+    CPU_ZERO(&role_cpus[role]);
+    if (cpulist.empty())
+        return true;
+
+    if (!Affinity::parseList(cpulist, &role_cpus[role]))
+        return false;
+
+    // Only CPUs the process may run on
+    sched_getaffinity(0, sizeof(cpu_set_t), &online);
+    CPU_AND(&role_cpus[role], &role_cpus[role], &online);
+
+    return CPU_COUNT(&role_cpus[role]) > 0;
+}
+
+void Affinity::place(bool enabled)
+{
+    placing = enabled;
+}
+
+void Affinity::pin(int role)
+{
+    cpu_set_t cpus;     // CPUs the thread is pinned to
+    int spanned[AFFINITY_NODES_MAX]; // Nodes the role's CPUs are on
+    int span = 0;
+
+    if (CPU_COUNT(&role_cpus[role]) == 0)
+        return;
+
+    for (int i = 0; i < node_count; i++)
+    {
+        CPU_AND(&cpus, &role_cpus[role], &node_cpus[i]);
+        if (CPU_COUNT(&cpus) > 0)
+            spanned[span++] = i;
+    }
+
+    // Threads of the role take turns between its nodes, and stay on theirs
+    if (span > 0)
+        CPU_AND(&cpus, &role_cpus[role], &node_cpus[spanned[next_thread[role]++ % span]]);
+    else
+        cpus = role_cpus[role];
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0)
+        Logger::log(LOG_MAIN, LOG_WARN, "Could not pin a thread of role %d", role);
+}
+
+int Affinity::currentNode()
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+
+    if (getcpu(&cpu, &node) != 0 || node >= (unsigned)node_count)
+        return 0;
+
+    return node;
+}
+
+void *Affinity::allocate(size_t size)
+{
+    placed_block *block = NULL;
+    int size_class = 0;
+    size_t class_size = AFFINITY_MIN_BLOCK;
+
+    // Find the first class that fits the object and its header
+    while (size_class < AFFINITY_CLASSES && size + sizeof(placed_block) > class_size)
+    {
+        size_class++;
+        class_size <<= 1;
+    }
+
+    // Objects are only placed if asked to, and if they fit a class
+    if (!placing || size_class == AFFINITY_CLASSES)
+    {
+        block = (placed_block *)malloc(sizeof(placed_block) + size);
+        if (block == NULL)
+            throw std::bad_alloc();
+
+        block->node = -1;
+        return (void *)(block + 1);
+    }
+
+    int node = Affinity::currentNode();
+    node_arena *arena = &arenas[node];
+
+    pthread_mutex_lock(&arena->lock);
+
+    // Reuse a block freed on this node, or cut a new one from the current chunk
+    if ((block = arena->free_list[size_class]) != NULL)
+        arena->free_list[size_class] = block->next;
+    else if (arena->left >= class_size || Affinity::grow(node))
+    {
+        block = (placed_block *)arena->cursor;
+        arena->cursor += class_size;
+        arena->left -= class_size;
+    }
+
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block == NULL)
+        throw std::bad_alloc();
+
+    block->node = node;
+    block->size_class = size_class;
+    return (void *)(block + 1);
+}
+
+void Affinity::release(void *object)
+{
+    if (object == NULL)
+        return;
+
+    placed_block *block = (placed_block *)object - 1;
+
+    if (block->node < 0)
+    {
+        free(block);
+        return;
+    }
+
+    // Blocks go back to the node they were placed on, whoever frees them
+    node_arena *arena = &arenas[block->node];
+
+    pthread_mutex_lock(&arena->lock);
+    block->next = arena->free_list[block->size_class];
+    arena->free_list[block->size_class] = block;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void Affinity::access(int node)
+{
+    if (node == Affinity::currentNode())
+        local_accesses->add();
+    else
+        remote_accesses->add();
+}
+
+bool Affinity::counting()
+{
+    return cache_misses_fd >= 0;
+}
+
+uint64_t Affinity::cacheMisses()
+{
+    return Affinity::readCounter(cache_misses_fd);
+}
+
+uint64_t Affinity::remoteMisses()
+{
+    return Affinity::readCounter(node_misses_fd);
+}
+
+void Affinity::listStats()
+{
+    static const char *roles[AFFINITY_ROLES] = {"io", "replication", "history"};
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    for (int i = 0; i < node_count; i++)
+        std::cout << "Node " << i << ": " << CPU_COUNT(&node_cpus[i]) << " CPU(s), " << (arenas[i].mapped >> 10) << " KiB placed" << std::endl;
+
+    for (int i = 0; i < AFFINITY_ROLES; i++)
+    {
+        std::cout << "Role " << roles[i] << ": ";
+        if (CPU_COUNT(&role_cpus[i]) == 0)
+            std::cout << "not pinned" << std::endl;
+        else
+            std::cout << CPU_COUNT(&role_cpus[i]) << " CPU(s), " << next_thread[i] << " thread(s) pinned" << std::endl;
+    }
+
+    std::cout << "Placement on the allocating thread's node: " << (placing ? "on" : "off") << std::endl;
+    std::cout << "Group accesses: " << local_accesses->value() << " local, " << remote_accesses->value() << " remote" << std::endl;
+
+    if (cache_misses_fd >= 0)
+        std::cout << "Cache misses: " << Affinity::cacheMisses() << std::endl;
+    else
+        std::cout << "Cache misses: unavailable" << std::endl;
+
+    if (node_misses_fd >= 0)
+        std::cout << "Misses served from another node: " << Affinity::remoteMisses() << std::endl;
+    else
+        std::cout << "Misses served from another node: unavailable" << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+bool Affinity::parseList(const std::string &cpulist, cpu_set_t *cpus)
+{
+    const char *cursor = cpulist.c_str();
+    char *end = NULL;
+
+    CPU_ZERO(cpus);
+
+    while (*cursor != '\0' && *cursor != '\n')
+    {
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+
+        if (end == cursor || first < 0)
+            return false;
+
+        if (*end == '-')
+        {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first)
+                return false;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return false;
+
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+
+        cursor = end;
+        if (*cursor == ',')
+            cursor++;
+        else if (*cursor != '\0' && *cursor != '\n')
+            return false;
+    }
+
+    return true;
+}
+
+int Affinity::openCounter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attributes;
+
+    bzero((void *)&attributes, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.inherit = 1;        // Count the threads started afterwards too
+    attributes.exclude_kernel = 1; // Allowed with a stricter perf_event_paranoid
+    attributes.exclude_hv = 1;
+
+    // Every CPU the process runs on
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+uint64_t Affinity::readCounter(int fd)
+{
+    uint64_t value = 0;
+
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+
+    return value;
+}
+
+bool Affinity::grow(int node)
+{
+    unsigned long mask[AFFINITY_NODES_MAX / (8 * sizeof(unsigned long))] = {0}; // Nodes the chunk is bound to
+
+    void *chunk = mmap(NULL, AFFINITY_ARENA_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+        return false;
+
+    // Pages come from the node once touched, the binding fails harmlessly on kernels without NUMA
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, chunk, AFFINITY_ARENA_BYTES, MPOL_PREFERRED, mask, AFFINITY_NODES_MAX + 1, 0) != 0)
+        Logger::log(LOG_MAIN, LOG_DEBUG, "Could not bind a chunk to node %d", node);
+
+    // The rest of the old chunk is too small for the class asked for, it stays unused
+    arenas[node].cursor = (char *)chunk;
+    arenas[node].left = AFFINITY_ARENA_BYTES;
+    arenas[node].mapped += AFFINITY_ARENA_BYTES;
+
+    return true;
+}
@@ -0,0 +1,82 @@
+#include "Checksum.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78 // Castagnoli polynomial, bit-reversed
+
+uint32_t Checksum::table[256];
+
+uint32_t Checksum::crc32c(const void *data, size_t length, uint32_t crc)
+{
+    static const bool use_hardware = Checksum::hardware();
+    static const bool table_built = use_hardware || Checksum::buildTable();
+    (void)table_built;
+
+    // Both versions work on the inverted checksum
+    crc = ~crc;
+    crc = use_hardware ? crc32cHardware((const uint8_t *)data, length, crc) : crc32cSoftware((const uint8_t *)data, length, crc);
+
+    return ~crc;
+}
+
+bool Checksum::hardware()
+{
+#if defined(__x86_64__)
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t Checksum::crc32cHardware(const uint8_t *data, size_t length, uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    // Eight bytes per instruction, then the ones left one by one
+    while (length >= sizeof(uint64_t))
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#else
+uint32_t Checksum::crc32cHardware(const uint8_t *data, size_t length, uint32_t crc)
+{
+    return crc32cSoftware(data, length, crc);
+}
+#endif
+
+uint32_t Checksum::crc32cSoftware(const uint8_t *data, size_t length, uint32_t crc)
+{
+    while (length-- > 0)
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+
+bool Checksum::buildTable()
+{
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+        uint32_t crc = byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        table[byte] = crc;
+    }
+
+    return true;
+}
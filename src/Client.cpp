@@ -12,7 +12,20 @@ pthread_t Client::ui_update_thread;
 pthread_t Client::election_listener_thread;
 
 std::string Client::username;
-RW_Monitor Client::socket_monitor;
+RW_Monitor Client::socket_monitor("Client::socket_monitor");
+
+std::atomic<int> Client::heartbeat_interval(HEARTBEAT_INTERVAL);
+std::atomic<uint64_t> Client::last_sent(0);
+std::atomic<uint64_t> Client::history_cursor(UINT64_MAX);
+std::atomic<bool> Client::history_requested(false);
+std::atomic<bool> Client::gap_filling(false);
+std::atomic<uint64_t> Client::newest_seen(0);
+std::atomic<int> Client::newest_seen_count(0);
+int Client::read_socket = -1;
+RW_Monitor Client::read_monitor("Client::read_monitor");
+std::vector<uint16_t> Client::partition_members;
+int Client::redirect_port = 0;
+int Client::redirects = 0;
 
 // Election listener
 int Client::ElectionListener::server_socket;
@@ -48,6 +61,7 @@ void Client::ElectionListener::listenConnections()
     while (!stop_issued && (socket = accept(server_socket, (struct sockaddr *)&client_address, (socklen_t *)&sockaddr_size)) > 0)
     {
         // Update the server socket
+        Client::probeServer(socket);
         Client::server_socket = socket;
         this->server_address = client_address;
         Client::server_port = client_address.sin_port;
@@ -113,6 +127,9 @@ Client::Client(std::string username, std::string groupname, std::string server_i
     Client::listen_port = stoi(listen_port);
     pthread_create(&election_listener_thread, NULL, startElectionListener, reinterpret_cast<void *>(Client::listen_port));
 
+    // A replica closing a connection must not end the client, failed sends are checked instead
+    signal(SIGPIPE, SIG_IGN);
+
     // Set atomic flags as false
     stop_issued = false;
     server_down = false;
@@ -136,39 +153,67 @@ Client::~Client()
 
 void Client::setupConnection()
 {
-    message_record *login_record; // Record for sending login packet
+    // Try to connect to remote server and log in
+    if (!this->connectServer(server_port))
+        throw std::runtime_error(appendErrorMessage("Error connecting to server"));
+
+    // Start user input getter thread
+    pthread_create(&input_handler_thread, NULL, handleUserInput, NULL);
+
+    // Start keep-alive thread
+    pthread_create(&keep_alive_thread, NULL, keepAlive, NULL);
+
+    // Start UI updater thread
+    pthread_create(&ui_update_thread, NULL, ClientInterface::updateUI, NULL);
+};
+
+bool Client::connectServer(int port)
+{
+    PoolHandle<message_record> login_record; // Record for sending login packet
+    int new_socket = -1;
 
     // Create socket
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error during socket creation"));
+    if ((new_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return false;
 
     // Fill server socket address
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(server_port);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = inet_addr(server_ip.c_str());
 
     // Try to connect to remote server
-    if (connect(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error connecting to server"));
+    if (connect(new_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        int error = errno;
+        close(new_socket);
+        errno = error;
+        return false;
+    }
 
     // Prepare message record with login information
     login_record = CommunicationUtils::composeMessage(username, std::string(groupname), LOGIN_MESSAGE, (uint16_t)Client::listen_port);
 
-    // Sends the command packet to the server
-    CommunicationUtils::sendPacket(server_socket, PAK_COMMAND, (char *)login_record, sizeof(*login_record) + login_record->length);
+    // Notice a vanished server even while idle
+    Client::probeServer(new_socket);
 
-    // Free login record
-    free(login_record);
+    // Request write rights
+    socket_monitor.requestWrite();
 
-    // Start user input getter thread
-    pthread_create(&input_handler_thread, NULL, handleUserInput, NULL);
+    // Replace the old server's socket
+    if (server_socket >= 0)
+        close(server_socket);
+    server_socket = new_socket;
+    server_port = port;
 
-    // Start keep-alive thread
-    pthread_create(&keep_alive_thread, NULL, keepAlive, NULL);
+    // Sends the command packet to the server
+    CommunicationUtils::sendPacket(server_socket, PAK_COMMAND, login_record.data(), sizeof(message_record) + login_record->length);
+    last_sent = Client::now();
 
-    // Start UI updater thread
-    pthread_create(&ui_update_thread, NULL, ClientInterface::updateUI, NULL);
-};
+    // Release write rights
+    socket_monitor.releaseWrite();
+
+    return true;
+}
 
 void Client::getMessages()
 {
@@ -213,6 +258,9 @@ void Client::getMessages()
                     sprintf(received_message->username, "%s", username.c_str());
                 }
 
+                // A failover gap is filled from the newest message shown
+                Client::noteSeen(received_message->timestamp);
+
                 // Get time into a readable format
                 strftime(message_time, sizeof(message_time), "%H:%M:%S", std::localtime((time_t *)&received_message->timestamp));
 
@@ -256,9 +304,47 @@ void Client::getMessages()
                 read_bytes = 0;
                 break;
 
+            case PAK_SEARCH_RESULT: // A message found by a search, or the end of the results
+                Client::showSearchResult(received_packet);
+                break;
+
+            case PAK_HISTORY_BATCH: // Consecutive history messages: the login tail, a page asked for, or a failover gap
+                Client::showHistoryBatch(received_packet);
+                break;
+
             case PAK_NEW_SERVER:
                 ClientInterface::printMessage("Connected to a new server");
+
+                // The old server picked the backup history was read from, it may be gone or be the leader now
+                Client::closeReader();
+
+                // Fetch whatever was posted while the old server was going down
+                if (newest_seen > 0)
+                {
+                    gap_filling = true;
+                    Client::requestHistory(newest_seen, HISTORY_BY_TIME, HISTORY_NEWER, HISTORY_PAGE_MAX);
+                }
                 break;
+
+            case PAK_LOGIN_ACCEPT: // Login accepted, with the server's liveness parameters
+
+                // Keep-alive as often as this server asks
+                if (((login_accept *)received_packet->_payload)->heartbeat > 0)
+                    heartbeat_interval = ((login_accept *)received_packet->_payload)->heartbeat;
+
+                // Read history from the backup the server picked, if it has one (older servers send less)
+                if (received_packet->length >= sizeof(login_accept) && ((login_accept *)received_packet->_payload)->read_port != 0)
+                    this->openReader(((login_accept *)received_packet->_payload)->read_port, ((login_accept *)received_packet->_payload)->replication);
+
+                // The login reached the replica leading the group
+                redirects = 0;
+
+                break;
+
+            case PAK_PARTITION_MAP: // Replicas of a partitioned cluster, the login is refused if another one leads the group
+                Client::handlePartitionMap(received_packet);
+                break;
+
             default: // Unknown packet
                 ClientInterface::printMessage("Received unkown packet from server");
                 break;
@@ -271,11 +357,29 @@ void Client::getMessages()
         // Set server as down
         server_down = true;
 
+        // Log in at the replica leading the group, if the login was sent there
+        if (!stop_issued && redirect_port != 0)
+        {
+            // Replicas may disagree on the owner for a moment while one joins or leaves
+            if (++redirects > PARTITION_REDIRECT_MAX)
+                sleep(USER_RECONNECT_TIMEOUT);
+
+            server_down = !this->connectServer(redirect_port);
+            redirect_port = 0;
+        }
+
         // If not stopping because of client action
-        if (!stop_issued)
+        if (!stop_issued && server_down)
         {
             // Wait
             sleep(USER_RECONNECT_TIMEOUT);
+
+            // A partitioned cluster never connects back, any remaining replica sends the login to the group's new owner
+            for (auto i = partition_members.begin(); server_down && !stop_issued && i != partition_members.end(); ++i)
+            {
+                if ((server_down = !this->connectServer(*i)) == false)
+                    ClientInterface::printMessage("Connected to a new server");
+            }
         }
     }
 
@@ -299,8 +403,6 @@ void Client::getMessages()
 
 void *Client::handleUserInput(void *arg)
 {
-    message_record *message;
-
     // Get user messages to be sent until Ctrl D is pressed
     char user_message[MESSAGE_MAX + 1];
     do
@@ -314,22 +416,54 @@ void *Client::handleUserInput(void *arg)
                 // Reset input area below the screen
                 ClientInterface::resetInput();
 
-                if (strlen(user_message) > 0)
+                // Search the group history, e.g. "/search deploy from:alice"
+                if (strncmp(user_message, SEARCH_COMMAND, strlen(SEARCH_COMMAND)) == 0)
+                {
+                    std::string query(user_message + strlen(SEARCH_COMMAND));
+
+                    // Bulk reads go to the backup, if there is one
+                    if (!Client::readFromReplica(PAK_SEARCH, (char *)query.c_str(), query.size() + 1))
+                    {
+                        // Request write rights
+                        socket_monitor.requestWrite();
+
+                        // Send the query as a search packet
+                        CommunicationUtils::sendPacket(server_socket, PAK_SEARCH, (char *)query.c_str(), query.size() + 1);
+                        last_sent = Client::now();
+
+                        // Release write rights
+                        socket_monitor.releaseWrite();
+                    }
+                }
+                // Fetch the page of history before the oldest message shown
+                else if (strcmp(user_message, HISTORY_COMMAND) == 0)
+                {
+                    history_requested = true;
+
+                    history_request request;
+                    request.cursor = history_cursor;
+                    request.by = HISTORY_BY_SEQUENCE;
+                    request.direction = HISTORY_OLDER;
+                    request.limit = HISTORY_PAGE;
+
+                    // Bulk reads go to the backup, if there is one
+                    if (!Client::readFromReplica(PAK_HISTORY_REQUEST, (char *)&request, sizeof(request)))
+                        Client::requestHistory(history_cursor, HISTORY_BY_SEQUENCE, HISTORY_OLDER, HISTORY_PAGE);
+                }
+                else if (strlen(user_message) > 0)
                 {
                     // Compose message
-                    message = CommunicationUtils::composeMessage(username, std::string(user_message), USER_MESSAGE);
+                    MessageBuffer message(username, user_message, USER_MESSAGE);
 
                     // Request write rights
                     socket_monitor.requestWrite();
 
-                    // Send message to server
-                    CommunicationUtils::sendPacket(server_socket, PAK_DATA, (char *)message, sizeof(*message) + message->length);
+                    // Send message to server, it also tells the server this client is alive
+                    CommunicationUtils::sendFrame(server_socket, message);
+                    last_sent = Client::now();
 
                     // Release write rights
                     socket_monitor.releaseWrite();
-
-                    // Free composed message
-                    free(message);
                 }
             }
             catch (const std::runtime_error &e)
@@ -368,8 +502,14 @@ void *Client::keepAlive(void *arg)
 
     while (!stop_issued)
     {
-        // Sleep for SLEEP_TIME seconds between attempting to send messages to the server
-        sleep(SLEEP_TIME);
+        uint64_t quiet = Client::now() - last_sent; // Time since anything was sent
+
+        // Something was sent recently, sleep until the client would have been quiet for the whole interval
+        if (quiet < (uint64_t)heartbeat_interval)
+        {
+            usleep((heartbeat_interval - quiet) * 1000);
+            continue;
+        }
 
         if (!stop_issued && !server_down)
         {
@@ -382,8 +522,254 @@ void *Client::keepAlive(void *arg)
             // Release write rights
             socket_monitor.releaseWrite();
         }
+
+        last_sent = Client::now();
     }
 
     // Exit
     pthread_exit(NULL);
 }
+
+void Client::probeServer(int socket)
+{
+    int yes = 1;
+    int idle = PROBE_IDLE;
+    int interval = PROBE_INTERVAL;
+    int count = PROBE_COUNT;
+
+    // Best effort, the keep-alives above still keep the server side alive without them
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+uint64_t Client::now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Client::requestHistory(uint64_t cursor, int by, int direction, int limit)
+{
+    history_request request;
+
+    request.cursor = cursor;
+    request.by = by;
+    request.direction = direction;
+    request.limit = limit;
+
+    // Request write rights
+    socket_monitor.requestWrite();
+
+    // Send the request as a history packet
+    CommunicationUtils::sendPacket(server_socket, PAK_HISTORY_REQUEST, (char *)&request, sizeof(request));
+    last_sent = Client::now();
+
+    // Release write rights
+    socket_monitor.releaseWrite();
+}
+
+void Client::noteSeen(uint64_t timestamp)
+{
+    if (timestamp > newest_seen)
+    {
+        newest_seen = timestamp;
+        newest_seen_count = 1;
+    }
+    else if (timestamp == newest_seen)
+        newest_seen_count++;
+}
+
+void Client::handlePartitionMap(packet *received_packet)
+{
+    partition_map *map = (partition_map *)received_packet->_payload;
+
+    if (received_packet->length < sizeof(partition_map) || received_packet->length < sizeof(partition_map) + map->count * sizeof(uint16_t))
+        return;
+
+    partition_members.assign(map->_members, map->_members + map->count);
+
+    // The server closes the connection, the login is then made at the owner
+    if (map->redirect)
+        redirect_port = map->owner;
+}
+
+void Client::showSearchResult(packet *received_packet)
+{
+    message_record *received_message; // Message found
+    char message_date[17];            // Date and time of the message
+    std::string chat_message;         // Line shown to the user
+
+    // An empty result ends the search
+    if (received_packet->length == 0)
+    {
+        ClientInterface::printMessage("End of search results");
+        return;
+    }
+
+    // Decode payload into a message record, which must fit in the packet
+    received_message = (message_record *)received_packet->_payload;
+    if (received_packet->length < sizeof(message_record) || sizeof(message_record) + received_message->length > received_packet->length)
+        return;
+
+    // Found messages may be old, so they carry their date
+    strftime(message_date, sizeof(message_date), "%Y-%m-%d %H:%M", std::localtime((time_t *)&received_message->timestamp));
+
+    chat_message = std::string("[search] ") + message_date + " " + received_message->username + ": " + std::string(received_message->_message, strnlen(received_message->_message, received_message->length));
+    ClientInterface::printMessage(chat_message);
+}
+
+void Client::showHistoryBatch(packet *received_packet)
+{
+    history_batch *batch = (history_batch *)received_packet->_payload;
+    message_record *received_message; // Message of the batch
+    char message_date[17];            // Date and time of the message
+    std::string chat_message;         // Line shown to the user
+    size_t offset = 0;
+    size_t records_bytes; // Bytes of records after the batch header
+    uint64_t gap_start = newest_seen;
+
+    if (received_packet->length < sizeof(history_batch))
+        return;
+
+    records_bytes = received_packet->length - sizeof(history_batch);
+
+    // Older pages end right before the oldest message shown
+    history_cursor = std::min<uint64_t>(history_cursor, batch->first);
+
+    for (uint32_t i = 0; i < batch->count && offset + sizeof(message_record) <= records_bytes; i++)
+    {
+        received_message = (message_record *)(batch->_records + offset);
+
+        // A record must end inside the packet
+        if (offset + sizeof(message_record) + received_message->length > records_bytes)
+            break;
+
+        offset += sizeof(message_record) + received_message->length;
+
+        // Timestamps are in seconds, so a gap starts with the messages of the newest second already shown
+        if (gap_filling && received_message->timestamp == gap_start && newest_seen_count > 0)
+        {
+            newest_seen_count--;
+            continue;
+        }
+
+        // Pages asked for are older than everything shown
+        if (!history_requested)
+            Client::noteSeen(received_message->timestamp);
+
+        // History messages may be old, so they carry their date
+        strftime(message_date, sizeof(message_date), "%Y-%m-%d %H:%M", std::localtime((time_t *)&received_message->timestamp));
+
+        chat_message = std::string("[history] ") + message_date + " " + received_message->username + ": " + std::string(received_message->_message, strnlen(received_message->_message, received_message->length));
+        ClientInterface::printMessage(chat_message);
+    }
+
+    if (!batch->last)
+        return;
+
+    if (gap_filling)
+    {
+        // A gap longer than a page is fetched page by page, up to where the history ended
+        if (batch->count > 0 && batch->first + batch->count < batch->end)
+            Client::requestHistory(batch->first + batch->count, HISTORY_BY_SEQUENCE, HISTORY_NEWER, HISTORY_PAGE_MAX);
+        else
+            gap_filling = false;
+    }
+    else if (history_requested)
+    {
+        if (batch->count == 0)
+            ClientInterface::printMessage("No older messages");
+        history_requested = false;
+    }
+}
+
+void Client::openReader(uint16_t port, uint64_t sequence)
+{
+    read_login login;                  // Group read, and how fresh the backup must be
+    char reply[PACKET_MAX];            // Buffer for the backup's answer
+    struct sockaddr_in reader_address; // Address of the backup, on the server's host
+    packet *answer = (packet *)reply;
+
+    bzero((void *)&login, sizeof(login));
+    strncpy(login.groupname, groupname.c_str(), sizeof(login.groupname) - 1);
+    login.sequence = sequence;
+
+    reader_address = server_address;
+    reader_address.sin_port = htons(port);
+
+    // Reads stay on the server if the backup cannot be reached or has not caught up with this login
+    int reader = socket(AF_INET, SOCK_STREAM, 0);
+    if (reader < 0 || connect(reader, (struct sockaddr *)&reader_address, sizeof(reader_address)) < 0 ||
+        CommunicationUtils::sendPacket(reader, PAK_READ_LOGIN, (char *)&login, sizeof(login)) <= 0 ||
+        CommunicationUtils::receivePacket(reader, reply, PACKET_MAX) <= 0 ||
+        answer->type != PAK_READ_ACCEPT || answer->length < sizeof(read_accept) || !((read_accept *)answer->_payload)->fresh)
+    {
+        if (reader >= 0)
+            close(reader);
+        return;
+    }
+
+    // Request write rights
+    read_monitor.requestWrite();
+
+    if (read_socket >= 0)
+        close(read_socket);
+    read_socket = reader;
+
+    // Release write rights
+    read_monitor.releaseWrite();
+}
+
+void Client::closeReader()
+{
+    // Request write rights
+    read_monitor.requestWrite();
+
+    if (read_socket >= 0)
+        close(read_socket);
+    read_socket = -1;
+
+    // Release write rights
+    read_monitor.releaseWrite();
+}
+
+bool Client::readFromReplica(int type, char *payload, int payload_size)
+{
+    char reply[PACKET_MAX]; // Buffer for each answer
+    bool done = false;      // If the whole answer arrived
+    packet *answer = (packet *)reply;
+
+    // Request write rights
+    read_monitor.requestWrite();
+
+    if (read_socket >= 0 && CommunicationUtils::sendPacket(read_socket, type, payload, payload_size) > 0)
+    {
+        // Answers are shown as they arrive, up to the one that ends them
+        while (!done && CommunicationUtils::receivePacket(read_socket, reply, PACKET_MAX) > 0)
+        {
+            if (answer->type == PAK_SEARCH_RESULT)
+            {
+                Client::showSearchResult(answer);
+                done = answer->length == 0;
+            }
+            else if (answer->type == PAK_HISTORY_BATCH && answer->length >= sizeof(history_batch))
+            {
+                Client::showHistoryBatch(answer);
+                done = ((history_batch *)answer->_payload)->last;
+            }
+        }
+    }
+
+    // A backup that went away is not asked again, reads go back to the server
+    if (!done && read_socket >= 0)
+    {
+        close(read_socket);
+        read_socket = -1;
+    }
+
+    // Release write rights
+    read_monitor.releaseWrite();
+
+    return done;
+}
@@ -0,0 +1,626 @@
+#include "CoalescingWriter.h"
+
+std::atomic<int> CoalescingWriter::window(COALESCE_WINDOW_US);
+std::atomic<int> CoalescingWriter::max_bytes(COALESCE_MAX_BYTES);
+std::atomic<bool> CoalescingWriter::cork(false);
+
+std::map<int, output_queue *> CoalescingWriter::queues;
+RW_Monitor CoalescingWriter::queues_monitor("CoalescingWriter::queues_monitor");
+
+std::vector<int> CoalescingWriter::dirty;
+pthread_mutex_t CoalescingWriter::dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t CoalescingWriter::dirty_signal = PTHREAD_COND_INITIALIZER;
+pthread_t CoalescingWriter::flusher_thread;
+std::atomic<bool> CoalescingWriter::running(false);
+
+Counter *CoalescingWriter::frames = Metrics::counter("coalesced_frames_total", "Frames handed to the coalescing writer");
+Counter *CoalescingWriter::bytes = Metrics::counter("coalesced_bytes_total", "Bytes handed to the coalescing writer");
+Counter *CoalescingWriter::syscalls = Metrics::counter("send_syscalls_total{path=\"coalesced\"}", "Send system calls issued");
+Counter *CoalescingWriter::partial_writes = Metrics::counter("partial_writes_total{path=\"coalesced\"}", "Send system calls that did not write everything");
+Counter *CoalescingWriter::size_flushes = Metrics::counter("coalesced_flushes_total{cause=\"size\"}", "Flushes of coalesced output");
+Counter *CoalescingWriter::timer_flushes = Metrics::counter("coalesced_flushes_total{cause=\"timer\"}", "Flushes of coalesced output");
+
+void CoalescingWriter::configure(int window_us, int flush_bytes, bool use_cork)
+{
+    window = window_us > 0 ? window_us : 0;
+    max_bytes = flush_bytes > 0 ? flush_bytes : COALESCE_MAX_BYTES;
+    cork = use_cork;
+}
+
+void CoalescingWriter::start()
+{
+    // Nothing to flush in the background if coalescing is disabled
+    if (window == 0 || running)
+        return;
+
+    running = true;
+    pthread_create(&flusher_thread, NULL, flushExpired, NULL);
+}
+
+void CoalescingWriter::stop()
+{
+    if (!running)
+        return;
+
+    // Wake the flusher up so it notices the stop
+    pthread_mutex_lock(&dirty_lock);
+    running = false;
+    pthread_cond_signal(&dirty_signal);
+    pthread_mutex_unlock(&dirty_lock);
+
+    pthread_join(flusher_thread, NULL);
+
+    // Request read rights
+    queues_monitor.requestRead();
+
+    // Write anything left behind
+    for (auto i = queues.begin(); i != queues.end(); ++i)
+    {
+        pthread_mutex_lock(&i->second->lock);
+        if (!i->second->pending.empty())
+            CoalescingWriter::write(i->first, i->second, NULL, 0);
+        pthread_mutex_unlock(&i->second->lock);
+    }
+
+    // Release read rights
+    queues_monitor.releaseRead();
+}
+
+int CoalescingWriter::enqueue(int socket, const Frame &frame, bool urgent)
+{
+    struct iovec part;
+
+    // The whole frame is a single part
+    part.iov_base = (void *)frame.get();
+    part.iov_len = frame.size();
+
+    return CoalescingWriter::append(socket, &part, 1, urgent);
+}
+
+int CoalescingWriter::enqueueParts(int socket, int packet_type, const struct iovec *parts, int part_count, bool urgent)
+{
+    struct iovec vector[part_count + 1];                // Header followed by the payload parts
+    alignas(packet) char header_buffer[sizeof(packet)]; // Buffer for the packet header
+    packet *header = (packet *)header_buffer;           // Packet header
+    int payload_size = 0;                               // Sum of all payload parts
+
+    // Calculate payload size
+    for (int i = 0; i < part_count; i++)
+        payload_size += parts[i].iov_len;
+
+    // Prepare header
+    bzero((void *)header, sizeof(packet));
+    header->type = packet_type;
+    header->sqn = 1;
+    header->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    header->length = payload_size;
+
+    // Gather header and parts
+    vector[0].iov_base = (void *)header;
+    vector[0].iov_len = sizeof(packet);
+    memcpy(vector + 1, parts, sizeof(struct iovec) * part_count);
+
+    return CoalescingWriter::append(socket, vector, part_count + 1, urgent);
+}
+
+void CoalescingWriter::flush(int socket)
+{
+    // Request read rights
+    queues_monitor.requestRead();
+
+    auto found = queues.find(socket);
+    if (found != queues.end())
+    {
+        pthread_mutex_lock(&found->second->lock);
+
+        // If the flusher is writing it, it writes what was queued since right after
+        if (!found->second->pending.empty() && !found->second->flushing)
+            CoalescingWriter::write(socket, found->second, NULL, 0);
+
+        pthread_mutex_unlock(&found->second->lock);
+    }
+
+    // Release read rights
+    queues_monitor.releaseRead();
+}
+
+void CoalescingWriter::remove(int socket)
+{
+    output_queue *queue = NULL;
+
+    // Request write rights
+    queues_monitor.requestWrite();
+
+    auto found = queues.find(socket);
+    if (found != queues.end())
+    {
+        queue = found->second;
+        queues.erase(found);
+    }
+
+    // Release write rights
+    queues_monitor.releaseWrite();
+
+    if (queue != NULL)
+    {
+        pthread_mutex_lock(&queue->lock);
+
+        // The flusher may still be writing to the socket, it must not be closed before it is done
+        while (queue->flushing)
+            pthread_cond_wait(&queue->flushed, &queue->lock);
+
+        // Give whatever is pending a last chance to leave
+        if (!queue->pending.empty())
+            CoalescingWriter::write(socket, queue, NULL, 0);
+
+        pthread_mutex_unlock(&queue->lock);
+
+        pthread_cond_destroy(&queue->flushed);
+        pthread_mutex_destroy(&queue->lock);
+        delete queue;
+    }
+}
+
+long CoalescingWriter::pendingBytes(int socket)
+{
+    long pending = 0;
+
+    // Request read rights
+    queues_monitor.requestRead();
+
+    auto found = queues.find(socket);
+    if (found != queues.end())
+    {
+        pthread_mutex_lock(&found->second->lock);
+        pending = found->second->pending.size();
+        pthread_mutex_unlock(&found->second->lock);
+    }
+
+    // Release read rights
+    queues_monitor.releaseRead();
+
+    return pending;
+}
+
+void CoalescingWriter::listStats()
+{
+    long written_frames = frames->value();
+    long write_calls = syscalls->value();
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Coalescing window (us): " << window << std::endl;
+    std::cout << "Flush threshold (bytes): " << max_bytes << std::endl;
+    std::cout << "TCP_CORK: " << (cork ? "on" : "off") << std::endl;
+    std::cout << "Frames: " << written_frames << std::endl;
+    std::cout << "Bytes: " << bytes->value() << std::endl;
+    std::cout << "Write syscalls: " << write_calls << std::endl;
+    std::cout << "Partial writes: " << partial_writes->value() << std::endl;
+    std::cout << "Flushes by size: " << size_flushes->value() << std::endl;
+    std::cout << "Flushes by timer: " << timer_flushes->value() << std::endl;
+    std::cout << "Syscalls per frame: " << (written_frames > 0 ? (double)write_calls / written_frames : 0) << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+output_queue *CoalescingWriter::getQueue(int socket)
+{
+    output_queue *queue = NULL;
+    int yes = 1;
+
+    auto found = queues.find(socket);
+    if (found != queues.end())
+        return found->second;
+
+    // Swap read rights for write rights to create the queue
+    queues_monitor.releaseRead();
+    queues_monitor.requestWrite();
+
+    // Someone else may have created it in between
+    if ((found = queues.find(socket)) == queues.end())
+    {
+        queue = new output_queue();
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->flushed, NULL);
+        queue->pending.reserve(max_bytes);
+        queue->oldest = 0;
+        queue->scheduled = false;
+        queue->flushing = false;
+
+        queues.insert(std::make_pair(socket, queue));
+
+        // The writer does the batching, the kernel should not hold batches back
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    else
+    {
+        queue = found->second;
+    }
+
+    // Go back to read rights
+    queues_monitor.releaseWrite();
+    queues_monitor.requestRead();
+
+    return queue;
+}
+
+int CoalescingWriter::append(int socket, const struct iovec *parts, int part_count, bool urgent)
+{
+    output_queue *queue = NULL;
+    int total = 0; // Bytes being appended
+    int result = 0;
+
+    for (int i = 0; i < part_count; i++)
+        total += parts[i].iov_len;
+
+    frames->add();
+    bytes->add(total);
+
+    // Coalescing disabled, write right away
+    if (window == 0)
+    {
+        syscalls->add();
+        return writev(socket, parts, part_count);
+    }
+
+    // Request read rights
+    queues_monitor.requestRead();
+
+    queue = CoalescingWriter::getQueue(socket);
+
+    pthread_mutex_lock(&queue->lock);
+
+    // If the batch is big enough (or this must not wait), write everything with this frame at the end
+    // (while the flusher writes older bytes of the queue, the frame goes behind them instead)
+    if (!queue->flushing && (urgent || queue->pending.size() + total >= (size_t)max_bytes))
+    {
+        size_flushes->add();
+        result = CoalescingWriter::write(socket, queue, parts, part_count);
+    }
+    // If not, keep it for the flusher
+    else
+    {
+        if (queue->pending.empty())
+            queue->oldest = CoalescingWriter::now();
+
+        for (int i = 0; i < part_count; i++)
+            queue->pending.insert(queue->pending.end(), (char *)parts[i].iov_base, (char *)parts[i].iov_base + parts[i].iov_len);
+
+        result = total;
+
+        // Let the flusher know about this socket
+        CoalescingWriter::schedule(socket, queue);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    // Release read rights
+    queues_monitor.releaseRead();
+
+    return result;
+}
+
+void CoalescingWriter::schedule(int socket, output_queue *queue)
+{
+    if (queue->scheduled)
+        return;
+
+    queue->scheduled = true;
+
+    pthread_mutex_lock(&dirty_lock);
+    dirty.push_back(socket);
+    pthread_cond_signal(&dirty_signal);
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+int CoalescingWriter::write(int socket, output_queue *queue, const struct iovec *extra, int extra_count)
+{
+    struct iovec vector[extra_count + 1];  // Pending bytes followed by the extra buffers
+    size_t queued = queue->pending.size(); // Bytes already pending, written first
+    size_t skip = 0;                       // Bytes of the extra buffers that were written
+    int count = 0;                         // Number of buffers
+    int total = 0;                         // Bytes written or kept
+    ssize_t written = 0;                   // Bytes written
+
+    // Gather pending bytes and the extra buffers
+    if (queued > 0)
+    {
+        vector[count].iov_base = queue->pending.data();
+        vector[count++].iov_len = queued;
+    }
+    for (int i = 0; i < extra_count; i++)
+        vector[count++] = extra[i];
+
+    for (int i = 0; i < count; i++)
+        total += vector[i].iov_len;
+
+    // The socket failed, nothing pending will ever leave
+    if ((written = CoalescingWriter::writeAvailable(socket, vector, count)) < 0)
+    {
+        queue->pending.clear();
+        return -1;
+    }
+
+    // Keep what the socket did not take at the front of the queue, in order
+    if ((size_t)written < queued)
+        queue->pending.erase(queue->pending.begin(), queue->pending.begin() + written);
+    else
+    {
+        queue->pending.clear();
+        skip = written - queued;
+    }
+
+    for (int i = 0; i < extra_count; i++)
+    {
+        if (skip >= extra[i].iov_len)
+        {
+            skip -= extra[i].iov_len;
+            continue;
+        }
+
+        queue->pending.insert(queue->pending.end(), (char *)extra[i].iov_base + skip, (char *)extra[i].iov_base + extra[i].iov_len);
+        skip = 0;
+    }
+
+    // Try the rest again once the window passes
+    if (!queue->pending.empty())
+    {
+        if (CoalescingWriter::backlogged(socket, queue))
+            return -1;
+
+        queue->oldest = CoalescingWriter::now();
+        CoalescingWriter::schedule(socket, queue);
+    }
+
+    return total;
+}
+
+ssize_t CoalescingWriter::writeAvailable(int socket, struct iovec *vector, int count)
+{
+    struct msghdr message; // Buffers not entirely written yet
+    ssize_t remaining = 0; // Bytes left to write
+    ssize_t written = 0;   // Bytes written by the last call
+    ssize_t total = 0;     // Bytes written
+    int yes = 1, no = 0;
+
+    for (int i = 0; i < count; i++)
+        remaining += vector[i].iov_len;
+
+    bzero((void *)&message, sizeof(message));
+    message.msg_iov = vector;
+    message.msg_iovlen = count;
+
+    if (cork)
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &yes, sizeof(yes));
+
+    // Write until everything is out, or until the socket buffer is full
+    while (remaining > 0)
+    {
+        syscalls->add();
+        if ((written = sendmsg(socket, &message, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // A full buffer is not a failure, the rest is written later
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                total = -1;
+            break;
+        }
+
+        total += written;
+        remaining -= written;
+
+        if (remaining > 0)
+        {
+            partial_writes->add();
+
+            // Skip the buffers that were entirely written
+            while (written >= (ssize_t)message.msg_iov->iov_len)
+            {
+                written -= message.msg_iov->iov_len;
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + written;
+            message.msg_iov->iov_len -= written;
+        }
+    }
+
+    if (cork)
+        setsockopt(socket, IPPROTO_TCP, TCP_CORK, &no, sizeof(no));
+
+    return total;
+}
+
+bool CoalescingWriter::backlogged(int socket, output_queue *queue)
+{
+    if (queue->pending.size() <= COALESCE_BACKLOG_MAX)
+        return false;
+
+    // The peer is not reading, its handler notices the shutdown and closes it
+    Logger::log(LOG_IO, LOG_WARN, "Socket %d left %zu bytes unread, shutting it down", socket, queue->pending.size());
+    queue->pending.clear();
+    shutdown(socket, SHUT_RDWR);
+
+    return true;
+}
+
+void *CoalescingWriter::flushExpired(void *arg)
+{
+    std::vector<int> sockets;      // Sockets taken from the dirty list
+    std::vector<int> waiting;      // Sockets whose window did not expire yet, or with bytes left
+    std::vector<flush_job> expired; // Bytes taken from the queues whose window expired
+    uint64_t current_time = 0;     // Time of the current pass
+    uint64_t next_wait = 0;        // Time until the next window expires
+
+    // Flushes fan every group's messages out, it runs next to the replication threads
+    Affinity::pin(AFFINITY_REPLICATION);
+
+    while (running)
+    {
+        // Wait for dirty sockets
+        pthread_mutex_lock(&dirty_lock);
+        while (running && dirty.empty())
+            pthread_cond_wait(&dirty_signal, &dirty_lock);
+        sockets.swap(dirty);
+        pthread_mutex_unlock(&dirty_lock);
+
+        // A descriptor reused after a remove may be listed twice
+        std::sort(sockets.begin(), sockets.end());
+        sockets.erase(std::unique(sockets.begin(), sockets.end()), sockets.end());
+
+        current_time = CoalescingWriter::now();
+        next_wait = window;
+        waiting.clear();
+
+        // Request read rights
+        queues_monitor.requestRead();
+
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            auto found = queues.find(sockets[i]);
+            if (found == queues.end())
+                continue;
+
+            output_queue *queue = found->second;
+            pthread_mutex_lock(&queue->lock);
+
+            // Window expired, take the bytes out and write them below, without the monitor or the lock
+            if (!queue->pending.empty() && current_time - queue->oldest >= (uint64_t)window)
+            {
+                expired.emplace_back();
+                expired.back().socket = sockets[i];
+                expired.back().queue = queue;
+                expired.back().bytes.swap(queue->pending);
+                expired.back().written = 0;
+
+                queue->flushing = true;
+            }
+            // Still waiting, check again later
+            else if (!queue->pending.empty())
+            {
+                waiting.push_back(sockets[i]);
+                next_wait = std::min(next_wait, window - (current_time - queue->oldest));
+            }
+            // Someone else already wrote it
+            else
+            {
+                queue->scheduled = false;
+            }
+
+            pthread_mutex_unlock(&queue->lock);
+        }
+
+        // Release read rights
+        queues_monitor.releaseRead();
+
+        // Write every expired queue, nobody waits for the monitor meanwhile
+        if (!expired.empty())
+            CoalescingWriter::writeExpired(expired, waiting);
+        expired.clear();
+
+        sockets.clear();
+
+        // Put back the sockets that are still waiting, and sleep until the first one expires
+        if (!waiting.empty())
+        {
+            pthread_mutex_lock(&dirty_lock);
+            dirty.insert(dirty.end(), waiting.begin(), waiting.end());
+            pthread_mutex_unlock(&dirty_lock);
+
+            usleep(next_wait);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+void CoalescingWriter::writeExpired(std::vector<flush_job> &jobs, std::vector<int> &waiting)
+{
+    std::vector<write_request> requests(jobs.size()); // One request for each queue
+    std::vector<struct iovec> parts(jobs.size());     // Bytes taken from each queue
+    int calls = -1;                                   // System calls used by the batch
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        parts[i].iov_base = jobs[i].bytes.data();
+        parts[i].iov_len = jobs[i].bytes.size();
+    }
+
+    // Hand every queue to a single batched submission, if the event loop offers one
+    if (jobs.size() > 1)
+    {
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            requests[i].socket = jobs[i].socket;
+            requests[i].part = parts[i];
+        }
+
+        calls = EventLoop::writeBatch(requests.data(), requests.size());
+    }
+
+    if (calls >= 0)
+        syscalls->add(calls);
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        flush_job *job = &jobs[i];
+        output_queue *queue = job->queue;
+
+        timer_flushes->add();
+
+        // Not batched, write it on its own
+        if (calls < 0)
+            job->written = CoalescingWriter::writeAvailable(job->socket, &parts[i], 1);
+        else
+        {
+            job->written = requests[i].written;
+            if (job->written >= 0 && (size_t)job->written < job->bytes.size())
+                partial_writes->add();
+        }
+
+        pthread_mutex_lock(&queue->lock);
+
+        queue->flushing = false;
+
+        // The socket failed, nothing pending will ever leave
+        if (job->written < 0)
+            queue->pending.clear();
+        // What was not written goes back in front of the frames queued meanwhile (the queue keeps its buffer)
+        else if ((size_t)job->written < job->bytes.size())
+        {
+            job->bytes.erase(job->bytes.begin(), job->bytes.begin() + job->written);
+            job->bytes.insert(job->bytes.end(), queue->pending.begin(), queue->pending.end());
+            queue->pending.swap(job->bytes);
+            queue->oldest = CoalescingWriter::now();
+
+            CoalescingWriter::backlogged(job->socket, queue);
+        }
+        else
+        {
+            job->bytes.assign(queue->pending.begin(), queue->pending.end());
+            queue->pending.swap(job->bytes);
+
+            // The socket took everything, frames queued meanwhile (maybe urgent ones) need not wait
+            if (!queue->pending.empty())
+                CoalescingWriter::write(job->socket, queue, NULL, 0);
+        }
+
+        if (!queue->pending.empty())
+            waiting.push_back(job->socket);
+        else
+            queue->scheduled = false;
+
+        // Let whoever waits to remove the queue go on
+        pthread_cond_broadcast(&queue->flushed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+uint64_t CoalescingWriter::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
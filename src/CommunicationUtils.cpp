@@ -1,38 +1,50 @@
 #include "CommunicationUtils.h"
 
+Counter *CommunicationUtils::send_syscalls = Metrics::counter("send_syscalls_total{path=\"direct\"}", "Send system calls issued");
+Counter *CommunicationUtils::partial_writes = Metrics::counter("partial_writes_total{path=\"direct\"}", "Send system calls that did not write everything");
+
 std::string CommunicationUtils::appendErrorMessage(const std::string message)
 {
     return message + " (" + std::string(strerror(errno)) + ")";
 }
 
-coordinator *CommunicationUtils::composeCoordinatorUpdate(std::map<int, int> translation)
+PoolHandle<coordinator> CommunicationUtils::composeCoordinatorUpdate(const std::map<int, int> &translation)
 {
-    // Create the arrays of old and new sockets
-    uint16_t *sockets = (uint16_t *)malloc(sizeof(uint16_t) * 2 * translation.size());
-    bzero((void *)sockets, sizeof(uint16_t) * 2 * translation.size());
+    // Create the coordinator packet message
+    PoolHandle<coordinator> coord = PoolHandle<coordinator>::allocate(sizeof(uint16_t) + (2 * sizeof(uint16_t) * translation.size()));
+    coord->counter = (uint16_t)translation.size();
 
-    // Fill array
+    // Fill the array of old and new sockets
+    uint16_t socket_pair[2];
     size_t offset = 0;
-    for (auto i = translation.begin(); i != translation.end(); ++i, offset += 2)
+    for (auto i = translation.begin(); i != translation.end(); ++i, offset += sizeof(socket_pair))
     {
-        sockets[offset] = i->first;
-        sockets[offset + 1] = i->second;
+        socket_pair[0] = i->first;
+        socket_pair[1] = i->second;
+        memcpy((char *)coord->_sockets + offset, socket_pair, sizeof(socket_pair));
     }
 
-    // Create the coordinator packet message
-    coordinator *coord = (coordinator *)malloc(sizeof(uint16_t) + (2 * sizeof(uint16_t) * translation.size()));
-    coord->counter = (uint16_t)translation.size();
-    if (coord->counter > 0)
-        memcpy((char *)coord->_sockets, sockets, sizeof(uint16_t) * 2 * translation.size());
-
     return coord;
 }
 
-replica_update *CommunicationUtils::composeReplicaUpdate(int identifier, int port)
+PoolHandle<partition_map> CommunicationUtils::composePartitionMap(int owner, bool redirect, const std::vector<uint16_t> &members)
+{
+    // Create structure, followed by the member ports
+    PoolHandle<partition_map> map = PoolHandle<partition_map>::allocate(sizeof(partition_map) + members.size() * sizeof(uint16_t));
+
+    // Fill data
+    map->owner = owner;
+    map->redirect = redirect;
+    map->count = members.size();
+    memcpy((void *)map->_members, members.data(), members.size() * sizeof(uint16_t));
+
+    return map;
+}
+
+PoolHandle<replica_update> CommunicationUtils::composeReplicaUpdate(int identifier, int port)
 {
     // Create structure
-    replica_update *update = (replica_update *)malloc(sizeof(replica_update));
-    bzero((void *)update, sizeof(replica_update));
+    PoolHandle<replica_update> update = PoolHandle<replica_update>::allocate(sizeof(replica_update));
 
     // Fill data
     update->identifier = identifier;
@@ -42,19 +54,19 @@ replica_update *CommunicationUtils::composeReplicaUpdate(int identifier, int por
     return update;
 }
 
-message_update *CommunicationUtils::composeMessageUpdate(message_record *message, std::string groupname, int socket)
+PoolHandle<message_update> CommunicationUtils::composeMessageUpdate(message_record *message, const std::string &groupname, int socket)
 {
     // Calculate message size
     int message_size = sizeof(message_record) + message->length;
 
     // Allocate memory for message update
-    message_update *new_update = (message_update *)malloc(sizeof(message_update) + message_size);
-    bzero((void *)new_update, sizeof(message_update) + message_size);
+    PoolHandle<message_update> new_update = PoolHandle<message_update>::allocate(sizeof(message_update) + message_size);
 
     // Fill data
     strcpy(new_update->groupname, groupname.c_str());
     new_update->socket = socket;
     new_update->length = message_size;
+    new_update->sent = Metrics::epochTime();
     memcpy((char *)new_update->_message, message, message_size);
 
     /*
@@ -75,11 +87,10 @@ message_update *CommunicationUtils::composeMessageUpdate(message_record *message
     return new_update;
 }
 
-login_update *CommunicationUtils::composeLoginUpdate(char *login, std::string ip, int port, int socket)
+PoolHandle<login_update> CommunicationUtils::composeLoginUpdate(char *login, const std::string &ip, int port, int socket)
 {
     // Create front end
-    login_update *new_front_end = (login_update *)malloc(sizeof(login_update) + sizeof(message_record) + ((message_record *)login)->length);
-    bzero((void *)new_front_end, sizeof(login_update) + sizeof(message_record) + ((message_record *)login)->length);
+    PoolHandle<login_update> new_front_end = PoolHandle<login_update>::allocate(sizeof(login_update) + sizeof(message_record) + ((message_record *)login)->length);
 
     // Prepare data
     strcpy(new_front_end->ip, ip.c_str());
@@ -101,14 +112,13 @@ login_update *CommunicationUtils::composeLoginUpdate(char *login, std::string ip
     return new_front_end;
 }
 
-packet *CommunicationUtils::composePacket(int packet_type, char *payload, int payload_size)
+PoolHandle<packet> CommunicationUtils::composePacket(int packet_type, char *payload, int payload_size)
 {
     // Calculate packet size
     int packet_size = sizeof(packet) + payload_size;
 
     // Prepare packet
-    packet *data = (packet *)malloc(packet_size);                                             // Malloc memory
-    bzero((void *)data, packet_size);                                                         // Initialize bytes to zero
+    PoolHandle<packet> data = PoolHandle<packet>::allocate(packet_size);                      // Get zeroed memory from the pool
     data->type = packet_type;                                                                 // Signal that a data packet is being sent
     data->sqn = 1;                                                                            // TODO Keep track of sequence numbers
     data->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); // Current timestamp
@@ -121,41 +131,75 @@ packet *CommunicationUtils::composePacket(int packet_type, char *payload, int pa
 
 int CommunicationUtils::sendPacket(int socket, int packet_type, char *payload, int payload_size)
 {
-    // Calculate size of packet that will be sent
-    int packet_size = sizeof(packet) + payload_size;
-    int bytes_sent = -1; // Number of bytes actually sent to the client
-
     // Prepare packet
-    packet *data = (packet *)malloc(packet_size);                                             // Malloc memory
-    bzero((void *)data, packet_size);                                                         // Initialize bytes to zero
-    data->type = packet_type;                                                                 // Signal that a data packet is being sent
-    data->sqn = 1;                                                                            // TODO Keep track of sequence numbers
-    data->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); // Current timestamp
-    data->length = payload_size;                                                              // Update payload size
-    memcpy((char *)data->_payload, payload, payload_size);                                    // Copy payload to packet
+    Frame data(packet_type, payload, payload_size);
 
     // Send packet
-    if ((bytes_sent = send(socket, data, packet_size, 0)) <= 0)
+    return CommunicationUtils::sendFrame(socket, data);
+}
+
+int CommunicationUtils::sendFrame(int socket, const Frame &frame)
+{
+    int bytes_sent = -1; // Number of bytes actually sent
+
+    // Send packet
+    send_syscalls->add();
+    if ((bytes_sent = send(socket, frame.get(), frame.size(), 0)) <= 0)
     {
         //std::cerr << appendErrorMessage("Unable to send message to server") << std::endl;
     }
-
-    // Free memory used for packet
-    free(data);
+    else if (bytes_sent < frame.size())
+        partial_writes->add();
 
     // Return number of bytes sent
     return bytes_sent;
 }
 
-message_record *CommunicationUtils::composeMessage(std::string sender_name, std::string message_content, int message_type, int port)
+int CommunicationUtils::sendPacketParts(int socket, int packet_type, const struct iovec *parts, int part_count)
+{
+    struct iovec vector[part_count + 1];              // Header followed by the payload parts
+    struct msghdr message;                            // Message descriptor for sendmsg
+    alignas(packet) char header_buffer[sizeof(packet)]; // Buffer for the packet header
+    packet *header = (packet *)header_buffer;         // Packet header
+    int payload_size = 0;                             // Sum of all payload parts
+
+    // Calculate payload size
+    for (int i = 0; i < part_count; i++)
+        payload_size += parts[i].iov_len;
+
+    // Prepare header
+    bzero((void *)header, sizeof(packet));
+    header->type = packet_type;
+    header->sqn = 1;
+    header->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    header->length = payload_size;
+
+    // Gather header and parts
+    vector[0].iov_base = (void *)header;
+    vector[0].iov_len = sizeof(packet);
+    memcpy(vector + 1, parts, sizeof(struct iovec) * part_count);
+
+    bzero((void *)&message, sizeof(message));
+    message.msg_iov = vector;
+    message.msg_iovlen = part_count + 1;
+
+    // Send packet
+    send_syscalls->add();
+    int bytes_sent = sendmsg(socket, &message, 0);
+    if (bytes_sent > 0 && bytes_sent < (int)sizeof(packet) + payload_size)
+        partial_writes->add();
+
+    return bytes_sent;
+}
+
+PoolHandle<message_record> CommunicationUtils::composeMessage(const std::string &sender_name, const std::string &message_content, int message_type, int port)
 {
     // Calculate total size of the message record struct
     int record_size = sizeof(message_record) + (message_content.length() + 1);
 
     // Create a record for the message
-    message_record *msg = (message_record *)malloc(record_size); // Malloc memory
-    bzero((void *)msg, record_size);                             // Initialize bytes to zero
-    strcpy(msg->username, sender_name.c_str());                  // Copy sender name
+    PoolHandle<message_record> msg = PoolHandle<message_record>::allocate(record_size); // Get zeroed memory from the pool
+    strcpy(msg->username, sender_name.c_str());                                          // Copy sender name
     msg->port = port;
     msg->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); // Current timestamp
     msg->type = message_type;                                                                // Update message type
@@ -184,6 +228,10 @@ int CommunicationUtils::receivePacket(int socket, char *buffer, int buf_size)
         else
             total_bytes = -1;
     }
+    // Refuse packets that would not fit in the buffer
+    if (total_bytes == header_size && ((packet *)buffer)->length > buf_size - header_size)
+        return -1;
+
     // If the entire header arrived
     if (total_bytes == header_size)
     {
@@ -211,3 +259,35 @@ int CommunicationUtils::receivePacket(int socket, char *buffer, int buf_size)
     // Return amount of bytes read/written
     return total_bytes;
 }
+
+int CommunicationUtils::receiveFrame(int socket, Frame &frame)
+{
+    // Allocate a frame big enough for any packet
+    frame = Frame(0, PACKET_MAX - sizeof(packet));
+
+    // Receive packet over it
+    return CommunicationUtils::receivePacket(socket, (char *)frame.get(), PACKET_MAX);
+}
+
+bool CommunicationUtils::validateMessage(Frame &frame)
+{
+    packet *received_packet = frame.get();
+    message_record *message = (message_record *)received_packet->_payload;
+
+    // Record header must fit in the payload
+    if (received_packet->length < sizeof(message_record))
+        return false;
+
+    // Message text must fit in the payload and respect the maximum message size
+    if (message->length == 0 || message->length > MESSAGE_MAX + 1 || message->length > received_packet->length - sizeof(message_record))
+        return false;
+
+    // Message text must be NUL terminated
+    if (message->_message[message->length - 1] != '\0')
+        return false;
+
+    // Drop anything after the record
+    frame.setLength(sizeof(message_record) + message->length);
+
+    return true;
+}
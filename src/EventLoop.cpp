@@ -0,0 +1,636 @@
+#include "EventLoop.h"
+
+#include <sched.h>
+#include <stdexcept>
+#include <algorithm>
+#include <iostream>
+
+std::atomic<int> EventLoop::backend(LOOP_THREADS);
+std::atomic<bool> EventLoop::running(false);
+
+EventLoop::accept_function EventLoop::on_accept;
+EventLoop::packet_function EventLoop::on_packet;
+EventLoop::close_function EventLoop::on_close;
+
+int EventLoop::listen_socket = -1;
+int EventLoop::wake_fd = -1;
+int EventLoop::epoll_fd = -1;
+std::map<int, loop_connection *> EventLoop::connections;
+uint32_t EventLoop::next_generation = 0;
+std::vector<int> EventLoop::incoming;
+pthread_mutex_t EventLoop::incoming_lock = PTHREAD_MUTEX_INITIALIZER;
+
+IORing *EventLoop::ring = NULL;
+IORing *EventLoop::send_ring = NULL;
+pthread_mutex_t EventLoop::send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef USE_IO_URING
+// Operation each completion belongs to, kept in the top byte of its user data
+#define OP_ACCEPT  1ULL
+#define OP_WAKE    2ULL
+#define OP_RECEIVE 4ULL
+#define OP_CANCEL  5ULL
+
+// User data of a connection's receive: operation, generation (24 bits) and socket
+#define RECEIVE_DATA(socket, generation) ((OP_RECEIVE << 56) | ((uint64_t)((generation) & 0xFFFFFF) << 32) | (uint32_t)(socket))
+#endif
+
+std::atomic<long> EventLoop::wakeups;
+std::atomic<long> EventLoop::receives;
+std::atomic<long> EventLoop::accepts;
+std::atomic<long> EventLoop::packets;
+std::atomic<long> EventLoop::timeouts;
+std::atomic<long> EventLoop::batches;
+std::atomic<long> EventLoop::batched;
+
+bool EventLoop::configure(const std::string &name)
+{
+    if (name == "threads")
+        backend = LOOP_THREADS;
+    else if (name == "epoll")
+        backend = LOOP_EPOLL;
+    else if (name == "uring")
+    {
+#ifdef USE_IO_URING
+        try
+        {
+            // Create the rings, the receive one with the provided buffers
+            ring = new IORing(LOOP_RING_ENTRIES);
+            if (!ring->provideBuffers(LOOP_BUFFERS, LOOP_BUFFER_SIZE))
+                throw std::runtime_error("Kernel does not support provided buffer rings");
+
+            send_ring = new IORing(LOOP_RING_ENTRIES);
+            backend = LOOP_URING;
+        }
+        catch (const std::runtime_error &e)
+        {
+            Logger::log(LOG_IO, LOG_WARN, "%s, falling back to epoll", e.what());
+
+            delete ring;
+            ring = NULL;
+            backend = LOOP_EPOLL;
+        }
+#else
+        Logger::log(LOG_IO, LOG_WARN, "Built without io_uring support (make IO_URING=1), falling back to epoll");
+        backend = LOOP_EPOLL;
+#endif
+    }
+    else
+        return false;
+
+    return true;
+}
+
+bool EventLoop::enabled()
+{
+    return backend != LOOP_THREADS;
+}
+
+void EventLoop::run(int socket, accept_function accepted, packet_function received, close_function closed)
+{
+    listen_socket = socket;
+    on_accept = accepted;
+    on_packet = received;
+    on_close = closed;
+
+    // Descriptor other threads write to, to wake the loop up
+    // OBS: It stays blocking, io_uring would complete reads of a non-blocking one right away
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        throw std::runtime_error(std::string("Error creating the event loop wake descriptor: ") + strerror(errno));
+
+    // The loop receives from every connection, it stays on the CPUs given to IO
+    Affinity::pin(AFFINITY_IO);
+
+    running = true;
+
+#ifdef USE_IO_URING
+    if (backend == LOOP_URING)
+        EventLoop::runUring();
+    else
+#endif
+        EventLoop::runEpoll();
+
+    // Hand every connection left to the close handler
+    EventLoop::takeIncoming();
+    while (!connections.empty())
+        EventLoop::closeConnection(connections.begin()->first);
+
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    close(wake_fd);
+    epoll_fd = wake_fd = -1;
+}
+
+void EventLoop::watch(int socket)
+{
+    uint64_t value = 1;
+
+    pthread_mutex_lock(&incoming_lock);
+    incoming.push_back(socket);
+    pthread_mutex_unlock(&incoming_lock);
+
+    // Let the loop know
+    if (write(wake_fd, &value, sizeof(value)) < 0)
+        Logger::log(LOG_IO, LOG_ERROR, "Could not wake the event loop up for socket %d", socket);
+}
+
+void EventLoop::stop()
+{
+    uint64_t value = 1;
+
+    running = false;
+
+    // Wake the loop up, so it notices the stop
+    if (wake_fd >= 0 && write(wake_fd, &value, sizeof(value)) < 0)
+        Logger::log(LOG_IO, LOG_ERROR, "Could not wake the event loop up");
+}
+
+int EventLoop::writeBatch(write_request *requests, int count)
+{
+#ifdef USE_IO_URING
+    io_uring_sqe *entry = NULL;
+    io_uring_cqe *completion = NULL;
+    int calls = 0;  // System calls used
+    int first = 0;  // First request of the current chunk
+    int last = 0;   // One past the last request of the current chunk
+
+    if (backend != LOOP_URING || send_ring == NULL)
+        return -1;
+
+    pthread_mutex_lock(&send_lock);
+
+    while (first < count)
+    {
+        unsigned entries = 0;   // Submission entries in this chunk
+        unsigned completed = 0; // Completions reaped for this chunk
+
+        // As many sockets as the ring fits
+        last = std::min(count, first + LOOP_RING_ENTRIES);
+
+        // One send per socket, nothing is linked: a short send leaves the rest to the caller
+        for (int i = first; i < last; i++)
+        {
+            requests[i].written = 0;
+
+            if ((entry = EventLoop::takeSQE(send_ring)) == NULL)
+            {
+                Logger::log(LOG_IO, LOG_WARN, "Send ring is full, socket %d keeps its bytes for later", requests[i].socket);
+
+                // End the chunk here, the caller keeps this socket's bytes
+                last = i + 1;
+                break;
+            }
+
+            entries++;
+
+            entry->opcode = IORING_OP_SEND;
+            entry->fd = requests[i].socket;
+            entry->addr = (unsigned long)requests[i].part.iov_base;
+            entry->len = requests[i].part.iov_len;
+            entry->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT; // A full socket keeps the rest for later
+            entry->user_data = i;
+        }
+
+        // Submit the whole chunk and wait for it
+        send_ring->submit(entries);
+        calls++;
+
+        while (completed < entries)
+        {
+            if ((completion = send_ring->peekCQE()) == NULL)
+            {
+                send_ring->submit(entries - completed);
+                calls++;
+                continue;
+            }
+
+            write_request *request = &requests[completion->user_data];
+
+            if (completion->res > 0 && request->written >= 0)
+                request->written += completion->res;
+            else if (completion->res < 0 && completion->res != -EAGAIN)
+                request->written = -1;
+
+            send_ring->advanceCQ();
+            completed++;
+        }
+
+        first = last;
+    }
+
+    pthread_mutex_unlock(&send_lock);
+
+    batches++;
+    batched += count;
+
+    return calls;
+#else
+    return -1;
+#endif
+}
+
+void EventLoop::listStats()
+{
+    const char *names[] = {"threads", "epoll", "uring"};
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Backend: " << names[backend] << std::endl;
+    std::cout << "Loop wakeups: " << wakeups << std::endl;
+    std::cout << "Receives: " << receives << std::endl;
+    std::cout << "Accepted connections: " << accepts << std::endl;
+    std::cout << "Packets: " << packets << std::endl;
+    std::cout << "Connections timed out: " << timeouts << std::endl;
+    std::cout << "Batched write submissions: " << batches << std::endl;
+    std::cout << "Sockets written by batches: " << batched << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+void EventLoop::addConnection(int socket)
+{
+    loop_connection *connection = new loop_connection();
+
+    connection->generation = next_generation++ & 0xFFFFFF;
+
+    // A descriptor can only be watched once
+    auto found = connections.find(socket);
+    if (found != connections.end())
+    {
+        delete found->second;
+        connections.erase(found);
+    }
+
+    connections.insert(std::make_pair(socket, connection));
+
+    // Shut the connection down if it stays quiet for USER_TIMEOUT seconds
+    TimerWheel::schedule(socket, USER_TIMEOUT * 1000);
+
+#ifdef USE_IO_URING
+    if (backend == LOOP_URING)
+    {
+        // Without a receive the connection would only end by its timer
+        if (!EventLoop::armReceive(socket, connection->generation))
+            EventLoop::closeConnection(socket);
+        return;
+    }
+#endif
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0)
+        Logger::log(LOG_IO, LOG_ERROR, "Could not watch socket %d: %s", socket, strerror(errno));
+}
+
+void EventLoop::closeConnection(int socket)
+{
+    auto found = connections.find(socket);
+    if (found == connections.end())
+        return;
+
+#ifdef USE_IO_URING
+    if (backend == LOOP_URING)
+    {
+        // Cancel the pending receive, its late completions are told apart by the generation
+        io_uring_sqe *entry = EventLoop::takeSQE(ring);
+        if (entry != NULL)
+        {
+            entry->opcode = IORING_OP_ASYNC_CANCEL;
+            entry->addr = RECEIVE_DATA(socket, found->second->generation);
+            entry->user_data = OP_CANCEL << 56;
+        }
+        else
+            Logger::log(LOG_IO, LOG_WARN, "Submission ring is full, the receive of socket %d is not cancelled", socket);
+    }
+    else
+#endif
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+
+    delete found->second;
+    connections.erase(found);
+
+    // Disarm its timer before the descriptor can be reused
+    if (TimerWheel::cancel(socket))
+        timeouts++;
+
+    // Let the server end the connection
+    on_close(socket);
+}
+
+void EventLoop::takeIncoming()
+{
+    std::vector<int> sockets;
+
+    pthread_mutex_lock(&incoming_lock);
+    sockets.swap(incoming);
+    pthread_mutex_unlock(&incoming_lock);
+
+    for (size_t i = 0; i < sockets.size(); i++)
+        EventLoop::addConnection(sockets[i]);
+}
+
+bool EventLoop::consume(int socket, loop_connection *connection, const char *data, size_t size)
+{
+    alignas(packet) char header_buffer[sizeof(packet)]; // Aligned copy of the packet header
+    packet *header = (packet *)header_buffer;           // Header of the packet being dispatched
+    const char *bytes = data;                           // Bytes being dispatched
+    size_t available = size;                            // Number of bytes left in bytes
+    bool buffered = !connection->input.empty();         // If the bytes come from the connection's input buffer
+
+    TimerWheel::touch(socket);
+
+    // Something was left from the last receive, complete it first
+    if (buffered)
+    {
+        connection->input.insert(connection->input.end(), data, data + size);
+        bytes = connection->input.data();
+        available = connection->input.size();
+    }
+
+    // Dispatch every complete packet
+    while (available >= sizeof(packet))
+    {
+        memcpy((void *)header, bytes, sizeof(packet));
+
+        // A packet that does not fit PACKET_MAX means the stream is broken
+        if (header->length > PACKET_MAX - sizeof(packet))
+            return false;
+
+        if (available < sizeof(packet) + header->length)
+            break;
+
+        // Copy the packet into its own frame
+        Frame frame(header->type, bytes + sizeof(packet), header->length);
+        frame.get()->sqn = header->sqn;
+        frame.get()->timestamp = header->timestamp;
+
+        bytes += sizeof(packet) + header->length;
+        available -= sizeof(packet) + header->length;
+        packets++;
+
+        // Decide if the packet is traced (its receive was shared with others, so it has no span)
+        Tracer::begin();
+
+        if (!on_packet(socket, frame))
+        {
+            Tracer::end();
+            return false;
+        }
+
+        Tracer::end();
+    }
+
+    // Keep whatever is left for the next receive
+    if (buffered)
+        connection->input.erase(connection->input.begin(), connection->input.end() - available);
+    else
+        connection->input.assign(bytes, bytes + available);
+
+    return true;
+}
+
+void EventLoop::acceptConnection(int socket)
+{
+    struct sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+
+    accepts++;
+
+    bzero((void *)&address, sizeof(address));
+    getpeername(socket, (struct sockaddr *)&address, &address_size);
+
+    on_accept(socket, &address);
+
+    // The handler usually wants the socket watched right away
+    EventLoop::takeIncoming();
+}
+
+void EventLoop::runEpoll()
+{
+    struct epoll_event event;              // Event being registered
+    struct epoll_event events[LOOP_EVENTS]; // Events returned by the kernel
+    char buffer[LOOP_BUFFER_SIZE];         // Buffer for received bytes
+    uint64_t wake_value = 0;               // Value read from the wake descriptor
+    int socket = -1;
+    ssize_t received = 0;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        throw std::runtime_error(std::string("Error creating the epoll instance: ") + strerror(errno));
+
+    // Watch the wake descriptor
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+
+    // Watch the listening socket, accepting without blocking
+    if (listen_socket >= 0)
+    {
+        fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK);
+
+        event.events = EPOLLIN;
+        event.data.fd = listen_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &event);
+    }
+
+    while (running)
+    {
+        int count = epoll_wait(epoll_fd, events, LOOP_EVENTS, LOOP_TICK_MS);
+        wakeups++;
+
+        for (int i = 0; i < count && running; i++)
+        {
+            socket = events[i].data.fd;
+
+            if (socket == wake_fd)
+            {
+                if (read(wake_fd, &wake_value, sizeof(wake_value)) > 0)
+                    EventLoop::takeIncoming();
+            }
+            else if (socket == listen_socket)
+            {
+                int new_socket = -1;
+                while ((new_socket = accept4(listen_socket, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+                    EventLoop::acceptConnection(new_socket);
+            }
+            else
+            {
+                auto found = connections.find(socket);
+                if (found == connections.end())
+                    continue;
+
+                // Readiness says this will not block, the socket itself stays blocking for the writers
+                receives++;
+                received = recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+                if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    continue;
+
+                if (received <= 0 || !EventLoop::consume(socket, found->second, buffer, received))
+                    EventLoop::closeConnection(socket);
+            }
+        }
+    }
+}
+
+#ifdef USE_IO_URING
+
+void EventLoop::runUring()
+{
+    io_uring_cqe *completion = NULL;
+    uint64_t wake_value = 0;
+
+    // Arm the long lived operations
+    if (listen_socket >= 0)
+        EventLoop::armAccept();
+    EventLoop::armWake(&wake_value);
+
+    while (running)
+    {
+        // Submit whatever was queued and wait for at least one completion
+        ring->submit(1);
+        wakeups++;
+
+        while (running && (completion = ring->peekCQE()) != NULL)
+        {
+            uint64_t data = completion->user_data;
+            int result = completion->res;
+            unsigned flags = completion->flags;
+
+            ring->advanceCQ();
+
+            switch (data >> 56)
+            {
+            case OP_ACCEPT:
+
+                if (result >= 0)
+                    EventLoop::acceptConnection(result);
+
+                // Multishot accepts may end, arm a new one
+                if (!(flags & IORING_CQE_F_MORE))
+                    EventLoop::armAccept();
+
+                break;
+            case OP_WAKE:
+
+                EventLoop::takeIncoming();
+                EventLoop::armWake(&wake_value);
+
+                break;
+            case OP_RECEIVE:
+            {
+                int socket = data & 0xFFFFFFFF;
+                uint32_t generation = (data >> 32) & 0xFFFFFF;
+                bool keep = true;
+
+                receives++;
+
+                // Completions of a closed connection are only there to give the buffer back
+                auto found = connections.find(socket);
+                bool current = found != connections.end() && found->second->generation == generation;
+
+                if (flags & IORING_CQE_F_BUFFER)
+                {
+                    unsigned buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+                    if (current && result > 0)
+                        keep = EventLoop::consume(socket, found->second, ring->buffer(buffer_id), result);
+
+                    ring->recycleBuffer(buffer_id);
+                }
+
+                if (!current)
+                    break;
+
+                // Out of buffers, the multishot receive ended but the connection is fine
+                if (result == -ENOBUFS)
+                    keep = EventLoop::armReceive(socket, generation);
+                else if (keep && result > 0 && !(flags & IORING_CQE_F_MORE))
+                    keep = EventLoop::armReceive(socket, generation);
+
+                if (!keep || result == 0 || (result < 0 && result != -ENOBUFS))
+                    EventLoop::closeConnection(socket);
+
+                break;
+            }
+            default: // Cancellations
+                break;
+            }
+        }
+    }
+}
+
+io_uring_sqe *EventLoop::takeSQE(IORing *ring)
+{
+    io_uring_sqe *entry = NULL;
+
+    // getSQE already submitted once, give the kernel a few more chances to take the pending entries
+    for (int i = 0; i < LOOP_SQE_RETRIES && (entry = ring->getSQE()) == NULL; i++)
+    {
+        ring->submit();
+        sched_yield();
+    }
+
+    return entry;
+}
+
+bool EventLoop::armAccept()
+{
+    io_uring_sqe *entry = EventLoop::takeSQE(ring);
+
+    if (entry == NULL)
+    {
+        Logger::log(LOG_IO, LOG_ERROR, "Submission ring is full, could not arm the accept");
+        return false;
+    }
+
+    entry->opcode = IORING_OP_ACCEPT;
+    entry->fd = listen_socket;
+    entry->ioprio = IORING_ACCEPT_MULTISHOT;
+    entry->user_data = OP_ACCEPT << 56;
+
+    return true;
+}
+
+bool EventLoop::armReceive(int socket, uint32_t generation)
+{
+    io_uring_sqe *entry = EventLoop::takeSQE(ring);
+
+    if (entry == NULL)
+    {
+        Logger::log(LOG_IO, LOG_ERROR, "Submission ring is full, could not arm the receive of socket %d", socket);
+        return false;
+    }
+
+    entry->opcode = IORING_OP_RECV;
+    entry->fd = socket;
+    entry->ioprio = IORING_RECV_MULTISHOT;
+    entry->flags = IOSQE_BUFFER_SELECT;
+    entry->buf_group = 0;
+    entry->user_data = RECEIVE_DATA(socket, generation);
+
+    return true;
+}
+
+bool EventLoop::armWake(uint64_t *value)
+{
+    io_uring_sqe *entry = EventLoop::takeSQE(ring);
+
+    if (entry == NULL)
+    {
+        Logger::log(LOG_IO, LOG_ERROR, "Submission ring is full, could not arm the wake up read");
+        return false;
+    }
+
+    entry->opcode = IORING_OP_READ;
+    entry->fd = wake_fd;
+    entry->addr = (unsigned long)value;
+    entry->len = sizeof(uint64_t);
+    entry->user_data = OP_WAKE << 56;
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,583 @@
+#include "FailoverBenchmark.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#include <cstdlib>
+
+// Epoll tag of the listen sockets, the other sockets are tagged with their descriptor
+#define LISTEN_TAG 0xFFFFFFFFu
+
+FailoverBenchmark::FailoverBenchmark(int replicas, int clients, int groups, int rate, int duration, int kill_after, int base_port, const std::string &replica_binary)
+{
+    struct rlimit limit;
+    char path[PATH_MAX];
+
+    if (replicas < 2 || clients <= 0 || groups <= 0 || rate <= 0 || duration <= 0)
+        throw std::runtime_error("Invalid benchmark parameters, needs at least 2 replicas and every other value > 0");
+
+    if (kill_after < 0 || kill_after >= duration)
+        throw std::runtime_error("Invalid kill time, must be between 0 and the duration");
+
+    // The replicas run in their own directories, the binary path must not depend on it
+    if (realpath(replica_binary.c_str(), path) == NULL)
+        throw std::runtime_error("Replica executable not found: " + replica_binary);
+
+    this->replica_count = replicas;
+    this->client_count = clients;
+    this->group_count = groups;
+    this->rate = rate;
+    this->duration = duration;
+    this->kill_after = kill_after;
+    this->base_port = base_port;
+    this->replica_binary = path;
+
+    this->clients = new failover_client[clients];
+    this->group_sizes.assign(groups, 0);
+    this->next_sqn.assign(clients, 0);
+    this->run_id = (unsigned long)time(NULL);
+    this->answered = 0;
+    this->kill_time = 0;
+    this->refused = 0;
+
+    for (int i = 0; i < clients; i++)
+    {
+        this->clients[i].socket = -1;
+        this->clients[i].connected = false;
+        this->clients[i].listen_socket = -1;
+        this->clients[i].answered = false;
+        this->clients[i].reconnected = 0;
+        this->clients[i].new_server = 0;
+        this->clients[i].recovered = 0;
+        this->clients[i].duplicates = 0;
+    }
+
+    // Two descriptors per client, plus the ones left by previous leaders
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)clients * 4 + 64)
+    {
+        limit.rlim_cur = std::min(limit.rlim_max, (rlim_t)clients * 4 + 64);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        throw std::runtime_error("Error creating the epoll instance");
+
+    // Dead sockets are noticed through send errors
+    signal(SIGPIPE, SIG_IGN);
+}
+
+FailoverBenchmark::~FailoverBenchmark()
+{
+    this->stopReplicas();
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i].socket > 0)
+            close(clients[i].socket);
+        if (clients[i].listen_socket > 0)
+            close(clients[i].listen_socket);
+        for (size_t j = 0; j < clients[i].retired.size(); j++)
+            close(clients[i].retired[j]);
+    }
+
+    delete[] clients;
+    close(epoll_fd);
+}
+
+void FailoverBenchmark::run()
+{
+    uint64_t interval = 0; // Time (in microseconds) between two posts
+    uint64_t start = 0;    // Time the current phase started
+    long total = 0;        // Messages that will be posted
+    int connected = 0;     // Clients logged in
+
+    // Start the leader first, then the backups that link to it
+    mkdir("failover_replicas", 0755);
+    for (int i = 0; i < replica_count; i++)
+    {
+        this->startReplica(i);
+        sleep(1);
+    }
+
+    // Make sure none of them died on startup
+    for (size_t i = 0; i < replicas.size(); i++)
+    {
+        if (waitpid(replicas[i].pid, NULL, WNOHANG) != 0)
+        {
+            replicas[i].pid = -1;
+            throw std::runtime_error("Replica " + std::to_string(replicas[i].id) + " exited on startup, see failover_replicas/replica_" + std::to_string(replicas[i].id) + "/replica.log");
+        }
+    }
+
+    std::cerr << "Started " << replica_count << " replicas" << std::endl;
+
+    // Drain the client sockets before logging in, the leader answers logins with history and join messages
+    receiving = true;
+    pthread_create(&receiver_thread, NULL, receive, (void *)this);
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (this->login(i))
+            connected++;
+    }
+
+    std::cerr << "Logged in " << connected << " of " << client_count << " clients" << std::endl;
+
+    // Let the join messages (and their replication) settle
+    sleep(1);
+
+    // Post at the configured rate, from every client in turn, killing the leader on the way
+    interval = 1000000 / rate;
+    total = (long)rate * duration;
+    start = FailoverBenchmark::now();
+
+    for (long i = 0; i < total; i++)
+    {
+        uint64_t due = start + i * interval;
+        uint64_t current = FailoverBenchmark::now();
+
+        if (due > current)
+            usleep(due - current);
+
+        // Crash the leader
+        if (kill_time == 0 && FailoverBenchmark::now() - start >= (uint64_t)kill_after * 1000000)
+        {
+            kill(replicas[0].pid, SIGKILL);
+            kill_time = FailoverBenchmark::now();
+            waitpid(replicas[0].pid, NULL, 0);
+            replicas[0].pid = -1;
+
+            std::cerr << "Killed the leader" << std::endl;
+        }
+
+        this->post(i % client_count);
+    }
+
+    // Wait for the clients to recover and the deliveries to arrive (at most 10 seconds)
+    start = FailoverBenchmark::now();
+    while (FailoverBenchmark::now() - start < 10000000)
+    {
+        bool done = true;
+
+        for (int i = 0; i < client_count && done; i++)
+            done = clients[i].recovered > 0 || clients[i].socket < 0;
+
+        if (done)
+            break;
+
+        usleep(10000);
+    }
+    sleep(1);
+
+    // Stop the receiver
+    receiving = false;
+    pthread_join(receiver_thread, NULL);
+}
+
+void FailoverBenchmark::report(std::ostream &output)
+{
+    std::vector<uint64_t> reconnects, new_servers, recoveries;
+    long expected = 0, received = 0, lost = 0, duplicates = 0;
+    int logged_in = 0;
+
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i].socket < 0)
+            continue;
+
+        logged_in++;
+        duplicates += clients[i].duplicates;
+
+        if (kill_time == 0)
+            continue;
+
+        if (clients[i].reconnected > 0)
+            reconnects.push_back(clients[i].reconnected - kill_time);
+        if (clients[i].new_server > 0)
+            new_servers.push_back(clients[i].new_server - kill_time);
+        if (clients[i].recovered > 0)
+            recoveries.push_back(clients[i].recovered - kill_time);
+    }
+
+    // Every member of the group must have received every message posted to it
+    for (size_t i = 0; i < posts.size(); i++)
+    {
+        uint64_t key = ((uint64_t)posts[i].sender << 32) | posts[i].sqn;
+        bool missing = false;
+
+        for (int j = 0; j < client_count; j++)
+        {
+            if (clients[j].group != posts[i].group || clients[j].socket < 0)
+                continue;
+
+            expected++;
+            if (clients[j].seen.count(key))
+                received++;
+            else
+                missing = true;
+        }
+
+        if (missing)
+            lost++;
+    }
+
+    std::sort(reconnects.begin(), reconnects.end());
+    std::sort(new_servers.begin(), new_servers.end());
+    std::sort(recoveries.begin(), recoveries.end());
+
+    // Percentiles (in milliseconds) of a sorted sample
+    auto summary = [](const std::vector<uint64_t> &sorted) -> std::string
+    {
+        return "{\"count\": " + std::to_string(sorted.size()) +
+               ", \"p50\": " + std::to_string(FailoverBenchmark::percentile(sorted, 0.50) / 1000.0) +
+               ", \"p99\": " + std::to_string(FailoverBenchmark::percentile(sorted, 0.99) / 1000.0) +
+               ", \"max\": " + std::to_string(sorted.empty() ? 0 : sorted.back() / 1000.0) + "}";
+    };
+
+    output << "{" << std::endl;
+    output << "  \"replicas\": " << replica_count << "," << std::endl;
+    output << "  \"clients\": " << client_count << "," << std::endl;
+    output << "  \"clients_logged_in\": " << logged_in << "," << std::endl;
+    output << "  \"groups\": " << group_count << "," << std::endl;
+    output << "  \"rate\": " << rate << "," << std::endl;
+    output << "  \"duration_s\": " << duration << "," << std::endl;
+    output << "  \"kill_after_s\": " << kill_after << "," << std::endl;
+    output << "  \"leader_killed\": " << (kill_time > 0 ? "true" : "false") << "," << std::endl;
+    output << "  \"reconnect_ms\": " << summary(reconnects) << "," << std::endl;
+    output << "  \"new_server_ms\": " << summary(new_servers) << "," << std::endl;
+    output << "  \"recovery_ms\": " << summary(recoveries) << "," << std::endl;
+    output << "  \"clients_not_recovered\": " << logged_in - (int)recoveries.size() << "," << std::endl;
+    output << "  \"messages_posted\": " << posts.size() << "," << std::endl;
+    output << "  \"posts_refused\": " << refused << "," << std::endl;
+    output << "  \"messages_lost\": " << lost << "," << std::endl;
+    output << "  \"deliveries_expected\": " << expected << "," << std::endl;
+    output << "  \"deliveries_received\": " << received << "," << std::endl;
+    output << "  \"duplicates\": " << duplicates << std::endl;
+    output << "}" << std::endl;
+}
+
+void FailoverBenchmark::startReplica(int id)
+{
+    failover_replica replica;
+    std::string directory = "failover_replicas/replica_" + std::to_string(id);
+    int input[2];
+
+    replica.id = id;
+    replica.port = base_port - id;
+
+    mkdir(directory.c_str(), 0755);
+    mkdir((directory + "/hist").c_str(), 0755);
+
+    // The harness keeps the replica's standard input, closing it would stop the replica
+    if (pipe(input) < 0)
+        throw std::runtime_error("Error creating the replica input pipe");
+
+    if ((replica.pid = fork()) < 0)
+        throw std::runtime_error("Error starting replica " + std::to_string(id));
+
+    if (replica.pid == 0)
+    {
+        int log = -1;
+
+        if (chdir(directory.c_str()) < 0 || (log = open("replica.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+            _exit(127);
+
+        dup2(input[0], STDIN_FILENO);
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        close(input[0]);
+        close(input[1]);
+        close(log);
+
+        execl(replica_binary.c_str(), "replica", "5", std::to_string(replica.port).c_str(), std::to_string(id).c_str(), "127.0.0.1", std::to_string(base_port).c_str(), "0", (char *)NULL);
+        _exit(127);
+    }
+
+    close(input[0]);
+    replica.input = input[1];
+    fcntl(replica.input, F_SETFD, FD_CLOEXEC);
+
+    replicas.push_back(replica);
+}
+
+void FailoverBenchmark::stopReplicas()
+{
+    const char stop[] = "stop\n";
+
+    for (size_t i = 0; i < replicas.size(); i++)
+    {
+        if (replicas[i].pid > 0 && write(replicas[i].input, stop, strlen(stop)) < 0)
+            kill(replicas[i].pid, SIGKILL);
+
+        close(replicas[i].input);
+        replicas[i].input = -1;
+    }
+
+    // Give them 3 seconds to stop on their own
+    uint64_t start = FailoverBenchmark::now();
+    for (size_t i = 0; i < replicas.size(); i++)
+    {
+        while (replicas[i].pid > 0 && waitpid(replicas[i].pid, NULL, WNOHANG) == 0)
+        {
+            if (FailoverBenchmark::now() - start > 3000000)
+            {
+                kill(replicas[i].pid, SIGKILL);
+                waitpid(replicas[i].pid, NULL, 0);
+            }
+            else
+                usleep(10000);
+        }
+
+        replicas[i].pid = -1;
+    }
+
+    replicas.clear();
+}
+
+bool FailoverBenchmark::login(int index)
+{
+    struct sockaddr_in address;
+    struct epoll_event event;
+    socklen_t address_size = sizeof(address);
+    failover_client &client = clients[index];
+    char username[24], groupname[24];
+    int yes = 1;
+    int socket_fd = -1;
+
+    client.group = index % group_count;
+    snprintf(username, sizeof(username), "failover%05d", index);
+    snprintf(groupname, sizeof(groupname), "fogroup%03d", client.group);
+
+    // Listen socket for the new leader, on any free port
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = 0;
+
+    if ((client.listen_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(client.listen_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0 ||
+        bind(client.listen_socket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(client.listen_socket, 4) < 0 ||
+        getsockname(client.listen_socket, (struct sockaddr *)&address, &address_size) < 0)
+        return false;
+
+    client.listen_port = ntohs(address.sin_port);
+
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)LISTEN_TAG << 32) | index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client.listen_socket, &event);
+
+    // Connect to the leader
+    address.sin_family = AF_INET;
+    address.sin_port = htons(base_port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return false;
+
+        if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            break;
+
+        close(socket_fd);
+        socket_fd = -1;
+        usleep(10000);
+    }
+
+    if (socket_fd < 0)
+        return false;
+
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)socket_fd << 32) | index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event);
+
+    client.socket = socket_fd;
+    client.connected = true;
+
+    // Login packet: username, the group as the message and the port a new leader connects to
+    int answers = answered;
+    MessageBuffer login_message(username, std::string(groupname), LOGIN_MESSAGE, PAK_COMMAND, client.listen_port);
+    if (send(socket_fd, (void *)login_message.get(), login_message.size(), MSG_NOSIGNAL) < 0)
+    {
+        client.connected = false;
+        return false;
+    }
+
+    group_sizes[client.group]++;
+
+    // Wait for the leader to answer before the next login
+    uint64_t start = FailoverBenchmark::now();
+    while (answered == answers && FailoverBenchmark::now() - start < 2000000)
+        usleep(100);
+
+    return true;
+}
+
+void FailoverBenchmark::post(int index)
+{
+    failover_client &client = clients[index];
+    char text[MESSAGE_MAX];
+    failover_post posted;
+
+    if (client.socket < 0 || !client.connected)
+    {
+        refused++;
+        return;
+    }
+
+    posted.sender = index;
+    posted.sqn = next_sqn[index]++;
+    posted.group = client.group;
+
+    // The text identifies the run, the sender and the message, and carries the send time
+    snprintf(text, sizeof(text), FAILOVER_PREFIX "%lu %d %u %lu", run_id, index, posted.sqn, (unsigned long)FailoverBenchmark::now());
+    MessageBuffer message("failover", std::string(text), USER_MESSAGE);
+
+    if (send(client.socket, (void *)message.get(), message.size(), MSG_NOSIGNAL) < 0)
+    {
+        refused++;
+        return;
+    }
+
+    posts.push_back(posted);
+}
+
+void *FailoverBenchmark::receive(void *arg)
+{
+    FailoverBenchmark *harness = (FailoverBenchmark *)arg;
+    struct epoll_event events[256];
+    char buffer[65536];
+
+    while (harness->receiving)
+    {
+        int count = epoll_wait(harness->epoll_fd, events, 256, 100);
+
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t tag = events[i].data.u64 >> 32;
+            int index = events[i].data.u64 & 0xFFFFFFFF;
+            failover_client &client = harness->clients[index];
+
+            // A new leader connecting
+            if (tag == LISTEN_TAG)
+            {
+                harness->acceptLeader(index);
+                continue;
+            }
+
+            ssize_t received = recv(tag, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+            if (received > 0)
+            {
+                // Leftovers of a previous leader are not part of the new stream
+                if ((int)tag == client.socket)
+                    harness->consume(client, index, buffer, received);
+            }
+            else if (received == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                epoll_ctl(harness->epoll_fd, EPOLL_CTL_DEL, tag, NULL);
+                if ((int)tag == client.socket)
+                    client.connected = false;
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+void FailoverBenchmark::acceptLeader(int index)
+{
+    failover_client &client = clients[index];
+    struct epoll_event event;
+    int leader_socket = -1;
+
+    if ((leader_socket = accept(client.listen_socket, NULL, NULL)) < 0)
+        return;
+
+    // The previous connection is kept open until the end, the main thread may still be sending through it
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client.socket, NULL);
+    client.retired.push_back(client.socket);
+    client.input.clear();
+
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)leader_socket << 32) | index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, leader_socket, &event);
+
+    client.socket = leader_socket;
+    client.connected = true;
+
+    if (client.reconnected == 0)
+        client.reconnected = FailoverBenchmark::now();
+}
+
+void FailoverBenchmark::consume(failover_client &client, int index, const char *data, size_t size)
+{
+    alignas(packet) char header_buffer[sizeof(packet)];                 // Aligned copy of the packet header
+    alignas(message_record) char record_buffer[sizeof(message_record)]; // Aligned copy of the message record header
+    packet *header = (packet *)header_buffer;
+    message_record *record = (message_record *)record_buffer;
+    size_t offset = 0;
+
+    client.input.insert(client.input.end(), data, data + size);
+
+    if (!client.answered)
+    {
+        client.answered = true;
+        answered++;
+    }
+
+    while (client.input.size() - offset >= sizeof(packet))
+    {
+        memcpy((void *)header, client.input.data() + offset, sizeof(packet));
+        if (client.input.size() - offset < sizeof(packet) + header->length)
+            break;
+
+        const char *payload = client.input.data() + offset + sizeof(packet);
+
+        if (header->type == PAK_NEW_SERVER && client.new_server == 0)
+            client.new_server = FailoverBenchmark::now();
+
+        // Only messages posted by the harness in this run are counted
+        if (header->type == PAK_DATA && header->length > sizeof(message_record))
+        {
+            memcpy((void *)record, payload, sizeof(message_record));
+            std::string text(payload + sizeof(message_record), header->length - sizeof(message_record));
+            unsigned long run = 0, sent = 0;
+            int sender = -1;
+            unsigned sqn = 0;
+
+            if (record->type == USER_MESSAGE &&
+                sscanf(text.c_str(), FAILOVER_PREFIX "%lu %d %u %lu", &run, &sender, &sqn, &sent) == 4 &&
+                run == run_id && sender >= 0 && sender < client_count)
+            {
+                uint64_t key = ((uint64_t)sender << 32) | sqn;
+
+                if (!client.seen.insert(key).second)
+                    client.duplicates++;
+
+                // Its own message, posted after the crash, came back: the client can post again
+                if (sender == index && client.recovered == 0 && kill_time > 0 && sent > kill_time)
+                    client.recovered = FailoverBenchmark::now();
+            }
+        }
+
+        offset += sizeof(packet) + header->length;
+    }
+
+    client.input.erase(client.input.begin(), client.input.begin() + offset);
+}
+
+uint64_t FailoverBenchmark::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t FailoverBenchmark::percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min(sorted.size() - 1, (size_t)std::ceil(p * sorted.size()) - 1)];
+}
@@ -0,0 +1,104 @@
+#include "Frame.h"
+
+// FRAME
+
+thread_local long Frame::copies = 0;
+
+Frame::Frame()
+{
+}
+
+Frame::Frame(int packet_type, int payload_size)
+{
+    // Allocate header and payload in a single zeroed block
+    data = PoolHandle<packet>::allocate(sizeof(packet) + payload_size);
+
+    // Fill header
+    data->type = packet_type;                                                                 // Packet type
+    data->sqn = 1;                                                                            // Unused by the protocol, receivers never read it
+    data->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); // Current timestamp
+    data->length = payload_size;                                                              // Payload size
+}
+
+Frame::Frame(int packet_type, const char *payload, int payload_size) : Frame(packet_type, payload_size)
+{
+    // Copy payload into the packet
+    memcpy(this->payload(), payload, payload_size);
+    copies++;
+}
+
+packet *Frame::get() const
+{
+    return data.get();
+}
+
+char *Frame::payload() const
+{
+    return (char *)data->_payload;
+}
+
+int Frame::size() const
+{
+    return sizeof(packet) + data->length;
+}
+
+void Frame::setType(int packet_type)
+{
+    data->type = packet_type;
+}
+
+void Frame::setLength(int payload_size)
+{
+    if (payload_size <= data->length)
+        data->length = payload_size;
+}
+
+Frame::operator bool() const
+{
+    return (bool)data;
+}
+
+long Frame::copiedByThread()
+{
+    return copies;
+}
+
+// MESSAGE BUFFER
+
+MessageBuffer::MessageBuffer()
+{
+}
+
+MessageBuffer::MessageBuffer(Frame &&frame) : Frame(std::move(frame))
+{
+}
+
+MessageBuffer::MessageBuffer(const std::string &sender_name, const std::string &message_content, int message_type, int packet_type, int port)
+    : MessageBuffer(sender_name, message_content.c_str(), message_content.length(), message_type, packet_type, port)
+{
+}
+
+MessageBuffer::MessageBuffer(const std::string &sender_name, const char *message_content, int content_length, int message_type, int packet_type, int port)
+    : Frame(packet_type, sizeof(message_record) + content_length + 1)
+{
+    message_record *msg = this->record();
+
+    // Compose the record in place
+    strncpy(msg->username, sender_name.c_str(), sizeof(msg->username) - 1);                  // Copy sender name
+    msg->port = port;                                                                        // Reconnect port
+    msg->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()); // Current timestamp
+    msg->type = message_type;                                                                // Update message type
+    msg->length = content_length + 1;                                                        // Update message length
+    memcpy((char *)msg->_message, message_content, content_length);                          // Copy message (already NUL terminated by the zeroed block)
+    copies++;
+}
+
+message_record *MessageBuffer::record() const
+{
+    return (message_record *)this->payload();
+}
+
+int MessageBuffer::recordSize() const
+{
+    return sizeof(message_record) + this->record()->length;
+}
@@ -1,37 +1,24 @@
 #include "Group.h"
 
 std::map<std::string, Group *> Group::active_groups;
-RW_Monitor Group::active_groups_monitor;
+RW_Monitor Group::active_groups_monitor("Group::active_groups_monitor");
 
-Group::Group(std::string groupname)
-{
-    long message_count; // Counter for how many messages are in the group history file
+Histogram *Group::fanout_size = Metrics::histogram("group_fanout_size", "Members each posted message was delivered to");
+Histogram *Group::history_read_time = Metrics::histogram("history_read_us", "Time (in microseconds) taken to read a group's history");
+Histogram *Group::search_time = Metrics::histogram("history_search_us", "Time (in microseconds) taken to search a group's history");
 
+Group::Group(std::string groupname) : users_monitor("Group::users_monitor")
+{
     // Update groupname
     this->groupname = groupname;
+    this->node = Affinity::currentNode();
 
-    // Name of the group's history file
-    std::string history_filename = groupname.append(".hist");
-
-    // Request write rights
-    history_file_monitor.requestWrite();
-
-    // Check if it already existed
-    if ((this->history_file = fopen((HIST_PATH + history_filename).c_str(), "rb+")) == NULL)
-    {
-        // If not, create it
-        this->history_file = fopen((HIST_PATH + history_filename).c_str(), "wb+");
-
-        // And add the header into it
-        message_count = 0;
-        fwrite(&message_count, sizeof(long), 1, this->history_file);
-    }
-
-    // Flush file
-    fflush(this->history_file);
+    // Register this group's metrics
+    this->messages_in = Metrics::counter("group_messages_in_total", "group", groupname, "Messages posted to each group");
+    this->messages_out = Metrics::counter("group_messages_out_total", "group", groupname, "Messages delivered to the members of each group");
 
-    // Release write rights
-    history_file_monitor.releaseWrite();
+    // Open (or share) the group's history log
+    this->history = HistoryLog::open(groupname);
 
     // Add itself to group list
     Group::addGroup(this);
@@ -39,14 +26,18 @@ Group::Group(std::string groupname)
 
 Group::~Group()
 {
-    // Request write rights
-    history_file_monitor.releaseWrite();
+    // Let go of the group history log
+    HistoryLog::close(this->history);
+}
 
-    // Close group history file
-    fclose(this->history_file);
+void *Group::operator new(size_t size)
+{
+    return Affinity::allocate(size);
+}
 
-    // Release write rights
-    history_file_monitor.releaseWrite();
+void Group::operator delete(void *group)
+{
+    Affinity::release(group);
 }
 
 Group *Group::getGroup(std::string groupname)
@@ -216,12 +207,25 @@ int Group::getUserCount()
     return user_count;
 }
 
-int Group::post(std::string message, std::string username, int message_type)
+int Group::post(const std::string &message, const std::string &username, int message_type)
+{
+    // Compose the message once, for every member
+    MessageBuffer composed(username, message, message_type);
+
+    // Post it
+    return this->post(composed);
+}
+
+int Group::post(const MessageBuffer &message)
 {
     int sent_messages = 0; // Number of messages that were sent
+    TraceSpan span("Group::post");
+
+    // Count whether the poster runs on the group's node
+    Affinity::access(this->node);
 
     // Save this message
-    this->saveMessage(message, username, message_type);
+    this->saveMessage(message.record());
 
     // Request read rights
     users_monitor.requestRead();
@@ -230,117 +234,68 @@ int Group::post(std::string message, std::string username, int message_type)
     for (std::map<std::string, User *>::iterator i = users.begin(); i != users.end(); ++i)
     {
         // Signal each user instance in the group that a new message was posted
-        sent_messages += i->second->signalNewMessage(message, username, this->groupname, PAK_DATA, message_type);
+        sent_messages += i->second->signalNewMessage(message, this->groupname);
     }
 
     // Release read rights
     users_monitor.releaseRead();
 
+    messages_in->add();
+    messages_out->add(sent_messages);
+    fanout_size->record(sent_messages);
+
     // Return the amount of messages that were issued
     return sent_messages;
 }
 
-void Group::saveMessage(std::string message, std::string username, int message_type)
+bool Group::saveMessage(const message_record *message)
 {
-    int record_size = -1;    // Size of the message that will be sent
-    long message_count = -1; // Number of messages already present in the file
-
-    // Compose the message
-    message_record *msg = CommunicationUtils::composeMessage(username, message, message_type);
+    TraceSpan span("Group::saveMessage");
 
-    // Calculate message size
-    record_size = sizeof(*msg) + msg->length;
-
-    // Request writing rights
-    history_file_monitor.requestWrite();
-
-    // Write message at the end of group history file
-    fseek(this->history_file, 0, SEEK_END);
-    fwrite(msg, record_size, 1, this->history_file);
-
-    // Update file header to increase message count
-    fseek(this->history_file, 0, SEEK_SET);
-    fread(&message_count, sizeof(long), 1, history_file);
-    message_count++;
-    fseek(this->history_file, 0, SEEK_SET);
-    fwrite(&message_count, sizeof(long), 1, history_file);
-
-    // Move pointer back to the end of the file
-    fseek(this->history_file, 0, SEEK_END);
-
-    // Update file
-    fflush(this->history_file);
-
-    // Release writing rights
-    history_file_monitor.releaseWrite();
-
-    // Free memory used for message record
-    free(msg);
+    // Append the message to the group history
+    return this->history->append(message);
 }
 
-int Group::recoverHistory(char *message_record_list, int n, User *user)
+int Group::readHistory(HistoryLog *history, const history_request &request, char *message_record_list, int n, uint64_t *first, uint64_t *end)
 {
-    char header_buffer[PACKET_MAX];  // Buffer for message headers that will be read
-    char message_buffer[PACKET_MAX]; // Buffer for messages that will be read
-    long total_messages = 0;         // Total number of messages in the file
-    long current_message = 0;        // Currently indexed message in the file
-    int read_messages = 0;           // Number of messages that were read and sent to user
-    int offset = 0;                  // Number of bytes needed to shift after the insert of a message into the message_record_list
-
-    // Request reading rights
-    history_file_monitor.requestRead();
+    int read_messages = 0;           // Number of messages read
+    uint64_t start = Metrics::now(); // Time the read started
+    uint64_t oldest, cursor;         // Oldest message kept, and the cursor as a sequence number
 
-    // Open history file for reading
-    FILE *hist = fopen((HIST_PATH + std::string(this->groupname + ".hist")).c_str(), "rb");
+    history->bounds(&oldest, end);
 
-    // Get total message count
-    fread(&total_messages, sizeof(long), 1, hist);
+    // A time cursor points at the first message sent at or after it
+    cursor = request.by == HISTORY_BY_TIME ? history->sequenceAt(request.cursor) : std::min(request.cursor, *end);
 
-    // Iterate through history file reading headers
-    while (current_message < total_messages && fread(header_buffer, sizeof(message_record), 1, hist) > 0)
+    if (request.direction == HISTORY_OLDER)
     {
-        // If the message is in the last N
-        if (current_message >= total_messages - n)
-        {
-
-            // Read the associated message
-            fread(message_buffer, ((message_record *)header_buffer)->length, 1, hist);
-
-            // Copy the message header into the buffer
-            memcpy(message_record_list + offset, header_buffer, sizeof(message_record));
-
-            // Update the offset
-            offset += sizeof(message_record);
-
-            // Copy the message payload into the buffer
-            memcpy(message_record_list + offset, message_buffer, ((message_record *)header_buffer)->length);
-
-            // Update the offset
-            offset += ((message_record *)header_buffer)->length;
+        // The n messages right before the cursor, or fewer if the history starts later
+        uint64_t from = std::max(cursor > (uint64_t)n ? cursor - n : 0, oldest);
+        *first = from;
+        if (cursor > from)
+            read_messages = history->readRange(from, message_record_list, cursor - from, first);
+    }
+    else
+    {
+        *first = cursor;
+        read_messages = history->readRange(cursor, message_record_list, n, first);
+    }
 
-            // Increase read message counter
-            read_messages++;
-        }
-        else
-        {
-            // If not, only jump to the next message
-            fseek(hist, ((message_record *)header_buffer)->length, SEEK_CUR);
-        }
+    history_read_time->record(Metrics::now() - start);
 
-        // Increase current message
-        current_message++;
+    // Return read messages
+    return read_messages;
+}
 
-        // Reset buffers for reading new messages
-        bzero((void *)header_buffer, PACKET_MAX);
-        bzero((void *)message_buffer, PACKET_MAX);
-    }
+int Group::search(HistoryLog *history, const std::string &query, char *message_record_list, int n)
+{
+    int found_messages = 0;          // Number of messages found
+    uint64_t start = Metrics::now(); // Time the search started
 
-    // Close file that was opened for reading
-    fclose(hist);
+    // Match the query against the segment indexes, newest first
+    found_messages = history->search(query, message_record_list, n);
 
-    // Release reading rights
-    history_file_monitor.releaseRead();
+    search_time->record(Metrics::now() - start);
 
-    // Return read messages
-    return read_messages;
+    return found_messages;
 }
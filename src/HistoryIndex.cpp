@@ -0,0 +1,381 @@
+#include "HistoryIndex.h"
+
+HistoryIndex::HistoryIndex() : mapped(NULL), mapped_size(0), header(NULL), mapped_blocks(NULL), mapped_offsets(NULL), dictionary(NULL), names(NULL), postings(NULL), postings_bytes(0)
+{
+}
+
+HistoryIndex::~HistoryIndex()
+{
+    if (mapped != NULL)
+        munmap((void *)mapped, mapped_size);
+}
+
+HistoryIndex *HistoryIndex::load(const std::string &path, uint64_t segment_bytes)
+{
+    struct stat file_stat;
+
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return NULL;
+
+    if (fstat(file, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(index_header))
+    {
+        ::close(file);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    HistoryIndex *index = new HistoryIndex();
+    index->mapped = (const char *)mapping;
+    index->mapped_size = file_stat.st_size;
+    index->header = (const index_header *)mapping;
+
+    // Every section must fit in the file
+    const index_header *header = index->header;
+    size_t names_start = sizeof(index_header) + (size_t)header->blocks * sizeof(index_block) + (size_t)header->records * sizeof(uint32_t) + (size_t)header->terms * sizeof(index_term);
+    if (memcmp(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic)) != 0 || names_start + header->names_bytes > index->mapped_size ||
+        header->blocks != (header->records + HISTORY_TIME_BLOCK - 1) / HISTORY_TIME_BLOCK)
+    {
+        delete index;
+        return NULL;
+    }
+
+    index->mapped_blocks = (const index_block *)(index->mapped + sizeof(index_header));
+    index->mapped_offsets = (const uint32_t *)(index->mapped_blocks + header->blocks);
+    index->dictionary = (const index_term *)(index->mapped_offsets + header->records);
+    index->names = index->mapped + names_start;
+    index->postings = index->names + header->names_bytes;
+    index->postings_bytes = index->mapped_size - names_start - header->names_bytes;
+
+    // Left over from a segment that was since rewritten (its index has no version of its own)
+    if (header->records > 0 && index->mapped_offsets[header->records - 1] >= segment_bytes)
+    {
+        delete index;
+        return NULL;
+    }
+
+    return index;
+}
+
+void HistoryIndex::tokenize(const message_record *record, std::vector<std::string> &terms)
+{
+    char day[16];        // UTC day the message was sent
+    time_t sent = record->timestamp;
+    struct tm calendar;
+
+    HistoryIndex::splitWords(record->_message, strnlen(record->_message, record->length), terms);
+
+    // Sender
+    std::string username(record->username, strnlen(record->username, sizeof(record->username)));
+    std::transform(username.begin(), username.end(), username.begin(), ::tolower);
+    terms.push_back("from:" + username);
+
+    // Day
+    gmtime_r(&sent, &calendar);
+    strftime(day, sizeof(day), "on:%Y-%m-%d", &calendar);
+    terms.push_back(day);
+
+    // Each term once per message, so posting lists never repeat a position
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+}
+
+void HistoryIndex::parseQuery(const std::string &query, std::vector<std::string> &terms)
+{
+    size_t start = 0;
+
+    while (start < query.size())
+    {
+        size_t end = query.find(' ', start);
+        if (end == std::string::npos)
+            end = query.size();
+
+        std::string word = query.substr(start, end - start);
+        std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+
+        // Sender and day filters are terms as they are
+        if (word.compare(0, 5, "from:") == 0 || word.compare(0, 3, "on:") == 0)
+            terms.push_back(word.substr(0, HISTORY_TERM_MAX + 5));
+        else
+            HistoryIndex::splitWords(word.c_str(), word.size(), terms);
+
+        start = end + 1;
+    }
+
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+}
+
+void HistoryIndex::add(uint32_t offset, uint64_t timestamp, const std::vector<std::string> &terms)
+{
+    uint32_t position = offsets.size();
+
+    offsets.push_back(offset);
+
+    // A new block starts from the newest timestamp so far, so blocks stay sorted by it
+    if (position % HISTORY_TIME_BLOCK == 0)
+    {
+        index_block block = {timestamp, blocks.empty() ? timestamp : std::max(timestamp, blocks.back().newest)};
+        blocks.push_back(block);
+    }
+    else
+    {
+        blocks.back().oldest = std::min(blocks.back().oldest, timestamp);
+        blocks.back().newest = std::max(blocks.back().newest, timestamp);
+    }
+
+    for (auto i = terms.begin(); i != terms.end(); ++i)
+    {
+        posting_list &list = this->terms[*i];
+
+        // Delta from the previous position, 7 bits per byte
+        uint32_t delta = list.count == 0 ? position : position - list.last;
+        while (delta >= 0x80)
+        {
+            list.encoded.push_back((char)(delta | 0x80));
+            delta >>= 7;
+        }
+        list.encoded.push_back((char)delta);
+
+        list.last = position;
+        list.count++;
+    }
+}
+
+bool HistoryIndex::write(const std::string &path)
+{
+    std::vector<const std::pair<const std::string, posting_list> *> sorted; // Terms, in name order
+    std::vector<index_term> entries;
+    index_header file_header;
+    uint32_t names_bytes = 0, postings_bytes = 0;
+
+    for (auto i = terms.begin(); i != terms.end(); ++i)
+        sorted.push_back(&*i);
+
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<const std::string, posting_list> *a, const std::pair<const std::string, posting_list> *b) { return a->first < b->first; });
+
+    for (auto i = sorted.begin(); i != sorted.end(); ++i)
+    {
+        index_term entry = {names_bytes, (uint32_t)(*i)->first.size(), postings_bytes, (*i)->second.count};
+        entries.push_back(entry);
+
+        names_bytes += (*i)->first.size();
+        postings_bytes += (*i)->second.encoded.size();
+    }
+
+    memcpy(file_header.magic, HISTORY_INDEX_MAGIC, sizeof(file_header.magic));
+    file_header.records = offsets.size();
+    file_header.terms = entries.size();
+    file_header.names_bytes = names_bytes;
+    file_header.blocks = blocks.size();
+    file_header.reserved = 0;
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == NULL)
+        return false;
+
+    fwrite(&file_header, sizeof(index_header), 1, file);
+    fwrite(blocks.data(), sizeof(index_block), blocks.size(), file);
+    fwrite(offsets.data(), sizeof(uint32_t), offsets.size(), file);
+    fwrite(entries.data(), sizeof(index_term), entries.size(), file);
+    for (auto i = sorted.begin(); i != sorted.end(); ++i)
+        fwrite((*i)->first.data(), 1, (*i)->first.size(), file);
+    for (auto i = sorted.begin(); i != sorted.end(); ++i)
+        fwrite((*i)->second.encoded.data(), 1, (*i)->second.encoded.size(), file);
+
+    bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+
+    // The index replaces the old one whole, or not at all
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool HistoryIndex::inMemory()
+{
+    return mapped == NULL;
+}
+
+uint32_t HistoryIndex::count()
+{
+    return mapped != NULL ? header->records : offsets.size();
+}
+
+uint32_t HistoryIndex::offsetOf(uint32_t position)
+{
+    return mapped != NULL ? mapped_offsets[position] : offsets[position];
+}
+
+uint32_t HistoryIndex::seek(uint64_t timestamp, bool *exact)
+{
+    const index_block *first = mapped != NULL ? mapped_blocks : blocks.data();
+    const index_block *last = first + (mapped != NULL ? header->blocks : blocks.size());
+
+    // First block whose newest timestamp is not older than the time
+    const index_block *found = std::partition_point(first, last, [timestamp](const index_block &block) { return block.newest < timestamp; });
+    if (found == last)
+    {
+        *exact = true;
+        return this->count();
+    }
+
+    // If even its oldest message is not older, the block starts right at the time
+    *exact = found->oldest >= timestamp;
+
+    return (found - first) * HISTORY_TIME_BLOCK;
+}
+
+void HistoryIndex::match(const std::vector<std::string> &terms, std::vector<uint32_t> &positions)
+{
+    std::vector<std::string> ordered(terms); // Terms, rarest first
+    std::vector<uint32_t> other, both;
+
+    positions.clear();
+    if (ordered.empty())
+        return;
+
+    // Intersecting from the rarest term keeps every step as small as the rarest list
+    for (auto i = ordered.begin(); i != ordered.end(); ++i)
+        if (this->frequency(*i) == 0)
+            return;
+
+    std::sort(ordered.begin(), ordered.end(), [this](const std::string &a, const std::string &b) { return this->frequency(a) < this->frequency(b); });
+
+    this->lookup(ordered[0], positions);
+
+    for (size_t i = 1; i < ordered.size() && !positions.empty(); i++)
+    {
+        other.clear();
+        both.clear();
+
+        this->lookup(ordered[i], other);
+        std::set_intersection(positions.begin(), positions.end(), other.begin(), other.end(), std::back_inserter(both));
+        positions.swap(both);
+    }
+}
+
+bool HistoryIndex::lookup(const std::string &term, std::vector<uint32_t> &positions)
+{
+    if (mapped == NULL)
+    {
+        auto found = terms.find(term);
+        if (found == terms.end())
+            return false;
+
+        HistoryIndex::decode(found->second.encoded.data(), found->second.encoded.size(), found->second.count, positions);
+        return true;
+    }
+
+    const index_term *entry = this->find(term);
+    if (entry == NULL)
+        return false;
+
+    // A list ends where the next one starts
+    size_t end = (entry + 1 < dictionary + header->terms) ? (entry + 1)->postings : postings_bytes;
+    if (entry->postings > end || end > postings_bytes)
+        return false;
+
+    HistoryIndex::decode(postings + entry->postings, end - entry->postings, entry->count, positions);
+    return true;
+}
+
+uint32_t HistoryIndex::frequency(const std::string &term)
+{
+    if (mapped == NULL)
+    {
+        auto found = terms.find(term);
+        return found == terms.end() ? 0 : found->second.count;
+    }
+
+    const index_term *entry = this->find(term);
+    return entry == NULL ? 0 : entry->count;
+}
+
+const index_term *HistoryIndex::find(const std::string &term)
+{
+    size_t low = 0, high = header->terms;
+
+    // Binary search over the sorted dictionary
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        const index_term *entry = &dictionary[middle];
+
+        if ((size_t)entry->name + entry->name_length > header->names_bytes)
+            return NULL;
+
+        int order = term.compare(0, std::string::npos, names + entry->name, entry->name_length);
+        if (order == 0)
+            return entry;
+        else if (order < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+
+    return NULL;
+}
+
+void HistoryIndex::decode(const char *encoded, size_t length, uint32_t count, std::vector<uint32_t> &positions)
+{
+    uint32_t position = 0;
+    size_t i = 0;
+
+    positions.reserve(positions.size() + count);
+
+    for (uint32_t decoded = 0; decoded < count && i < length; decoded++)
+    {
+        uint32_t delta = 0;
+        int shift = 0;
+
+        while (i < length && (encoded[i] & 0x80) && shift < 28)
+        {
+            delta |= (uint32_t)(encoded[i++] & 0x7F) << shift;
+            shift += 7;
+        }
+
+        if (i == length)
+            break;
+
+        delta |= (uint32_t)(encoded[i++] & 0x7F) << shift;
+
+        position = decoded == 0 ? delta : position + delta;
+        positions.push_back(position);
+    }
+}
+
+void HistoryIndex::splitWords(const char *text, size_t length, std::vector<std::string> &terms)
+{
+    size_t start = 0;
+
+    while (start < length)
+    {
+        // Letters, digits and every byte of multi-byte characters make words
+        while (start < length && !isalnum((unsigned char)text[start]) && (unsigned char)text[start] < 0x80)
+            start++;
+
+        size_t end = start;
+        while (end < length && (isalnum((unsigned char)text[end]) || (unsigned char)text[end] >= 0x80))
+            end++;
+
+        if (end > start)
+        {
+            std::string word(text + start, std::min<size_t>(end - start, HISTORY_TERM_MAX));
+            std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+            terms.push_back(word);
+        }
+
+        start = end;
+    }
+}
@@ -0,0 +1,1094 @@
+#include "HistoryLog.h"
+
+#include <stdio_ext.h>
+#include <algorithm>
+#include <cinttypes>
+
+std::map<std::string, HistoryLog *> HistoryLog::open_logs;
+pthread_mutex_t HistoryLog::logs_lock = PTHREAD_MUTEX_INITIALIZER;
+retention_policy HistoryLog::retention = {0, 0, 0};
+
+pthread_t HistoryLog::maintenance_thread;
+std::atomic<bool> HistoryLog::running(false);
+
+Counter *HistoryLog::segments_sealed = Metrics::counter("history_segments_sealed_total", "History segments sealed, full or old");
+Counter *HistoryLog::segments_deleted = Metrics::counter("history_segments_deleted_total", "History segments deleted by the retention policy");
+Counter *HistoryLog::segments_merged = Metrics::counter("history_segments_merged_total", "Small history segments merged into others");
+Counter *HistoryLog::torn_records = Metrics::counter("history_torn_records_total", "Damaged history records, cut off the end of the active segment or found when reading");
+
+void HistoryLog::configure(const retention_policy &policy)
+{
+    retention = policy;
+}
+
+void HistoryLog::start()
+{
+    if (running)
+        return;
+
+    running = true;
+    pthread_create(&maintenance_thread, NULL, maintain, NULL);
+}
+
+void HistoryLog::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    pthread_join(maintenance_thread, NULL);
+}
+
+HistoryLog *HistoryLog::open(const std::string &groupname)
+{
+    HistoryLog *log = NULL;
+
+    pthread_mutex_lock(&logs_lock);
+
+    auto found = open_logs.find(groupname);
+    if (found != open_logs.end())
+        log = found->second;
+    else
+    {
+        log = new HistoryLog(groupname);
+        open_logs.insert(std::make_pair(groupname, log));
+    }
+
+    log->references++;
+
+    pthread_mutex_unlock(&logs_lock);
+
+    return log;
+}
+
+void HistoryLog::close(HistoryLog *log)
+{
+    pthread_mutex_lock(&logs_lock);
+
+    if (--log->references == 0)
+    {
+        open_logs.erase(log->name);
+        delete log;
+    }
+
+    pthread_mutex_unlock(&logs_lock);
+}
+
+HistoryLog::HistoryLog(const std::string &groupname) : name(groupname), directory(HIST_PATH + groupname + "/"), references(0), next_id(0), format(HISTORY_FORMAT), active(NULL), monitor("HistoryLog::monitor")
+{
+    pthread_mutex_init(&index_lock, NULL);
+
+    std::string legacy = HIST_PATH + groupname + ".hist"; // Single-file history of older versions
+
+    mkdir(directory.c_str(), 0755);
+
+    // A new log starts with an empty active segment
+    if (!this->readManifest())
+    {
+        history_segment first = {0, 0, 0, 0, (uint64_t)time(NULL), 0};
+        segments.push_back(first);
+        next_id = 1;
+
+        this->writeManifest();
+    }
+    else if (format < HISTORY_FORMAT)
+        this->convertSegments();
+
+    this->removeOrphans();
+    this->recoverActive();
+
+    if ((active = fopen(this->segmentPath(segments.back().id).c_str(), "ab")) == NULL)
+        Logger::log(LOG_MAIN, LOG_ERROR, "Could not open the history of group %s", groupname.c_str());
+
+    // Bring an old single-file history over, once
+    if (active != NULL && access(legacy.c_str(), F_OK) == 0)
+        this->migrate(legacy);
+}
+
+HistoryLog::~HistoryLog()
+{
+    if (active != NULL)
+        fclose(active);
+
+    for (auto i = indexes.begin(); i != indexes.end(); ++i)
+        delete i->second;
+
+    pthread_mutex_destroy(&index_lock);
+}
+
+void *HistoryLog::operator new(size_t size)
+{
+    return Affinity::allocate(size);
+}
+
+void HistoryLog::operator delete(void *log)
+{
+    Affinity::release(log);
+}
+
+bool HistoryLog::append(const message_record *record, uint64_t *sequence)
+{
+    uint32_t record_size = sizeof(message_record) + record->length; // Size of the record that will be saved
+    bool written = false;                                           // If the record reached the file
+    alignas(history_frame) char frame_buffer[sizeof(history_frame)]; // Buffer for the record's frame
+    history_frame *frame = (history_frame *)frame_buffer;
+
+    std::vector<std::string> terms;                                  // Terms the message is indexed by
+
+    // Frame and tokenize the record before taking the monitor
+    frame->length = record_size;
+    frame->checksum = HistoryLog::frameChecksum(record_size, (const char *)record);
+    HistoryIndex::tokenize(record, terms);
+
+    // Request write rights
+    monitor.requestWrite();
+
+    // Seal the active segment if the record does not fit in it, or if it got old
+    history_segment *current = &segments.back();
+    if (current->count > 0 && (current->bytes + sizeof(history_frame) + record_size > HISTORY_SEGMENT_BYTES || (uint64_t)time(NULL) >= current->created + HISTORY_SEGMENT_AGE))
+    {
+        this->roll();
+        current = &segments.back();
+    }
+
+    if (active != NULL)
+    {
+        // Both land in the stream's buffer, and reach the file in one write
+        written = fwrite(frame, sizeof(history_frame), 1, active) == 1 &&
+                  fwrite(record, record_size, 1, active) == 1 &&
+                  fflush(active) == 0;
+
+        if (written)
+        {
+            // The active segment's index is always in memory
+            indexes[current->id]->add(current->bytes, record->timestamp, terms);
+
+            if (sequence != NULL)
+                *sequence = current->first + current->count;
+            current->count++;
+            current->bytes += sizeof(history_frame) + record_size;
+            current->newest = std::max(current->newest, record->timestamp);
+        }
+        else
+        {
+            // Drop what the stream still holds and whatever part reached the file, so the segment ends on a whole record
+            __fpurge(active);
+            clearerr(active);
+            if (ftruncate(fileno(active), current->bytes) != 0)
+                Logger::log(LOG_MAIN, LOG_ERROR, "Could not cut history segment %" PRIu64 " of group %s back after a failed write", current->id, name.c_str());
+
+            Logger::log(LOG_MAIN, LOG_ERROR, "Could not write a message to the history of group %s", name.c_str());
+        }
+    }
+
+    // Release write rights
+    monitor.releaseWrite();
+
+    return written;
+}
+
+void HistoryLog::bounds(uint64_t *oldest, uint64_t *end)
+{
+    // Request read rights
+    monitor.requestRead();
+
+    *oldest = segments.front().first;
+    *end = segments.back().first + segments.back().count;
+
+    // Release read rights
+    monitor.releaseRead();
+}
+
+int HistoryLog::readRange(uint64_t sequence, char *buffer, int n, uint64_t *first)
+{
+    int read_messages = 0; // Number of messages copied to the buffer
+    size_t offset = 0;     // Where the next record is copied to
+
+    // Request read rights
+    monitor.requestRead();
+
+    // Messages deleted by retention are skipped
+    sequence = std::max(sequence, segments.front().first);
+    *first = sequence;
+
+    // Last segment starting at or before the first message
+    auto after = std::upper_bound(segments.begin(), segments.end(), sequence, [](uint64_t value, const history_segment &segment) { return value < segment.first; });
+    size_t i = after == segments.begin() ? 0 : after - segments.begin() - 1;
+
+    for (; i < segments.size() && read_messages < n; i++)
+    {
+        if (sequence >= segments[i].first + segments[i].count)
+            continue;
+
+        // The index has every frame's offset, so the first message is read without stepping over the older ones
+        uint32_t position = sequence - segments[i].first;
+        HistoryIndex *index = this->indexOf(segments[i]);
+        FILE *segment = fopen(this->segmentPath(segments[i].id).c_str(), "rb");
+        if (index == NULL || segment == NULL || position >= index->count() || fseek(segment, index->offsetOf(position), SEEK_SET) != 0)
+        {
+            if (segment != NULL)
+                fclose(segment);
+            break;
+        }
+
+        for (; position < segments[i].count && read_messages < n; position++)
+        {
+            // Records are read straight into the caller's buffer
+            size_t record_size = HistoryLog::readRecord(segment, buffer + offset);
+            if (record_size == 0)
+            {
+                torn_records->add();
+                Logger::log(LOG_MAIN, LOG_ERROR, "Damaged record in history segment %" PRIu64 " of group %s", segments[i].id, name.c_str());
+                break;
+            }
+
+            offset += record_size;
+            read_messages++;
+            sequence++;
+        }
+
+        fclose(segment);
+
+        // A range never skips over a damaged record
+        if (position < segments[i].count && read_messages < n)
+            break;
+    }
+
+    // Release read rights
+    monitor.releaseRead();
+
+    return read_messages;
+}
+
+uint64_t HistoryLog::sequenceAt(uint64_t timestamp)
+{
+    char record_buffer[PACKET_MAX]; // Buffer for each record
+    uint64_t sequence;              // First message sent at or after the time
+    bool exact;                     // If the block found starts right at the time
+
+    // Request read rights
+    monitor.requestRead();
+
+    // First segment whose newest message is not older than the time (an empty active segment ends the list)
+    auto found = std::partition_point(segments.begin(), segments.end(), [timestamp](const history_segment &segment) { return segment.count > 0 && segment.newest < timestamp; });
+
+    sequence = segments.back().first + segments.back().count;
+    HistoryIndex *index = (found != segments.end() && found->count > 0) ? this->indexOf(*found) : NULL;
+    if (index != NULL)
+    {
+        // Then the block of the segment the time falls in
+        uint32_t position = index->seek(timestamp, &exact);
+        sequence = found->first + std::min<uint64_t>(position, found->count);
+
+        // Only that block is read, up to the first message that is not older
+        FILE *segment = exact ? NULL : fopen(this->segmentPath(found->id).c_str(), "rb");
+        if (segment != NULL)
+        {
+            if (fseek(segment, index->offsetOf(position), SEEK_SET) == 0)
+                while (sequence < found->first + found->count && HistoryLog::readRecord(segment, record_buffer) > 0 && ((message_record *)record_buffer)->timestamp < timestamp)
+                    sequence++;
+
+            fclose(segment);
+        }
+    }
+
+    // Release read rights
+    monitor.releaseRead();
+
+    return sequence;
+}
+
+int HistoryLog::search(const std::string &query, char *buffer, int n)
+{
+    std::vector<std::string> terms;                       // Terms of the query
+    std::vector<std::pair<size_t, uint32_t>> found;       // Segment and position of each message found, newest first
+    std::vector<uint32_t> positions;                      // Messages of a segment with every term
+    int read_messages = 0;                                // Number of messages copied to the buffer
+    size_t offset = 0;                                    // Where the next record is copied to
+
+    HistoryIndex::parseQuery(query, terms);
+    if (terms.empty() || n <= 0)
+        return 0;
+
+    // Request read rights
+    monitor.requestRead();
+
+    // Newest segments first, until there are enough messages
+    for (size_t i = segments.size(); i-- > 0 && found.size() < (size_t)n;)
+    {
+        HistoryIndex *index = this->indexOf(segments[i]);
+        if (index == NULL)
+            continue;
+
+        index->match(terms, positions);
+        for (size_t j = positions.size(); j-- > 0 && found.size() < (size_t)n;)
+            found.push_back(std::make_pair(i, positions[j]));
+    }
+
+    // Read only the messages found, oldest first, each from its offset
+    FILE *segment = NULL;
+    size_t open_segment = segments.size();
+    for (size_t k = found.size(); k-- > 0;)
+    {
+        if (found[k].first != open_segment)
+        {
+            if (segment != NULL)
+                fclose(segment);
+
+            open_segment = found[k].first;
+            segment = fopen(this->segmentPath(segments[open_segment].id).c_str(), "rb");
+        }
+
+        HistoryIndex *index = this->indexOf(segments[open_segment]);
+        if (segment == NULL || found[k].second >= index->count() || fseek(segment, index->offsetOf(found[k].second), SEEK_SET) != 0)
+            continue;
+
+        size_t record_size = HistoryLog::readRecord(segment, buffer + offset);
+        if (record_size == 0)
+        {
+            torn_records->add();
+            continue;
+        }
+
+        offset += record_size;
+        read_messages++;
+    }
+
+    if (segment != NULL)
+        fclose(segment);
+
+    // Release read rights
+    monitor.releaseRead();
+
+    return read_messages;
+}
+
+uint64_t HistoryLog::bytes()
+{
+    uint64_t total = 0;
+
+    // Request read rights
+    monitor.requestRead();
+
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+        total += i->bytes;
+
+    // Release read rights
+    monitor.releaseRead();
+
+    return total;
+}
+
+void HistoryLog::collect(std::ostream &output)
+{
+    pthread_mutex_lock(&logs_lock);
+
+    for (auto i = open_logs.begin(); i != open_logs.end(); ++i)
+        output << "chat_history_file_bytes{group=\"" << Metrics::escapeLabel(i->first) << "\"} " << i->second->bytes() << "\n";
+
+    pthread_mutex_unlock(&logs_lock);
+}
+
+void HistoryLog::listStats()
+{
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    pthread_mutex_lock(&logs_lock);
+
+    for (auto i = open_logs.begin(); i != open_logs.end(); ++i)
+    {
+        HistoryLog *log = i->second;
+
+        // Request read rights
+        log->monitor.requestRead();
+
+        uint64_t total = 0;
+        for (auto segment = log->segments.begin(); segment != log->segments.end(); ++segment)
+            total += segment->bytes;
+
+        std::cout << "Group " << i->first << ": " << log->segments.size() << " segment(s), messages "
+                  << log->segments.front().first << " to " << log->segments.back().first + log->segments.back().count
+                  << ", " << total << " bytes" << std::endl;
+
+        // Release read rights
+        log->monitor.releaseRead();
+    }
+
+    pthread_mutex_unlock(&logs_lock);
+
+    std::cout << "Segments sealed: " << segments_sealed->value() << std::endl;
+    std::cout << "Segments deleted: " << segments_deleted->value() << std::endl;
+    std::cout << "Segments merged: " << segments_merged->value() << std::endl;
+    std::cout << "Damaged records: " << torn_records->value() << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+void *HistoryLog::maintain(void *arg)
+{
+    // Merges read and write whole segments, away from the CPUs serving connections
+    Affinity::pin(AFFINITY_HISTORY);
+
+    while (running)
+    {
+        // Sleep in steps of 100ms, so stopping does not wait for a whole pass
+        for (int waited = 0; running && waited < HISTORY_MAINTENANCE_MS; waited += 100)
+            usleep(100 * 1000);
+
+        std::vector<HistoryLog *> logs;
+        int deleted = 0, merged = 0;
+
+        // Hold on to every open log, so none is closed during the pass
+        pthread_mutex_lock(&logs_lock);
+        for (auto i = open_logs.begin(); i != open_logs.end(); ++i)
+        {
+            i->second->references++;
+            logs.push_back(i->second);
+        }
+        pthread_mutex_unlock(&logs_lock);
+
+        for (auto i = logs.begin(); i != logs.end(); ++i)
+        {
+            (*i)->persistIndexes();
+            deleted += (*i)->enforceRetention();
+
+            int run;
+            while (running && (run = (*i)->compact()) > 0)
+                merged += run;
+
+            HistoryLog::close(*i);
+        }
+
+        if (deleted > 0 || merged > 0)
+            Logger::log(LOG_MAIN, LOG_DEBUG, "History maintenance deleted %d and merged %d segment(s)", deleted, merged);
+    }
+
+    pthread_exit(NULL);
+}
+
+int HistoryLog::enforceRetention()
+{
+    std::vector<uint64_t> deleted; // Segments taken out of the manifest
+    uint64_t now = time(NULL);
+    uint64_t total = 0;
+
+    // Request write rights
+    monitor.requestWrite();
+
+    // A quiet group's active segment is sealed once it gets old, so it can expire too
+    if (segments.back().count > 0 && now >= segments.back().created + HISTORY_SEGMENT_AGE)
+        this->roll();
+
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+        total += i->bytes;
+
+    // Drop the oldest sealed segments until the policy holds, the active one is always kept
+    while (segments.size() > 1)
+    {
+        history_segment &oldest = segments.front();
+
+        bool expired = retention.age > 0 && oldest.newest + retention.age < now;
+        bool too_many = retention.segments > 0 && segments.size() > retention.segments;
+        bool too_big = retention.bytes > 0 && total > retention.bytes;
+
+        if (!expired && !too_many && !too_big)
+            break;
+
+        total -= oldest.bytes;
+        deleted.push_back(oldest.id);
+        this->dropIndex(oldest.id);
+        segments.erase(segments.begin());
+    }
+
+    if (!deleted.empty())
+        this->writeManifest();
+
+    // Release write rights
+    monitor.releaseWrite();
+
+    // Nobody can reach the files anymore
+    for (auto i = deleted.begin(); i != deleted.end(); ++i)
+    {
+        unlink(this->segmentPath(*i).c_str());
+        unlink(this->indexPath(*i).c_str());
+    }
+
+    segments_deleted->add(deleted.size());
+
+    return deleted.size();
+}
+
+int HistoryLog::compact()
+{
+    std::vector<history_segment> run; // Sealed segments that are merged
+    size_t start = 0;                 // Position of the run in the segment list
+    char copy_buffer[65536];          // Buffer for copying the segments
+    size_t copied;
+
+    // Request read rights
+    monitor.requestRead();
+
+    // First small sealed segment that can be merged with the ones after it
+    for (size_t i = 0; i + 1 < segments.size() && run.empty(); i++)
+    {
+        if (segments[i].bytes >= HISTORY_COMPACT_BYTES)
+            continue;
+
+        uint64_t total = segments[i].bytes;
+        size_t end = i + 1;
+        while (end + 1 < segments.size() && total + segments[end].bytes <= HISTORY_SEGMENT_BYTES)
+            total += segments[end++].bytes;
+
+        if (end - i > 1)
+        {
+            start = i;
+            run.assign(segments.begin() + i, segments.begin() + end);
+        }
+    }
+
+    // Release read rights
+    monitor.releaseRead();
+
+    if (run.empty())
+        return 0;
+
+    // Sealed segments are never written to, so they are copied (and indexed) without any lock
+    std::string temporary = directory + "compact.tmp";
+    FILE *merged_file = fopen(temporary.c_str(), "wb");
+    if (merged_file == NULL)
+        return 0;
+
+    history_segment merged = {next_id++, run.front().first, 0, 0, run.front().created, 0};
+    bool failed = false;
+
+    for (auto i = run.begin(); i != run.end() && !failed; ++i)
+    {
+        FILE *segment = fopen(this->segmentPath(i->id).c_str(), "rb");
+        if (segment == NULL)
+        {
+            failed = true;
+            break;
+        }
+
+        while ((copied = fread(copy_buffer, 1, sizeof(copy_buffer), segment)) > 0)
+            failed |= fwrite(copy_buffer, 1, copied, merged_file) != copied;
+
+        fclose(segment);
+
+        merged.count += i->count;
+        merged.bytes += i->bytes;
+        merged.newest = std::max(merged.newest, i->newest);
+    }
+
+    failed |= fflush(merged_file) != 0 || fsync(fileno(merged_file)) != 0;
+    fclose(merged_file);
+
+    // The merged segment's index is in place before the manifest lists it
+    if (!failed)
+    {
+        HistoryIndex *merged_index = HistoryLog::buildIndex(temporary);
+        failed = merged_index == NULL || !merged_index->write(this->indexPath(merged.id));
+        delete merged_index;
+    }
+
+    if (failed)
+    {
+        unlink(temporary.c_str());
+        unlink(this->indexPath(merged.id).c_str());
+        Logger::log(LOG_MAIN, LOG_WARN, "Could not merge the history segments of group %s", name.c_str());
+        return 0;
+    }
+
+    // Request write rights
+    monitor.requestWrite();
+
+    // Only this thread takes segments out, and appends only touch the end, so the run is where it was
+    rename(temporary.c_str(), this->segmentPath(merged.id).c_str());
+
+    for (auto i = run.begin(); i != run.end(); ++i)
+        this->dropIndex(i->id);
+
+    segments.erase(segments.begin() + start, segments.begin() + start + run.size());
+    segments.insert(segments.begin() + start, merged);
+
+    this->writeManifest();
+
+    // Release write rights
+    monitor.releaseWrite();
+
+    for (auto i = run.begin(); i != run.end(); ++i)
+    {
+        unlink(this->segmentPath(i->id).c_str());
+        unlink(this->indexPath(i->id).c_str());
+    }
+
+    segments_merged->add(run.size());
+
+    return run.size();
+}
+
+void HistoryLog::roll()
+{
+    history_segment &sealed = segments.back();
+    history_segment next = {next_id++, sealed.first + sealed.count, 0, 0, (uint64_t)time(NULL), 0};
+
+    // The sealed segment reaches the disk whole, only the active one can be torn by a crash
+    if (active != NULL)
+    {
+        fsync(fileno(active));
+        fclose(active);
+    }
+
+    // The file exists before the manifest lists it
+    active = fopen(this->segmentPath(next.id).c_str(), "ab");
+    segments.push_back(next);
+
+    // The sealed segment's index stays in memory until the maintenance thread writes it
+    pthread_mutex_lock(&index_lock);
+    indexes[next.id] = new HistoryIndex();
+    pthread_mutex_unlock(&index_lock);
+
+    this->writeManifest();
+
+    segments_sealed->add();
+}
+
+bool HistoryLog::readManifest()
+{
+    history_segment segment;
+    uint64_t first_free_id;
+    char header[64];
+
+    FILE *manifest = fopen((directory + HISTORY_MANIFEST).c_str(), "r");
+    if (manifest == NULL)
+        return false;
+
+    // Manifests written before records were framed have no format
+    format = 1;
+    if (fgets(header, sizeof(header), manifest) == NULL ||
+        sscanf(header, "segments %" SCNu64 " format %u", &first_free_id, &format) < 1)
+    {
+        fclose(manifest);
+        return false;
+    }
+
+    next_id = first_free_id;
+
+    while (fscanf(manifest, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+                  &segment.id, &segment.first, &segment.count, &segment.bytes, &segment.created, &segment.newest) == 6)
+        segments.push_back(segment);
+
+    fclose(manifest);
+
+    return !segments.empty();
+}
+
+void HistoryLog::writeManifest()
+{
+    std::string temporary = directory + HISTORY_MANIFEST + ".tmp";
+
+    FILE *manifest = fopen(temporary.c_str(), "w");
+    if (manifest == NULL)
+    {
+        Logger::log(LOG_MAIN, LOG_ERROR, "Could not write the history manifest of group %s", name.c_str());
+        return;
+    }
+
+    fprintf(manifest, "segments %" PRIu64 " format %u\n", next_id.load(), format);
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+        fprintf(manifest, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                i->id, i->first, i->count, i->bytes, i->created, i->newest);
+
+    // The new manifest replaces the old one whole, or not at all
+    fflush(manifest);
+    fsync(fileno(manifest));
+    fclose(manifest);
+
+    rename(temporary.c_str(), (directory + HISTORY_MANIFEST).c_str());
+}
+
+void HistoryLog::recoverActive()
+{
+    history_segment &current = segments.back();
+    char record_buffer[PACKET_MAX]; // Buffer for each record
+    size_t record_size;
+    uint64_t file_size;
+    std::vector<std::string> terms; // Terms of each record
+
+    std::string path = this->segmentPath(current.id);
+    HistoryIndex *index = new HistoryIndex();
+
+    current.count = 0;
+    current.bytes = 0;
+
+    // The active segment's index is rebuilt along with its count
+    pthread_mutex_lock(&index_lock);
+    indexes[current.id] = index;
+    pthread_mutex_unlock(&index_lock);
+
+    FILE *segment = fopen(path.c_str(), "rb");
+    if (segment == NULL)
+        return;
+
+    // One sequential pass, in large reads
+    setvbuf(segment, NULL, _IOFBF, HISTORY_SCAN_BUFFER);
+
+    while ((record_size = HistoryLog::readRecord(segment, record_buffer)) > 0)
+    {
+        terms.clear();
+        HistoryIndex::tokenize((message_record *)record_buffer, terms);
+        index->add(current.bytes, ((message_record *)record_buffer)->timestamp, terms);
+
+        current.count++;
+        current.bytes += sizeof(history_frame) + record_size;
+        current.newest = std::max(current.newest, ((message_record *)record_buffer)->timestamp);
+    }
+
+    fseek(segment, 0, SEEK_END);
+    file_size = ftell(segment);
+    fclose(segment);
+
+    // Cut whatever follows the last whole record, new records are appended after it
+    if (file_size > current.bytes)
+    {
+        if (truncate(path.c_str(), current.bytes) == 0)
+            Logger::log(LOG_MAIN, LOG_WARN, "Cut %" PRIu64 " torn byte(s) off the history of group %s", file_size - current.bytes, name.c_str());
+        else
+            Logger::log(LOG_MAIN, LOG_ERROR, "Could not cut the torn end off the history of group %s", name.c_str());
+
+        torn_records->add();
+    }
+}
+
+size_t HistoryLog::readRecord(FILE *segment, char *record)
+{
+    alignas(history_frame) char frame_buffer[sizeof(history_frame)]; // Buffer for the frame
+    history_frame *frame = (history_frame *)frame_buffer;
+
+    if (fread(frame, sizeof(history_frame), 1, segment) != 1)
+        return 0;
+
+    // A length that does not fit a packet can only come from a damaged frame
+    if (frame->length < sizeof(message_record) || frame->length > PACKET_MAX)
+        return 0;
+
+    if (fread(record, frame->length, 1, segment) != 1)
+        return 0;
+
+    if (HistoryLog::frameChecksum(frame->length, record) != frame->checksum)
+        return 0;
+
+    // The record must describe the same size as its frame
+    if (sizeof(message_record) + ((message_record *)record)->length != frame->length)
+        return 0;
+
+    return frame->length;
+}
+
+HistoryIndex *HistoryLog::indexOf(const history_segment &segment)
+{
+    HistoryIndex *index = NULL;
+
+    pthread_mutex_lock(&index_lock);
+
+    auto found = indexes.find(segment.id);
+    if (found != indexes.end())
+        index = found->second;
+    else
+    {
+        // Mapped from its file, or rebuilt if the file is missing (a crash before it was written) or stale
+        if ((index = HistoryIndex::load(this->indexPath(segment.id), segment.bytes)) == NULL)
+        {
+            index = HistoryLog::buildIndex(this->segmentPath(segment.id));
+            if (index != NULL && !index->write(this->indexPath(segment.id)))
+                Logger::log(LOG_MAIN, LOG_WARN, "Could not write the index of history segment %" PRIu64 " of group %s", segment.id, name.c_str());
+        }
+
+        if (index != NULL)
+            indexes[segment.id] = index;
+    }
+
+    pthread_mutex_unlock(&index_lock);
+
+    return index;
+}
+
+HistoryIndex *HistoryLog::buildIndex(const std::string &path)
+{
+    char record_buffer[PACKET_MAX]; // Buffer for each record
+    size_t record_size;
+    uint32_t offset = 0;
+    std::vector<std::string> terms; // Terms of each record
+
+    FILE *segment = fopen(path.c_str(), "rb");
+    if (segment == NULL)
+        return NULL;
+
+    setvbuf(segment, NULL, _IOFBF, HISTORY_SCAN_BUFFER);
+
+    HistoryIndex *index = new HistoryIndex();
+    while ((record_size = HistoryLog::readRecord(segment, record_buffer)) > 0)
+    {
+        terms.clear();
+        HistoryIndex::tokenize((message_record *)record_buffer, terms);
+        index->add(offset, ((message_record *)record_buffer)->timestamp, terms);
+
+        offset += sizeof(history_frame) + record_size;
+    }
+
+    fclose(segment);
+
+    return index;
+}
+
+void HistoryLog::dropIndex(uint64_t id)
+{
+    pthread_mutex_lock(&index_lock);
+
+    auto found = indexes.find(id);
+    if (found != indexes.end())
+    {
+        delete found->second;
+        indexes.erase(found);
+    }
+
+    pthread_mutex_unlock(&index_lock);
+}
+
+int HistoryLog::persistIndexes()
+{
+    std::vector<uint64_t> written; // Sealed segments whose index was written
+
+    // Request read rights
+    monitor.requestRead();
+
+    // Sealed indexes are not added to anymore, so they are written with read rights only
+    pthread_mutex_lock(&index_lock);
+    for (size_t i = 0; i + 1 < segments.size(); i++)
+    {
+        auto found = indexes.find(segments[i].id);
+        if (found != indexes.end() && found->second->inMemory())
+        {
+            if (found->second->write(this->indexPath(segments[i].id)))
+                written.push_back(segments[i].id);
+            else
+                Logger::log(LOG_MAIN, LOG_WARN, "Could not write the index of history segment %" PRIu64 " of group %s", segments[i].id, name.c_str());
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    // Release read rights
+    monitor.releaseRead();
+
+    if (written.empty())
+        return 0;
+
+    // Request write rights
+    monitor.requestWrite();
+
+    // Dropped from memory, they are mapped from their files when searched
+    for (auto i = written.begin(); i != written.end(); ++i)
+        this->dropIndex(*i);
+
+    // Release write rights
+    monitor.releaseWrite();
+
+    return written.size();
+}
+
+uint32_t HistoryLog::frameChecksum(uint32_t length, const char *record)
+{
+    return Checksum::crc32c(record, length, Checksum::crc32c(&length, sizeof(length)));
+}
+
+void HistoryLog::convertSegments()
+{
+    for (auto i = segments.begin(); i != segments.end(); ++i)
+    {
+        if (!this->convertSegment(*i))
+        {
+            // The manifest keeps the old format, so the next open tries again
+            Logger::log(LOG_MAIN, LOG_ERROR, "Could not convert history segment %" PRIu64 " of group %s", i->id, name.c_str());
+            return;
+        }
+    }
+
+    format = HISTORY_FORMAT;
+    this->writeManifest();
+
+    Logger::log(LOG_MAIN, LOG_INFO, "Converted %zu history segment(s) of group %s to framed records", segments.size(), name.c_str());
+}
+
+bool HistoryLog::convertSegment(history_segment &segment)
+{
+    char record_buffer[PACKET_MAX]; // Buffer for each converted record
+    message_record *record = (message_record *)record_buffer;
+    alignas(history_frame) char frame_buffer[sizeof(history_frame)]; // Buffer for each record's frame
+    history_frame *frame = (history_frame *)frame_buffer;
+    uint64_t bytes = 0; // Size of the converted segment
+    bool failed = false;
+
+    std::string path = this->segmentPath(segment.id);
+    std::string temporary = path + ".tmp";
+
+    // Never written to, or converted already by an open that stopped before the manifest was rewritten
+    if (access(path.c_str(), F_OK) != 0 || HistoryLog::isFramed(path))
+        return true;
+
+    FILE *old_segment = fopen(path.c_str(), "rb");
+    if (old_segment == NULL)
+        return false;
+
+    FILE *new_segment = fopen(temporary.c_str(), "wb");
+    if (new_segment == NULL)
+    {
+        fclose(old_segment);
+        return false;
+    }
+
+    setvbuf(old_segment, NULL, _IOFBF, HISTORY_SCAN_BUFFER);
+
+    // A torn record at the end of an old active segment is left behind
+    while (fread(record, sizeof(message_record), 1, old_segment) == 1 &&
+           record->length <= PACKET_MAX - sizeof(message_record) &&
+           (record->length == 0 || fread(record_buffer + sizeof(message_record), record->length, 1, old_segment) == 1))
+    {
+        frame->length = sizeof(message_record) + record->length;
+        frame->checksum = HistoryLog::frameChecksum(frame->length, record_buffer);
+
+        failed |= fwrite(frame, sizeof(history_frame), 1, new_segment) != 1;
+        failed |= fwrite(record_buffer, frame->length, 1, new_segment) != 1;
+
+        bytes += sizeof(history_frame) + frame->length;
+    }
+
+    fclose(old_segment);
+
+    fflush(new_segment);
+    failed |= fsync(fileno(new_segment)) != 0;
+    fclose(new_segment);
+
+    if (failed || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    // Its offsets changed, the index is rebuilt when needed
+    unlink(this->indexPath(segment.id).c_str());
+    segment.bytes = bytes;
+
+    return true;
+}
+
+bool HistoryLog::isFramed(const std::string &path)
+{
+    char record_buffer[PACKET_MAX]; // Buffer for each record
+    size_t record_size;
+    uint64_t bytes = 0; // Size of the whole records read
+    uint64_t file_size;
+
+    FILE *segment = fopen(path.c_str(), "rb");
+    if (segment == NULL)
+        return false;
+
+    setvbuf(segment, NULL, _IOFBF, HISTORY_SCAN_BUFFER);
+
+    while ((record_size = HistoryLog::readRecord(segment, record_buffer)) > 0)
+        bytes += sizeof(history_frame) + record_size;
+
+    fseek(segment, 0, SEEK_END);
+    file_size = ftell(segment);
+    fclose(segment);
+
+    return bytes == file_size;
+}
+
+void HistoryLog::migrate(const std::string &filename)
+{
+    char record_buffer[PACKET_MAX]; // Buffer for each migrated record
+    message_record *record = (message_record *)record_buffer;
+    long total_messages = 0;        // Message count in the old file's header
+    long migrated = 0;
+
+    FILE *legacy = fopen(filename.c_str(), "rb");
+    if (legacy == NULL)
+        return;
+
+    if (fread(&total_messages, sizeof(long), 1, legacy) == 1)
+    {
+        // Stops at a record that could not be written, the old file keeps every record under its new name
+        while (migrated < total_messages && fread(record, sizeof(message_record), 1, legacy) == 1 &&
+               record->length <= PACKET_MAX - sizeof(message_record) &&
+               (record->length == 0 || fread(record_buffer + sizeof(message_record), record->length, 1, legacy) == 1) &&
+               this->append(record))
+        {
+            migrated++;
+        }
+    }
+
+    fclose(legacy);
+
+    // Keep the old file around, under a name that is not migrated again
+    rename(filename.c_str(), (filename + ".migrated").c_str());
+
+    Logger::log(LOG_MAIN, LOG_INFO, "Moved %ld message(s) of group %s to its segmented history", migrated, name.c_str());
+}
+
+void HistoryLog::removeOrphans()
+{
+    DIR *listing = opendir(directory.c_str());
+    struct dirent *entry;
+
+    if (listing == NULL)
+        return;
+
+    while ((entry = readdir(listing)) != NULL)
+    {
+        std::string filename(entry->d_name);
+        bool listed = false;
+
+        bool segment_file = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".seg") == 0;
+        bool index_file = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".idx") == 0;
+
+        if (!segment_file && !index_file)
+        {
+            // Left by an interrupted merge, index or manifest write
+            if (filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".tmp") == 0)
+                unlink((directory + filename).c_str());
+            continue;
+        }
+
+        uint64_t id = strtoull(filename.c_str(), NULL, 10);
+        for (auto i = segments.begin(); i != segments.end() && !listed; ++i)
+            listed = i->id == id;
+
+        if (!listed)
+        {
+            unlink((directory + filename).c_str());
+            Logger::log(LOG_MAIN, LOG_INFO, "Removed unlisted history file %s of group %s", filename.c_str(), name.c_str());
+        }
+    }
+
+    closedir(listing);
+}
+
+std::string HistoryLog::segmentPath(uint64_t id)
+{
+    char filename[32];
+
+    snprintf(filename, sizeof(filename), "%08" PRIu64 ".seg", id);
+
+    return directory + filename;
+}
+
+std::string HistoryLog::indexPath(uint64_t id)
+{
+    char filename[32];
+
+    snprintf(filename, sizeof(filename), "%08" PRIu64 ".idx", id);
+
+    return directory + filename;
+}
@@ -0,0 +1,197 @@
+#include "IORing.h"
+
+#ifdef USE_IO_URING
+
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+
+IORing::IORing(unsigned entries)
+{
+    io_uring_params params;
+
+    bzero((void *)&params, sizeof(params));
+    this->buffer_ring = NULL;
+    this->buffers = NULL;
+    this->sq_pending = 0;
+
+    // Create the instance
+    if ((ring_fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        throw std::runtime_error(std::string("Error during io_uring setup: ") + strerror(errno));
+
+    // Map the submission and completion rings (a single mapping on recent kernels)
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+
+    sq_map = mmap(NULL, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED)
+    {
+        close(ring_fd);
+        throw std::runtime_error(std::string("Error mapping the io_uring submission ring: ") + strerror(errno));
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_map = sq_map;
+    else if ((cq_map = mmap(NULL, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        munmap(sq_map, sq_map_size);
+        close(ring_fd);
+        throw std::runtime_error(std::string("Error mapping the io_uring completion ring: ") + strerror(errno));
+    }
+
+    // Map the submission entries
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        if (cq_map != sq_map)
+            munmap(cq_map, cq_map_size);
+        munmap(sq_map, sq_map_size);
+        close(ring_fd);
+        throw std::runtime_error(std::string("Error mapping the io_uring entries: ") + strerror(errno));
+    }
+
+    // Locate the ring fields
+    sq_head = (unsigned *)((char *)sq_map + params.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_map + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_map + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_map + params.sq_off.array);
+    sq_entries = params.sq_entries;
+
+    cq_head = (unsigned *)((char *)cq_map + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_map + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_map + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)((char *)cq_map + params.cq_off.cqes);
+}
+
+IORing::~IORing()
+{
+    if (buffer_ring != NULL)
+    {
+        munmap((void *)buffer_ring, buffer_count * sizeof(io_uring_buf));
+        free(buffers);
+    }
+
+    munmap((void *)sqes, sqes_size);
+    if (cq_map != sq_map)
+        munmap(cq_map, cq_map_size);
+    munmap(sq_map, sq_map_size);
+
+    close(ring_fd);
+}
+
+io_uring_sqe *IORing::getSQE()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail + sq_pending;
+
+    // Ring is full, hand what we have to the kernel
+    if (tail - head >= sq_entries)
+    {
+        this->submit();
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        tail = *sq_tail + sq_pending;
+
+        if (tail - head >= sq_entries)
+            return NULL;
+    }
+
+    io_uring_sqe *entry = &sqes[tail & *sq_mask];
+    bzero((void *)entry, sizeof(io_uring_sqe));
+
+    // The entry is submitted in the same order it was taken
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    sq_pending++;
+
+    return entry;
+}
+
+int IORing::submit(unsigned wait_for)
+{
+    unsigned submitted = sq_pending;
+    int result = 0;
+
+    // Publish the filled entries
+    __atomic_store_n(sq_tail, *sq_tail + sq_pending, __ATOMIC_RELEASE);
+    sq_pending = 0;
+
+    do
+    {
+        result = syscall(__NR_io_uring_enter, ring_fd, submitted, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+
+    return result < 0 ? -errno : result;
+}
+
+io_uring_cqe *IORing::peekCQE()
+{
+    unsigned head = *cq_head;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &cqes[head & *cq_mask];
+}
+
+void IORing::advanceCQ()
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool IORing::provideBuffers(unsigned count, unsigned size)
+{
+    io_uring_buf_reg registration;
+
+    // Memory shared with the kernel, holding the buffer descriptors
+    void *ring_memory = mmap(NULL, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring_memory == MAP_FAILED)
+        return false;
+
+    bzero((void *)&registration, sizeof(registration));
+    registration.ring_addr = (unsigned long)ring_memory;
+    registration.ring_entries = count;
+    registration.bgid = 0;
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+    {
+        munmap(ring_memory, count * sizeof(io_uring_buf));
+        return false;
+    }
+
+    buffer_ring = (io_uring_buf_ring *)ring_memory;
+    buffers = (char *)malloc((size_t)count * size);
+    buffer_count = count;
+    buffer_size = size;
+    buffer_tail = 0;
+
+    // Hand every buffer to the kernel
+    for (unsigned i = 0; i < count; i++)
+        this->recycleBuffer(i);
+
+    return true;
+}
+
+char *IORing::buffer(unsigned buffer_id)
+{
+    return buffers + (size_t)buffer_id * buffer_size;
+}
+
+void IORing::recycleBuffer(unsigned buffer_id)
+{
+    // OBS: The descriptors are indexed by hand, in C++ the empty member the kernel header wraps
+    // bufs with takes a byte, shifting the array. The first descriptor shares its last field
+    // with the ring tail, so that field is not touched
+    io_uring_buf *descriptor = (io_uring_buf *)buffer_ring + (buffer_tail & (buffer_count - 1));
+
+    descriptor->addr = (unsigned long)this->buffer(buffer_id);
+    descriptor->len = buffer_size;
+    descriptor->bid = buffer_id;
+
+    // Publish it
+    buffer_tail++;
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,394 @@
+#include "LoadGenerator.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+
+LoadGenerator::LoadGenerator(const std::string &ip, int port, int users, int groups, int rate, int duration, int keep_alive)
+{
+    struct rlimit limit;
+
+    if (users <= 0 || groups <= 0 || rate <= 0 || duration <= 0)
+        throw std::runtime_error("Invalid benchmark parameters, must be > 0");
+
+    if (keep_alive < 0)
+        throw std::runtime_error("Invalid keep-alive interval, must be >= 0");
+
+    this->server_ip = !ip.compare("localhost") ? "127.0.0.1" : ip;
+    this->server_port = port;
+    this->user_count = users;
+    this->group_count = groups;
+    this->rate = rate;
+    this->duration = duration;
+    this->keep_alive = keep_alive;
+
+    this->users.resize(users);
+    this->group_sizes.assign(groups, 0);
+    this->answered = 0;
+    this->posted = 0;
+    this->expected = 0;
+    this->delivered = 0;
+    this->keep_alives = 0;
+    this->login_time = 0;
+    this->post_start = 0;
+    this->post_end = 0;
+
+    // One descriptor per user
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)users + 64)
+    {
+        limit.rlim_cur = std::min(limit.rlim_max, (rlim_t)users + 64);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        throw std::runtime_error("Error creating the epoll instance");
+}
+
+LoadGenerator::~LoadGenerator()
+{
+    for (size_t i = 0; i < users.size(); i++)
+    {
+        if (users[i].socket > 0)
+            close(users[i].socket);
+    }
+
+    close(epoll_fd);
+}
+
+void LoadGenerator::run()
+{
+    char text[MESSAGE_MAX];       // Text of the message being posted
+    uint64_t interval = 0;        // Time (in microseconds) between two posts
+    uint64_t start = 0;           // Time the current phase started
+    uint64_t next_keep_alive = 0; // Time the next round of keep-alives is due
+    long total = 0;               // Messages that will be posted
+    int connected = 0;            // Users logged in
+
+    // Start draining connections before logging in, the server answers logins with history and join messages
+    receiving = true;
+    pthread_create(&receiver_thread, NULL, receive, (void *)this);
+
+    // Log every user in
+    start = LoadGenerator::now();
+    for (int i = 0; i < user_count; i++)
+    {
+        if (this->login(i))
+            connected++;
+    }
+
+    login_time = LoadGenerator::now() - start;
+    std::cout << "Logged in " << connected << " of " << user_count << " users in " << login_time / 1000 << " ms" << std::endl;
+
+    // Let the join messages settle
+    sleep(1);
+
+    // Keep-alives go out in rounds, between the posts
+    next_keep_alive = LoadGenerator::now();
+
+    // Post messages at the configured rate, from every user in turn
+    interval = 1000000 / rate;
+    total = (long)rate * duration;
+    start = LoadGenerator::now();
+    post_start = start;
+
+    for (long i = 0; i < total; i++)
+    {
+        bench_user &user = users[i % user_count];
+        uint64_t due = start + i * interval;
+        uint64_t current = LoadGenerator::now();
+
+        // Wait for this message's turn, sending the keep-alives that fall due meanwhile
+        while (true)
+        {
+            if (keep_alive > 0 && current >= next_keep_alive)
+            {
+                this->sendKeepAlives();
+                next_keep_alive = current + (uint64_t)keep_alive * 1000;
+            }
+
+            if (current >= due)
+                break;
+
+            usleep(std::min(due, keep_alive > 0 ? next_keep_alive : due) - current);
+            current = LoadGenerator::now();
+        }
+
+        if (user.socket <= 0)
+            continue;
+
+        // The text carries the send time
+        snprintf(text, sizeof(text), BENCH_PREFIX "%lu", (unsigned long)LoadGenerator::now());
+        MessageBuffer message("bench", std::string(text), USER_MESSAGE);
+
+        expected += group_sizes[user.group];
+        posted++;
+
+        if (send(user.socket, (void *)message.get(), message.size(), MSG_NOSIGNAL) < 0)
+        {
+            expected -= group_sizes[user.group];
+            posted--;
+        }
+    }
+
+    // Wait for the deliveries (at most 10 seconds after the last post)
+    start = LoadGenerator::now();
+    while (delivered < expected && LoadGenerator::now() - start < 10000000)
+    {
+        if (keep_alive > 0 && LoadGenerator::now() >= next_keep_alive)
+        {
+            this->sendKeepAlives();
+            next_keep_alive = LoadGenerator::now() + (uint64_t)keep_alive * 1000;
+        }
+
+        usleep(1000);
+    }
+
+    // Stop the receiver
+    receiving = false;
+    pthread_join(receiver_thread, NULL);
+}
+
+void LoadGenerator::report()
+{
+    std::vector<uint64_t> sorted(latencies);
+    std::vector<uint64_t> sorted_setups(setups);
+    double elapsed = (post_end > post_start ? post_end - post_start : 1) / 1000000.0;
+    double login_elapsed = (login_time > 0 ? login_time : 1) / 1000000.0;
+
+    std::sort(sorted.begin(), sorted.end());
+    std::sort(sorted_setups.begin(), sorted_setups.end());
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Users: " << user_count << std::endl;
+    std::cout << "Groups: " << group_count << std::endl;
+    std::cout << "Connection setups: " << setups.size() << std::endl;
+    std::cout << "Connection setup rate (logins/s): " << setups.size() / login_elapsed << std::endl;
+    std::cout << "Connection setup p50 (us): " << LoadGenerator::percentile(sorted_setups, 0.50) << std::endl;
+    std::cout << "Connection setup p99 (us): " << LoadGenerator::percentile(sorted_setups, 0.99) << std::endl;
+    std::cout << "Connection setup p999 (us): " << LoadGenerator::percentile(sorted_setups, 0.999) << std::endl;
+    std::cout << "Keep-alives sent: " << keep_alives << std::endl;
+    std::cout << "Messages posted: " << posted << std::endl;
+    std::cout << "Deliveries expected: " << expected << std::endl;
+    std::cout << "Deliveries received: " << delivered << std::endl;
+    std::cout << "Elapsed (s): " << elapsed << std::endl;
+    std::cout << "Throughput (messages/s): " << posted / elapsed << std::endl;
+    std::cout << "Throughput (deliveries/s): " << delivered / elapsed << std::endl;
+    std::cout << "Latency p50 (us): " << LoadGenerator::percentile(sorted, 0.50) << std::endl;
+    std::cout << "Latency p99 (us): " << LoadGenerator::percentile(sorted, 0.99) << std::endl;
+    std::cout << "Latency p999 (us): " << LoadGenerator::percentile(sorted, 0.999) << std::endl;
+    std::cout << "Latency max (us): " << (sorted.empty() ? 0 : sorted.back()) << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+bool LoadGenerator::login(int index)
+{
+    bench_user &user = users[index];
+    int port = server_port; // Port the login is made at
+
+    user.group = index % group_count;
+    user.redirect = 0;
+
+    // Setup time counts from the first connection attempt
+    uint64_t setup_start = LoadGenerator::now();
+
+    for (int hop = 0; hop <= PARTITION_REDIRECT_MAX; hop++)
+    {
+        int answers = answered;
+        if (!this->connectUser(index, port))
+            return false;
+
+        // Wait for the server to answer (with the join message), so logins do not pile up in the listen backlog
+        uint64_t start = LoadGenerator::now();
+        while (answered == answers && LoadGenerator::now() - start < 2000000)
+            usleep(100);
+
+        // A partitioned cluster sends the login to the replica leading the group, which is where the setup ends
+        if (answered != answers && user.redirect != 0)
+        {
+            port = user.redirect;
+
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, user.socket, NULL);
+            close(user.socket);
+            user.socket = -1;
+            user.redirect = 0;
+            user.answered = false;
+            user.input.clear();
+            continue;
+        }
+
+        group_sizes[user.group]++;
+
+        if (answered != answers)
+            setups.push_back(LoadGenerator::now() - setup_start);
+
+        return true;
+    }
+
+    return false;
+}
+
+bool LoadGenerator::connectUser(int index, int port)
+{
+    struct sockaddr_in server_address;
+    struct epoll_event event;
+    bench_user &user = users[index];
+    char username[24], groupname[24];
+
+    snprintf(username, sizeof(username), "bench%05d", index);
+    snprintf(groupname, sizeof(groupname), "group%03d", user.group);
+
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    server_address.sin_addr.s_addr = inet_addr(server_ip.c_str());
+
+    // The server listen backlog is short, retry refused connections for a while
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        if ((user.socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return false;
+
+        if (connect(user.socket, (struct sockaddr *)&server_address, sizeof(server_address)) == 0)
+            break;
+
+        close(user.socket);
+        user.socket = -1;
+        usleep(10000);
+    }
+
+    if (user.socket < 0)
+        return false;
+
+    // Watch it before logging in
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, user.socket, &event);
+
+    // Login packet: username, and the group as the message
+    MessageBuffer login_message(username, std::string(groupname), LOGIN_MESSAGE, PAK_COMMAND, 0);
+    if (send(user.socket, (void *)login_message.get(), login_message.size(), MSG_NOSIGNAL) < 0)
+    {
+        close(user.socket);
+        user.socket = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void LoadGenerator::sendKeepAlives()
+{
+    char keep_alive = 'x'; // Same payload the client sends
+    Frame frame(PAK_KEEP_ALIVE, &keep_alive, sizeof(keep_alive));
+
+    for (size_t i = 0; i < users.size(); i++)
+    {
+        if (users[i].socket > 0 && send(users[i].socket, (void *)frame.get(), frame.size(), MSG_NOSIGNAL) > 0)
+            keep_alives++;
+    }
+}
+
+void *LoadGenerator::receive(void *arg)
+{
+    LoadGenerator *generator = (LoadGenerator *)arg;
+    struct epoll_event events[256];
+    char buffer[65536];
+
+    while (generator->receiving)
+    {
+        int count = epoll_wait(generator->epoll_fd, events, 256, 100);
+
+        for (int i = 0; i < count; i++)
+        {
+            bench_user &user = generator->users[events[i].data.u32];
+            ssize_t received = recv(user.socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+            if (received > 0)
+                generator->consume(user, buffer, received);
+            else if (received == 0 || (errno != EAGAIN && errno != EINTR))
+                epoll_ctl(generator->epoll_fd, EPOLL_CTL_DEL, user.socket, NULL);
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+void LoadGenerator::consume(bench_user &user, const char *data, size_t size)
+{
+    alignas(packet) char header_buffer[sizeof(packet)];                 // Aligned copy of the packet header
+    alignas(message_record) char record_buffer[sizeof(message_record)]; // Aligned copy of the message record header
+    alignas(partition_map) char map_buffer[sizeof(partition_map)];      // Aligned copy of a partition map header
+    packet *header = (packet *)header_buffer;
+    message_record *record = (message_record *)record_buffer;
+    partition_map *map = (partition_map *)map_buffer;
+    size_t offset = 0;
+
+    user.input.insert(user.input.end(), data, data + size);
+
+    while (user.input.size() - offset >= sizeof(packet))
+    {
+        memcpy((void *)header, user.input.data() + offset, sizeof(packet));
+        if (user.input.size() - offset < sizeof(packet) + header->length)
+            break;
+
+        const char *payload = user.input.data() + offset + sizeof(packet);
+
+        // Only chat messages posted by the generator are measured
+        if (header->type == PAK_DATA && header->length > sizeof(message_record))
+        {
+            memcpy((void *)record, payload, sizeof(message_record));
+            const char *text = payload + sizeof(message_record);
+            size_t text_size = header->length - sizeof(message_record);
+
+            if (record->type == USER_MESSAGE && text_size > strlen(BENCH_PREFIX) && strncmp(text, BENCH_PREFIX, strlen(BENCH_PREFIX)) == 0)
+            {
+                uint64_t sent = strtoull(text + strlen(BENCH_PREFIX), NULL, 10);
+                uint64_t current = LoadGenerator::now();
+
+                // Only messages posted in this run are measured, history replays are older
+                if (sent >= post_start && post_start > 0)
+                {
+                    latencies.push_back(current - sent);
+                    delivered++;
+                    post_end = current;
+                }
+            }
+        }
+
+        // A partitioned cluster refused the login, it must be made at the replica leading the group
+        if (header->type == PAK_PARTITION_MAP && header->length >= sizeof(partition_map))
+        {
+            memcpy((void *)map, payload, sizeof(partition_map));
+            if (map->redirect)
+                user.redirect = map->owner;
+        }
+
+        offset += sizeof(packet) + header->length;
+    }
+
+    user.input.erase(user.input.begin(), user.input.begin() + offset);
+
+    // Answered once the redirect, if any, is known
+    if (!user.answered)
+    {
+        user.answered = true;
+        answered++;
+    }
+}
+
+uint64_t LoadGenerator::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t LoadGenerator::percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min(sorted.size() - 1, (size_t)std::ceil(p * sorted.size()) - 1)];
+}
@@ -0,0 +1,251 @@
+#include "Logger.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+// Names used in configuration and output, indexed by level and subsystem
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+static const char *subsystem_names[LOG_SUBSYSTEMS] = {"main", "frontend", "replication", "election", "io"};
+
+std::atomic<int> Logger::levels[LOG_SUBSYSTEMS] = {{LOG_INFO}, {LOG_INFO}, {LOG_INFO}, {LOG_INFO}, {LOG_INFO}};
+
+log_slot Logger::ring[LOG_RING_ENTRIES];
+std::atomic<uint64_t> Logger::tail(0);
+uint64_t Logger::head = 0;
+
+pthread_t Logger::writer_thread;
+std::atomic<bool> Logger::running(false);
+
+Counter *Logger::dropped = Metrics::counter("log_lines_dropped_total", "Log lines dropped because the logger's ring was full");
+
+bool Logger::configure(const std::string &levels)
+{
+    int new_levels[LOG_SUBSYSTEMS];
+    size_t start = 0;
+
+    for (int i = 0; i < LOG_SUBSYSTEMS; i++)
+        new_levels[i] = Logger::levels[i];
+
+    // Go through every entry of the list
+    while (start <= levels.size())
+    {
+        size_t end = levels.find(',', start);
+        if (end == std::string::npos)
+            end = levels.size();
+
+        std::string entry = levels.substr(start, end - start);
+        size_t equals = entry.find('=');
+        std::string subsystem = equals == std::string::npos ? "" : entry.substr(0, equals);
+        std::string level = equals == std::string::npos ? entry : entry.substr(equals + 1);
+        int level_value = -1;
+        int subsystem_value = -1;
+
+        for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+            if (level == level_names[i])
+                level_value = i;
+
+        if (level_value < 0)
+            return false;
+
+        // A bare level sets every subsystem
+        if (subsystem.empty())
+        {
+            for (int i = 0; i < LOG_SUBSYSTEMS; i++)
+                new_levels[i] = level_value;
+        }
+        else
+        {
+            for (int i = 0; i < LOG_SUBSYSTEMS; i++)
+                if (subsystem == subsystem_names[i])
+                    subsystem_value = i;
+
+            if (subsystem_value < 0)
+                return false;
+
+            new_levels[subsystem_value] = level_value;
+        }
+
+        start = end + 1;
+    }
+
+    for (int i = 0; i < LOG_SUBSYSTEMS; i++)
+        Logger::levels[i] = new_levels[i];
+
+    return true;
+}
+
+void Logger::start()
+{
+    if (running)
+        return;
+
+    // Every slot starts ready for its first lap
+    for (uint64_t i = 0; i < LOG_RING_ENTRIES; i++)
+        ring[i].sequence = i;
+
+    tail = 0;
+    head = 0;
+
+    running = true;
+    pthread_create(&writer_thread, NULL, writeLines, NULL);
+}
+
+void Logger::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    pthread_join(writer_thread, NULL);
+}
+
+void Logger::log(int subsystem, int level, const char *format, ...)
+{
+    char text[LOG_LINE_MAX]; // Line, when written right away
+    log_slot *slot = NULL;
+    va_list arguments;
+
+    if (!Logger::enabled(subsystem, level))
+        return;
+
+    // No writer thread, write it right away
+    if (!running)
+    {
+        char line[LOG_LINE_MAX + 64];
+
+        va_start(arguments, format);
+        vsnprintf(text, sizeof(text), format, arguments);
+        va_end(arguments);
+
+        int size = Logger::formatLine(line, sizeof(line), Metrics::epochTime(), level, subsystem, text);
+        Logger::output(level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO, line, size);
+
+        return;
+    }
+
+    // Claim a ring position whose slot the writer is done with
+    uint64_t position = tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        slot = &ring[position & (LOG_RING_ENTRIES - 1)];
+        int64_t difference = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)position;
+
+        // Free slot, try to take it
+        if (difference == 0)
+        {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        // The writer has not read this slot yet, the ring is full
+        else if (difference < 0)
+        {
+            dropped->add();
+            return;
+        }
+        // Someone else took it, try the next one
+        else
+            position = tail.load(std::memory_order_relaxed);
+    }
+
+    // Format the line straight into the slot
+    slot->level = level;
+    slot->subsystem = subsystem;
+    slot->time = Metrics::epochTime();
+
+    va_start(arguments, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, arguments);
+    va_end(arguments);
+
+    // Hand it to the writer
+    slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+void *Logger::writeLines(void *arg)
+{
+    while (running)
+    {
+        // Nothing to write, wait a bit
+        if (Logger::drain() == 0)
+            usleep(LOG_FLUSH_US);
+    }
+
+    // Write whatever is left
+    Logger::drain();
+
+    pthread_exit(NULL);
+}
+
+int Logger::drain()
+{
+    char batch[LOG_BATCH_BYTES]; // Lines written at once
+    size_t batch_size = 0;       // Bytes in the batch
+    int batch_fd = STDOUT_FILENO; // Where the batch goes
+    int lines = 0;
+
+    while (true)
+    {
+        log_slot *slot = &ring[head & (LOG_RING_ENTRIES - 1)];
+
+        // Nothing else was handed over yet
+        if (slot->sequence.load(std::memory_order_acquire) != head + 1)
+            break;
+
+        int fd = slot->level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO;
+
+        // Keep the order of the lines: write the batch before switching streams or overflowing it
+        if (batch_size > 0 && (fd != batch_fd || batch_size + LOG_LINE_MAX + 64 > sizeof(batch)))
+        {
+            Logger::output(batch_fd, batch, batch_size);
+            batch_size = 0;
+        }
+
+        batch_fd = fd;
+        batch_size += Logger::formatLine(batch + batch_size, sizeof(batch) - batch_size, slot->time, slot->level, slot->subsystem, slot->text);
+
+        // Give the slot back for the next lap
+        slot->sequence.store(head + LOG_RING_ENTRIES, std::memory_order_release);
+        head++;
+        lines++;
+    }
+
+    if (batch_size > 0)
+        Logger::output(batch_fd, batch, batch_size);
+
+    return lines;
+}
+
+void Logger::output(int fd, const char *data, size_t size)
+{
+    ssize_t written = 0;
+
+    // Write everything, unless the stream is gone
+    while (size > 0 && (written = write(fd, data, size)) > 0)
+    {
+        data += written;
+        size -= written;
+    }
+}
+
+int Logger::formatLine(char *buffer, size_t size, uint64_t time, int level, int subsystem, const char *text)
+{
+    time_t seconds = time / 1000000;
+    struct tm local;
+    int written = 0;
+
+    localtime_r(&seconds, &local);
+
+    written = snprintf(buffer, size, "%02d:%02d:%02d.%03d %-5s %s: %s\n",
+                       local.tm_hour, local.tm_min, local.tm_sec, (int)(time % 1000000 / 1000),
+                       level_names[level], subsystem_names[subsystem], text);
+
+    // Truncated lines still end with a newline
+    if (written >= (int)size)
+    {
+        buffer[size - 2] = '\n';
+        written = size - 1;
+    }
+
+    return written;
+}
@@ -0,0 +1,142 @@
+#include <new>
+
+#include "MemoryPool.h"
+
+std::atomic<long> MemoryPool::live_objects;
+std::atomic<long> MemoryPool::peak_objects;
+std::atomic<long> MemoryPool::allocations;
+std::atomic<long> MemoryPool::spills;
+thread_local long MemoryPool::acquired = 0;
+
+// Header placed before every block handed out by the pool
+typedef struct __pool_block
+{
+    struct __pool_block *next; // Next free block, while the block is in a cache
+    int size_class;            // Size class of the block, -1 if it came straight from the global allocator
+    int padding;               // Keeps the user data 16-byte aligned
+
+} pool_block;
+
+// Per-thread cache of free blocks, one list for each size class
+class ThreadCache
+{
+public:
+    pool_block *free_list[POOL_CLASSES]; // Free blocks for each size class
+    int free_count[POOL_CLASSES];        // Number of blocks in each free list
+
+    ThreadCache()
+    {
+        bzero((void *)free_list, sizeof(free_list));
+        bzero((void *)free_count, sizeof(free_count));
+    }
+
+    // Give every cached block back to the global allocator when the thread exits
+    ~ThreadCache()
+    {
+        pool_block *block = NULL;
+
+        for (int i = 0; i < POOL_CLASSES; i++)
+        {
+            while ((block = free_list[i]) != NULL)
+            {
+                free_list[i] = block->next;
+                free(block);
+            }
+        }
+    }
+};
+
+static thread_local ThreadCache cache;
+
+int MemoryPool::sizeClass(size_t size)
+{
+    size_t class_size = POOL_MIN_BLOCK;
+
+    // Find the first class that fits the requested size
+    for (int i = 0; i < POOL_CLASSES; i++, class_size <<= 1)
+    {
+        if (size <= class_size)
+            return i;
+    }
+
+    // Too big for any class
+    return -1;
+}
+
+void *MemoryPool::allocate(size_t size)
+{
+    int size_class = MemoryPool::sizeClass(size);
+    pool_block *block = NULL;
+
+    // Try to reuse a block cached by this thread
+    if (size_class >= 0 && (block = cache.free_list[size_class]) != NULL)
+    {
+        cache.free_list[size_class] = block->next;
+        cache.free_count[size_class]--;
+    }
+    // If there is none, spill to the global allocator
+    else
+    {
+        block = (pool_block *)malloc(sizeof(pool_block) + (size_class >= 0 ? (size_t)POOL_MIN_BLOCK << size_class : size));
+        if (block == NULL)
+            throw std::bad_alloc();
+
+        block->size_class = size_class;
+        spills++;
+    }
+
+    // Update counters
+    allocations++;
+    acquired++;
+    long live = ++live_objects;
+    long peak = peak_objects;
+    while (live > peak && !peak_objects.compare_exchange_weak(peak, live))
+        ;
+
+    // Initialize requested bytes to zero
+    bzero((void *)(block + 1), size);
+
+    return (void *)(block + 1);
+}
+
+void MemoryPool::release(void *data)
+{
+    if (data == NULL)
+        return;
+
+    pool_block *block = (pool_block *)data - 1;
+
+    live_objects--;
+
+    // Keep the block in this thread's cache if it belongs to a size class and there is room for it
+    if (block->size_class >= 0 && cache.free_count[block->size_class] < POOL_CACHE_MAX)
+    {
+        block->next = cache.free_list[block->size_class];
+        cache.free_list[block->size_class] = block;
+        cache.free_count[block->size_class]++;
+    }
+    // If not, give it back to the global allocator
+    else
+    {
+        free(block);
+    }
+}
+
+long MemoryPool::acquiredByThread()
+{
+    return acquired;
+}
+
+void MemoryPool::listStats()
+{
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Live objects: " << live_objects << std::endl;
+    std::cout << "Peak objects: " << peak_objects << std::endl;
+    std::cout << "Allocations: " << allocations << std::endl;
+    std::cout << "Spills to global allocator: " << spills << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
@@ -0,0 +1,318 @@
+#include "Metrics.h"
+
+#include <iostream>
+#include <set>
+
+pthread_mutex_t Metrics::registry_lock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<int> Metrics::next_shard(0);
+
+Counter::Counter()
+{
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        shards[i].value = 0;
+}
+
+long Counter::value() const
+{
+    long total = 0;
+
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        total += shards[i].value.load(std::memory_order_relaxed);
+
+    return total;
+}
+
+Histogram::Histogram()
+{
+    for (int i = 0; i < METRICS_SHARDS; i++)
+    {
+        for (int j = 0; j < METRICS_BUCKETS; j++)
+            shards[i].buckets[j] = 0;
+
+        shards[i].count = 0;
+        shards[i].sum = 0;
+    }
+}
+
+uint64_t Histogram::count() const
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        total += shards[i].count.load(std::memory_order_relaxed);
+
+    return total;
+}
+
+uint64_t Histogram::sum() const
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        total += shards[i].sum.load(std::memory_order_relaxed);
+
+    return total;
+}
+
+std::vector<uint64_t> Histogram::snapshot() const
+{
+    std::vector<uint64_t> buckets(METRICS_BUCKETS, 0);
+
+    for (int i = 0; i < METRICS_SHARDS; i++)
+        for (int j = 0; j < METRICS_BUCKETS; j++)
+            buckets[j] += shards[i].buckets[j].load(std::memory_order_relaxed);
+
+    return buckets;
+}
+
+uint64_t Histogram::percentile(const std::vector<uint64_t> &buckets, double p)
+{
+    uint64_t total = 0;
+    uint64_t seen = 0;
+
+    for (uint64_t bucket_count : buckets)
+        total += bucket_count;
+
+    if (total == 0)
+        return 0;
+
+    // Rank of the value at the percentile, at least the first one
+    uint64_t rank = (uint64_t)(p * total);
+    if (rank == 0)
+        rank = 1;
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return Histogram::bucketLimit(i);
+    }
+
+    return Histogram::bucketLimit(buckets.size() - 1);
+}
+
+uint64_t Histogram::bucketLimit(int bucket)
+{
+    // Small values are exact
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket;
+
+    int exponent = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    int sub_bucket = bucket % METRICS_SUB_BUCKETS;
+    uint64_t width = 1ULL << (exponent - METRICS_SUB_BITS);
+
+    return (1ULL << exponent) + (sub_bucket + 1) * width - 1;
+}
+
+Counter *Metrics::counter(const std::string &name, const std::string &help)
+{
+    Counter *found_counter = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+
+    auto found = counters().find(name);
+    if (found != counters().end())
+        found_counter = found->second;
+    else
+    {
+        found_counter = new Counter();
+        counters().insert(std::make_pair(name, found_counter));
+        helps().insert(std::make_pair(Metrics::family(name), help));
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return found_counter;
+}
+
+Counter *Metrics::counter(const std::string &name, const std::string &label, const std::string &value, const std::string &help)
+{
+    std::string series = name + "{" + label + "=\"" + Metrics::escapeLabel(value) + "\"}";
+    std::string prefix = name + "{";
+    int series_count = 0; // Series the family already has
+
+    Counter *found_counter = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+
+    auto found = counters().find(series);
+    if (found == counters().end())
+    {
+        // Count the family's series, they are next to each other in the registry
+        for (auto i = counters().lower_bound(prefix); i != counters().end() && i->first.compare(0, prefix.size(), prefix) == 0; ++i)
+            series_count++;
+
+        // Too many already, fold this value into the shared one
+        if (series_count >= METRICS_SERIES_MAX)
+        {
+            series = name + "{" + label + "=\"other\"}";
+            found = counters().find(series);
+        }
+    }
+
+    if (found != counters().end())
+        found_counter = found->second;
+    else
+    {
+        found_counter = new Counter();
+        counters().insert(std::make_pair(series, found_counter));
+        helps().insert(std::make_pair(name, help));
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return found_counter;
+}
+
+Histogram *Metrics::histogram(const std::string &name, const std::string &help)
+{
+    Histogram *found_histogram = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+
+    auto found = histograms().find(name);
+    if (found != histograms().end())
+        found_histogram = found->second;
+    else
+    {
+        found_histogram = new Histogram();
+        histograms().insert(std::make_pair(name, found_histogram));
+        helps().insert(std::make_pair(Metrics::family(name), help));
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return found_histogram;
+}
+
+void Metrics::listStats()
+{
+    pthread_mutex_lock(&registry_lock);
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    for (auto const &entry : counters())
+        std::cout << entry.first << ": " << entry.second->value() << std::endl;
+
+    for (auto const &entry : histograms())
+    {
+        std::vector<uint64_t> buckets = entry.second->snapshot();
+        uint64_t values = entry.second->count();
+
+        std::cout << entry.first << ": count " << values
+                  << ", mean " << (values > 0 ? entry.second->sum() / values : 0)
+                  << ", p50 " << Histogram::percentile(buckets, 0.50)
+                  << ", p99 " << Histogram::percentile(buckets, 0.99)
+                  << ", p999 " << Histogram::percentile(buckets, 0.999) << std::endl;
+    }
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void Metrics::exposition(std::ostream &output)
+{
+    std::set<std::string> described; // Families whose HELP and TYPE lines were written
+
+    pthread_mutex_lock(&registry_lock);
+
+    for (auto const &entry : counters())
+    {
+        std::string name = Metrics::family(entry.first);
+
+        if (described.insert(name).second)
+        {
+            output << "# HELP " << name << " " << helps()[name] << "\n";
+            output << "# TYPE " << name << " counter\n";
+        }
+
+        output << entry.first << " " << entry.second->value() << "\n";
+    }
+
+    for (auto const &entry : histograms())
+    {
+        std::string name = Metrics::family(entry.first);
+        std::string label_list = Metrics::labels(entry.first);
+        std::string prefix = label_list.empty() ? "{" : "{" + label_list + ",";
+        std::string suffix = label_list.empty() ? "" : "{" + label_list + "}";
+        std::vector<uint64_t> buckets = entry.second->snapshot();
+        uint64_t cumulative = 0;
+
+        if (described.insert(name).second)
+        {
+            output << "# HELP " << name << " " << helps()[name] << "\n";
+            output << "# TYPE " << name << " histogram\n";
+        }
+
+        // Only the buckets that hold values, the others add nothing to the cumulative counts
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            if (buckets[i] == 0)
+                continue;
+
+            cumulative += buckets[i];
+            output << name << "_bucket" << prefix << "le=\"" << Histogram::bucketLimit(i) << "\"} " << cumulative << "\n";
+        }
+
+        output << name << "_bucket" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+        output << name << "_sum" << suffix << " " << entry.second->sum() << "\n";
+        output << name << "_count" << suffix << " " << cumulative << "\n";
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+}
+
+std::string Metrics::family(const std::string &name)
+{
+    return name.substr(0, name.find('{'));
+}
+
+std::string Metrics::labels(const std::string &name)
+{
+    size_t start = name.find('{');
+
+    if (start == std::string::npos || name.back() != '}')
+        return "";
+
+    return name.substr(start + 1, name.size() - start - 2);
+}
+
+std::string Metrics::escapeLabel(const std::string &value)
+{
+    std::string escaped;
+
+    for (char c : value)
+    {
+        if (c == '\\')
+            escaped += "\\\\";
+        else if (c == '"')
+            escaped += "\\\"";
+        else if (c == '\n')
+            escaped += "\\n";
+        else
+            escaped += c;
+    }
+
+    return escaped;
+}
+
+std::map<std::string, Counter *> &Metrics::counters()
+{
+    static std::map<std::string, Counter *> registered;
+    return registered;
+}
+
+std::map<std::string, Histogram *> &Metrics::histograms()
+{
+    static std::map<std::string, Histogram *> registered;
+    return registered;
+}
+
+std::map<std::string, std::string> &Metrics::helps()
+{
+    static std::map<std::string, std::string> registered;
+    return registered;
+}
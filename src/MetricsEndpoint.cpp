@@ -0,0 +1,130 @@
+#include "MetricsEndpoint.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <errno.h>
+
+int MetricsEndpoint::listen_socket = -1;
+pthread_t MetricsEndpoint::endpoint_thread;
+std::atomic<bool> MetricsEndpoint::running(false);
+metrics_collector MetricsEndpoint::collector = NULL;
+
+void MetricsEndpoint::start(int port, metrics_collector collector)
+{
+    struct sockaddr_in address;
+    int yes = 1;
+
+    MetricsEndpoint::collector = collector;
+
+    // Create the listening socket
+    if ((listen_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        throw std::runtime_error("Error creating the metrics socket (" + std::string(strerror(errno)) + ")");
+
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    bzero((void *)&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listen_socket, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_socket, METRICS_BACKLOG) < 0)
+    {
+        close(listen_socket);
+        listen_socket = -1;
+        throw std::runtime_error("Error binding the metrics socket to port " + std::to_string(port) + " (" + std::string(strerror(errno)) + ")");
+    }
+
+    running = true;
+    pthread_create(&endpoint_thread, NULL, serve, NULL);
+
+    Logger::log(LOG_MAIN, LOG_INFO, "Serving metrics at port %d", port);
+}
+
+void MetricsEndpoint::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+
+    // Wake the endpoint thread from accept
+    shutdown(listen_socket, SHUT_RDWR);
+    pthread_join(endpoint_thread, NULL);
+
+    close(listen_socket);
+    listen_socket = -1;
+}
+
+void MetricsEndpoint::describe(std::ostream &output, const std::string &family, const std::string &type, const std::string &help)
+{
+    output << "# HELP " << family << " " << help << "\n";
+    output << "# TYPE " << family << " " << type << "\n";
+}
+
+void *MetricsEndpoint::serve(void *arg)
+{
+    int socket = -1;
+
+    while (running)
+    {
+        if ((socket = accept(listen_socket, NULL, NULL)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            break;
+        }
+
+        MetricsEndpoint::answer(socket);
+        close(socket);
+    }
+
+    pthread_exit(NULL);
+}
+
+void MetricsEndpoint::answer(int socket)
+{
+    struct timeval timeout = {1, 0}; // Slow scrapers are not waited for
+    std::string request;             // Request received so far
+    std::ostringstream body;         // Scrape being answered
+    std::ostringstream response;     // Complete response
+    char buffer[1024];
+    ssize_t received = 0;
+
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Read until the end of the headers
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < METRICS_REQUEST_MAX &&
+           (received = recv(socket, buffer, sizeof(buffer), 0)) > 0)
+        request.append(buffer, received);
+
+    // Only the metrics path exists
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0)
+    {
+        Metrics::exposition(body);
+
+        if (collector != NULL)
+            collector(body);
+
+        response << "HTTP/1.1 200 OK\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n";
+    }
+    else
+    {
+        body << "Not found, metrics are served at /metrics\n";
+
+        response << "HTTP/1.1 404 Not Found\r\n"
+                 << "Content-Type: text/plain\r\n";
+    }
+
+    response << "Content-Length: " << body.str().size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body.str();
+
+    std::string data = response.str();
+    size_t sent = 0;
+    ssize_t written = 0;
+
+    while (sent < data.size() && (written = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL)) > 0)
+        sent += written;
+}
@@ -0,0 +1,402 @@
+#include "MicroBenchmark.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <random>
+#include <sys/stat.h>
+
+MicroBenchmark::MicroBenchmark(long iterations, int repeats, int warmup, int cpu, unsigned seed, int payload_size, int members, const std::string &filter)
+{
+    std::mt19937 generator(seed);
+    int buffer_size = 1 << 20;
+
+    if (iterations <= 0 || repeats <= 0 || warmup < 0)
+        throw std::runtime_error("Invalid benchmark parameters, iterations and repeats must be > 0");
+
+    if (payload_size <= 0 || payload_size >= MESSAGE_MAX)
+        throw std::runtime_error("Invalid payload size, must be between 1 and " + std::to_string(MESSAGE_MAX - 1));
+
+    if (members < 2)
+        throw std::runtime_error("Invalid number of members, must be at least 2");
+
+    this->iterations = iterations;
+    this->repeats = repeats;
+    this->warmup = warmup;
+    this->cpu = cpu;
+    this->seed = seed;
+    this->payload_size = payload_size;
+    this->members = members;
+    this->filter = filter;
+    this->pinned = false;
+    this->fanout_blocks = 0;
+    this->fanout_copies = 0;
+    this->broadcast_blocks = -1;
+    this->broadcast_copies = -1;
+
+    // Pin the process, so every repetition runs on the same core
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        this->pinned = sched_setaffinity(0, sizeof(set), &set) == 0;
+
+        if (!this->pinned)
+            std::cerr << "Could not pin the process to CPU " << cpu << ", running unpinned" << std::endl;
+    }
+
+    // Printable message text, the same for every run with this seed
+    for (int i = 0; i < payload_size; i++)
+        text.push_back('a' + generator() % 26);
+
+    // Socketpair for the socket cases, with room for a whole batch
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0)
+        throw std::runtime_error(CommunicationUtils::appendErrorMessage("Error creating the socketpair"));
+
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockets[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockets[1], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sockets[0], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+}
+
+MicroBenchmark::~MicroBenchmark()
+{
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
+void MicroBenchmark::run()
+{
+    measure("composeMessage", &MicroBenchmark::benchComposeMessage);
+    measure("composePacket", &MicroBenchmark::benchComposePacket);
+    measure("sendPacket", &MicroBenchmark::benchSendPacket);
+    measure("receivePacket", &MicroBenchmark::benchReceivePacket);
+    measure("composeMessageUpdate", &MicroBenchmark::benchComposeMessageUpdate);
+    measure("RW_Monitor.read", &MicroBenchmark::benchMonitorRead);
+    measure("RW_Monitor.write", &MicroBenchmark::benchMonitorWrite);
+
+    if (filter.empty() || std::string("broadcast").find(filter) != std::string::npos)
+    {
+        this->joinMembers();
+        measure("broadcast", &MicroBenchmark::benchBroadcast);
+        this->countBroadcast();
+        this->leaveMembers();
+    }
+}
+
+void MicroBenchmark::report(std::ostream &output)
+{
+    output << "{" << std::endl;
+    output << "  \"iterations\": " << iterations << "," << std::endl;
+    output << "  \"repeats\": " << repeats << "," << std::endl;
+    output << "  \"warmup\": " << warmup << "," << std::endl;
+    output << "  \"cpu\": " << cpu << "," << std::endl;
+    output << "  \"pinned\": " << (pinned ? "true" : "false") << "," << std::endl;
+    output << "  \"seed\": " << seed << "," << std::endl;
+    output << "  \"payload_bytes\": " << payload_size << "," << std::endl;
+    output << "  \"members\": " << members << "," << std::endl;
+    output << "  \"broadcast_pool_blocks\": " << broadcast_blocks << "," << std::endl;
+    output << "  \"broadcast_payload_copies\": " << broadcast_copies << "," << std::endl;
+    output << "  \"results\": [";
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        std::vector<double> sorted(results[i].samples);
+        std::sort(sorted.begin(), sorted.end());
+
+        output << (i > 0 ? "," : "") << std::endl;
+        output << "    {" << std::endl;
+        output << "      \"name\": \"" << results[i].name << "\"," << std::endl;
+        output << "      \"ns_per_op\": {\"min\": " << sorted.front() << ", \"median\": " << sorted[sorted.size() / 2] << ", \"max\": " << sorted.back() << "}," << std::endl;
+        output << "      \"samples\": [";
+        for (size_t j = 0; j < results[i].samples.size(); j++)
+            output << (j > 0 ? ", " : "") << results[i].samples[j];
+        output << "]" << std::endl;
+        output << "    }";
+    }
+
+    output << std::endl
+           << "  ]" << std::endl;
+    output << "}" << std::endl;
+}
+
+long MicroBenchmark::broadcastBlocks() const
+{
+    return broadcast_blocks;
+}
+
+long MicroBenchmark::broadcastCopies() const
+{
+    return broadcast_copies;
+}
+
+void MicroBenchmark::measure(const std::string &name, bench_case function)
+{
+    bench_result result;
+
+    if (!filter.empty() && name.find(filter) == std::string::npos)
+        return;
+
+    result.name = name;
+
+    // Warm caches and the memory pool up, these runs are not kept
+    for (int i = 0; i < warmup; i++)
+        (this->*function)(iterations);
+
+    for (int i = 0; i < repeats; i++)
+        result.samples.push_back((double)(this->*function)(iterations) / iterations);
+
+    results.push_back(result);
+}
+
+void MicroBenchmark::countBroadcast()
+{
+    // Fill the memory pool's free lists first
+    for (int i = 0; i < std::max(warmup, 1); i++)
+        benchBroadcast(MICROBENCH_BATCH);
+
+    fanout_blocks = 0;
+    fanout_copies = 0;
+    benchBroadcast(iterations);
+    broadcast_blocks = fanout_blocks;
+    broadcast_copies = fanout_copies;
+}
+
+void MicroBenchmark::joinMembers()
+{
+    int buffer_size = 1 << 20;
+    int pair[2];
+
+    // Members get every frame written right away, the case then drains them
+    CoalescingWriter::configure(0, COALESCE_MAX_BYTES, false);
+    mkdir(HIST_PATH, 0755);
+
+    for (int i = 0; i < members; i++)
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+            throw std::runtime_error(CommunicationUtils::appendErrorMessage("Error creating a member's socketpair"));
+
+        setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+        setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+        setsockopt(pair[0], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+        // The session owns the server end, and closes it when it leaves
+        clients.push_back(pair[0]);
+        sessions.push_back(new Session("member" + std::to_string(i), MICROBENCH_GROUP, pair[1]));
+
+        if (!sessions.back()->isOpen())
+            throw std::runtime_error("Member " + std::to_string(i) + " could not join the group");
+    }
+}
+
+void MicroBenchmark::leaveMembers()
+{
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+        delete sessions[i];
+        close(clients[i]);
+    }
+
+    sessions.clear();
+    clients.clear();
+}
+
+uint64_t MicroBenchmark::benchComposeMessage(long count)
+{
+    uint64_t start = MicroBenchmark::now();
+
+    for (long i = 0; i < count; i++)
+    {
+        PoolHandle<message_record> message = CommunicationUtils::composeMessage("bench", text, USER_MESSAGE);
+    }
+
+    return MicroBenchmark::now() - start;
+}
+
+uint64_t MicroBenchmark::benchComposePacket(long count)
+{
+    PoolHandle<message_record> message = CommunicationUtils::composeMessage("bench", text, USER_MESSAGE);
+    int message_size = sizeof(message_record) + message->length;
+    uint64_t start = MicroBenchmark::now();
+
+    for (long i = 0; i < count; i++)
+    {
+        PoolHandle<packet> data = CommunicationUtils::composePacket(PAK_DATA, (char *)message.get(), message_size);
+    }
+
+    return MicroBenchmark::now() - start;
+}
+
+uint64_t MicroBenchmark::benchSendPacket(long count)
+{
+    PoolHandle<message_record> message = CommunicationUtils::composeMessage("bench", text, USER_MESSAGE);
+    int message_size = sizeof(message_record) + message->length;
+    uint64_t elapsed = 0;
+
+    // Send in batches, the other end is drained between them (not timed)
+    for (long done = 0; done < count;)
+    {
+        long batch = std::min((long)MICROBENCH_BATCH, count - done);
+        uint64_t start = MicroBenchmark::now();
+
+        for (long i = 0; i < batch; i++)
+            CommunicationUtils::sendPacket(sockets[0], PAK_DATA, (char *)message.get(), message_size);
+
+        elapsed += MicroBenchmark::now() - start;
+
+        MicroBenchmark::drain(sockets[1], batch * (sizeof(packet) + message_size));
+        done += batch;
+    }
+
+    return elapsed;
+}
+
+uint64_t MicroBenchmark::benchReceivePacket(long count)
+{
+    PoolHandle<message_record> message = CommunicationUtils::composeMessage("bench", text, USER_MESSAGE);
+    int message_size = sizeof(message_record) + message->length;
+    PoolHandle<packet> data = CommunicationUtils::composePacket(PAK_DATA, (char *)message.get(), message_size);
+    int packet_size = sizeof(packet) + message_size;
+    std::vector<char> batch_bytes;
+    char buffer[PACKET_MAX];
+    uint64_t elapsed = 0;
+
+    // A whole batch of packets, written at once
+    for (int i = 0; i < MICROBENCH_BATCH; i++)
+        batch_bytes.insert(batch_bytes.end(), (char *)data.get(), (char *)data.get() + packet_size);
+
+    // Fill the other end in batches (not timed), then receive them one by one
+    for (long done = 0; done < count;)
+    {
+        long batch = std::min((long)MICROBENCH_BATCH, count - done);
+
+        if (write(sockets[0], batch_bytes.data(), batch * packet_size) != batch * packet_size)
+            throw std::runtime_error(CommunicationUtils::appendErrorMessage("Error filling the socketpair"));
+
+        uint64_t start = MicroBenchmark::now();
+
+        for (long i = 0; i < batch; i++)
+            CommunicationUtils::receivePacket(sockets[1], buffer, PACKET_MAX);
+
+        elapsed += MicroBenchmark::now() - start;
+        done += batch;
+    }
+
+    return elapsed;
+}
+
+uint64_t MicroBenchmark::benchComposeMessageUpdate(long count)
+{
+    PoolHandle<message_record> message = CommunicationUtils::composeMessage("bench", text, USER_MESSAGE);
+    std::string groupname("benchgroup");
+    uint64_t start = MicroBenchmark::now();
+
+    for (long i = 0; i < count; i++)
+    {
+        PoolHandle<message_update> update = CommunicationUtils::composeMessageUpdate(message.get(), groupname, sockets[0]);
+    }
+
+    return MicroBenchmark::now() - start;
+}
+
+uint64_t MicroBenchmark::benchBroadcast(long count)
+{
+    MessageBuffer message("member0", text, USER_MESSAGE);
+    Session *poster = sessions.front();
+    uint64_t elapsed = 0;
+
+    // The first member's client end sends a batch (not timed), its session receives and posts it to the group
+    for (long done = 0; done < count;)
+    {
+        long batch = std::min((long)MICROBENCH_BATCH, count - done);
+
+        for (long i = 0; i < batch; i++)
+            CommunicationUtils::sendFrame(clients.front(), message);
+
+        uint64_t start = MicroBenchmark::now();
+
+        for (long i = 0; i < batch; i++)
+        {
+            Frame received;
+
+            if (CommunicationUtils::receiveFrame(poster->getId(), received) <= 0 || !CommunicationUtils::validateMessage(received))
+                throw std::runtime_error("Error receiving a posted frame");
+
+            // Only the receive may take a block, or copy the payload
+            long blocks = MemoryPool::acquiredByThread();
+            long copies = Frame::copiedByThread();
+
+            MessageBuffer posted(std::move(received));
+            poster->stampMessage(posted);
+            poster->messageGroup(posted);
+
+            fanout_blocks += MemoryPool::acquiredByThread() - blocks;
+            fanout_copies += Frame::copiedByThread() - copies;
+        }
+
+        elapsed += MicroBenchmark::now() - start;
+
+        // Every member (the poster included) got the batch
+        for (size_t i = 0; i < clients.size(); i++)
+            MicroBenchmark::drain(clients[i], batch * message.size());
+
+        done += batch;
+    }
+
+    return elapsed;
+}
+
+uint64_t MicroBenchmark::benchMonitorRead(long count)
+{
+    RW_Monitor monitor("MicroBenchmark::monitor");
+    uint64_t start = MicroBenchmark::now();
+
+    for (long i = 0; i < count; i++)
+    {
+        // Request read rights
+        monitor.requestRead();
+
+        // Release read rights
+        monitor.releaseRead();
+    }
+
+    return MicroBenchmark::now() - start;
+}
+
+uint64_t MicroBenchmark::benchMonitorWrite(long count)
+{
+    RW_Monitor monitor("MicroBenchmark::monitor");
+    uint64_t start = MicroBenchmark::now();
+
+    for (long i = 0; i < count; i++)
+    {
+        // Request write rights
+        monitor.requestWrite();
+
+        // Release write rights
+        monitor.releaseWrite();
+    }
+
+    return MicroBenchmark::now() - start;
+}
+
+void MicroBenchmark::drain(int socket, size_t size)
+{
+    char buffer[65536];
+
+    while (size > 0)
+    {
+        ssize_t received = read(socket, buffer, std::min(size, sizeof(buffer)));
+        if (received <= 0)
+            throw std::runtime_error(CommunicationUtils::appendErrorMessage("Error draining the socketpair"));
+
+        size -= received;
+    }
+}
+
+uint64_t MicroBenchmark::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
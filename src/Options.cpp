@@ -0,0 +1,48 @@
+#include <cstdlib>
+
+#include "Options.h"
+
+std::map<std::string, std::string> Options::values;
+
+bool Options::parse(int argc, char **argv, int first)
+{
+    for (int i = first; i < argc; i++)
+    {
+        std::string argument(argv[i]);
+
+        // Every option starts with two dashes
+        if (argument.compare(0, 2, "--") != 0 || argument.length() == 2)
+            return false;
+
+        // Split name and value (flags have no value)
+        size_t separator = argument.find('=');
+        if (separator == std::string::npos)
+            values[argument.substr(2)] = "";
+        else
+            values[argument.substr(2, separator - 2)] = argument.substr(separator + 1);
+    }
+
+    return true;
+}
+
+bool Options::has(const std::string &name)
+{
+    return values.find(name) != values.end();
+}
+
+int Options::getInt(const std::string &name, int default_value)
+{
+    auto found = values.find(name);
+
+    if (found == values.end() || found->second.empty())
+        return default_value;
+
+    return atoi(found->second.c_str());
+}
+
+std::string Options::getString(const std::string &name, const std::string &default_value)
+{
+    auto found = values.find(name);
+
+    return found == values.end() ? default_value : found->second;
+}
@@ -0,0 +1,234 @@
+#include "PartitionMap.h"
+
+std::atomic<bool> PartitionMap::partitioned(false);
+std::map<uint64_t, int> PartitionMap::ring;
+std::map<int, int> PartitionMap::owners;
+std::map<int, int> PartitionMap::members;
+std::map<int, uint64_t> PartitionMap::reported;
+int PartitionMap::local = -1;
+uint64_t PartitionMap::epoch = 0;
+RW_Monitor PartitionMap::ring_monitor("PartitionMap::ring_monitor");
+
+void PartitionMap::configure(bool enabled)
+{
+    partitioned = enabled;
+}
+
+bool PartitionMap::enabled()
+{
+    return partitioned;
+}
+
+bool PartitionMap::add(int id, int port, bool local)
+{
+    // Request write rights
+    ring_monitor.requestWrite();
+
+    bool added = members.insert(std::make_pair(id, port)).second;
+
+    if (local)
+        PartitionMap::local = id;
+
+    // Release write rights
+    ring_monitor.releaseWrite();
+
+    return added;
+}
+
+bool PartitionMap::remove(int id)
+{
+    // Request write rights
+    ring_monitor.requestWrite();
+
+    bool removed = members.erase(id) > 0;
+    reported.erase(id);
+
+    // Release write rights
+    ring_monitor.releaseWrite();
+
+    return removed;
+}
+
+void PartitionMap::report(int id, uint64_t digest)
+{
+    // Request write rights
+    ring_monitor.requestWrite();
+
+    reported[id] = digest;
+
+    // Release write rights
+    ring_monitor.releaseWrite();
+}
+
+bool PartitionMap::confirm()
+{
+    char point[32];     // Name of one of a replica's points
+    bool agreed = true; // If every other member reported the same members
+    size_t kept = 0;    // Members of the ring that are still members
+
+    // Request write rights
+    ring_monitor.requestWrite();
+
+    uint64_t own = PartitionMap::memberDigest();
+
+    for (auto i = members.begin(); i != members.end(); ++i)
+    {
+        auto found = reported.find(i->first);
+        if (i->first != local && (found == reported.end() || found->second != own))
+            agreed = false;
+
+        kept += owners.count(i->first);
+    }
+
+    // The first ring needs no majority, later ones must keep one of the ring they replace
+    agreed = agreed && members != owners && (owners.empty() || kept * 2 > owners.size());
+
+    if (agreed)
+    {
+        owners = members;
+        ring.clear();
+        epoch++;
+
+        // Points only depend on the identifier, so every replica places them alike
+        for (auto i = owners.begin(); i != owners.end(); ++i)
+        {
+            for (int j = 0; j < PARTITION_VNODES; j++)
+            {
+                int length = snprintf(point, sizeof(point), "replica-%d#%d", i->first, j);
+                ring[PartitionMap::hash(point, length)] = i->first;
+            }
+        }
+    }
+
+    // Release write rights
+    ring_monitor.releaseWrite();
+
+    return agreed;
+}
+
+uint64_t PartitionMap::digest()
+{
+    // Request read rights
+    ring_monitor.requestRead();
+
+    uint64_t value = PartitionMap::memberDigest();
+
+    // Release read rights
+    ring_monitor.releaseRead();
+
+    return value;
+}
+
+int PartitionMap::ownerOf(const std::string &groupname, int *port)
+{
+    int owner = -1;
+
+    // Request read rights
+    ring_monitor.requestRead();
+
+    if (!ring.empty())
+    {
+        // First point at or after the group's, wrapping around the ring
+        auto found = ring.lower_bound(PartitionMap::hash(groupname.data(), groupname.size()));
+        if (found == ring.end())
+            found = ring.begin();
+
+        owner = found->second;
+        *port = owners.at(owner);
+    }
+
+    // Release read rights
+    ring_monitor.releaseRead();
+
+    return owner;
+}
+
+int PartitionMap::highest()
+{
+    // Request read rights
+    ring_monitor.requestRead();
+
+    int id = members.empty() ? -1 : members.rbegin()->first;
+
+    // Release read rights
+    ring_monitor.releaseRead();
+
+    return id;
+}
+
+std::vector<uint16_t> PartitionMap::ports()
+{
+    std::vector<uint16_t> listening;
+
+    // Request read rights
+    ring_monitor.requestRead();
+
+    for (auto i = members.begin(); i != members.end(); ++i)
+        listening.push_back(i->second);
+
+    // Release read rights
+    ring_monitor.releaseRead();
+
+    return listening;
+}
+
+void PartitionMap::listStats()
+{
+    std::map<int, uint64_t> owned; // Share of the ring each replica owns, in hash values
+
+    // Request read rights
+    ring_monitor.requestRead();
+
+    // Each point owns the hash values from the previous point, excluded, up to itself
+    uint64_t previous = ring.empty() ? 0 : ring.rbegin()->first;
+    for (auto i = ring.begin(); i != ring.end(); ++i)
+    {
+        owned[i->second] += i->first - previous;
+        previous = i->first;
+    }
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    std::cout << "Partitioning: " << (partitioned ? "on" : "off") << std::endl;
+    std::cout << "Ring epoch: " << epoch << (members == owners ? "" : " (members changed, waiting for the others to agree)") << std::endl;
+    for (auto i = owners.begin(); i != owners.end(); ++i)
+        std::cout << "Replica " << i->first << " (port " << i->second << "): " << std::fixed << std::setprecision(1)
+                  << (owners.size() == 1 ? 100.0 : owned[i->first] * 100.0 / 18446744073709551616.0) << "% of the groups" << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    // Release read rights
+    ring_monitor.releaseRead();
+}
+
+uint64_t PartitionMap::memberDigest()
+{
+    std::string listed; // Identifiers of the members, in order
+
+    for (auto i = members.begin(); i != members.end(); ++i)
+        listed += std::to_string(i->first) + ",";
+
+    return PartitionMap::hash(listed.data(), listed.size());
+}
+
+uint64_t PartitionMap::hash(const char *data, size_t length)
+{
+    uint64_t value = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        value ^= (unsigned char)data[i];
+        value *= 1099511628211ULL;
+    }
+
+    // Finalizer, FNV alone leaves names that differ in their last byte close on the ring
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+
+    return value;
+}
@@ -1,12 +1,36 @@
 #include "RW_Monitor.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 
-RW_Monitor::RW_Monitor()
+Histogram *RW_Monitor::read_waits = Metrics::histogram("lock_wait_us{mode=\"read\"}", "Time (in microseconds) monitor requests waited, only counting requests that had to");
+Histogram *RW_Monitor::write_waits = Metrics::histogram("lock_wait_us{mode=\"write\"}", "Time (in microseconds) monitor requests waited, only counting requests that had to");
+
+// Contention counters by monitor name, created on first use since monitors are built during static initialization
+static std::map<std::string, lock_profile *> &lockProfiles()
+{
+    static std::map<std::string, lock_profile *> profiles;
+    return profiles;
+}
+
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+RW_Monitor::RW_Monitor(const char *name)
 {
     // Initialize reader and writer variables with 0
     num_readers = 0;
     num_writers = 0;
 
+    // Share the contention counters of every monitor with this name
+#ifdef PROFILE_LOCKS
+    profile = RW_Monitor::profileOf(name);
+#else
+    profile = NULL;
+#endif
+    read_since = 0;
+    write_since = 0;
+
     // Initialize condition variables and mutex
     pthread_cond_init( &ok_read, NULL);
     pthread_cond_init( &ok_write, NULL);
@@ -15,42 +39,184 @@ RW_Monitor::RW_Monitor()
 
 void RW_Monitor::requestRead()
 {
-    // Wait until there are no more writers
-    while(this->num_writers > 0) pthread_cond_wait(&ok_read, &lock);
+    uint64_t requested = profile ? RW_Monitor::now() : 0;
+
+    pthread_mutex_lock(&lock);
+
+    // Wait until there are no more writers, timing the wait only when there is one
+    if (this->num_writers > 0)
+    {
+        uint64_t start = Metrics::now();
+
+        while(this->num_writers > 0) pthread_cond_wait(&ok_read, &lock);
+
+        read_waits->record(Metrics::now() - start);
+    }
 
     // Increase reader count
     num_readers++;
+
+    if (profile)
+    {
+        uint64_t granted = RW_Monitor::now();
+
+        profile->acquisitions[0].fetch_add(1, std::memory_order_relaxed);
+        profile->waited[0].fetch_add(granted - requested, std::memory_order_relaxed);
+
+        // The monitor is held for reading from its first reader until its last one leaves
+        if (num_readers == 1)
+            read_since = granted;
+    }
+
+    pthread_mutex_unlock(&lock);
 }
 
 void RW_Monitor::requestWrite()
 {
-    // Wait until there are no more readers or writers
-    while(this->num_writers > 0 || this->num_readers > 0) pthread_cond_wait(&ok_write, &lock);
+    uint64_t requested = profile ? RW_Monitor::now() : 0;
+
+    pthread_mutex_lock(&lock);
+
+    // Wait until there are no more readers or writers, timing the wait only when there is one
+    if (this->num_writers > 0 || this->num_readers > 0)
+    {
+        uint64_t start = Metrics::now();
+
+        while(this->num_writers > 0 || this->num_readers > 0) pthread_cond_wait(&ok_write, &lock);
+
+        write_waits->record(Metrics::now() - start);
+    }
 
     // Increase writer count
     num_writers++;
+
+    if (profile)
+    {
+        write_since = RW_Monitor::now();
+
+        profile->acquisitions[1].fetch_add(1, std::memory_order_relaxed);
+        profile->waited[1].fetch_add(write_since - requested, std::memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&lock);
 }
 
 void RW_Monitor::releaseRead()
 {
+    pthread_mutex_lock(&lock);
+
     // Decrease number of readers
     num_readers--;
 
     // If no readers are left, notify the writer thread
     if (num_readers == 0)
     {
+        if (profile)
+            profile->held[0].fetch_add(RW_Monitor::now() - read_since, std::memory_order_relaxed);
+
         pthread_cond_signal(&ok_write);
     }
+
+    pthread_mutex_unlock(&lock);
 }
 
 void RW_Monitor::releaseWrite()
 {
+    pthread_mutex_lock(&lock);
+
     // Decrease number of writers
     num_writers--;
 
+    if (profile)
+        profile->held[1].fetch_add(RW_Monitor::now() - write_since, std::memory_order_relaxed);
+
     // Signal all reader threads
     pthread_cond_broadcast(&ok_read);
 
     // Signal any writer thread
     pthread_cond_signal(&ok_write);
-}
\ No newline at end of file
+
+    pthread_mutex_unlock(&lock);
+}
+
+void RW_Monitor::listContention()
+{
+    std::vector<lock_profile *> ranked;
+
+#ifndef PROFILE_LOCKS
+    std::cout << "Lock profiling is off, build with 'make PROFILE_LOCKS=1' to enable it" << std::endl;
+    return;
+#endif
+
+    // Copy the profiles, the registry lock is not held while printing
+    pthread_mutex_lock(&profiles_lock);
+    for (auto i = lockProfiles().begin(); i != lockProfiles().end(); ++i)
+        ranked.push_back(i->second);
+    pthread_mutex_unlock(&profiles_lock);
+
+    // Longest total wait first
+    std::sort(ranked.begin(), ranked.end(), [](lock_profile *a, lock_profile *b) {
+        return a->waited[0] + a->waited[1] > b->waited[0] + b->waited[1];
+    });
+
+    if (ranked.size() > LOCK_REPORT_TOP)
+        ranked.resize(LOCK_REPORT_TOP);
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    // Times in microseconds
+    for (lock_profile *profile : ranked)
+    {
+        const char *modes[2] = {"read", "write"};
+        char line[256];
+
+        std::cout << " " << profile->name << std::endl;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            uint64_t acquisitions = profile->acquisitions[mode];
+
+            snprintf(line, sizeof(line), "  %-5s acquisitions=%lu waited=%luus (avg %.2fus) held=%luus",
+                     modes[mode], (unsigned long)acquisitions, (unsigned long)(profile->waited[mode] / 1000),
+                     acquisitions ? profile->waited[mode] / 1000.0 / acquisitions : 0.0,
+                     (unsigned long)(profile->held[mode] / 1000));
+            std::cout << line << std::endl;
+        }
+    }
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+lock_profile *RW_Monitor::profileOf(const char *name)
+{
+    lock_profile *profile = NULL;
+
+    pthread_mutex_lock(&profiles_lock);
+
+    auto found = lockProfiles().find(name);
+    if (found != lockProfiles().end())
+        profile = found->second;
+    else
+    {
+        profile = new lock_profile();
+        profile->name = name;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            profile->acquisitions[mode] = 0;
+            profile->waited[mode] = 0;
+            profile->held[mode] = 0;
+        }
+
+        lockProfiles()[name] = profile;
+    }
+
+    pthread_mutex_unlock(&profiles_lock);
+
+    return profile;
+}
+
+uint64_t RW_Monitor::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
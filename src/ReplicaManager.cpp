@@ -10,28 +10,43 @@ std::map<std::string, command_function> ReplicaManager::available_commands = {
     {"users", &User::listUsers},
     {"threads", &ReplicaManager::listThreads},
     {"leader", &ReplicaManager::currentLeader},
-    {"state", &ReplicaManager::getState}
+    {"state", &ReplicaManager::getState},
+    {"pools", &MemoryPool::listStats},
+    {"io", &CoalescingWriter::listStats},
+    {"loop", &EventLoop::listStats},
+    {"metrics", &Metrics::listStats},
+    {"locks", &RW_Monitor::listContention},
+    {"timers", &TimerWheel::listStats},
+    {"history", &HistoryLog::listStats},
+    {"partitions", &PartitionMap::listStats},
+    {"workers", &WorkerPool::listStats},
+    {"affinity", &Affinity::listStats},
+    {"acceptors", &Acceptor::listStats},
+    {"trace", &Tracer::dump}
 
 };
 pthread_t ReplicaManager::command_handler_thread;
 
 // Client connection logic
 struct sockaddr_in ReplicaManager::server_address;
-struct sockaddr_in ReplicaManager::client_address;
 int ReplicaManager::main_socket;
 
-std::map<int, pthread_t> ReplicaManager::front_end_threads;
-RW_Monitor ReplicaManager::fe_threads_monitor;
+std::set<int> ReplicaManager::front_end_sockets;
+RW_Monitor ReplicaManager::fe_sockets_monitor("ReplicaManager::fe_sockets_monitor");
+
+std::set<int> ReplicaManager::worker_sockets;
+RW_Monitor ReplicaManager::worker_sockets_monitor("ReplicaManager::worker_sockets_monitor");
 
 std::map<int, std::pair<std::string, int>> ReplicaManager::clients;
-RW_Monitor ReplicaManager::clients_monitor;
+RW_Monitor ReplicaManager::clients_monitor("ReplicaManager::clients_monitor");
 
 // Replication logic
 int ReplicaManager::ID;
 int ReplicaManager::port;
-std::map<int, pthread_t> ReplicaManager::replica_manager_threads;
-RW_Monitor ReplicaManager::rm_threads_monitor;
+std::set<int> ReplicaManager::replica_manager_sockets;
+RW_Monitor ReplicaManager::rm_sockets_monitor("ReplicaManager::rm_sockets_monitor");
 pthread_t ReplicaManager::keep_alive_thread;
+std::atomic<bool> ReplicaManager::keep_alive_started(false);
 
 // Election logic
 int ReplicaManager::leader;
@@ -43,12 +58,27 @@ std::atomic<bool> ReplicaManager::got_answer;
 std::atomic<bool> ReplicaManager::election_started;
 
 std::map<int, std::pair<int, int>> ReplicaManager::replicas;
-RW_Monitor ReplicaManager::replicas_monitor;
+RW_Monitor ReplicaManager::replicas_monitor("ReplicaManager::replicas_monitor");
 
 // Business logic
 int ReplicaManager::message_history;
 std::map<int, Session *> ReplicaManager::session_list;
-RW_Monitor ReplicaManager::session_monitor;
+RW_Monitor ReplicaManager::session_monitor("ReplicaManager::session_monitor");
+
+// Metrics
+Histogram *ReplicaManager::replication_lag = Metrics::histogram("replication_lag_us", "Time (in microseconds) between the leader sending a message update and a backup handling it");
+Histogram *ReplicaManager::election_duration = Metrics::histogram("election_duration_us", "Time (in microseconds) elections took, from start to a new leader");
+std::atomic<uint64_t> ReplicaManager::last_election(0);
+Counter *ReplicaManager::reads_served = Metrics::counter("replica_reads_served_total", "Read-only logins a replica accepted, to serve history and search reads");
+Counter *ReplicaManager::reads_refused = Metrics::counter("replica_reads_refused_total", "Read-only logins refused because the replica had not caught up with the reader");
+Counter *ReplicaManager::partition_redirects = Metrics::counter("partition_redirects_total", "Logins and sessions sent to the replica leading their group, in a partitioned cluster");
+Counter *ReplicaManager::partition_refusals = Metrics::counter("partition_refusals_total", "Messages refused because the partition ring gave their group to another replica, in a partitioned cluster");
+
+// Read serving
+std::atomic<uint64_t> ReplicaManager::replication_sequence(0);
+pthread_mutex_t ReplicaManager::sequence_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ReplicaManager::sequence_signal = PTHREAD_COND_INITIALIZER;
+std::atomic<unsigned> ReplicaManager::next_reader(0);
 
 // Other
 std::atomic<bool> ReplicaManager::stop_issued;
@@ -64,22 +94,43 @@ ReplicaManager::ReplicaManager(int history, int port_, int id_, std::string lead
 
     ReplicaManager::election_started = false;
 
+    // Backups mirror the leader's sessions without writing to their clients, partitioned replicas only have their own
+    Session::delivering = this->leader == this->ID || PartitionMap::enabled();
+
+    // Every replica leads a share of the groups, when partitioned (the first one alone, the
+    // others once the cluster agrees on them)
+    PartitionMap::add(this->ID, this->port, true);
+    if (this->leader == this->ID)
+        PartitionMap::confirm();
+
+    // Start the workers that handle the connections
+    WorkerPool::start();
+
     // If this is not the leader replica
     if (this->leader != this->ID)
     {
         // Setup the new connection with leader
         ReplicaManager::leader_socket = ReplicaManager::setupReplicaConnection(leader_port_, leader_ip_, leader_);
 
-        // Spawn thread to communicate with leader, and add it to the list
-        pthread_t leader_communication;
-        pthread_create(&leader_communication, NULL, leaderCommunication, NULL);
+        replica_manager_sockets.insert(leader_socket);
 
-        replica_manager_threads.insert(std::make_pair(leader_socket, leader_communication));
+        // Hand the communication with the leader to a worker
+        if (!WorkerPool::submit(leaderCommunication, NULL))
+            throw std::runtime_error("Could not hand the leader connection to a worker");
     }
 
     // Setup connection
     ReplicaManager::setupLeaderConnection();
 
+    // Start the output coalescing flusher
+    CoalescingWriter::start();
+
+    // Start watching the front-ends' and replicas' liveness
+    TimerWheel::start();
+
+    // Start enforcing history retention and merging small segments
+    HistoryLog::start();
+
     // Spawn thread for listening to administrator commands
     pthread_create(&command_handler_thread, NULL, handleCommands, NULL);
 
@@ -89,8 +140,8 @@ ReplicaManager::ReplicaManager(int history, int port_, int id_, std::string lead
 
 ReplicaManager::~ReplicaManager()
 {
-    // Close client listener socket
-    close(main_socket);
+    // Close client listener sockets
+    Acceptor::release();
 
     // TODO Anything else?
 }
@@ -121,28 +172,16 @@ int ReplicaManager::setupReplicaConnection(int new_replica_port, std::string new
     // Release write rights
     replicas_monitor.releaseWrite();
 
+    // It leads some of the groups, if partitioned
+    ReplicaManager::updateRing(new_replica_id, new_replica_port, true);
+
     return new_socket;
 }
 
 void ReplicaManager::setupLeaderConnection()
 {
-    // Create socket
-    if ((main_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error during socket creation"));
-
-    // Prepare server socket address (Where the server listens at)
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(ReplicaManager::port);
-
-    // Set socket options
-    int yes = 1;
-    if (setsockopt(main_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
-        throw std::runtime_error(appendErrorMessage("Error setting socket options"));
-
-    // Bind socket
-    if (bind(main_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error during socket bind"));
+    // Open and bind a socket for each acceptor (the event loop accepts from a single one)
+    main_socket = Acceptor::open(ReplicaManager::port, !EventLoop::enabled());
 }
 
 int ReplicaManager::setupFrontEndConnection(std::string ip, int port)
@@ -167,127 +206,123 @@ int ReplicaManager::setupFrontEndConnection(std::string ip, int port)
 
 void *ReplicaManager::leaderCommunication(void *arg)
 {
-    replica_update *link_message = NULL;
+    PoolHandle<replica_update> link_message;
 
     // Compose link message
     link_message = CommunicationUtils::composeReplicaUpdate(ReplicaManager::ID, ReplicaManager::port);
 
     // Send link message to current leader
-    CommunicationUtils::sendPacket(ReplicaManager::leader_socket, PAK_LINK, (char *)link_message, sizeof(replica_update));
-
-    // Free data structure
-    free(link_message);
+    CommunicationUtils::sendPacket(ReplicaManager::leader_socket, PAK_LINK, link_message.data(), sizeof(replica_update));
 
     // Spawn thread for keeping replica alive
-    pthread_create(&keep_alive_thread, NULL, keepAlive, NULL);
+    if (pthread_create(&keep_alive_thread, NULL, keepAlive, NULL) == 0)
+        keep_alive_started = true;
 
     // Handle connection with replica manager passing it's socket as argument
-    handleRMConnection((void *)&ReplicaManager::leader_socket);
+    handleRMConnection((void *)(intptr_t)ReplicaManager::leader_socket);
 
     return NULL;
 }
 
 void *ReplicaManager::listenConnections(void *arg)
 {
-    int *new_socket = NULL;
-    size_t sockaddr_size = sizeof(struct sockaddr_in);
-
-    int socket = -1; // New connection socket
-
-    // Set passive listen socket
-    if (listen(main_socket, 3) < 0)
-        throw std::runtime_error(appendErrorMessage("Error setting socket as passive listener"));
+    // Set passive listen sockets
+    Acceptor::listen();
 
     // Output ready info
-    std::cout << "Replica " << ReplicaManager::ID << " ready to receive new connections" << std::endl;
-    std::cout << "Current leader is " << ReplicaManager::leader << std::endl;
+    Logger::log(LOG_MAIN, LOG_INFO, "Replica %d ready to receive new connections", ReplicaManager::ID);
+    Logger::log(LOG_MAIN, LOG_INFO, "Current leader is %d", ReplicaManager::leader);
     ReplicaManager::listCommands();
 
-    // Wait for new connections
-    while (!stop_issued && (socket = accept(main_socket, (struct sockaddr *)&client_address, (socklen_t *)&sockaddr_size)) > 0)
-    {
-        pthread_t new_thread;
-
-        // Get a reference to the socket
-        new_socket = (int *)malloc(sizeof(int));
-        *new_socket = socket;
-
-        // Spawn new thread for handling that connection
-        if (pthread_create(&new_thread, NULL, handleUnkownConnection, (void *)new_socket) < 0)
-        {
-            // Close socket if no thread was created
-            std::cerr << "Could not create thread for socket " << socket << std::endl;
-            close(socket);
-        }
-    }
+    // With an event loop, this thread accepts the connections and receives from every front-end until stopped
+    if (EventLoop::enabled())
+        EventLoop::run(main_socket, &ReplicaManager::acceptConnection, &ReplicaManager::handleFEPacket, &ReplicaManager::closeFEConnection);
+    else
+        // Wait for new connections on every acceptor
+        Acceptor::run(&ReplicaManager::dispatchConnection);
 
     // Issue a stop command
     ReplicaManager::issueStop();
 
-    // Request write rights
-    fe_threads_monitor.requestWrite();
+    Logger::log(LOG_MAIN, LOG_INFO, "Waiting for client and replica communication to end...");
 
-    // Wait for all front end threads to finish
-    for (std::map<int, pthread_t>::iterator i = front_end_threads.begin(); i != front_end_threads.end(); ++i)
-    {
-        std::cout << "Waiting for client communication to end on socket " << i->first << "..." << std::endl;
+    // Wait for every connection handler to end, then for the workers
+    WorkerPool::stop();
 
-        // Join thread
-        pthread_join(i->second, NULL);
-    }
+    // Request write rights
+    fe_sockets_monitor.requestWrite();
 
-    // Clear map
-    front_end_threads.clear();
+    // Clear list
+    front_end_sockets.clear();
 
     // Release write rights
-    fe_threads_monitor.releaseWrite();
+    fe_sockets_monitor.releaseWrite();
 
     // Request write rights
-    rm_threads_monitor.requestWrite();
-
-    // Wait for all replica manager threads to finish
-    for (auto i = replica_manager_threads.begin(); i != replica_manager_threads.end(); ++i)
-    {
-        std::cout << "Waiting for replica communication to end on socket " << i->first << "..." << std::endl;
-
-        // Join thread
-        pthread_join(i->second, NULL);
-    }
+    rm_sockets_monitor.requestWrite();
 
-    // Clear map
-    replica_manager_threads.clear();
+    // Clear list
+    replica_manager_sockets.clear();
 
     // Release write rights
-    rm_threads_monitor.releaseWrite();
+    rm_sockets_monitor.releaseWrite();
 
-    std::cout << "Waiting for command handler to end..." << std::endl;
+    Logger::log(LOG_MAIN, LOG_INFO, "Waiting for command handler to end...");
 
     // Join with the command handler thread
     pthread_join(command_handler_thread, NULL);
 
-    // Join with the keep-alive thread
-    pthread_cancel(ReplicaManager::keep_alive_thread);
-    pthread_join(keep_alive_thread, NULL);
+    // Join with the keep-alive thread, if this replica started one (it sees the stop within SLEEP_TIME)
+    if (keep_alive_started)
+        pthread_join(keep_alive_thread, NULL);
+
+    // Write anything still queued
+    CoalescingWriter::stop();
+    TimerWheel::stop();
+    HistoryLog::stop();
 
     return NULL;
 }
 
+void ReplicaManager::dispatchConnection(int socket)
+{
+    // Hand the connection to a worker
+    if (!WorkerPool::submit(handleUnkownConnection, (void *)(intptr_t)socket))
+    {
+        // Close socket if no worker took it
+        Logger::log(LOG_FRONTEND, LOG_ERROR, "Could not hand socket %d to a worker", socket);
+        close(socket);
+    }
+}
+
 void *ReplicaManager::handleUnkownConnection(void *arg)
 {
-    int socket = *(int *)arg;           // Socket assigned to connection
-    struct timeval timeout;             // Timeout struct
+    int socket = (int)(intptr_t)arg;    // Socket assigned to connection
     char buffer[PACKET_MAX];            // Buffer for message
     int read_bytes = -1;                // Number of bytes read from socket
     packet *received_packet = NULL;     // Received message as a packet structure
     replica_update *new_replica = NULL; // New replica communication info
 
-    pthread_t self = pthread_self(); // Get current thread id
-
     // Clear buffer
     bzero((void *)buffer, PACKET_MAX);
 
-    // Receive first message from connection (Identification as client or replica)
-    read_bytes = CommunicationUtils::receivePacket(socket, buffer, PACKET_MAX);
+    // Shut the connection down if it does not identify itself within USER_TIMEOUT seconds
+    TimerWheel::schedule(socket, USER_TIMEOUT * 1000);
+
+    // Receive first message from connection (Identification as client or replica), unless stopping
+    if (ReplicaManager::listWorkerSocket(socket, true))
+        read_bytes = CommunicationUtils::receivePacket(socket, buffer, PACKET_MAX);
+
+    // Each kind of connection arms its own timer
+    TimerWheel::cancel(socket);
+
+    // Readers stay listed while their reads are served
+    if (read_bytes <= 0 || ((packet *)buffer)->type != PAK_READ_LOGIN)
+        ReplicaManager::listWorkerSocket(socket, false);
+
+    // The connection ended (or timed out) before saying what it is
+    if (read_bytes <= 0)
+        close(socket);
 
     // If message was received ok
     if (read_bytes > 0)
@@ -295,31 +330,49 @@ void *ReplicaManager::handleUnkownConnection(void *arg)
         // Decode message into a packet format
         received_packet = (packet *)buffer;
 
-        std::cout << "Received packet of type " << received_packet->type << " from the new connection on socket " << socket << std::endl;
+        Logger::log(LOG_FRONTEND, LOG_DEBUG, "Received packet of type %d from the new connection on socket %d", received_packet->type, socket);
 
         switch (received_packet->type)
         {
         case PAK_COMMAND: // Login packet, came from a client
 
+            // When partitioned, logins to groups led by another replica are sent there
+            if (ReplicaManager::redirectLogin((message_record *)received_packet->_payload, socket))
+            {
+                close(socket);
+                break;
+            }
+
+            // With an event loop, this thread only handles the login
+            if (EventLoop::enabled())
+            {
+                // Process the new client
+                ReplicaManager::processNewClient((message_record *)received_packet->_payload, socket);
+
+                // Receive next messages in the event loop
+                if (ReplicaManager::getSessionBySocket(socket) != NULL)
+                    EventLoop::watch(socket);
+
+                break;
+            }
+
             // Request write rights
-            fe_threads_monitor.requestWrite();
+            fe_sockets_monitor.requestWrite();
 
-            // Add thread to list of front end handlers
-            front_end_threads.insert(std::make_pair(socket, self));
+            // Add it to the list of front-ends handled by a worker
+            front_end_sockets.insert(socket);
 
             // Release write rights
-            fe_threads_monitor.releaseWrite();
+            fe_sockets_monitor.releaseWrite();
 
-            // Set the keep-alive timer on the socket
-            timeout = {.tv_sec = USER_TIMEOUT, .tv_usec = 0};
-            if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
-                throw std::runtime_error(appendErrorMessage("Error setting socket options"));
+            // Shut the connection down if the front-end stays quiet for USER_TIMEOUT seconds
+            TimerWheel::schedule(socket, USER_TIMEOUT * 1000);
 
             // Process the new client
             ReplicaManager::processNewClient((message_record *)received_packet->_payload, socket);
 
             // Start listening for next messages
-            ReplicaManager::handleFEConnection(&socket);
+            ReplicaManager::handleFEConnection((void *)(intptr_t)socket);
 
             break;
         case PAK_LINK: // Link packet, came from a replica
@@ -328,13 +381,13 @@ void *ReplicaManager::handleUnkownConnection(void *arg)
             new_replica = (replica_update *)(received_packet->_payload);
 
             // Request write rights
-            rm_threads_monitor.requestWrite();
+            rm_sockets_monitor.requestWrite();
 
-            // Add thread to list of replica manager handlers
-            replica_manager_threads.insert(std::make_pair(socket, self));
+            // Add it to the list of replicas handled by a worker
+            replica_manager_sockets.insert(socket);
 
             // Release write rights
-            rm_threads_monitor.releaseWrite();
+            rm_sockets_monitor.releaseWrite();
 
             // Request write rights
             replicas_monitor.requestWrite();
@@ -345,10 +398,11 @@ void *ReplicaManager::handleUnkownConnection(void *arg)
             // Release write rights
             replicas_monitor.releaseWrite();
 
-            // Set the keep-alive timer on the socket
-            timeout = {.tv_sec = REPLICA_TIMEOUT, .tv_usec = 0};
-            if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
-                throw std::runtime_error(appendErrorMessage("Error setting socket options"));
+            // It leads some of the groups, if partitioned
+            ReplicaManager::updateRing(new_replica->identifier, new_replica->port, true);
+
+            // Shut the connection down if the replica stays quiet for REPLICA_TIMEOUT seconds
+            TimerWheel::schedule(socket, REPLICA_TIMEOUT * 1000);
 
             // If this is the leader
             if (ReplicaManager::ID == ReplicaManager::leader)
@@ -358,87 +412,206 @@ void *ReplicaManager::handleUnkownConnection(void *arg)
             }
 
             // Start listening for next messages
-            ReplicaManager::handleRMConnection((void *)&socket);
+            ReplicaManager::handleRMConnection((void *)(intptr_t)socket);
+
+            break;
+        case PAK_READ_LOGIN: // Read-only login, came from a client reading history
+
+            // Serve the reads until the client closes the connection
+            ReplicaManager::handleReader(socket, received_packet);
 
             break;
         default: // Anything else does not make sense
-            std::cerr << "Invalid packet type (" << received_packet->type << ") received from socket " << socket << std::endl;
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Invalid packet type (%d) received from socket %d", received_packet->type, socket);
+            close(socket);
             break;
         }
     }
 
-    // Free received argument
-    free(arg);
-
-    // Exit
-    pthread_exit(NULL);
+    // Give the worker back
+    return NULL;
 }
 
 void *ReplicaManager::handleFEConnection(void *arg)
 {
-    int socket = *(int *)arg;
-    int read_bytes = -1;     // Number of bytes read from socket
-    char buffer[PACKET_MAX]; // Buffer for message
+    int socket = (int)(intptr_t)arg;
+    int read_bytes = -1; // Number of bytes read from socket
+    Frame frame;         // Frame each packet is received into
+    uint64_t receiving = Tracer::begin(); // Start of the receive, if the next message is traced
 
-    packet *received_packet = NULL; // Received message as a packet structure
-    message_record *message = NULL; // Received packet content
-    message_update *update = NULL;  // Message update structure for sending to replicas
+    // Wait for messages
+    while (!stop_issued && (read_bytes = CommunicationUtils::receiveFrame(socket, frame)) > 0)
+    {
+        Tracer::record("receivePacket", receiving);
 
-    // Get session information
-    Session *current_session = ReplicaManager::getSessionBySocket(socket); // Session info for this client
+        // Anything received keeps the front-end alive
+        TimerWheel::touch(socket);
 
-    // Wait for messages
-    while (!stop_issued && (read_bytes = CommunicationUtils::receivePacket(socket, buffer, PACKET_MAX)) > 0)
+        // Handle the received packet
+        ReplicaManager::handleFEPacket(socket, frame);
+
+        // Decide if the next message is traced
+        receiving = Tracer::begin();
+    }
+
+    Tracer::end();
+
+    // Disarm its timer before the descriptor can be reused
+    if (TimerWheel::cancel(socket))
+        Logger::log(LOG_FRONTEND, LOG_INFO, "Front-end at socket %d timed out", socket);
+
+    // Propagate the disconnection and delete the session (closes the socket)
+    ReplicaManager::closeFEConnection(socket);
+
+    // Remove itself from the FE threads list
+    if (!stop_issued)
     {
-        // Decode received message into a packet structure
-        received_packet = (packet *)buffer;
+        // Request write rights
+        fe_sockets_monitor.requestWrite();
 
-        if (received_packet->type != PAK_KEEP_ALIVE)
+        // Remove itself from the front-end list
+        front_end_sockets.erase(socket);
+
+        // Release write rights
+        fe_sockets_monitor.releaseWrite();
+    }
+
+    return NULL;
+}
+
+void ReplicaManager::acceptConnection(int socket, struct sockaddr_in *address)
+{
+    // Hand the identification of that connection to a worker
+    if (!WorkerPool::submit(handleUnkownConnection, (void *)(intptr_t)socket))
+    {
+        // Close socket if no worker took it
+        Logger::log(LOG_FRONTEND, LOG_ERROR, "Could not hand socket %d to a worker", socket);
+        close(socket);
+    }
+}
+
+bool ReplicaManager::handleFEPacket(int socket, Frame &frame)
+{
+    packet *received_packet = frame.get(); // Received message as a packet structure
+    alignas(message_update) char update_buffer[sizeof(message_update)]; // Buffer for the message update header
+    message_update *update = (message_update *)update_buffer;           // Message update header for sending to replicas
+    struct iovec update_parts[2];                                       // Message update header followed by the relayed message record
+
+    if (received_packet->type != PAK_KEEP_ALIVE)
+        Logger::log(LOG_FRONTEND, LOG_DEBUG, "Received packet of type %d from front-end socket %d, with size %d and length %d", received_packet->type, socket, frame.size(), received_packet->length);
+
+    // Based on packet type
+    switch (received_packet->type)
+    {
+    case PAK_DATA:
+    {
+        // Get session information
+        Session *current_session = ReplicaManager::getSessionBySocket(socket); // Session info for this client
+
+        // Validate the received message record in place
+        if (current_session == NULL || !CommunicationUtils::validateMessage(frame))
         {
-            std::cout << "Received packet of type " << received_packet->type << " from a front-end" << std::endl;
-            std::cout << "It has size " << read_bytes << " and length " << received_packet->length << std::endl;
-            std::cout << "" << std::endl;
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Malformed message received from front-end socket %d", socket);
+            break;
         }
 
-        // Based on packet type
-        switch (received_packet->type)
+        // Only the group's owner on the agreed ring writes to it (its session is being sent there)
+        int owner_port = 0;
+        if (PartitionMap::enabled() && PartitionMap::ownerOf(current_session->getGroup()->groupname, &owner_port) != ReplicaManager::ID)
         {
-        case PAK_DATA:
+            MessageBuffer refusal(current_session->getUser()->username, "Message not sent, the group moved to another replica", SERVER_MESSAGE, PAK_SERVER_MESSAGE);
+            CoalescingWriter::enqueue(socket, refusal, true);
 
-            // Decode received message into a message record
-            message = (message_record *)received_packet->_payload;
+            partition_refusals->add();
+            break;
+        }
 
-            // Compose a message update
-            update = CommunicationUtils::composeMessageUpdate(message, current_session->getGroup()->groupname, socket);
+        // Take the received frame as the message that will be relayed
+        MessageBuffer message(std::move(frame));
 
-            // Update replicas
-            ReplicaManager::updateAllReplicas((void *)update, sizeof(message_update) + update->length, PAK_UPDATE_MSG);
+        // Stamp server timestamp and canonical username into it
+        current_session->stampMessage(message);
 
-            // Free message update structure
-            free(update);
-            update = NULL;
+        // Compose the message update header, pointing to the same record
+        uint64_t composing = Tracer::start();
+        bzero((void *)update, sizeof(message_update));
+        strncpy(update->groupname, current_session->getGroup()->groupname.c_str(), sizeof(update->groupname) - 1);
+        update->socket = socket;
+        update->length = message.recordSize();
+        update->sent = Metrics::epochTime();
+        update->sequence = ++ReplicaManager::replication_sequence;
 
-            // Send message
-            if (current_session != NULL)
-                current_session->messageGroup(message);
+        update_parts[0].iov_base = (void *)update;
+        update_parts[0].iov_len = sizeof(message_update);
+        update_parts[1].iov_base = (void *)message.record();
+        update_parts[1].iov_len = message.recordSize();
+        Tracer::record("composeMessageUpdate", composing);
 
+        // Update replicas
+        ReplicaManager::updateAllReplicas(update_parts, 2, PAK_UPDATE_MSG);
+
+        // Relay the same buffer to the group
+        current_session->messageGroup(message);
+
+        break;
+    }
+    case PAK_SEARCH:
+    {
+        // Get session information
+        Session *current_session = ReplicaManager::getSessionBySocket(socket);
+        if (current_session == NULL)
+        {
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Search received from front-end socket %d before login", socket);
             break;
-        case PAK_KEEP_ALIVE:
-            // Do nothing
-            break;
-        default:
-            std::cerr << "Unknown packet type (" << received_packet->type << ") received from front-end socket " << socket << std::endl;
+        }
+
+        // The query is the payload's text, answered from this replica's own history
+        current_session->sendSearch(std::string(received_packet->_payload, strnlen(received_packet->_payload, std::min<int>(received_packet->length, MESSAGE_MAX))));
+
+        break;
+    }
+    case PAK_HISTORY_REQUEST:
+    {
+        // Get session information
+        Session *current_session = ReplicaManager::getSessionBySocket(socket);
+        if (current_session == NULL || received_packet->length < sizeof(history_request))
+        {
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Invalid history request received from front-end socket %d", socket);
             break;
         }
 
-        // Reset buffer
-        bzero((void *)buffer, PACKET_MAX);
+        // Stream the range back in batches, from this replica's own history
+        current_session->sendHistoryRange(*(history_request *)received_packet->_payload);
+
+        break;
+    }
+    case PAK_KEEP_ALIVE:
+        // Do nothing
+        break;
+    default:
+        Logger::log(LOG_FRONTEND, LOG_WARN, "Unknown packet type (%d) received from front-end socket %d", received_packet->type, socket);
+        break;
     }
 
-    // Update replicas
-    if (!stop_issued)
+    return true;
+}
+
+void ReplicaManager::closeFEConnection(int socket)
+{
+    // Get session information
+    Session *current_session = ReplicaManager::getSessionBySocket(socket);
+
+    // Update replicas (partitioned replicas do not mirror sessions)
+    if (!stop_issued && !PartitionMap::enabled())
         ReplicaManager::updateAllReplicas((void *)&socket, sizeof(int), PAK_UPDATE_DISCONNECT);
 
+    // No session, only the socket is left
+    if (current_session == NULL)
+    {
+        close(socket);
+        return;
+    }
+
     // Request write rights
     ReplicaManager::session_monitor.requestWrite();
 
@@ -448,48 +621,245 @@ void *ReplicaManager::handleFEConnection(void *arg)
     // Release write rights
     ReplicaManager::session_monitor.releaseWrite();
 
-    // Delete session
+    // Delete session (closes the socket)
     delete current_session;
+}
 
-    // Check if connection ended due to timeout
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+void ReplicaManager::handleReader(int socket, packet *login_packet)
+{
+    read_login *login = (read_login *)login_packet->_payload; // Group and replication sequence number the reader needs
+    read_accept accept;                                         // Answer to the login
+    Frame frame;                                                // Frame each request is received into
+    struct timespec deadline;                                   // Time the reader stops waiting to be caught up with
+
+    std::string groupname(login->groupname, strnlen(login->groupname, sizeof(login->groupname)));
+    if (login_packet->length < sizeof(read_login) || !std::regex_match(groupname, std::regex(NAME_REGEX)))
     {
-        // If so, close the connection for good
+        Logger::log(LOG_FRONTEND, LOG_WARN, "Invalid read-only login received from socket %d", socket);
+        ReplicaManager::listWorkerSocket(socket, false);
         close(socket);
+        return;
     }
 
-    // Remove itself from the FE threads list
-    if (!stop_issued)
+    // Updates are applied as they arrive, the reader only waits for the ones in flight
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += READ_WAIT_MS / 1000;
+    deadline.tv_nsec += (READ_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
     {
-        // Request write rights
-        fe_threads_monitor.requestWrite();
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-        // Remove itself from the threads list
-        front_end_threads.erase(socket);
+    pthread_mutex_lock(&sequence_lock);
+    while (replication_sequence < login->sequence && !stop_issued)
+    {
+        if (pthread_cond_timedwait(&sequence_signal, &sequence_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    pthread_mutex_unlock(&sequence_lock);
 
-        // Release write rights
-        fe_threads_monitor.releaseWrite();
+    bzero((void *)&accept, sizeof(accept));
+    accept.applied = replication_sequence;
+    accept.fresh = accept.applied >= login->sequence;
+    CommunicationUtils::sendPacket(socket, PAK_READ_ACCEPT, (char *)&accept, sizeof(accept));
+
+    if (!accept.fresh)
+    {
+        reads_refused->add();
+        Logger::log(LOG_FRONTEND, LOG_INFO, "Refused a reader of group %s at socket %d, applied %" PRIu64 " of %" PRIu64, groupname.c_str(), socket, accept.applied, login->sequence);
+        ReplicaManager::listWorkerSocket(socket, false);
+        close(socket);
+        return;
     }
 
-    pthread_exit(NULL);
+    reads_served->add();
+
+    // Reads go through a session that never joins the group, holding the group's history
+    // log instead, which stays open however the group's members come and go (it closes both)
+    Session reader(HistoryLog::open(groupname), socket);
+
+    // Shut the connection down if the reader stays quiet for USER_TIMEOUT seconds
+    TimerWheel::schedule(socket, USER_TIMEOUT * 1000);
+
+    while (!stop_issued && CommunicationUtils::receiveFrame(socket, frame) > 0)
+    {
+        packet *received_packet = frame.get();
+
+        // Anything received keeps the reader alive
+        TimerWheel::touch(socket);
+
+        switch (received_packet->type)
+        {
+        case PAK_HISTORY_REQUEST:
+            if (received_packet->length >= sizeof(history_request))
+                reader.sendHistoryRange(*(history_request *)received_packet->_payload);
+            break;
+        case PAK_SEARCH:
+            reader.sendSearch(std::string(received_packet->_payload, strnlen(received_packet->_payload, std::min<int>(received_packet->length, MESSAGE_MAX))));
+            break;
+        case PAK_KEEP_ALIVE:
+            break;
+        default:
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Unexpected packet type (%d) received from reader socket %d", received_packet->type, socket);
+            break;
+        }
+    }
+
+    // Disarm its timer and unlist it before the descriptor can be reused (the session closes it)
+    TimerWheel::cancel(socket);
+    ReplicaManager::listWorkerSocket(socket, false);
+}
+
+bool ReplicaManager::listWorkerSocket(int socket, bool listed)
+{
+    // Request write rights
+    worker_sockets_monitor.requestWrite();
+
+    if (listed)
+        worker_sockets.insert(socket);
+    else
+        worker_sockets.erase(socket);
+
+    // Release write rights
+    worker_sockets_monitor.releaseWrite();
+
+    // A stop issued before the socket was listed did not shut it down
+    return !stop_issued;
+}
+
+uint16_t ReplicaManager::pickReader()
+{
+    uint16_t reader_port = 0; // Port of the backup picked
+    unsigned turn = next_reader++;
+
+    // Partitioned replicas number their own updates, so no backup can vouch for a single sequence
+    if (PartitionMap::enabled())
+        return 0;
+
+    // Request read rights
+    replicas_monitor.requestRead();
+
+    // Every backup in turn (the leader is not in its own replica list)
+    if (!replicas.empty())
+    {
+        auto i = replicas.begin();
+        std::advance(i, turn % replicas.size());
+        reader_port = i->second.second;
+    }
+
+    // Release read rights
+    replicas_monitor.releaseRead();
+
+    return reader_port;
+}
+
+bool ReplicaManager::redirectLogin(message_record *login_info, int socket)
+{
+    PoolHandle<partition_map> map; // Replicas, and the one leading the group
+    int owner_port = 0;            // Listening port of the group's owner
+
+    if (!PartitionMap::enabled())
+        return false;
+
+    // The group is the login's message
+    std::string groupname(login_info->_message, strnlen(login_info->_message, std::min<int>(login_info->length, MESSAGE_MAX)));
+
+    // Logins to the groups this replica leads go on as usual
+    int owner = PartitionMap::ownerOf(groupname, &owner_port);
+    if (owner < 0 || owner == ReplicaManager::ID)
+        return false;
+
+    map = CommunicationUtils::composePartitionMap(owner_port, true, PartitionMap::ports());
+    CommunicationUtils::sendPacket(socket, PAK_PARTITION_MAP, map.data(), sizeof(partition_map) + map->count * sizeof(uint16_t));
+
+    partition_redirects->add();
+    Logger::log(LOG_FRONTEND, LOG_DEBUG, "Sent a login to group %s at socket %d to replica %d", groupname.c_str(), socket, owner);
+
+    return true;
+}
+
+void ReplicaManager::updateRing(int id, int port, bool joined)
+{
+    if (!PartitionMap::enabled())
+        return;
+
+    if (joined ? !PartitionMap::add(id, port) : !PartitionMap::remove(id))
+        return;
+
+    Logger::log(LOG_REPLICATION, LOG_INFO, "Replica %d %s the partition members", id, joined ? "joined" : "left");
+
+    // The others learn of it now, not with the next keep-alive
+    ReplicaManager::sendKeepAlives();
+    ReplicaManager::confirmRing();
+}
+
+void ReplicaManager::handleRingReport(int socket, packet *received_packet)
+{
+    int id = ReplicaManager::getReplicaBySocket(socket);
+
+    if (!PartitionMap::enabled() || id < 0 || received_packet->length < sizeof(uint64_t))
+        return;
+
+    PartitionMap::report(id, *(uint64_t *)received_packet->_payload);
+    ReplicaManager::confirmRing();
+}
+
+void ReplicaManager::confirmRing()
+{
+    PoolHandle<partition_map> map; // Replicas, and the one now leading a session's group
+    int owner_port = 0;            // Listening port of a session group's owner
+
+    if (!PartitionMap::confirm())
+        return;
+
+    Logger::log(LOG_REPLICATION, LOG_INFO, "The partition ring moved to %zu replica(s), every member agreed", PartitionMap::ports().size());
+
+    std::vector<uint16_t> members = PartitionMap::ports();
+
+    // Request read rights (sessions are not deleted, nor their sockets closed, meanwhile)
+    session_monitor.requestRead();
+
+    for (auto i = session_list.begin(); i != session_list.end(); ++i)
+    {
+        int owner = PartitionMap::ownerOf(i->second->getGroup()->groupname, &owner_port);
+        if (owner < 0 || owner == ReplicaManager::ID)
+            continue;
+
+        // Queued, so it is not written in the middle of a message headed to the client
+        map = CommunicationUtils::composePartitionMap(owner_port, true, members);
+        CoalescingWriter::enqueue(i->first, Frame(PAK_PARTITION_MAP, map.data(), sizeof(partition_map) + map->count * sizeof(uint16_t)), true);
+
+        // The receiver sees the connection end and closes it as usual
+        shutdown(i->first, SHUT_RD);
+
+        partition_redirects->add();
+    }
+
+    // Release read rights
+    session_monitor.releaseRead();
 }
 
 void *ReplicaManager::handleRMConnection(void *arg)
 {
-    int socket = *(int *)arg;       // Socket of connected replica
+    int socket = (int)(intptr_t)arg; // Socket of connected replica
     int read_bytes = -1;            // Number of bytes read from socket
     char buffer[PACKET_MAX];        // Buffer for message
     packet *received_packet = NULL; // Received message as a packet structure
     int buddy_id = -1;              // ID of buddy replica
+    bool timed_out = false;         // If the replica stayed quiet for too long
 
     // Wait for messages
     while (!stop_issued && (read_bytes = CommunicationUtils::receivePacket(socket, buffer, PACKET_MAX)) > 0)
     {
+        // Anything received keeps the replica alive
+        TimerWheel::touch(socket);
+
         // Decode received message into a packet structure
         received_packet = (packet *)buffer;
 
         if (received_packet->type != PAK_KEEP_ALIVE)
-            std::cout << "Received packet of type " << received_packet->type << " from replica connection" << std::endl;
+            Logger::log(LOG_REPLICATION, LOG_DEBUG, "Received packet of type %d from replica socket %d", received_packet->type, socket);
 
         // Based on packet type
         switch (received_packet->type)
@@ -511,8 +881,8 @@ void *ReplicaManager::handleRMConnection(void *arg)
         case PAK_ELECTION_COORDINATOR:
             ReplicaManager::handleElection(received_packet, socket);
             break;
-        case PAK_KEEP_ALIVE: // Keep-Alive
-            // Do nothing
+        case PAK_KEEP_ALIVE: // Keep-Alive, with the replica's partition members
+            ReplicaManager::handleRingReport(socket, received_packet);
             break;
         default:
             break;
@@ -522,21 +892,47 @@ void *ReplicaManager::handleRMConnection(void *arg)
         bzero((void *)buffer, PACKET_MAX);
     }
 
+    // Disarm its timer before the descriptor can be reused
+    timed_out = TimerWheel::cancel(socket);
+
     // Get ID of buddy replica
     buddy_id = ReplicaManager::getReplicaBySocket(socket);
 
+    // Partitioned replicas need no election, the groups the replica led move to the next replicas on the ring
+    if (PartitionMap::enabled() && buddy_id >= 0 && !stop_issued)
+    {
+        // Request write rights
+        replicas_monitor.requestWrite();
+
+        int buddy_port = replicas.at(socket).second;
+        replicas.erase(socket);
+
+        // Release write rights
+        replicas_monitor.releaseWrite();
+
+        ReplicaManager::updateRing(buddy_id, buddy_port, false);
+
+        // New replicas join through the remaining one with the highest identifier
+        if (ReplicaManager::leader == buddy_id)
+        {
+            leader = PartitionMap::highest();
+            last_election = Metrics::epochTime() / 1000000;
+            Logger::log(LOG_ELECTION, LOG_INFO, "Replicas now join through %d", ReplicaManager::leader);
+        }
+    }
     // If this was leader that timed out, no elections have been started by this replica and server is not stopping
-    if (ReplicaManager::leader == buddy_id && !election_started && !stop_issued)
+    else if (ReplicaManager::leader == buddy_id && !election_started && !stop_issued)
     {
-        std::cout << "Starting an election " << std::endl;
+        Logger::log(LOG_ELECTION, LOG_INFO, "Starting an election");
         ReplicaManager::startElection();
     }
     // Check if connection ended due to timeout
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    if (timed_out)
     {
-        std::cout << "Replica at socket " << socket << " timed out" << std::endl;
+        Logger::log(LOG_REPLICATION, LOG_WARN, "Replica at socket %d timed out", socket);
 
         // Close socket
+        CoalescingWriter::remove(socket);
         close(socket);
     }
     else
@@ -545,35 +941,31 @@ void *ReplicaManager::handleRMConnection(void *arg)
         if (!stop_issued)
         {
             // Request write rights
-            rm_threads_monitor.requestWrite();
+            rm_sockets_monitor.requestWrite();
 
-            // Remove itself from the threads list
-            replica_manager_threads.erase(socket);
+            // Remove itself from the replica list
+            replica_manager_sockets.erase(socket);
 
             // Release write rights
-            rm_threads_monitor.releaseWrite();
+            rm_sockets_monitor.releaseWrite();
         }
     }
 
-    pthread_exit(NULL);
+    return NULL;
 }
 
 // REPLICATION UPDATES LOGIC
 
 void ReplicaManager::catchUpReplica(int socket, int new_id, int new_port)
 {
-    replica_update *update = NULL;
-    replica_update *new_replica = NULL;
-    message_record *login_data = NULL;
-    login_update *front_end_data = NULL;
+    PoolHandle<replica_update> update;
+    PoolHandle<message_record> login_data;
+    PoolHandle<login_update> front_end_data;
     Session *session = NULL;
 
     // Request read rights
     replicas_monitor.requestRead();
 
-    // Create a replica update structure for the new replica
-    new_replica = CommunicationUtils::composeReplicaUpdate(new_id, new_port);
-
     // Iterate list of replica managers
     for (auto i = ReplicaManager::replicas.begin(); i != ReplicaManager::replicas.end(); ++i)
     {
@@ -583,21 +975,17 @@ void ReplicaManager::catchUpReplica(int socket, int new_id, int new_port)
             update = CommunicationUtils::composeReplicaUpdate((i->second).first, (i->second).second);
 
             // Send to new replica
-            CommunicationUtils::sendPacket(socket, PAK_UPDATE_REPLICA, (char *)update, sizeof(replica_update));
-
-            // Free data structure
-            free(update);
-            update = NULL;
+            CommunicationUtils::sendPacket(socket, PAK_UPDATE_REPLICA, update.data(), sizeof(replica_update));
         }
     }
 
-    // Free new replica update data structure
-    free(new_replica);
-    new_replica = NULL;
-
     // Release read rights
     replicas_monitor.releaseRead();
 
+    // Partitioned replicas do not mirror sessions
+    if (PartitionMap::enabled())
+        return;
+
     // Request read rights
     clients_monitor.requestRead();
 
@@ -617,16 +1005,10 @@ void ReplicaManager::catchUpReplica(int socket, int new_id, int new_port)
         login_data = CommunicationUtils::composeMessage(session->getUser()->username, session->getGroup()->groupname, PAK_COMMAND);
 
         // Composed a login update
-        front_end_data = CommunicationUtils::composeLoginUpdate((char *)login_data, (i->second).first, (i->second).second, i->first);
+        front_end_data = CommunicationUtils::composeLoginUpdate(login_data.data(), (i->second).first, (i->second).second, i->first);
 
         // Send to new replica
-        CommunicationUtils::sendPacket(socket, PAK_UPDATE_LOGIN, (char *)front_end_data, sizeof(login_update) + front_end_data->length);
-
-        // Free composed data structures
-        free(login_data);
-        free(front_end_data);
-        login_data = NULL;
-        front_end_data = NULL;
+        CommunicationUtils::sendPacket(socket, PAK_UPDATE_LOGIN, front_end_data.data(), sizeof(login_update) + front_end_data->length);
     }
 
     // Release read rights
@@ -636,18 +1018,37 @@ void ReplicaManager::catchUpReplica(int socket, int new_id, int new_port)
 void ReplicaManager::updateAllReplicas(void *update_payload, int payload_size, int type)
 {
     // Request read rights
-    rm_threads_monitor.requestRead();
+    rm_sockets_monitor.requestRead();
 
     // For each connected replica
-    for (auto i = ReplicaManager::replica_manager_threads.begin(); i != ReplicaManager::replica_manager_threads.end(); ++i)
+    for (auto i = ReplicaManager::replica_manager_sockets.begin(); i != ReplicaManager::replica_manager_sockets.end(); ++i)
     {
-        // Send update packet
-        if (i->first != ReplicaManager::ID)
-            CommunicationUtils::sendPacket(i->first, type, (char *)update_payload, payload_size);
+        // Send update packet, only message updates may wait to be coalesced
+        if (*i != ReplicaManager::ID)
+            CoalescingWriter::enqueue(*i, Frame(type, (char *)update_payload, payload_size), type != PAK_UPDATE_MSG);
     }
 
     // Release read rights
-    rm_threads_monitor.releaseRead();
+    rm_sockets_monitor.releaseRead();
+}
+
+void ReplicaManager::updateAllReplicas(const struct iovec *parts, int part_count, int type)
+{
+    TraceSpan span("updateAllReplicas");
+
+    // Request read rights
+    rm_sockets_monitor.requestRead();
+
+    // For each connected replica
+    for (auto i = ReplicaManager::replica_manager_sockets.begin(); i != ReplicaManager::replica_manager_sockets.end(); ++i)
+    {
+        // Send update packet, only message updates may wait to be coalesced
+        if (*i != ReplicaManager::ID)
+            CoalescingWriter::enqueueParts(*i, type, parts, part_count, type != PAK_UPDATE_MSG);
+    }
+
+    // Release read rights
+    rm_sockets_monitor.releaseRead();
 }
 
 // Secondary replica manager methods
@@ -688,19 +1089,45 @@ void ReplicaManager::handleMessageUpdate(packet *received_packet)
     message_update *update = NULL;
     message_record *message = NULL;
     Group *destination_group = NULL;
+    uint64_t received = Metrics::epochTime();
 
     // Decode payload into message update and it's payload into a message record
     update = (message_update *)received_packet->_payload;
     message = (message_record *)update->_message;
 
+    // Check that the record fits in the update and is NUL terminated
+    if (update->length < sizeof(message_record) || message->length == 0 ||
+        message->length > update->length - sizeof(message_record) || message->_message[message->length - 1] != '\0')
+    {
+        Logger::log(LOG_REPLICATION, LOG_WARN, "Malformed message update received");
+        return;
+    }
+
+    // Time since the leader sent it (clocks of different hosts may disagree, never below 0)
+    replication_lag->record(received > update->sent ? received - update->sent : 0);
+
     // Get referenced group
     destination_group = Group::getGroup(update->groupname);
 
-    std::cout << "Received a message from " << message->username << " to group " << destination_group->groupname << std::endl;
-    std::cout << "It is: " << message->_message << std::endl;
+    Logger::log(LOG_REPLICATION, LOG_DEBUG, "Received a message from %s to group %s: %s", message->username, destination_group->groupname.c_str(), message->_message);
 
-    // Update it's history file
-    destination_group->saveMessage(message->_message, message->username, message->type);
+    // Update it's history file with the record stamped by the leader
+    destination_group->saveMessage(message);
+
+    // Readers waiting for this update may be served now (updates from one leader arrive in order,
+    // and a new leader's epoch puts its updates above the old leader's, however far those went)
+    ReplicaManager::advanceSequence(update->sequence);
+}
+
+void ReplicaManager::advanceSequence(uint64_t sequence)
+{
+    pthread_mutex_lock(&sequence_lock);
+
+    if (sequence > replication_sequence)
+        replication_sequence = sequence;
+
+    pthread_cond_broadcast(&sequence_signal);
+    pthread_mutex_unlock(&sequence_lock);
 }
 
 void ReplicaManager::handleDisconnectUpdate(packet *received_packet)
@@ -735,8 +1162,8 @@ void ReplicaManager::handleDisconnectUpdate(packet *received_packet)
 void ReplicaManager::handleReplicaUpdate(packet *received_packet)
 {
     replica_update *rm_update = NULL;
+    PoolHandle<replica_update> link_message;
     int new_rm_socket = -1;
-    pthread_t new_rm_thread;
 
     // Decode structure into a replica update packet
     rm_update = (replica_update *)(received_packet->_payload);
@@ -744,31 +1171,37 @@ void ReplicaManager::handleReplicaUpdate(packet *received_packet)
     // Setup the connection to this new replica
     new_rm_socket = ReplicaManager::setupReplicaConnection(rm_update->port, "127.0.0.1", rm_update->identifier);
 
-    // Spawn a new thread to handle that connection
-    if (pthread_create(&new_rm_thread, NULL, handleRMConnection, (void *)&new_rm_socket) < 0)
-    {
-        // Close socket if no thread was created
-        std::cerr << "Could not create thread for new replica manager (" << rm_update->identifier << ") at socket " << new_rm_socket << std::endl;
-        close(new_rm_socket);
-    }
-
     // Compose a link packet to the new replica manager
-    rm_update = CommunicationUtils::composeReplicaUpdate(ReplicaManager::ID, ReplicaManager::port);
+    link_message = CommunicationUtils::composeReplicaUpdate(ReplicaManager::ID, ReplicaManager::port);
 
     // Send greetings to new replica
-    CommunicationUtils::sendPacket(new_rm_socket, PAK_LINK, (char *)rm_update, sizeof(replica_update));
-
-    // Free data structure
-    free(rm_update);
+    CommunicationUtils::sendPacket(new_rm_socket, PAK_LINK, link_message.data(), sizeof(replica_update));
 
     // Request write rights
-    rm_threads_monitor.requestWrite();
+    rm_sockets_monitor.requestWrite();
 
-    // Add thread to list of replica manager communication threads
-    replica_manager_threads.insert(std::make_pair(new_rm_socket, new_rm_thread));
+    // Add it to the list of replicas handled by a worker
+    replica_manager_sockets.insert(new_rm_socket);
 
     // Release write rights
-    rm_threads_monitor.releaseWrite();
+    rm_sockets_monitor.releaseWrite();
+
+    // Hand that connection to a worker
+    if (!WorkerPool::submit(handleRMConnection, (void *)(intptr_t)new_rm_socket))
+    {
+        // Close socket if no worker took it
+        Logger::log(LOG_REPLICATION, LOG_ERROR, "Could not hand new replica manager (%d) at socket %d to a worker", rm_update->identifier, new_rm_socket);
+
+        // Request write rights
+        rm_sockets_monitor.requestWrite();
+
+        replica_manager_sockets.erase(new_rm_socket);
+
+        // Release write rights
+        rm_sockets_monitor.releaseWrite();
+
+        close(new_rm_socket);
+    }
 }
 
 // REPLICA GETTERS
@@ -849,7 +1282,7 @@ void ReplicaManager::handleElection(packet *received_packet, int incoming_socket
         break;
     case PAK_ELECTION_ANSWER:
 
-        std::cout << "Received an election answer from " << replicas[incoming_socket].first << std::endl;
+        Logger::log(LOG_ELECTION, LOG_INFO, "Received an election answer from %d", replicas[incoming_socket].first);
         ReplicaManager::got_answer = true;
 
         break;
@@ -857,7 +1290,7 @@ void ReplicaManager::handleElection(packet *received_packet, int incoming_socket
 
         coord = (coordinator *)(received_packet->_payload);
 
-        std::cout << "Received coordinator packet with " << coord->counter << " entries " << std::endl;
+        Logger::log(LOG_ELECTION, LOG_INFO, "Received coordinator packet with %d entries", coord->counter);
 
         ReplicaManager::got_answer = true;
 
@@ -867,6 +1300,7 @@ void ReplicaManager::handleElection(packet *received_packet, int incoming_socket
             leader = replicas[incoming_socket].first;
             leader_port = replicas[incoming_socket].second;
             leader_socket = incoming_socket;
+            last_election = Metrics::epochTime() / 1000000;
 
             if (coord->counter > 0)
             {
@@ -881,7 +1315,7 @@ void ReplicaManager::handleElection(packet *received_packet, int incoming_socket
                     if ((session = getSessionBySocket(old_socket)) != NULL)
                     {
                         // Update session socket info
-                        session->setSocket(new_socket);
+                        session->setSocket(new_socket, false);
 
                         // Update client list
                         clients_monitor.requestRead();
@@ -913,6 +1347,7 @@ void ReplicaManager::handleElection(packet *received_packet, int incoming_socket
 void ReplicaManager::startElection()
 {
     int previous_leader = ReplicaManager::leader;
+    uint64_t start = Metrics::now();
 
     ReplicaManager::election_started = true;
     ReplicaManager::removeReplicaLeader();
@@ -935,14 +1370,14 @@ void ReplicaManager::startElection()
         replicas_monitor.releaseRead();
 
         // Wait for answers
-        std::cout << "Sent election-start messages, waiting..." << std::endl;
+        Logger::log(LOG_ELECTION, LOG_INFO, "Sent election-start messages, waiting...");
 
         sleep(ELECTION_TIMEOUT);
 
         // After waking up, check for answers
         if (!ReplicaManager::got_answer)
         {
-            std::cout << "Got no answers, I am the new coordinator " << std::endl;
+            Logger::log(LOG_ELECTION, LOG_INFO, "Got no answers, I am the new coordinator");
 
             // If no answers arrived, this is the new coordinator
             ReplicaManager::becomeLeader();
@@ -950,18 +1385,21 @@ void ReplicaManager::startElection()
         else
         {
             // Wait for coordinator
-            std::cout << "Got an answer, waiting again..." << std::endl;
+            Logger::log(LOG_ELECTION, LOG_INFO, "Got an answer, waiting again...");
 
             sleep(ELECTION_TIMEOUT);
 
             if (previous_leader == ReplicaManager::leader)
             {
-                std::cout << "Still no answers, restarting election..." << std::endl;
+                Logger::log(LOG_ELECTION, LOG_INFO, "Still no answers, restarting election...");
             }
         }
     }
 
-    std::cout << "Election finished, new leader is " << ReplicaManager::leader << std::endl;
+    Logger::log(LOG_ELECTION, LOG_INFO, "Election finished, new leader is %d", ReplicaManager::leader);
+
+    election_duration->record(Metrics::now() - start);
+    last_election = Metrics::epochTime() / 1000000;
 
     // End election
     ReplicaManager::election_started = false;
@@ -969,34 +1407,39 @@ void ReplicaManager::startElection()
 
 void *ReplicaManager::keepAlive(void *arg)
 {
-    char keep_alive = '\0';
-
     // For the entire time this replica is running
     while (!ReplicaManager::stop_issued)
     {
 
-        // Sleep for SLEEP_TIME seconds
-        sleep(SLEEP_TIME);
-
-        // Request read rights
-        rm_threads_monitor.requestRead();
-
-        // For each connected replica
-        for (auto i = ReplicaManager::replica_manager_threads.begin(); i != ReplicaManager::replica_manager_threads.end(); ++i)
-        {
-            // Send KAL packet
-            if (i->first != ReplicaManager::ID)
-                CommunicationUtils::sendPacket(i->first, PAK_KEEP_ALIVE, &keep_alive, sizeof(keep_alive));
-        }
+        // Sleep for SLEEP_TIME seconds (sleep would truncate it to 0)
+        usleep(SLEEP_TIME * 1000000);
 
-        // Release read rights
-        rm_threads_monitor.releaseRead();
+        ReplicaManager::sendKeepAlives();
     }
 
     // Exit
     pthread_exit(NULL);
 }
 
+void ReplicaManager::sendKeepAlives()
+{
+    uint64_t digest = PartitionMap::digest(); // Partition members of this replica, for the others to agree on
+
+    // Request read rights
+    rm_sockets_monitor.requestRead();
+
+    // For each connected replica
+    for (auto i = ReplicaManager::replica_manager_sockets.begin(); i != ReplicaManager::replica_manager_sockets.end(); ++i)
+    {
+        // Queue KAL packet, it leaves with any pending update
+        if (*i != ReplicaManager::ID)
+            CoalescingWriter::enqueue(*i, Frame(PAK_KEEP_ALIVE, (char *)&digest, sizeof(digest)));
+    }
+
+    // Release read rights
+    rm_sockets_monitor.releaseRead();
+}
+
 void ReplicaManager::removeReplicaLeader()
 {
     replicas_monitor.requestWrite();
@@ -1024,29 +1467,35 @@ void ReplicaManager::becomeLeader()
     // New socket for re-connecting front-ends
     int new_fe_socket = -1;
 
-    coordinator *coord_packet = NULL;   // Sent to replica managers
+    PoolHandle<coordinator> coord_packet; // Sent to replica managers
 
     // Session
     Session *session = NULL;
 
-    // Timeout struct
-    struct timeval timeout;
+    char empty = '\0';
 
     // Update it's own information
     leader = ReplicaManager::ID;
     leader_port = ReplicaManager::port;
     leader_socket = ReplicaManager::main_socket;
 
+    // Start a new epoch, backups ahead of this replica must not take its updates for old ones
+    ReplicaManager::advanceSequence(((replication_sequence >> READ_EPOCH_SHIFT) + 1) << READ_EPOCH_SHIFT);
+    Logger::log(LOG_ELECTION, LOG_INFO, "Leading replication epoch %" PRIu64, replication_sequence >> READ_EPOCH_SHIFT);
+
     // Request write rights
     clients_monitor.requestWrite();
 
     // Iterate front ends collecting new and old socket
     for (auto i = ReplicaManager::clients.begin(); i != ReplicaManager::clients.end(); ++i)
     {
-        std::cout << "Setting up connection to a client to keep them alive" << std::endl;
+        Logger::log(LOG_FRONTEND, LOG_INFO, "Setting up connection to a client to keep them alive");
         // Connect to client
         new_fe_socket = ReplicaManager::setupFrontEndConnection(i->second.first, i->second.second);
 
+        // Let the client know it is talking to a new server
+        CommunicationUtils::sendPacket(new_fe_socket, PAK_NEW_SERVER, &empty, sizeof(empty));
+
         // Add the new socket to the map
         translation.insert(std::make_pair(i->first, new_fe_socket));
 
@@ -1054,7 +1503,7 @@ void ReplicaManager::becomeLeader()
         session = ReplicaManager::getSessionBySocket(i->first);
 
         // Update socket information
-        session->setSocket(new_fe_socket);
+        session->setSocket(new_fe_socket, true);
 
         // Re-add to session and client list
         new_sessions.insert(std::make_pair(new_fe_socket, session));
@@ -1068,83 +1517,87 @@ void ReplicaManager::becomeLeader()
     coord_packet = CommunicationUtils::composeCoordinatorUpdate(translation);
 
     // Send a coordinator packet to every replica
-    ReplicaManager::updateAllReplicas(coord_packet, sizeof(uint16_t) + 2 * sizeof(uint16_t) * translation.size(), PAK_ELECTION_COORDINATOR);
+    ReplicaManager::updateAllReplicas(coord_packet.get(), sizeof(uint16_t) + 2 * sizeof(uint16_t) * translation.size(), PAK_ELECTION_COORDINATOR);
 
     // Update session list
     session_monitor.requestWrite();
     session_list = new_sessions;
     session_monitor.releaseWrite();
 
+    // Sessions now have sockets to their clients
+    Session::delivering = true;
+
     // Update client list
     clients_monitor.requestWrite();
     clients = new_clients;
     clients_monitor.releaseWrite();
 
     // Request write and read rights
-    fe_threads_monitor.requestWrite();
+    fe_sockets_monitor.requestWrite();
     clients_monitor.releaseRead();
 
-    // Spawn threads for each front-end
+    // Hand each front-end to a worker
     for (auto i = ReplicaManager::clients.begin(); i != ReplicaManager::clients.end(); ++i)
     {
-        pthread_t new_fe_thread;
+        // Shut the connection down if the front-end stays quiet for USER_TIMEOUT seconds
+        TimerWheel::schedule(i->first, USER_TIMEOUT * 1000);
 
-        // Set the keep-alive timer on the socket
-        timeout = {.tv_sec = USER_TIMEOUT, .tv_usec = 0};
-        if (setsockopt(i->first, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
-            throw std::runtime_error(appendErrorMessage("Error setting socket options"));
+        // Add it to the list of front-ends handled by a worker
+        front_end_sockets.insert(i->first);
 
-        // Start thread to communicate with front-end
-        if (pthread_create(&new_fe_thread, NULL, handleFEConnection, (void *)&i->first) < 0)
+        // Start communicating with the front-end
+        if (!WorkerPool::submit(handleFEConnection, (void *)(intptr_t)i->first))
         {
-            // Close socket if no thread was created
-            std::cerr << "Could not create thread for socket " << i->first << std::endl;
+            // Close socket if no worker took it
+            Logger::log(LOG_FRONTEND, LOG_ERROR, "Could not hand socket %d to a worker", i->first);
+            front_end_sockets.erase(i->first);
+
+            // Disarm its timer before the descriptor can be reused
+            TimerWheel::cancel(i->first);
             close(i->first);
         }
-
-        // Add thread to list of front end handlers
-        front_end_threads.insert(std::make_pair(i->first, new_fe_thread));
     }
 
     // Release write and read rights
-    fe_threads_monitor.releaseWrite();
+    fe_sockets_monitor.releaseWrite();
     clients_monitor.releaseRead();
-
-    // Free created data structure
-    free(coord_packet);
 }
 
 // BUSINESS LOGIC
 
 void ReplicaManager::processNewClient(message_record *login_info, int socket)
 {
-    login_update *front_end = NULL;
+    PoolHandle<login_update> front_end;
     Session *new_session = NULL;
+    struct sockaddr_in address; // Front-end address
+    socklen_t address_size = sizeof(address);
 
-    // Get client IP and port
-    std::string front_end_ip = inet_ntoa(client_address.sin_addr);
+    // Get client IP (from the connection itself, several acceptors may be accepting at once) and port
+    bzero((void *)&address, sizeof(address));
+    getpeername(socket, (struct sockaddr *)&address, &address_size);
+    std::string front_end_ip = inet_ntoa(address.sin_addr);
     int front_end_port = login_info->port;
 
-    // Create front end registry
-    front_end = CommunicationUtils::composeLoginUpdate((char *)login_info, front_end_ip, front_end_port, socket);
-
-    // Update replicas
-    ReplicaManager::updateAllReplicas((void *)front_end, sizeof(login_update) + front_end->length, PAK_UPDATE_LOGIN);
+    // Update replicas (partitioned replicas do not mirror sessions)
+    if (!PartitionMap::enabled())
+    {
+        // Create front end registry
+        front_end = CommunicationUtils::composeLoginUpdate((char *)login_info, front_end_ip, front_end_port, socket);
 
-    // Free front end registry
-    free(front_end);
+        ReplicaManager::updateAllReplicas((void *)front_end.get(), sizeof(login_update) + front_end->length, PAK_UPDATE_LOGIN);
+    }
 
     // Process login
     if (!(new_session = ReplicaManager::processLogin(login_info, socket, true)))
     {
         // Request write rights
-        fe_threads_monitor.requestWrite();
+        fe_sockets_monitor.requestWrite();
 
         // Remove itself from the threads list
-        front_end_threads.erase(socket);
+        front_end_sockets.erase(socket);
 
         // Release write rights
-        fe_threads_monitor.releaseWrite();
+        fe_sockets_monitor.releaseWrite();
 
         // Return
         return;
@@ -1186,7 +1639,16 @@ Session *ReplicaManager::processLogin(message_record *login_info, int socket, bo
         // If this is being processed on current master
         if (master)
         {
-            // Send history to client
+            // Accept the login and send history to client
+            new_session->acceptLogin(ReplicaManager::replication_sequence, ReplicaManager::pickReader());
+
+            // Tell the client every replica, where to log in again if this one fails
+            if (PartitionMap::enabled())
+            {
+                PoolHandle<partition_map> map = CommunicationUtils::composePartitionMap(ReplicaManager::port, false, PartitionMap::ports());
+                CommunicationUtils::sendPacket(socket, PAK_PARTITION_MAP, map.data(), sizeof(partition_map) + map->count * sizeof(uint16_t));
+            }
+
             new_session->sendHistory(ReplicaManager::message_history);
         }
     }
@@ -1244,56 +1706,77 @@ void ReplicaManager::issueStop()
 {
     ReplicaManager::stop_issued = true;
 
+    // Readers waiting to be caught up with give up
+    pthread_mutex_lock(&sequence_lock);
+    pthread_cond_broadcast(&sequence_signal);
+    pthread_mutex_unlock(&sequence_lock);
+
+    // Stop the event loop, it closes every front-end connection
+    if (EventLoop::enabled())
+        EventLoop::stop();
+
     // Request read rights
-    ReplicaManager::fe_threads_monitor.requestRead();
+    ReplicaManager::fe_sockets_monitor.requestRead();
 
     // Stop all communication with clients
-    for (std::map<int, pthread_t>::iterator i = front_end_threads.begin(); i != front_end_threads.end(); ++i)
+    for (std::set<int>::iterator i = front_end_sockets.begin(); i != front_end_sockets.end(); ++i)
+    {
+        shutdown(*i, SHUT_RDWR);
+    }
+
+    // Release read rights
+    ReplicaManager::fe_sockets_monitor.releaseRead();
+
+    // Request read rights
+    ReplicaManager::worker_sockets_monitor.requestRead();
+
+    // Stop connections still identifying themselves, and readers
+    for (std::set<int>::iterator i = worker_sockets.begin(); i != worker_sockets.end(); ++i)
     {
-        shutdown(i->first, SHUT_RDWR);
+        shutdown(*i, SHUT_RDWR);
     }
 
     // Release read rights
-    ReplicaManager::fe_threads_monitor.releaseRead();
+    ReplicaManager::worker_sockets_monitor.releaseRead();
 
     // Request read rights
-    ReplicaManager::rm_threads_monitor.requestRead();
+    ReplicaManager::rm_sockets_monitor.requestRead();
 
     // Stop all communication with replicas
-    for (std::map<int, pthread_t>::iterator i = replica_manager_threads.begin(); i != replica_manager_threads.end(); ++i)
+    for (std::set<int>::iterator i = replica_manager_sockets.begin(); i != replica_manager_sockets.end(); ++i)
     {
-        shutdown(i->first, SHUT_RDWR);
+        shutdown(*i, SHUT_RDWR);
     }
 
     // Release read rights
-    ReplicaManager::rm_threads_monitor.releaseRead();
+    ReplicaManager::rm_sockets_monitor.releaseRead();
 
-    // Stop the main socket from receiving connections
-    shutdown(ReplicaManager::main_socket, SHUT_RDWR);
+    // Stop the listening sockets from receiving connections
+    Acceptor::stop();
 }
 
 void ReplicaManager::listThreads()
 {
     // Request read rights
-    fe_threads_monitor.requestRead();
+    fe_sockets_monitor.requestRead();
 
     // Delimiter
     std::cout << "FRONT END THREADS" << std::endl;
     std::cout << "======================" << std::endl;
 
     // Iterate through threads
-    for (std::map<int, pthread_t>::iterator i = front_end_threads.begin(); i != front_end_threads.end(); ++i)
+    for (std::set<int>::iterator i = front_end_sockets.begin(); i != front_end_sockets.end(); ++i)
     {
-        std::cout << " FE Thread associated with socket " << i->first << std::endl;
+        std::cout << " FE worker task associated with socket " << *i << std::endl;
     }
     // Delimiter
     std::cout << "======================" << std::endl;
 
     // Release read rights
-    fe_threads_monitor.releaseRead();
+    fe_sockets_monitor.releaseRead();
 
     // Request read rights
-    rm_threads_monitor.requestRead();
+    rm_sockets_monitor.requestRead();
     replicas_monitor.requestRead();
 
     // Delimiter
@@ -1301,16 +1784,16 @@ void ReplicaManager::listThreads()
     std::cout << "======================" << std::endl;
 
     // Iterate through threads
-    for (std::map<int, pthread_t>::iterator i = replica_manager_threads.begin(); i != replica_manager_threads.end(); ++i)
+    for (std::set<int>::iterator i = replica_manager_sockets.begin(); i != replica_manager_sockets.end(); ++i)
     {
-        std::cout << " RM Thread associated with socket " << i->first << std::endl;
-        std::cout << " + This thread is talking to a replica with ID " << replicas.at(i->first).first << std::endl;
+        std::cout << " RM worker task associated with socket " << *i << std::endl;
+        std::cout << " + This task is talking to a replica with ID " << replicas.at(*i).first << std::endl;
     }
     // Delimiter
     std::cout << "======================" << std::endl;
 
     // Release read rights
-    rm_threads_monitor.releaseRead();
+    rm_sockets_monitor.releaseRead();
     replicas_monitor.releaseRead();
 }
 
@@ -1337,9 +1820,9 @@ void ReplicaManager::getState()
     debug << "The socket trough which I talk to them is " << ReplicaManager::leader_socket << std::endl;
     debug << "Here are my data structures: " << std::endl;
 
-    debug << "+ Front End Threads list: " << std::endl;
-    for (auto i = ReplicaManager::front_end_threads.begin(); i != front_end_threads.end(); ++i)
-        debug << "| Thread with ID " << i->second << ", who talks to socket " << i->first << std::endl;
+    debug << "+ Front End sockets list: " << std::endl;
+    for (auto i = ReplicaManager::front_end_sockets.begin(); i != front_end_sockets.end(); ++i)
+        debug << "| Worker task who talks to socket " << *i << std::endl;
 
     debug << std::endl
           << "+ Clients list:" << std::endl;
@@ -1347,9 +1830,9 @@ void ReplicaManager::getState()
         debug << "| Client on socket " << i->first << ", listening for new servers on port " << i->second.second << std::endl;
 
     debug << std::endl
-          << "+ Replica Threads list: " << std::endl;
-    for (auto i = ReplicaManager::replica_manager_threads.begin(); i != ReplicaManager::replica_manager_threads.end(); ++i)
-        debug << "| Thread with ID " << i->second << ", who talks to socket " << i->first << std::endl;
+          << "+ Replica sockets list: " << std::endl;
+    for (auto i = ReplicaManager::replica_manager_sockets.begin(); i != ReplicaManager::replica_manager_sockets.end(); ++i)
+        debug << "| Worker task who talks to socket " << *i << std::endl;
 
     debug << std::endl
           << "+ Replicas list: " << std::endl;
@@ -1371,3 +1854,78 @@ void ReplicaManager::handleSIGPIPE(int signal)
 {
     //std::cerr << "Error sending packet " << std::endl;
 }
+
+void ReplicaManager::exportMetrics(std::ostream &output)
+{
+    std::map<std::string, int> group_sessions; // Sessions in each group
+
+    // Request read rights
+    clients_monitor.requestRead();
+
+    MetricsEndpoint::describe(output, "chat_front_ends", "gauge", "Front-ends (clients) connected to the replicas");
+    output << "chat_front_ends " << clients.size() << "\n";
+
+    // Release read rights
+    clients_monitor.releaseRead();
+
+    // Request read rights
+    session_monitor.requestRead();
+
+    for (auto i = session_list.begin(); i != session_list.end(); ++i)
+        group_sessions[i->second->getGroup()->groupname]++;
+
+    // Release read rights
+    session_monitor.releaseRead();
+
+    MetricsEndpoint::describe(output, "chat_group_sessions", "gauge", "Sessions logged into each group");
+    for (auto i = group_sessions.begin(); i != group_sessions.end(); ++i)
+        output << "chat_group_sessions{group=\"" << Metrics::escapeLabel(i->first) << "\"} " << i->second << "\n";
+
+    // Request read rights
+    replicas_monitor.requestRead();
+
+    MetricsEndpoint::describe(output, "chat_replication_queue_bytes", "gauge", "Bytes queued for each peer replica, waiting to be written");
+    for (auto i = replicas.begin(); i != replicas.end(); ++i)
+        output << "chat_replication_queue_bytes{replica=\"" << i->second.first << "\"} " << CoalescingWriter::pendingBytes(i->first) << "\n";
+
+    // Release read rights
+    replicas_monitor.releaseRead();
+
+    MetricsEndpoint::describe(output, "chat_replication_sequence", "gauge", "Last message update the leader relayed, or a backup applied (its leader's epoch above bit 48)");
+    output << "chat_replication_sequence " << ReplicaManager::replication_sequence << "\n";
+
+    MetricsEndpoint::describe(output, "chat_partition_members", "gauge", "Replicas the groups are split between, 0 if the cluster is not partitioned");
+    output << "chat_partition_members " << (PartitionMap::enabled() ? PartitionMap::ports().size() : 0) << "\n";
+
+    MetricsEndpoint::describe(output, "chat_worker_threads", "gauge", "Workers in the pool that handles the connections");
+    output << "chat_worker_threads " << WorkerPool::threads() << "\n";
+
+    MetricsEndpoint::describe(output, "chat_worker_busy", "gauge", "Workers running a task, most of them handling a connection");
+    output << "chat_worker_busy " << WorkerPool::active() << "\n";
+
+    MetricsEndpoint::describe(output, "chat_worker_queued", "gauge", "Tasks waiting for a worker");
+    output << "chat_worker_queued " << WorkerPool::pending() << "\n";
+
+    // Hardware counters, only if the kernel let the process open them
+    if (Affinity::counting())
+    {
+        MetricsEndpoint::describe(output, "chat_cache_misses_total", "counter", "Cache misses of the process, read from the hardware counters");
+        output << "chat_cache_misses_total " << Affinity::cacheMisses() << "\n";
+
+        MetricsEndpoint::describe(output, "chat_remote_node_misses_total", "counter", "Cache misses of the process served from another NUMA node");
+        output << "chat_remote_node_misses_total " << Affinity::remoteMisses() << "\n";
+    }
+
+    MetricsEndpoint::describe(output, "chat_leader", "gauge", "Identifier of the current leader replica, as this replica sees it");
+    output << "chat_leader " << ReplicaManager::leader << "\n";
+
+    MetricsEndpoint::describe(output, "chat_is_leader", "gauge", "1 if this replica is the leader");
+    output << "chat_is_leader " << (ReplicaManager::leader == ReplicaManager::ID ? 1 : 0) << "\n";
+
+    MetricsEndpoint::describe(output, "chat_last_election_seconds", "gauge", "Time (in seconds since the epoch) the last election ended, 0 if none did");
+    output << "chat_last_election_seconds " << last_election << "\n";
+
+    // Sizes are summed from the segment lists, with read rights only
+    MetricsEndpoint::describe(output, "chat_history_file_bytes", "gauge", "Size of each group's history segments");
+    HistoryLog::collect(output);
+}
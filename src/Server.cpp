@@ -8,8 +8,11 @@ std::map<std::string, command_function> Server::available_commands;
 int Server::message_history;
 int Server::server_socket;
 
-std::map<int, pthread_t> Server::connection_handler_threads;
-RW_Monitor Server::threads_monitor;
+std::set<int> Server::connection_sockets;
+RW_Monitor Server::connections_monitor("Server::connections_monitor");
+
+std::map<int, Session *> Server::session_list;
+RW_Monitor Server::session_monitor("Server::session_monitor");
 
 Server::Server(int N)
 {
@@ -25,101 +28,98 @@ Server::Server(int N)
     available_commands.insert(std::make_pair("list users", &User::listUsers));
     available_commands.insert(std::make_pair("list groups", &Group::listGroups));
     available_commands.insert(std::make_pair("list threads", &Server::listThreads));
+    available_commands.insert(std::make_pair("list pools", &MemoryPool::listStats));
+    available_commands.insert(std::make_pair("list io", &CoalescingWriter::listStats));
+    available_commands.insert(std::make_pair("list loop", &EventLoop::listStats));
+    available_commands.insert(std::make_pair("list metrics", &Metrics::listStats));
+    available_commands.insert(std::make_pair("list locks", &RW_Monitor::listContention));
+    available_commands.insert(std::make_pair("list timers", &TimerWheel::listStats));
+    available_commands.insert(std::make_pair("list history", &HistoryLog::listStats));
+    available_commands.insert(std::make_pair("list workers", &WorkerPool::listStats));
+    available_commands.insert(std::make_pair("list affinity", &Affinity::listStats));
+    available_commands.insert(std::make_pair("list acceptors", &Acceptor::listStats));
+    available_commands.insert(std::make_pair("dump trace", &Tracer::dump));
     available_commands.insert(std::make_pair("stop", &Server::issueStop));
     available_commands.insert(std::make_pair("help", &Server::listCommands));
 
     // Setup socket
     setupConnection();
+
+    // Start the output coalescing flusher
+    CoalescingWriter::start();
+
+    // Start watching the clients' liveness
+    TimerWheel::start();
+
+    // Start enforcing history retention and merging small segments
+    HistoryLog::start();
+
+    // Start the workers that handle the connections (the event loop handles them itself)
+    if (!EventLoop::enabled())
+        WorkerPool::start();
 }
 
 Server::~Server()
 {
     // Close opened sockets
-    close(server_socket);
+    Acceptor::release();
 }
 
 void Server::listenConnections()
 {
-    int client_socket = -1; // Socket assigned to each client on accept
-
-    // Create struct for socket timeout and set USER_TIMEOUT seconds
-    struct timeval timeout_timer;
-    timeout_timer.tv_sec = USER_TIMEOUT;
-    timeout_timer.tv_usec = 0;
-
-    // Set passive listen socket
-    if (listen(server_socket, 3) < 0)
-        throw std::runtime_error(appendErrorMessage("Error setting socket as passive listener"));
+    // Set passive listen sockets
+    Acceptor::listen();
 
     // Spawn thread for listening to administrator commands
     pthread_create(&command_handler_thread, NULL, handleCommands, NULL);
 
     // Admin instructions
-    std::cout << "Server is ready to receive connections" << std::endl;
+    Logger::log(LOG_MAIN, LOG_INFO, "Server is ready to receive connections");
     Server::listCommands();
 
-    // Wait for incoming connections
-    int sockaddr_size = sizeof(struct sockaddr_in);
-    int *new_socket;
-    while (!stop_issued && (client_socket = accept(server_socket, (struct sockaddr *)&client_address, (socklen_t *)&sockaddr_size)) > 0)
+    // With an event loop, this thread accepts and receives from every client until stopped
+    if (EventLoop::enabled())
     {
-        // Start new thread for new connection
-        pthread_t comm_thread;
-
-        // Get reference to client socket
-        new_socket = (int *)malloc(sizeof(int));
-        *new_socket = client_socket;
-
-        // Set the keep-alive timer on the socket
-        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout_timer, sizeof(timeout_timer)) < 0)
-            throw std::runtime_error(appendErrorMessage("Error setting socket options"));
+        EventLoop::run(server_socket, &Server::acceptConnection, &Server::handlePacket, &Server::closeConnection);
 
-        // Spawn new thread for handling that client
-        if (pthread_create(&comm_thread, NULL, handleConnection, (void *)new_socket) < 0)
-        {
-            // Close socket if no thread was created
-            std::cerr << "Could not create thread for socket " << client_socket << std::endl;
-            close(client_socket);
-        }
+        Logger::log(LOG_MAIN, LOG_INFO, "Waiting for command handler to end...");
 
-        // Request write rights
-        threads_monitor.requestWrite();
+        // Join with the command handler thread
+        pthread_join(command_handler_thread, NULL);
 
-        // Add thread to list of connection handlers
-        connection_handler_threads.insert(std::make_pair(*new_socket, comm_thread));
+        // Write anything still queued
+        CoalescingWriter::stop();
+        TimerWheel::stop();
+        HistoryLog::stop();
 
-        // Release write rights
-        threads_monitor.releaseWrite();
+        return;
     }
 
-    // Request read rights
-    threads_monitor.requestRead();
+    // Wait for incoming connections on every acceptor
+    Acceptor::run(&Server::dispatchConnection);
 
-    // Socket associated with each thread
-    int thread_socket = -1;
+    Logger::log(LOG_MAIN, LOG_INFO, "Waiting for client communication to end...");
 
-    // Wait for all threads to finish
-    for (std::map<int, pthread_t>::iterator i = connection_handler_threads.begin(); i != connection_handler_threads.end(); ++i)
-    {
+    // Wait for every connection handler to end, then for the workers
+    WorkerPool::stop();
 
-        std::cout << "Waiting for client communication to end on socket " << i->first << "..." << std::endl;
-        // Get the thread reference
-        pthread_join(i->second, NULL);
+    // Request write rights
+    connections_monitor.requestWrite();
 
-        // Save the thread number
-        thread_socket = i->first;
+    connection_sockets.clear();
 
-        // Remove this ended thread from the thread list
-        connection_handler_threads.erase(thread_socket);
-    }
+    // Release write rights
+    connections_monitor.releaseWrite();
 
-    std::cout << "Waiting for command handler to end..." << std::endl;
+    Logger::log(LOG_MAIN, LOG_INFO, "Waiting for command handler to end...");
 
     // Join with the command handler thread
     pthread_join(command_handler_thread, NULL);
 
-    // Release read rights
-    threads_monitor.releaseRead();
+    // Write anything still queued
+    CoalescingWriter::stop();
+    TimerWheel::stop();
+    HistoryLog::stop();
 }
 
 void Server::listCommands()
@@ -156,156 +156,256 @@ void *Server::handleCommands(void *arg)
     pthread_exit(NULL);
 }
 
-void *Server::handleConnection(void *arg)
+void Server::dispatchConnection(int client_socket)
 {
-    int socket = *(int *)arg;        // Client socket
-    int read_bytes = -1;             // Number of bytes read from the message
-    char client_message[PACKET_MAX]; // Buffer for client message, maximum of PACKET_MAX bytes
-    message_record *login_message;   // Buffer for client login information
+    // Request write rights
+    connections_monitor.requestWrite();
+
+    // Add it to the connection list before its handler runs, so a stop reaches it even if still queued
+    connection_sockets.insert(client_socket);
+
+    // Release write rights
+    connections_monitor.releaseWrite();
+
+    // Shut the connection down if the client stays quiet for USER_TIMEOUT seconds
+    TimerWheel::schedule(client_socket, USER_TIMEOUT * 1000);
+
+    // Hand the client to a worker
+    if (!WorkerPool::submit(handleConnection, (void *)(intptr_t)client_socket))
+    {
+        // Close socket if no worker took it
+        Logger::log(LOG_FRONTEND, LOG_ERROR, "Could not hand socket %d to a worker", client_socket);
+        TimerWheel::cancel(client_socket);
+        close(client_socket);
 
-    message_record *read_message;
+        // Request write rights
+        connections_monitor.requestWrite();
+
+        connection_sockets.erase(client_socket);
+
+        // Release write rights
+        connections_monitor.releaseWrite();
+    }
+}
 
-    Session *current_session = NULL; // Current session instance for a client
+void *Server::handleConnection(void *arg)
+{
+    int socket = (int)(intptr_t)arg; // Client socket
+    int read_bytes = -1;      // Number of bytes read from the message
+    Frame client_message;     // Frame for client message, maximum of PACKET_MAX bytes
+    uint64_t receiving = Tracer::begin(); // Start of the receive, if the next message is traced
 
-    while ((read_bytes = recv(socket, client_message, PACKET_MAX, 0)) > 0)
+    while (!stop_issued && (read_bytes = CommunicationUtils::receiveFrame(socket, client_message)) > 0)
     {
-        // Decode received data into a packet structure
-        packet *received_packet = (packet *)client_message;
+        Tracer::record("receivePacket", receiving);
+
+        // Anything received keeps the client alive
+        TimerWheel::touch(socket);
 
-        // Decide action according to packet type
-        switch (received_packet->type)
+        // Handle the packet, stop if the client was rejected
+        if (!Server::handlePacket(socket, client_message))
         {
-        case PAK_DATA: // Data packet
+            // Reject connection
+            Server::closeConnection(socket);
 
-            // Decode received message into a message record
-            read_message = (message_record *)received_packet->_payload;
+            // Request write rights
+            connections_monitor.requestWrite();
 
-            // Send message
-            if (current_session != NULL)
-                current_session->messageGroup(read_message);
+            // Remove itself from the connection list
+            connection_sockets.erase(socket);
 
-            break;
+            // Release write rights
+            connections_monitor.releaseWrite();
 
-        case PAK_COMMAND: // Command packet (login)
+            // Give the worker back
+            return NULL;
+        }
 
-            // Get user login information
-            login_message = (message_record *)received_packet->_payload;
+        // Decide if the next message is traced
+        receiving = Tracer::begin();
+    }
+
+    // Close current session (or the bare socket, if it never logged in)
+    // OBS: If the connection ended due to timeout, there is no point in sending message to client, application probably froze
+    Server::closeConnection(socket);
 
-            // (Try to) Create session
-            current_session = new Session(login_message->username, login_message->_message, socket);
+    if (!stop_issued)
+    {
+        // Request write rights
+        connections_monitor.requestWrite();
 
-            // If session creation went ok
-            if (current_session->isOpen())
-            {
-                // Send history to client
-                current_session->sendHistory(Server::message_history);
-            }
-            else
-            {
-                // Reject connection
-                close(socket);
+        // Remove itself from the connection list
+        connection_sockets.erase(socket);
 
-                // Delete current session
-                delete (current_session);
+        // Release write rights
+        connections_monitor.releaseWrite();
+    }
+
+    // Give the worker back
+    return NULL;
+}
+
+void Server::acceptConnection(int socket, struct sockaddr_in *address)
+{
+    // Receive from the client in the event loop
+    EventLoop::watch(socket);
+}
 
-                // Free received argument pointer
-                free(arg);
+bool Server::handlePacket(int socket, Frame &client_message)
+{
+    packet *received_packet = client_message.get(); // Received packet
+    message_record *login_message;                  // Buffer for client login information
+    Session *current_session = NULL;                // Current session instance for a client
 
-                // Request write rights
-                threads_monitor.requestWrite();
+    // Request read rights
+    session_monitor.requestRead();
 
-                // Remove itself from the threads list
-                connection_handler_threads.erase(socket);
+    // Get the session of this client, if it already logged in
+    auto found = session_list.find(socket);
+    if (found != session_list.end())
+        current_session = found->second;
 
-                // Release write rights
-                threads_monitor.releaseWrite();
+    // Release read rights
+    session_monitor.releaseRead();
 
-                // Exit
-                pthread_exit(NULL);
-            }
+    // Decide action according to packet type
+    switch (received_packet->type)
+    {
+    case PAK_DATA: // Data packet
 
+        // Validate the received message record in place
+        if (current_session == NULL || !CommunicationUtils::validateMessage(client_message))
+        {
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Malformed message received from socket at %d", socket);
             break;
-        case PAK_KEEP_ALIVE: // Keep-alive packet
+        }
+
+        {
+            // Take the received frame as the message that will be relayed
+            MessageBuffer read_message(std::move(client_message));
+
+            // Stamp server timestamp and canonical username into it
+            current_session->stampMessage(read_message);
+
+            // Send message
+            current_session->messageGroup(read_message);
+        }
+
+        break;
+
+    case PAK_COMMAND: // Command packet (login)
+
+        // Get user login information
+        login_message = (message_record *)received_packet->_payload;
+
+        // (Try to) Create session
+        current_session = new Session(login_message->username, login_message->_message, socket);
+
+        // Request write rights
+        session_monitor.requestWrite();
+
+        // Keep the session, even a rejected one is only deleted when the connection is closed
+        session_list[socket] = current_session;
+
+        // Release write rights
+        session_monitor.releaseWrite();
+
+        // If session creation went ok, send history to client
+        if (!current_session->isOpen())
+            return false;
 
+        current_session->acceptLogin(0, 0);
+        current_session->sendHistory(Server::message_history);
+
+        break;
+    case PAK_SEARCH: // History search packet
+
+        if (current_session == NULL)
+        {
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Search received from socket at %d before login", socket);
             break;
-        default:
-            std::cout << "Unkown packet received from socket at " << socket << std::endl;
+        }
+
+        // The query is the payload's text
+        current_session->sendSearch(std::string(received_packet->_payload, strnlen(received_packet->_payload, std::min<int>(received_packet->length, MESSAGE_MAX))));
+
+        break;
+    case PAK_HISTORY_REQUEST: // History range packet
+
+        if (current_session == NULL || received_packet->length < sizeof(history_request))
+        {
+            Logger::log(LOG_FRONTEND, LOG_WARN, "Invalid history request received from socket at %d", socket);
             break;
         }
 
-        // Clear the message buffer
-        bzero((void *)client_message, PACKET_MAX);
-    }
+        // Stream the range back in batches
+        current_session->sendHistoryRange(*(history_request *)received_packet->_payload);
 
-    // Close current session
-    delete (current_session);
+        break;
+    case PAK_KEEP_ALIVE: // Keep-alive packet
 
-    // Check if connection ended due to timeout
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-    {
-        // If so, close the connection for good
-        // OBS: No point in sending message to client, application probably froze
-        close(socket);
+        break;
+    default:
+        Logger::log(LOG_FRONTEND, LOG_WARN, "Unkown packet received from socket at %d", socket);
+        break;
     }
 
-    // Free received argument
-    free(arg);
+    return true;
+}
 
-    if (!stop_issued)
-    {
-        // Request write rights
-        threads_monitor.requestWrite();
+void Server::closeConnection(int socket)
+{
+    Session *current_session = NULL;
 
-        // Remove itself from the threads list
-        connection_handler_threads.erase(socket);
+    // Disarm its timer before the descriptor can be reused
+    if (TimerWheel::cancel(socket))
+        Logger::log(LOG_FRONTEND, LOG_INFO, "Client at socket %d timed out", socket);
 
-        // Release write rights
-        threads_monitor.releaseWrite();
+    // Request write rights
+    session_monitor.requestWrite();
+
+    // Take the session out of the list
+    auto found = session_list.find(socket);
+    if (found != session_list.end())
+    {
+        current_session = found->second;
+        session_list.erase(found);
     }
 
-    // Exit
-    pthread_exit(NULL);
+    // Release write rights
+    session_monitor.releaseWrite();
+
+    // Deleting the session closes its socket
+    if (current_session != NULL)
+        delete (current_session);
+    else
+        close(socket);
 }
 
 void Server::setupConnection()
 {
-    // Create socket
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error during socket creation"));
-
-    // Prepare server socket address
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(SERVER_PORT);
-
-    // Set socket options
-    int yes = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
-        throw std::runtime_error(appendErrorMessage("Error setting socket options"));
-
-    // Bind socket
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
-        throw std::runtime_error(appendErrorMessage("Error during socket bind"));
+    // Open and bind a socket for each acceptor (the event loop accepts from a single one)
+    server_socket = Acceptor::open(SERVER_PORT, !EventLoop::enabled());
 }
 
 void Server::listThreads()
 {
     // Request read rights
-    threads_monitor.requestRead();
+    connections_monitor.requestRead();
 
     // Delimiter
     std::cout << "======================" << std::endl;
 
-    // Iterate through threads
-    for (std::map<int, pthread_t>::iterator i = connection_handler_threads.begin(); i != connection_handler_threads.end(); ++i)
+    // Iterate through connections
+    for (std::set<int>::iterator i = connection_sockets.begin(); i != connection_sockets.end(); ++i)
     {
-        std::cout << " Thread associated with socket " << i->first << std::endl;
+        std::cout << " Worker task associated with socket " << *i << std::endl;
     }
     // Delimiter
     std::cout << "======================" << std::endl;
 
     // Release read rights
-    threads_monitor.releaseRead();
+    connections_monitor.releaseRead();
 }
 
 void Server::issueStop()
@@ -314,18 +414,22 @@ void Server::issueStop()
     // Issue a stop command to all running threads
     Server::stop_issued = true;
 
+    // Stop the event loop, it closes every client connection
+    if (EventLoop::enabled())
+        EventLoop::stop();
+
     // Request read rights
-    Server::threads_monitor.requestRead();
+    Server::connections_monitor.requestRead();
 
     // Stop all communication with clients
-    for (std::map<int, pthread_t>::iterator i = connection_handler_threads.begin(); i != connection_handler_threads.end(); ++i)
+    for (std::set<int>::iterator i = connection_sockets.begin(); i != connection_sockets.end(); ++i)
     {
-        shutdown(i->first, SHUT_RDWR);
+        shutdown(*i, SHUT_RDWR);
     }
 
     // Release read rights
-    Server::threads_monitor.releaseRead();
+    Server::connections_monitor.releaseRead();
 
-    // Stop the main socket from receiving connections
-    shutdown(Server::server_socket, SHUT_RDWR);
+    // Stop the listening sockets from receiving connections
+    Acceptor::stop();
 }
\ No newline at end of file
@@ -1,15 +1,18 @@
 #include "Session.h"
 
+std::atomic<bool> Session::delivering(true);
+
 Session::Session(std::string username, std::string groupname, int socket)
 {
     // Variables for if the user has too many sessions
     std::string message;
-    message_record *dc = NULL;
 
     // Initial values
     this->socket = socket;
     this->user = NULL;
     this->group = NULL;
+    this->history = NULL;
+    this->owns_socket = Session::delivering;
 
     // Attempt to join that group with that user
     if (!Group::joinByName(username, groupname, &this->user, &this->group, this))
@@ -18,20 +21,51 @@ Session::Session(std::string username, std::string groupname, int socket)
         message = "Connection was refused: exceeds MAX_SESSIONS (" + std::to_string(MAX_SESSIONS) + ")";
 
         // Compose message record
-        dc = CommunicationUtils::composeMessage(username, message, PAK_SERVER_MESSAGE);
+        MessageBuffer dc(username, message, PAK_SERVER_MESSAGE, PAK_COMMAND);
 
-        // Send message record to client
-        sendPacket(this->socket, PAK_COMMAND, (char *)dc, sizeof(*dc) + dc->length);
+        // Send message record to client (backups only mirror it, the leader tells the client)
+        if (Session::delivering)
+            CoalescingWriter::enqueue(this->socket, dc, true);
     }
+    else
+        this->history = this->group->history;
+}
+
+Session::Session(HistoryLog *history, int socket)
+{
+    // Nobody joins the group, the session only reads its history
+    this->socket = socket;
+    this->user = NULL;
+    this->group = NULL;
+    this->history = history;
+    this->owns_socket = true;
 }
 
 Session::~Session()
 {
-    // Leave the group with the user
-    this->user->leaveGroup(this);
+    // Leave the group with the user (read-only sessions never joined)
+    if (this->user != NULL)
+        this->user->leaveGroup(this);
+    else if (this->group == NULL && this->history != NULL)
+        HistoryLog::close(this->history);
 
-    // Close the socket
-    close(this->socket);
+    // Drop anything still queued and close the socket (a descriptor of this process with that
+    // number, e.g. a reader's, is left alone when the socket is the leader's)
+    if (this->owns_socket)
+    {
+        CoalescingWriter::remove(this->socket);
+        close(this->socket);
+    }
+}
+
+void *Session::operator new(size_t size)
+{
+    return Affinity::allocate(size);
+}
+
+void Session::operator delete(void *session)
+{
+    Affinity::release(session);
 }
 
 bool Session::isOpen()
@@ -54,64 +88,172 @@ User *Session::getUser()
     return this->user;
 }
 
-void Session::setSocket(int socket)
+void Session::setSocket(int socket, bool owned)
 {
+    // Nothing queued for the old socket will ever be delivered
+    if (this->owns_socket)
+        CoalescingWriter::remove(this->socket);
+
     // Update user side socket
     this->user->updateSession(this->socket, socket);
 
     // Update this side's socket
     this->socket = socket;
+    this->owns_socket = owned;
+}
+
+void Session::reply(int packet_type, char *payload, size_t payload_size)
+{
+    struct iovec part;
+
+    part.iov_base = payload;
+    part.iov_len = payload_size;
+
+    CoalescingWriter::enqueueParts(this->socket, packet_type, &part, 1, true);
+}
+
+void Session::acceptLogin(uint64_t replication, uint16_t read_port)
+{
+    login_accept accept;
+
+    bzero((void *)&accept, sizeof(accept));
+
+    // Quiet clients send a keep-alive well before the server would drop them
+    accept.heartbeat = HEARTBEAT_INTERVAL;
+    accept.timeout = USER_TIMEOUT * 1000;
+
+    // Where the client may read history from, and how fresh that replica must be
+    accept.replication = replication;
+    accept.read_port = read_port;
+
+    this->reply(PAK_LOGIN_ACCEPT, (char *)&accept, sizeof(accept));
 }
 
 int Session::sendHistory(int N)
 {
-    char read_buffer[PACKET_MAX * N]; // Buffer for messages
-    int message_count;                // How many messages were actually read
-    int offset = 0;                   // Current ofset in read buffer
-    char send_buffer[PACKET_MAX];     // Buffer for sending messages
-    message_record *message;          // Composed message that will be sent
+    history_request request; // The newest N messages
+
+    request.cursor = UINT64_MAX;
+    request.by = HISTORY_BY_SEQUENCE;
+    request.direction = HISTORY_OLDER;
+    request.limit = std::max(N, 0);
+
+    return this->sendHistoryRange(request);
+}
+
+int Session::sendHistoryRange(const history_request &request)
+{
+    int limit = std::min<int>(request.limit, HISTORY_PAGE_MAX);  // How many messages are read at most
+    std::vector<char> read_buffer((size_t)PACKET_MAX * std::max(limit, 1)); // Buffer for messages
+    int message_count;                                           // How many messages were actually read
+    int offset = 0;                                              // Current offset in read buffer
+    message_record *message;                                     // Message being batched
+    uint64_t first, end;                                         // Sequence numbers of the first message, and of the next one
 
-    // Initialize message records buffer
-    bzero((void *)read_buffer, PACKET_MAX * N);
+    alignas(history_batch) char batch_buffer[PACKET_MAX - sizeof(packet)]; // Batch being filled
+    history_batch *batch = (history_batch *)batch_buffer;
+    size_t batch_bytes = 0;                                                // Bytes of records in the batch
 
-    // Recover message history
-    message_count = this->group->recoverHistory(read_buffer, N, user);
+    // Read the range, seeking straight to its first message
+    message_count = Group::readHistory(this->history, request, read_buffer.data(), limit, &first, &end);
+
+    batch->first = first;
+    batch->end = end;
+    batch->count = 0;
+    batch->last = 0;
 
-    // Iterate through the buffer
     for (int i = 0; i < message_count; i++)
     {
-        // Decode the buffer data into a message record
-        message = (message_record *)(read_buffer + offset);
+        message = (message_record *)(read_buffer.data() + offset);
+        size_t record_size = sizeof(message_record) + message->length;
 
-        // Clear the send buffer and copy the new data into it
-        bzero((void *)send_buffer, PACKET_MAX);
-        memcpy(send_buffer, read_buffer + offset, sizeof(message_record) + message->length);
+        // Send the batch once the next record does not fit (a single record always fits, messages are short)
+        if (batch->count > 0 && sizeof(history_batch) + batch_bytes + record_size > sizeof(batch_buffer))
+        {
+            this->reply(PAK_HISTORY_BATCH, batch_buffer, sizeof(history_batch) + batch_bytes);
 
-        // Send the old message to the connected client
-        sendPacket(socket, PAK_DATA, send_buffer, sizeof(message_record) + message->length);
+            batch->first += batch->count;
+            batch->count = 0;
+            batch_bytes = 0;
+        }
+
+        memcpy((char *)batch->_records + batch_bytes, message, record_size);
+        batch_bytes += record_size;
+        batch->count++;
 
         // Go forward in the buffer
+        offset += record_size;
+    }
+
+    // The last batch is sent even if empty, it tells the client where the history ends
+    batch->last = 1;
+    this->reply(PAK_HISTORY_BATCH, batch_buffer, sizeof(history_batch) + batch_bytes);
+
+    return message_count;
+}
+
+int Session::sendSearch(const std::string &query)
+{
+    char read_buffer[PACKET_MAX * SEARCH_RESULTS_MAX]; // Buffer for the messages found
+    int message_count;                                 // How many messages were found
+    int offset = 0;                                    // Current offset in read buffer
+    message_record *message;                           // Message found
+    char empty = 0;
+
+    // Search the group history
+    message_count = Group::search(this->history, query, read_buffer, SEARCH_RESULTS_MAX);
+
+    // Send each message found, oldest first
+    for (int i = 0; i < message_count; i++)
+    {
+        message = (message_record *)(read_buffer + offset);
+
+        this->reply(PAK_SEARCH_RESULT, read_buffer + offset, sizeof(message_record) + message->length);
+
         offset += sizeof(message_record) + message->length;
     }
 
+    // An empty result ends the search
+    this->reply(PAK_SEARCH_RESULT, &empty, 0);
+
     return message_count;
 }
 
-void Session::messageGroup(message_record *message)
+void Session::stampMessage(MessageBuffer &message)
+{
+    message_record *record = message.record();
+
+    // Replace whatever the client claimed with the canonical username
+    bzero((void *)record->username, sizeof(record->username));
+    strncpy(record->username, this->user->username.c_str(), sizeof(record->username) - 1);
+
+    // Stamp server side data
+    record->port = 0xFFFF;
+    record->type = USER_MESSAGE;
+    record->timestamp = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+
+    // Relayed as a data packet
+    message.setType(PAK_DATA);
+}
+
+void Session::messageGroup(const MessageBuffer &message)
 {
     // Update user's last seen variable
     this->user->setLastSeen();
 
     // Send message to the group
     if (this->group != NULL)
-        this->group->post(message->_message, this->user->username, USER_MESSAGE);
+        this->group->post(message);
 }
 
-void Session::messageClient(message_record *message, int packet_type)
+void Session::messageClient(const Frame &frame)
 {
-    // Calculate message size
-    int size = sizeof(*message) + message->length;
+    TraceSpan span("Session::messageClient");
+
+    // Backups mirror the leader's sessions, their sockets are the leader's
+    if (!Session::delivering)
+        return;
 
-    // Send
-    CommunicationUtils::sendPacket(this->socket, packet_type, (char *)message, size);
+    // Queue, to be written together with other frames headed to this client
+    CoalescingWriter::enqueue(this->socket, frame);
 }
@@ -0,0 +1,258 @@
+#include "TimerWheel.h"
+
+#include <algorithm>
+
+std::atomic<timer_entry *> TimerWheel::pages[TIMER_PAGES];
+timer_entry *TimerWheel::slots[TIMER_LEVELS][TIMER_SLOTS];
+std::atomic<uint64_t> TimerWheel::current(0);
+long TimerWheel::armed_timers = 0;
+pthread_mutex_t TimerWheel::wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_t TimerWheel::wheel_thread;
+std::atomic<bool> TimerWheel::running(false);
+
+Counter *TimerWheel::expirations = Metrics::counter("connection_timeouts_total", "Connections shut down for staying quiet past their timeout");
+Counter *TimerWheel::reschedules = Metrics::counter("timer_reschedules_total", "Liveness timers moved to a later deadline because their connection was active");
+
+void TimerWheel::start()
+{
+    if (running)
+        return;
+
+    running = true;
+    pthread_create(&wheel_thread, NULL, advanceWheel, NULL);
+}
+
+void TimerWheel::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+    pthread_join(wheel_thread, NULL);
+}
+
+void TimerWheel::schedule(int socket, int timeout_ms)
+{
+    pthread_mutex_lock(&wheel_lock);
+
+    timer_entry *entry = TimerWheel::entryOf(socket, true);
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&wheel_lock);
+        Logger::log(LOG_IO, LOG_WARN, "Socket %d is out of the timer wheel's range, its liveness is not watched", socket);
+        return;
+    }
+
+    // A descriptor only has one timer
+    if (entry->armed)
+        TimerWheel::unlink(entry);
+    else
+        armed_timers++;
+
+    entry->socket = socket;
+    // Rounded up, plus the tick already under way, so timers never expire early
+    entry->timeout = (timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS + 1;
+    entry->last_active = current.load();
+    entry->deadline = current + entry->timeout;
+    entry->armed = true;
+    entry->expired = false;
+
+    TimerWheel::insert(entry);
+
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+bool TimerWheel::cancel(int socket)
+{
+    bool expired = false;
+
+    pthread_mutex_lock(&wheel_lock);
+
+    timer_entry *entry = TimerWheel::entryOf(socket, false);
+    if (entry != NULL)
+    {
+        if (entry->armed)
+        {
+            TimerWheel::unlink(entry);
+            entry->armed = false;
+            armed_timers--;
+        }
+
+        expired = entry->expired;
+        entry->expired = false;
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+
+    return expired;
+}
+
+void TimerWheel::listStats()
+{
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    pthread_mutex_lock(&wheel_lock);
+    std::cout << "Armed timers: " << armed_timers << std::endl;
+    pthread_mutex_unlock(&wheel_lock);
+
+    std::cout << "Current tick: " << current << " (" << TIMER_TICK_MS << "ms each)" << std::endl;
+    std::cout << "Connections timed out: " << expirations->value() << std::endl;
+    std::cout << "Timers moved by activity: " << reschedules->value() << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+void *TimerWheel::advanceWheel(void *arg)
+{
+    uint64_t started = TimerWheel::now() - current * TIMER_TICK_MS; // Time tick 0 started at
+
+    while (running)
+    {
+        usleep(TIMER_TICK_MS * 1000);
+
+        uint64_t target = (TimerWheel::now() - started) / TIMER_TICK_MS;
+        int shut_down = 0;
+
+        // Catch up on every tick that passed, one slot at a time
+        pthread_mutex_lock(&wheel_lock);
+        while (current < target)
+            shut_down += TimerWheel::advance(current + 1);
+        pthread_mutex_unlock(&wheel_lock);
+
+        if (shut_down > 0)
+            Logger::log(LOG_IO, LOG_INFO, "%d connection(s) timed out", shut_down);
+    }
+
+    pthread_exit(NULL);
+}
+
+int TimerWheel::advance(uint64_t tick)
+{
+    timer_entry *due = NULL;
+    int shut_down = 0;
+
+    current = tick;
+
+    // Every time a level wraps around, the next slot of the level above is spread through the levels below
+    for (int level = 1; level < TIMER_LEVELS; level++)
+    {
+        if ((tick & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            break;
+
+        timer_entry **slot = &slots[level][(tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+        timer_entry *cascading = *slot;
+        *slot = NULL;
+
+        while (cascading != NULL)
+        {
+            timer_entry *next = cascading->next;
+            TimerWheel::insert(cascading);
+            cascading = next;
+        }
+    }
+
+    // Take the timers due now
+    timer_entry **slot = &slots[0][tick & (TIMER_SLOTS - 1)];
+    due = *slot;
+    *slot = NULL;
+
+    while (due != NULL)
+    {
+        timer_entry *entry = due;
+        due = due->next;
+
+        uint64_t active_until = entry->last_active.load(std::memory_order_relaxed) + entry->timeout;
+
+        // Deadline beyond the wheel's range, it was parked in the last slot
+        if (entry->deadline > tick)
+            TimerWheel::insert(entry);
+        // Heard from since it was armed, move it to its new deadline
+        else if (active_until > tick)
+        {
+            entry->deadline = active_until;
+            TimerWheel::insert(entry);
+            reschedules->add();
+        }
+        // Quiet for the whole timeout, shut it down (while holding the lock, so the descriptor
+        // cannot be closed and reused before)
+        else
+        {
+            entry->armed = false;
+            entry->expired = true;
+            entry->slot = NULL;
+            armed_timers--;
+
+            shutdown(entry->socket, SHUT_RD);
+            expirations->add();
+            shut_down++;
+        }
+    }
+
+    return shut_down;
+}
+
+void TimerWheel::insert(timer_entry *entry)
+{
+    uint64_t tick = current;
+    uint64_t due = std::max<uint64_t>(entry->deadline, tick + 1);
+    int level = 0;
+
+    // Deadlines beyond the wheel's range wait in its last slot
+    due = std::min<uint64_t>(due, tick + (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1);
+
+    // The finest level that reaches the deadline
+    while (level < TIMER_LEVELS - 1 && due - tick >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+        level++;
+
+    timer_entry **slot = &slots[level][(due >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+
+    entry->slot = slot;
+    entry->previous = NULL;
+    entry->next = *slot;
+    if (*slot != NULL)
+        (*slot)->previous = entry;
+    *slot = entry;
+}
+
+void TimerWheel::unlink(timer_entry *entry)
+{
+    if (entry->slot == NULL)
+        return;
+
+    if (entry->previous != NULL)
+        entry->previous->next = entry->next;
+    else
+        *entry->slot = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->previous = entry->previous;
+
+    entry->slot = NULL;
+    entry->previous = entry->next = NULL;
+}
+
+timer_entry *TimerWheel::entryOf(int socket, bool create)
+{
+    if (socket < 0 || socket >= (TIMER_PAGES << TIMER_PAGE_BITS))
+        return NULL;
+
+    std::atomic<timer_entry *> &page = pages[socket >> TIMER_PAGE_BITS];
+    timer_entry *entries = page.load(std::memory_order_acquire);
+
+    // Pages are never freed, so receivers can touch them without the lock
+    if (entries == NULL && create)
+    {
+        entries = new timer_entry[1 << TIMER_PAGE_BITS]();
+        page.store(entries, std::memory_order_release);
+    }
+
+    return entries != NULL ? &entries[socket & ((1 << TIMER_PAGE_BITS) - 1)] : NULL;
+}
+
+uint64_t TimerWheel::now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,165 @@
+#include "Tracer.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+
+std::atomic<int> Tracer::rate(0);
+std::atomic<uint64_t> Tracer::next_message(1);
+
+std::vector<trace_ring *> Tracer::rings;
+std::vector<trace_ring *> Tracer::free_rings;
+pthread_mutex_t Tracer::rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+thread_local uint64_t Tracer::current_message = 0;
+thread_local int Tracer::countdown = 0;
+
+// Holds the ring of a thread, giving it back when the thread exits
+struct __trace_ring_owner
+{
+    trace_ring *ring = NULL;
+
+    ~__trace_ring_owner()
+    {
+        if (ring != NULL)
+            Tracer::releaseRing(ring);
+    }
+};
+
+static thread_local __trace_ring_owner ring_owner;
+
+void Tracer::configure(int rate)
+{
+    Tracer::rate = rate > 0 ? rate : 0;
+}
+
+uint64_t Tracer::begin()
+{
+    int every = rate.load(std::memory_order_relaxed);
+
+    current_message = 0;
+
+    // Tracing off, or not this one
+    if (every == 0 || ++countdown < every)
+        return 0;
+
+    countdown = 0;
+    current_message = next_message.fetch_add(1, std::memory_order_relaxed);
+
+    return Tracer::now();
+}
+
+void Tracer::record(const char *name, uint64_t start)
+{
+    if (start == 0 || !Tracer::active())
+        return;
+
+    uint64_t end = Tracer::now();
+    trace_ring *ring = Tracer::ownRing();
+    uint64_t position = ring->next.load(std::memory_order_relaxed);
+    trace_event *event = &ring->events[position & (TRACE_RING_ENTRIES - 1)];
+
+    event->start.store(start, std::memory_order_relaxed);
+    event->duration.store(end - start, std::memory_order_relaxed);
+    event->message.store(current_message, std::memory_order_relaxed);
+    event->thread.store(ring->thread, std::memory_order_relaxed);
+    event->name.store(name, std::memory_order_relaxed);
+
+    // Publish the span
+    ring->next.store(position + 1, std::memory_order_release);
+}
+
+long Tracer::write(std::ostream &output)
+{
+    long written = 0;
+    pid_t process = getpid();
+
+    output << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+
+    pthread_mutex_lock(&rings_lock);
+
+    for (trace_ring *ring : rings)
+    {
+        uint64_t last = ring->next.load(std::memory_order_acquire);
+        uint64_t first = last > TRACE_RING_ENTRIES ? last - TRACE_RING_ENTRIES : 0;
+
+        for (uint64_t position = first; position < last; position++)
+        {
+            trace_event *event = &ring->events[position & (TRACE_RING_ENTRIES - 1)];
+            const char *name = event->name.load(std::memory_order_relaxed);
+
+            if (name == NULL)
+                continue;
+
+            uint64_t start = event->start.load(std::memory_order_relaxed);
+            uint64_t duration = event->duration.load(std::memory_order_relaxed);
+            char times[64];
+
+            // Chrome wants microseconds, kept with nanosecond precision
+            snprintf(times, sizeof(times), "\"ts\": %lu.%03lu, \"dur\": %lu.%03lu", start / 1000, start % 1000, duration / 1000, duration % 1000);
+
+            output << (written > 0 ? "," : "") << "\n  {\"name\": \"" << name << "\", \"cat\": \"message\", \"ph\": \"X\", " << times
+                   << ", \"pid\": " << process << ", \"tid\": " << event->thread.load(std::memory_order_relaxed)
+                   << ", \"args\": {\"message\": " << event->message.load(std::memory_order_relaxed) << "}}";
+            written++;
+        }
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    output << "\n]}" << std::endl;
+
+    return written;
+}
+
+void Tracer::dump()
+{
+    std::ofstream output(TRACE_FILE);
+
+    if (!output)
+    {
+        std::cout << "Could not open " << TRACE_FILE << std::endl;
+        return;
+    }
+
+    long written = Tracer::write(output);
+
+    std::cout << "Dumped " << written << " spans to " << TRACE_FILE << " (tracing " << (rate > 0 ? "1 in " + std::to_string(rate) + " messages" : "off") << ")" << std::endl;
+}
+
+trace_ring *Tracer::ownRing()
+{
+    if (ring_owner.ring != NULL)
+        return ring_owner.ring;
+
+    pthread_mutex_lock(&rings_lock);
+
+    // Reuse the ring of a thread that exited, or create one
+    if (!free_rings.empty())
+    {
+        ring_owner.ring = free_rings.back();
+        free_rings.pop_back();
+    }
+    else
+    {
+        ring_owner.ring = new trace_ring();
+        ring_owner.ring->next = 0;
+        for (int i = 0; i < TRACE_RING_ENTRIES; i++)
+            ring_owner.ring->events[i].name = NULL;
+
+        rings.push_back(ring_owner.ring);
+    }
+
+    ring_owner.ring->thread = syscall(SYS_gettid);
+
+    pthread_mutex_unlock(&rings_lock);
+
+    return ring_owner.ring;
+}
+
+void Tracer::releaseRing(trace_ring *ring)
+{
+    pthread_mutex_lock(&rings_lock);
+    free_rings.push_back(ring);
+    pthread_mutex_unlock(&rings_lock);
+}
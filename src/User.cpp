@@ -1,7 +1,7 @@
 #include "User.h"
 
 std::map<std::string, User *> User::active_users;
-RW_Monitor User::active_users_monitor;
+RW_Monitor User::active_users_monitor("User::active_users_monitor");
 
 User *User::getUser(std::string username)
 {
@@ -66,7 +66,7 @@ void User::listUsers()
     active_users_monitor.releaseRead();
 }
 
-User::User(std::string username)
+User::User(std::string username) : session_monitor("User::session_monitor")
 {
     // Update username, last seen and active sessions
     this->username = username;
@@ -189,11 +189,8 @@ int User::leaveGroup(Session *session)
     return 0;
 }
 
-int User::signalNewMessage(std::string message, std::string username, std::string groupname, int packet_type, int message_type)
+int User::signalNewMessage(const MessageBuffer &message, const std::string &groupname)
 {
-    // Compose a new message
-    message_record *msg = CommunicationUtils::composeMessage(username, message, message_type);
-
     // Request read rights
     session_monitor.requestRead();
 
@@ -202,15 +199,12 @@ int User::signalNewMessage(std::string message, std::string username, std::strin
     {
         // If client is part of this group, send message
         if (!i->second->getGroup()->groupname.compare(groupname))
-            i->second->messageClient(msg, packet_type);
+            i->second->messageClient(message);
     }
 
     // Release read rights
     session_monitor.releaseRead();
 
-    // Free created structure
-    free(msg);
-
     return 1;
 }
 
@@ -0,0 +1,296 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+std::atomic<int> WorkerPool::initial_workers(WORKER_POOL_SIZE);
+std::atomic<int> WorkerPool::max_workers(WORKER_POOL_SIZE * WORKER_POOL_GROWTH);
+std::atomic<int> WorkerPool::max_queued(WORKER_QUEUE_MAX);
+
+std::vector<worker_queue *> WorkerPool::workers;
+std::atomic<int> WorkerPool::worker_count(0);
+std::atomic<int> WorkerPool::queued(0);
+std::atomic<int> WorkerPool::busy(0);
+std::atomic<unsigned> WorkerPool::next_worker(0);
+thread_local int WorkerPool::current = -1;
+
+pthread_mutex_t WorkerPool::idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t WorkerPool::idle_signal = PTHREAD_COND_INITIALIZER;
+int WorkerPool::idle_workers = 0;
+int WorkerPool::wakeups = 0;
+std::atomic<bool> WorkerPool::running(false);
+
+Counter *WorkerPool::submitted = Metrics::counter("worker_tasks_total", "Tasks handed to the worker pool");
+Counter *WorkerPool::steals = Metrics::counter("worker_steals_total", "Tasks run by a worker other than the one they were handed to");
+Counter *WorkerPool::rejected = Metrics::counter("worker_rejected_total", "Tasks the worker pool rejected because too many were waiting");
+Counter *WorkerPool::spawned = Metrics::counter("worker_threads_started_total", "Worker threads started");
+
+void WorkerPool::configure(int workers, int queue_max)
+{
+    initial_workers = std::max(workers, 1);
+    max_workers = initial_workers * WORKER_POOL_GROWTH;
+    max_queued = queue_max > 0 ? queue_max : WORKER_QUEUE_MAX;
+}
+
+void WorkerPool::start()
+{
+    if (running)
+        return;
+
+    pthread_mutex_lock(&idle_lock);
+
+    // Never resized while workers run, they read each other's slots without a lock
+    workers.assign(max_workers, NULL);
+
+    running = true;
+    while (worker_count < initial_workers && WorkerPool::spawn())
+        ;
+
+    pthread_mutex_unlock(&idle_lock);
+}
+
+void WorkerPool::stop()
+{
+    if (!running)
+        return;
+
+    // Workers still run what was queued, then leave instead of waiting
+    pthread_mutex_lock(&idle_lock);
+    running = false;
+    pthread_cond_broadcast(&idle_signal);
+    pthread_mutex_unlock(&idle_lock);
+
+    for (int i = 0; i < worker_count; i++)
+        pthread_join(workers[i]->thread, NULL);
+
+    // Workers steal from each other until they leave, so no deque goes before all of them did
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_mutex_destroy(&workers[i]->lock);
+        delete workers[i];
+        workers[i] = NULL;
+    }
+
+    worker_count = 0;
+    idle_workers = 0;
+    wakeups = 0;
+}
+
+bool WorkerPool::submit(worker_task task, void *argument)
+{
+    if (!running || worker_count == 0)
+        return false;
+
+    // Bound the tasks waiting, a backlog this deep will not be served in time anyway
+    if (queued >= max_queued)
+    {
+        rejected->add();
+        Logger::log(LOG_MAIN, LOG_WARN, "Worker pool rejected a task, %d are already waiting", queued.load());
+        return false;
+    }
+
+    // Workers keep what they submit, the rest is spread over every deque
+    int index = current >= 0 ? current : next_worker++ % worker_count;
+    worker_queue *queue = workers[index];
+
+    pthread_mutex_lock(&queue->lock);
+    queue->jobs.push_back({task, argument});
+    queue->size++;
+    pthread_mutex_unlock(&queue->lock);
+
+    queued++;
+    submitted->add();
+
+    pthread_mutex_lock(&idle_lock);
+    WorkerPool::wake();
+    pthread_mutex_unlock(&idle_lock);
+
+    return true;
+}
+
+int WorkerPool::threads()
+{
+    return worker_count;
+}
+
+int WorkerPool::active()
+{
+    return busy;
+}
+
+int WorkerPool::pending()
+{
+    return queued;
+}
+
+void WorkerPool::listStats()
+{
+    // Delimiter
+    std::cout << "======================" << std::endl;
+
+    pthread_mutex_lock(&idle_lock);
+    std::cout << "Workers: " << worker_count << " (started with " << initial_workers << ", at most " << max_workers << ")" << std::endl;
+    std::cout << "Busy: " << busy << ", idle: " << idle_workers << std::endl;
+    pthread_mutex_unlock(&idle_lock);
+
+    std::cout << "Tasks waiting: " << queued << " (at most " << max_queued << ")" << std::endl;
+    std::cout << "Tasks submitted: " << submitted->value() << ", stolen: " << steals->value() << ", rejected: " << rejected->value() << std::endl;
+
+    // Workers never go away while the pool runs, so they can be read without the lock
+    for (int i = 0; i < worker_count; i++)
+        std::cout << " Worker " << i << ": " << workers[i]->executed << " tasks run, " << workers[i]->stolen << " stolen, " << workers[i]->size << " waiting" << std::endl;
+
+    // Delimiter
+    std::cout << "======================" << std::endl;
+}
+
+void *WorkerPool::work(void *arg)
+{
+    int index = (int)(intptr_t)arg; // Index of this worker
+    worker_job job;                 // Task being run
+
+    current = index;
+
+    // Workers run the connection handlers
+    Affinity::pin(AFFINITY_IO);
+
+    while (true)
+    {
+        if (WorkerPool::take(index, &job))
+        {
+            // Tasks left behind need another worker, this one may be busy for long
+            if (queued > 0)
+            {
+                pthread_mutex_lock(&idle_lock);
+                WorkerPool::wake();
+                pthread_mutex_unlock(&idle_lock);
+            }
+
+            job.task(job.argument);
+
+            workers[index]->executed++;
+            busy--;
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+
+        // A task may have been submitted while the deques were scanned
+        if (queued > 0)
+        {
+            pthread_mutex_unlock(&idle_lock);
+            continue;
+        }
+
+        if (!running)
+        {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+
+        idle_workers++;
+        while (running && wakeups == 0)
+            pthread_cond_wait(&idle_signal, &idle_lock);
+
+        // Whoever woke this worker already took it off the idle count
+        if (wakeups > 0)
+            wakeups--;
+        else
+            idle_workers--;
+
+        pthread_mutex_unlock(&idle_lock);
+    }
+
+    return NULL;
+}
+
+bool WorkerPool::take(int index, worker_job *job)
+{
+    int count = std::max(worker_count.load(), index + 1); // A new worker runs before it is counted
+
+    // Own deque first, newest task first, then the oldest task of every other deque
+    for (int i = 0; i < count; i++)
+    {
+        worker_queue *queue = workers[(index + i) % count];
+        if (queue->size == 0)
+            continue;
+
+        pthread_mutex_lock(&queue->lock);
+
+        if (queue->jobs.empty())
+        {
+            pthread_mutex_unlock(&queue->lock);
+            continue;
+        }
+
+        if (i == 0)
+        {
+            *job = queue->jobs.back();
+            queue->jobs.pop_back();
+        }
+        else
+        {
+            *job = queue->jobs.front();
+            queue->jobs.pop_front();
+        }
+        queue->size--;
+
+        pthread_mutex_unlock(&queue->lock);
+
+        // Counted busy before it stops being queued, so a waiting task is never missed by wake
+        busy++;
+        queued--;
+
+        if (i > 0)
+        {
+            workers[index]->stolen++;
+            steals->add();
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void WorkerPool::wake()
+{
+    // An idle worker takes it
+    if (idle_workers > 0)
+    {
+        idle_workers--;
+        wakeups++;
+        pthread_cond_signal(&idle_signal);
+        return;
+    }
+
+    // Workers neither busy nor idle are between tasks and take one each, start another if they are too few
+    if (worker_count - busy < queued)
+        WorkerPool::spawn();
+}
+
+bool WorkerPool::spawn()
+{
+    if (!running || worker_count >= max_workers)
+        return false;
+
+    worker_queue *queue = new worker_queue();
+    pthread_mutex_init(&queue->lock, NULL);
+
+    // Published before the thread starts, it reads its own slot right away
+    int index = worker_count;
+    workers[index] = queue;
+
+    if (pthread_create(&queue->thread, NULL, work, (void *)(intptr_t)index) != 0)
+    {
+        Logger::log(LOG_MAIN, LOG_ERROR, "Could not start worker %d", index);
+        workers[index] = NULL;
+        pthread_mutex_destroy(&queue->lock);
+        delete queue;
+        return false;
+    }
+
+    worker_count++;
+    spawned->add();
+
+    return true;
+}
@@ -0,0 +1,38 @@
+#include "LoadGenerator.h"
+#include "Options.h"
+
+/* Load generator entrypoint */
+int main(int argc, char **argv)
+{
+    // Parse command line input
+    if (argc < 3 || !Options::parse(argc, argv, 3))
+    {
+        std::cerr << "Usage: " << argv[0] << " <server-ip> <server-port> [options]" << std::endl;
+        std::cerr << "The target may be a server or the leader replica" << std::endl;
+        std::cerr << "Options:" << std::endl;
+        std::cerr << "  --users=<n>       Simulated users (default 1000)" << std::endl;
+        std::cerr << "  --groups=<n>      Groups the users are spread through (default 10)" << std::endl;
+        std::cerr << "  --rate=<n>        Messages posted per second (default 1000)" << std::endl;
+        std::cerr << "  --duration=<s>    Time messages are posted for (default 5)" << std::endl;
+        std::cerr << "  --keepalive=<ms>  Time between keep-alives of each user, 0 disables them (default " << HEARTBEAT_INTERVAL << ")" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        LoadGenerator generator(argv[1], atoi(argv[2]), Options::getInt("users", 1000), Options::getInt("groups", 10), Options::getInt("rate", 1000), Options::getInt("duration", 5), Options::getInt("keepalive", HEARTBEAT_INTERVAL));
+
+        // Log in, post and wait for the deliveries
+        generator.run();
+
+        // Print results
+        generator.report();
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
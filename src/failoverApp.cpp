@@ -0,0 +1,54 @@
+#include <fstream>
+
+#include "FailoverBenchmark.h"
+#include "Options.h"
+
+/* Failover benchmark entrypoint */
+int main(int argc, char **argv)
+{
+    // Parse command line input
+    if (!Options::parse(argc, argv, 1) || Options::has("help"))
+    {
+        std::cerr << "Usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "Options:" << std::endl;
+        std::cerr << "  --replicas=<n>    Replicas started on loopback, replica 0 leads (default 3)" << std::endl;
+        std::cerr << "  --clients=<n>     Synthetic clients (default 20)" << std::endl;
+        std::cerr << "  --groups=<n>      Groups the clients are spread through (default 4)" << std::endl;
+        std::cerr << "  --rate=<n>        Messages posted per second (default 200)" << std::endl;
+        std::cerr << "  --duration=<s>    Time messages are posted for (default 10)" << std::endl;
+        std::cerr << "  --kill-after=<s>  Time after the first post the leader is killed (default 3)" << std::endl;
+        std::cerr << "  --port=<n>        Port of replica 0, replica i listens at port - i (default 7000)" << std::endl;
+        std::cerr << "  --replica=<path>  Replica executable (default ./replica)" << std::endl;
+        std::cerr << "  --output=<file>   Write the JSON results to a file instead of stdout" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        FailoverBenchmark harness(Options::getInt("replicas", 3), Options::getInt("clients", 20), Options::getInt("groups", 4), Options::getInt("rate", 200), Options::getInt("duration", 10), Options::getInt("kill-after", 3), Options::getInt("port", 7000), Options::getString("replica", "./replica"));
+
+        // Start the replicas, post and crash the leader
+        harness.run();
+
+        // Print results
+        if (Options::has("output"))
+        {
+            std::ofstream output(Options::getString("output", ""));
+            if (!output)
+                throw std::runtime_error("Could not open the output file");
+
+            harness.report(output);
+        }
+        else
+        {
+            harness.report(std::cout);
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
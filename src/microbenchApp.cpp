@@ -0,0 +1,61 @@
+#include <fstream>
+
+#include "MicroBenchmark.h"
+#include "Options.h"
+
+/* Microbenchmark entrypoint */
+int main(int argc, char **argv)
+{
+    // Parse command line input
+    if (!Options::parse(argc, argv, 1) || Options::has("help"))
+    {
+        std::cerr << "Usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "Options:" << std::endl;
+        std::cerr << "  --iterations=<n>  Operations per repetition (default 100000)" << std::endl;
+        std::cerr << "  --repeats=<n>     Measured repetitions of each case (default 10)" << std::endl;
+        std::cerr << "  --warmup=<n>      Discarded repetitions before the measured ones (default 2)" << std::endl;
+        std::cerr << "  --cpu=<n>         CPU to pin the process to, -1 disables pinning (default 0)" << std::endl;
+        std::cerr << "  --seed=<n>        Seed for the message text (default 1)" << std::endl;
+        std::cerr << "  --payload=<n>     Size (in bytes) of the message text (default 128)" << std::endl;
+        std::cerr << "  --members=<n>     Sessions in the group of the broadcast case, at least 2 (default 4)" << std::endl;
+        std::cerr << "  --filter=<name>   Only run the cases whose name contains this" << std::endl;
+        std::cerr << "  --output=<file>   Write the JSON results to a file instead of stdout" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        MicroBenchmark benchmark(Options::getInt("iterations", 100000), Options::getInt("repeats", 10), Options::getInt("warmup", 2), Options::getInt("cpu", 0), Options::getInt("seed", 1), Options::getInt("payload", 128), Options::getInt("members", 4), Options::getString("filter", ""));
+
+        // Run every case
+        benchmark.run();
+
+        // Print results
+        if (Options::has("output"))
+        {
+            std::ofstream output(Options::getString("output", ""));
+            if (!output)
+                throw std::runtime_error("Could not open the output file");
+
+            benchmark.report(output);
+        }
+        else
+        {
+            benchmark.report(std::cout);
+        }
+
+        // Broadcasting a received message must neither take a pool block nor copy it once warm
+        if (benchmark.broadcastBlocks() > 0 || benchmark.broadcastCopies() > 0)
+        {
+            std::cerr << "Broadcast path took " << benchmark.broadcastBlocks() << " pool blocks and made " << benchmark.broadcastCopies() << " payload copies once warm, expected 0" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,28 +1,123 @@
 #include "ReplicaManager.h"
+#include "Options.h"
 
 /* Replica entrypoint */
 int main(int argc, char **argv)
 {
     // Parse command line input
-    if (argc < 7)
+    if (argc < 7 || !Options::parse(argc, argv, 7))
     {
-        std::cerr << "Usage: " << argv[0] << " <N> <replica-port> <replica-ID> <leader-ip> <leader-port> <leader-id> " << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <N> <replica-port> <replica-ID> <leader-ip> <leader-port> <leader-id> [options]" << std::endl;
+        std::cerr << "  <N>                     Newest messages sent to a user when they log in, at most " << HISTORY_PAGE_MAX << std::endl;
+        std::cerr << "Options:" << std::endl;
+        std::cerr << "  --acceptors=<n>         Threads accepting connections, each on its own socket (default " << ACCEPTOR_COUNT << ")" << std::endl;
+        std::cerr << "  --backlog=<n>           Connections waiting to be accepted on each socket (default " << LISTEN_BACKLOG << ")" << std::endl;
+        std::cerr << "  --coalesce-window=<us>  Time a frame may wait to be written with others, 0 disables (default " << COALESCE_WINDOW_US << ")" << std::endl;
+        std::cerr << "  --coalesce-bytes=<n>    Pending bytes per socket that cause an immediate write (default " << COALESCE_MAX_BYTES << ")" << std::endl;
+        std::cerr << "  --cork                  Wrap coalesced writes in TCP_CORK" << std::endl;
+        std::cerr << "  --io=<backend>          Front-end I/O: threads, epoll or uring (default threads)" << std::endl;
+        std::cerr << "  --numa-local            Allocate groups, sessions and history logs on the node of the thread creating them" << std::endl;
+        std::cerr << "  --pin-io=<cpus>         CPUs the connection workers and event loop run on, e.g. 0-3,8 (default unpinned)" << std::endl;
+        std::cerr << "  --pin-replication=<cpus> CPUs the output flusher runs on (default unpinned)" << std::endl;
+        std::cerr << "  --pin-history=<cpus>    CPUs the history maintenance runs on (default unpinned)" << std::endl;
+        std::cerr << "  --metrics-port=<port>   Serve metrics over HTTP at this port, at /metrics (default off)" << std::endl;
+        std::cerr << "  --partitioned           Split the groups between the replicas, each leading its own (every replica must be given it)" << std::endl;
+        std::cerr << "  --log=<levels>          Log levels, e.g. info,election=debug (levels: error, warn, info, debug;" << std::endl;
+        std::cerr << "                          subsystems: main, frontend, replication, election, io; default info)" << std::endl;
+        std::cerr << "  --retain-age=<s>        Delete history segments this long after their newest message (default 0, kept)" << std::endl;
+        std::cerr << "  --retain-segments=<n>   History segments kept per group (default 0, all)" << std::endl;
+        std::cerr << "  --retain-mb=<n>         History kept per group, in MiB (default 0, all)" << std::endl;
+        std::cerr << "  --trace-rate=<n>        Trace one message in every n, dumped by the trace command (default 0, off)" << std::endl;
+        std::cerr << "  --workers=<n>           Workers started to handle connections, up to " << WORKER_POOL_GROWTH << " times as many while all are busy;" << std::endl;
+        std::cerr << "                          with --io=threads every connection keeps one (default " << WORKER_POOL_SIZE << ")" << std::endl;
+        std::cerr << "  --worker-queue=<n>      Tasks waiting for a worker before new connections are refused (default " << WORKER_QUEUE_MAX << ")" << std::endl;
         return 1;
     }
 
+    // Set the log levels
+    if (!Logger::configure(Options::getString("log", "info")))
+    {
+        std::cerr << "Invalid log levels: " << Options::getString("log", "info") << std::endl;
+        return 1;
+    }
+
+    // Choose the front-end I/O backend
+    if (!EventLoop::configure(Options::getString("io", "threads")))
+    {
+        std::cerr << "Unknown I/O backend: " << Options::getString("io", "threads") << std::endl;
+        return 1;
+    }
+
+    // Configure output coalescing
+    CoalescingWriter::configure(Options::getInt("coalesce-window", COALESCE_WINDOW_US), Options::getInt("coalesce-bytes", COALESCE_MAX_BYTES), Options::has("cork"));
+
+    // Split the groups between the replicas, if asked to
+    PartitionMap::configure(Options::has("partitioned"));
+
+    // Set the tracing sample rate
+    Tracer::configure(Options::getInt("trace-rate", 0));
+
+    // Size the pool of workers that handle the connections
+    WorkerPool::configure(Options::getInt("workers", WORKER_POOL_SIZE), Options::getInt("worker-queue", WORKER_QUEUE_MAX));
+
+    // Set how many threads accept connections, and how many may wait for them
+    Acceptor::configure(Options::getInt("acceptors", ACCEPTOR_COUNT), Options::getInt("backlog", LISTEN_BACKLOG));
+
+    // Pin each thread role to its CPUs
+    const char *pin_options[AFFINITY_ROLES] = {"pin-io", "pin-replication", "pin-history"};
+    for (int i = 0; i < AFFINITY_ROLES; i++)
+        if (!Affinity::configure(i, Options::getString(pin_options[i], "")))
+        {
+            std::cerr << "Invalid CPU list: " << Options::getString(pin_options[i], "") << std::endl;
+            return 1;
+        }
+
+    // A login is answered with one history page, so N cannot be more than a page holds
+    if (atoi(argv[1]) > HISTORY_PAGE_MAX)
+    {
+        std::cerr << "N must be at most " << HISTORY_PAGE_MAX << std::endl;
+        return 1;
+    }
+
+    // Place the groups' state on the node of the thread creating it, if asked to
+    Affinity::place(Options::has("numa-local"));
+
+    // Set which history segments are kept
+    retention_policy retention;
+    retention.age = Options::getInt("retain-age", 0);
+    retention.segments = Options::getInt("retain-segments", 0);
+    retention.bytes = (uint64_t)Options::getInt("retain-mb", 0) << 20;
+    HistoryLog::configure(retention);
+
+    // Read the topology and open the hardware counters, before any thread starts
+    Affinity::start();
+
+    // Write logs from a background thread
+    Logger::start();
+
     try
     {
         // Create an instance of Replica
         ReplicaManager replica(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), argv[4], atoi(argv[5]), atoi(argv[6]));
 
+        // Serve metrics, if asked to
+        if (Options::has("metrics-port"))
+            MetricsEndpoint::start(Options::getInt("metrics-port", 0), &ReplicaManager::exportMetrics);
+
         // Start listening for connections
         replica.listenConnections(NULL);
+
+        // Stop serving metrics
+        MetricsEndpoint::stop();
     }
     catch (const std::runtime_error &e)
     {
-        std::cerr << e.what() << '\n';
+        Logger::log(LOG_MAIN, LOG_ERROR, "%s", e.what());
     }
 
+    // Write whatever is left in the log
+    Logger::stop();
+
     // End
     std::cout << "Replica " << argv[3] << " stopped safely." << std::endl;
     return 0;